@@ -0,0 +1,294 @@
+#!/bin/bash
+
+set -euo pipefail
+
+#=== Configuration ===#
+NETNS="orion-bench"
+GEN_IF="veth-gen"          # Lives in $NETNS, pktgen/tcpreplay transmit here
+CAP_IF="veth-cap"          # Stays in the root namespace, the backend captures here
+CAP_ADDR="10.99.0.1"
+GEN_ADDR="10.99.0.2"
+BACKENDS="legacy tcpdump netsniff-ng xdp_pcap xdp_xsk tpacket"
+SIZES="64 512 1500 imix"
+RATES="100000 250000 500000 1000000 2000000 4000000"
+DURATION=10                # Seconds of traffic per run
+FLOWS=1024                 # Distinct UDP source ports in synthetic traffic
+LOSS_TOLERANCE="0.0001"    # A run is loss-free if at most this fraction is missing
+REPLAY=""                  # Replay this pcap with tcpreplay instead of pktgen
+RESULTS="bench-results.json"
+WORK_DIR="/tmp/orion-bench"
+
+usage() {
+    echo "Usage: $0 [--backends \"<list>\"] [--sizes \"<list>\"] [--rates \"<list>\"] [--duration <s>]"
+    echo "          [--flows <n>] [--replay <file.pcap>] [--results <file>] [--sweep]"
+    echo "Backends: $BACKENDS"
+    echo "Sizes are frame sizes in bytes or 'imix' (7:4:1 of 64/576/1500)"
+    echo "Each backend/size steps up through the rates and stops at the first lossy one"
+    echo "unless --sweep is given. One JSON object per run is appended to the results file."
+}
+
+SWEEP=false
+while [[ $# -gt 0 ]]; do
+    case "$1" in
+        --backends) BACKENDS="$2"; shift 2 ;;
+        --sizes) SIZES="$2"; shift 2 ;;
+        --rates) RATES="$2"; shift 2 ;;
+        --duration) DURATION="$2"; shift 2 ;;
+        --flows) FLOWS="$2"; shift 2 ;;
+        --replay) REPLAY="$2"; shift 2 ;;
+        --results) RESULTS="$2"; shift 2 ;;
+        --sweep) SWEEP=true; shift ;;
+        -h|--help) usage; exit 0 ;;
+        *) echo "Unknown argument: $1"; usage; exit 1 ;;
+    esac
+done
+
+#=== Helpers ===#
+log() {
+    local when=$(date +"%F %T")
+    echo "[$when] $*" >&2
+}
+
+in_ns() {
+    ip netns exec "$NETNS" "$@"
+}
+
+cap_stat() {
+    cat "/sys/class/net/$CAP_IF/statistics/$1"
+}
+
+gen_stat() {
+    in_ns cat "/sys/class/net/$GEN_IF/statistics/$1"
+}
+
+# Total user+system jiffies of a process and all of its threads
+proc_jiffies() {
+    local pid=$1
+    awk '{ print $14 + $15 }' "/proc/$pid/stat" 2>/dev/null || echo 0
+}
+
+# Busy and total jiffies for every core, one "busy total" pair per line
+core_jiffies() {
+    awk '/^cpu[0-9]/ { busy = $2 + $3 + $4 + $7 + $8; print busy, busy + $5 + $6 }' /proc/stat
+}
+
+# Per-core utilisation in percent between two core_jiffies snapshots, as a JSON array
+core_percent() {
+    paste -d' ' <(echo "$1") <(echo "$2") | awk '
+        { db = $3 - $1; dt = $4 - $2; printf "%s%.1f", (NR > 1 ? "," : "["), (dt > 0 ? 100 * db / dt : 0) }
+        END { print "]" }'
+}
+
+# Packets in every capture file under a directory, counted with our own reader
+count_packets() {
+    local total=0 n
+    while IFS= read -r -d '' f; do
+        n=$(bin/pcap_extract -r "$f" -o /dev/null 2>&1 | awk '/^Extracted/ { print $2 }')
+        total=$((total + ${n:-0}))
+    done < <(find "$1" -type f \( -name '*.pcap' -o -name '*.pcap.gz' -o -name '*.partial' \) -print0)
+    echo "$total"
+}
+
+bytes_written() {
+    find "$1" -type f -printf '%s\n' | awk '{ s += $1 } END { print s + 0 }'
+}
+
+#=== Test network ===#
+setup_network() {
+    teardown_network
+    ip netns add "$NETNS"
+    ip link add "$CAP_IF" type veth peer name "$GEN_IF"
+    ip link set "$GEN_IF" netns "$NETNS"
+
+    ip addr add "$CAP_ADDR/24" dev "$CAP_IF"
+    in_ns ip addr add "$GEN_ADDR/24" dev "$GEN_IF"
+
+    # Keep IPv6 neighbour discovery and friends out of the counts
+    sysctl -qw "net.ipv6.conf.$CAP_IF.disable_ipv6=1"
+    in_ns sysctl -qw "net.ipv6.conf.$GEN_IF.disable_ipv6=1"
+
+    ip link set "$CAP_IF" up
+    in_ns ip link set "$GEN_IF" up
+    in_ns ip link set lo up
+
+    # Native XDP on a veth only receives when the peer has an XDP program of its own
+    # or GRO is on; turning GRO on is the cheaper of the two
+    in_ns ethtool -K "$GEN_IF" tx off &>/dev/null || true
+    ethtool -K "$CAP_IF" gro on &>/dev/null || true
+
+    modprobe pktgen
+}
+
+teardown_network() {
+    ip link del "$CAP_IF" &>/dev/null || true
+    ip netns del "$NETNS" &>/dev/null || true
+}
+
+#=== Traffic ===#
+pgset() {
+    local file=$1; shift
+    in_ns sh -c "echo '$*' > /proc/net/pktgen/$file"
+}
+
+# Sends $2 pps of $1-byte frames for $DURATION seconds and blocks until done
+send_traffic() {
+    local size=$1 rate=$2
+    local count=$((rate * DURATION))
+
+    if [[ -n "$REPLAY" ]]; then
+        in_ns tcpreplay -q -i "$GEN_IF" --pps="$rate" --limit="$count" --loop=0 "$REPLAY" &>/dev/null
+        return
+    fi
+
+    local dst_mac=$(cat "/sys/class/net/$CAP_IF/address")
+    pgset kpktgend_0 "rem_device_all"
+    pgset kpktgend_0 "add_device $GEN_IF"
+    pgset "$GEN_IF" "count $count"
+    pgset "$GEN_IF" "delay 0"
+    pgset "$GEN_IF" "ratep $rate"
+    pgset "$GEN_IF" "dst_mac $dst_mac"
+    pgset "$GEN_IF" "dst $CAP_ADDR"
+    pgset "$GEN_IF" "src_min $GEN_ADDR"
+    pgset "$GEN_IF" "src_max $GEN_ADDR"
+    pgset "$GEN_IF" "udp_dst_min 9"
+    pgset "$GEN_IF" "udp_dst_max 9"
+    pgset "$GEN_IF" "udp_src_min 10000"
+    pgset "$GEN_IF" "udp_src_max $((10000 + FLOWS - 1))"
+    pgset "$GEN_IF" "flag UDPSRC_RND"
+    if [[ "$size" == "imix" ]]; then
+        pgset "$GEN_IF" "imix_weights 64,7 576,4 1500,1"
+    else
+        pgset "$GEN_IF" "imix_weights"
+        # pktgen sizes exclude the 4-byte FCS
+        pgset "$GEN_IF" "pkt_size $((size - 4))"
+    fi
+    pgset pgctrl "start"
+}
+
+#=== Backends ===#
+# Starts a backend writing under $1 and sets BACKEND_PID
+start_backend() {
+    local backend=$1 out=$2
+    case "$backend" in
+        legacy)
+            bin/legacy -k -i "$CAP_IF" -s "$out" &>"$out.log" &
+            ;;
+        tcpdump)
+            tcpdump -i "$CAP_IF" -w "$out/cap.pcap" -nn -s 2000 &>"$out.log" &
+            ;;
+        netsniff-ng)
+            netsniff-ng -i "$CAP_IF" -o "$out/cap.pcap" --silent &>"$out.log" &
+            ;;
+        xdp_pcap)
+            bin/xdp_pcap_user -i "$CAP_IF" -o "$out/cap.pcap.gz" &>"$out.log" &
+            ;;
+        xdp_xsk)
+            xdp-loader load -m native -p /sys/fs/bpf "$CAP_IF" bin/xdp_xsk_kern.o &>>"$out.log"
+            bin/xdp_xsk_user -i "$CAP_IF" -c -o "$out/cap.pcap.gz" &>>"$out.log" &
+            ;;
+        tpacket)
+            bin/tpacket_fanout -i "$CAP_IF" -s "$out" &>"$out.log" &
+            ;;
+        *)
+            log "ERROR: Unknown backend '$backend'"
+            return 1
+            ;;
+    esac
+    BACKEND_PID=$!
+}
+
+stop_backend() {
+    local backend=$1
+    kill -INT "$BACKEND_PID" 2>/dev/null || true
+    wait "$BACKEND_PID" 2>/dev/null || true
+    if [[ "$backend" == "xdp_xsk" ]]; then
+        xdp-loader unload --all "$CAP_IF" &>/dev/null || true
+        rm -f /sys/fs/bpf/xsks_map
+    fi
+}
+
+#=== One run ===#
+# Prints one JSON object and returns 0 if the run was loss-free
+run_one() {
+    local backend=$1 size=$2 rate=$3
+    local out="$WORK_DIR/$backend-$size-$rate"
+    rm -rf "$out" "$out.log"
+    mkdir -p "$out"
+
+    start_backend "$backend" "$out"
+    sleep 2
+    if ! kill -0 "$BACKEND_PID" 2>/dev/null; then
+        log "ERROR: $backend exited during startup, see $out.log"
+        return 2
+    fi
+
+    local tx0=$(gen_stat tx_packets) rx0=$(cap_stat rx_packets) drop0=$(cap_stat rx_dropped)
+    local cores0=$(core_jiffies) proc0=$(proc_jiffies "$BACKEND_PID")
+    local t0=$(date +%s.%N)
+
+    send_traffic "$size" "$rate"
+    sleep 2  # Let the backend drain its rings and buffers
+
+    local t1=$(date +%s.%N)
+    local cores1=$(core_jiffies) proc1=$(proc_jiffies "$BACKEND_PID")
+    local sent=$(( $(gen_stat tx_packets) - tx0 ))
+    local received=$(( $(cap_stat rx_packets) - rx0 ))
+    local if_drops=$(( $(cap_stat rx_dropped) - drop0 ))
+    stop_backend "$backend"
+
+    local captured=$(count_packets "$out")
+    local written=$(bytes_written "$out")
+    local lost=$(( sent > captured ? sent - captured : 0 ))
+    local hz=$(getconf CLK_TCK)
+    local proc_cpu=$(awk -v d="$((proc1 - proc0))" -v hz="$hz" -v t0="$t0" -v t1="$t1" \
+        'BEGIN { printf "%.1f", 100 * d / hz / (t1 - t0) }')
+    local loss_free=$(awk -v l="$lost" -v s="$sent" -v tol="$LOSS_TOLERANCE" \
+        'BEGIN { print (s > 0 && l / s <= tol) ? "true" : "false" }')
+
+    printf '{"backend":"%s","size":"%s","rate_pps":%d,"duration_s":%d,"sent":%d,"received":%d,' \
+        "$backend" "$size" "$rate" "$DURATION" "$sent" "$received"
+    printf '"captured":%d,"lost":%d,"if_drops":%d,"loss_free":%s,"bytes_written":%d,' \
+        "$captured" "$lost" "$if_drops" "$loss_free" "$written"
+    printf '"backend_cpu_pct":%s,"core_cpu_pct":%s}\n' "$proc_cpu" "$(core_percent "$cores0" "$cores1")"
+
+    rm -rf "$out"
+    [[ "$loss_free" == "true" ]]
+}
+
+#=== Main ===#
+if [[ $EUID -ne 0 ]]; then
+    echo "Error: must run as root (namespaces, pktgen, XDP)"
+    exit 1
+fi
+if [[ -n "$REPLAY" && ! -r "$REPLAY" ]]; then
+    echo "Error: cannot read $REPLAY"
+    exit 1
+fi
+
+make -s all
+mkdir -p "$WORK_DIR"
+trap teardown_network EXIT
+setup_network
+log "Test network up: $NETNS/$GEN_IF -> $CAP_IF"
+
+for backend in $BACKENDS; do
+    for size in $SIZES; do
+        best=0
+        for rate in $RATES; do
+            log "$backend size=$size rate=$rate pps"
+            set +e
+            result=$(run_one "$backend" "$size" "$rate")
+            rc=$?
+            set -e
+            [[ -n "$result" ]] && echo "$result" | tee -a "$RESULTS"
+            if [[ $rc -eq 0 ]]; then
+                best=$rate
+            elif [[ $rc -eq 2 ]] || ! $SWEEP; then
+                break
+            fi
+        done
+        printf '{"backend":"%s","size":"%s","max_loss_free_pps":%d}\n' "$backend" "$size" "$best" | tee -a "$RESULTS"
+    done
+done
+
+log "Results appended to $RESULTS"
@@ -82,7 +82,10 @@ sanity_check() {
                 ;;
         esac
 
-        if ! capinfos "$now_f" &>/dev/null; then
+        # legacy cuts a torn tail back to the last sync point itself when it resumes the hour
+        if [[ "$TOOL" == "legacy" ]]; then
+            log "INFO: $now_f will be recovered and resumed by legacy"
+        elif ! capinfos "$now_f" &>/dev/null; then
             log "WARNING: capinfos failed - possibly truncated or invalid pcap ($now_f)."
             mark_corrupt "$now_f"
             return 1
@@ -246,7 +249,7 @@ if sanity_check; then
             bin/tcpdump-pfring -i "$IFACE" -G 3600 -w "$PCAP_DIR/%Y-%m-%d.%H.pcap" -nn -U &>/dev/null &
             ;;
         legacy)
-            gcc src/legacy.c -lpcap -lz -o bin/legacy &>/dev/null
+            gcc src/legacy.c src/capfile.c src/colcap.c src/flowbloom.c src/pgz.c src/uring.c src/metrics.c -lpcap -lz -lpthread -o bin/legacy &>/dev/null
             bin/legacy -u -i "$IFACE" -s "$PCAP_DIR" &
             ;;
         xdpdump)
@@ -0,0 +1,772 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "capfile.h"
+#include "colcap.h"
+#include "flowbloom.h"
+#include "pgz.h"
+#include "uring.h"
+#include "metrics.h"
+
+#define LINKTYPE_ETHERNET 1
+
+/*
+    A sync point is an empty gzip member with FEXTRA and FHCRC set. Its extra field ('P','S')
+    holds the length and CRC-32 of the member (or columnar chunk) before it, both little-endian,
+    and the header CRC covers them, so a sync point checks itself and the member it follows.
+    The first SYNC_SIG_LEN bytes never change, which is what the backward scan looks for.
+*/
+#define SYNC_SIZE    CAPFILE_SYNC_SIZE
+#define SYNC_SIG_LEN 16
+static const unsigned char sync_sig[SYNC_SIG_LEN] = {
+    0x1f, 0x8b, 8, 0x06, 0, 0, 0, 0, 0, 0xff,  // Deflate, FEXTRA | FHCRC, no mtime, unknown OS
+    12, 0, 'P', 'S', 8, 0                      // XLEN, then one 8-byte subfield
+};
+
+// Writes that can be in flight, so possibly missing, when the writer dies (see uring.h)
+#define RECOVER_WINDOW ((uint64_t)URING_DEFAULT_DEPTH * URING_DEFAULT_BUF_SIZE)
+#define MAX_MEMBER     (2 * CAPFILE_BUF_SIZE)  // Far more than deflate (or colcap_bound()) can grow a chunk by
+#define SCAN_BLOCK     (1 << 20)
+
+static struct metric m_records = METRIC_INIT("capfile_records_total", METRIC_COUNTER, "Packets written to capture files");
+static struct metric m_pcap_bytes = METRIC_INIT("capfile_pcap_bytes_total", METRIC_COUNTER, "Uncompressed pcap bytes written to capture files");
+static struct metric m_written = METRIC_INIT("capfile_written_bytes_total", METRIC_COUNTER, "Bytes written to capture files, after compression");
+static struct metric m_write = METRIC_INIT("capfile_write_seconds", METRIC_HISTOGRAM, "Time a write to a capture file blocked its caller");
+
+/*
+    A chunk whose index entry is waiting for pgz to report where its member landed. Members
+    are written in the order they were flushed, so a FIFO is enough to pair them up. Once it
+    has its place, the entry waits again (in a second FIFO) until the chunk is in the file.
+*/
+struct pending_chunk {
+    struct capfile_index_entry entry;
+    struct flowbloom_entry*    bloom;
+    struct pending_chunk*      next;
+};
+
+struct capfile {
+    int            fd;
+    int            idx_fd;
+    int            bloom_fd;
+    struct pgz*    pgz;
+    struct uring_writer* uw;  // Asynchronous writes, when CAPFILE_URING took effect
+    int            preallocated;
+    unsigned char* buf;
+    size_t         used;
+    uint64_t       frac_ns;  // Nanoseconds per unit of the record timestamp fraction
+    uint8_t        codecs[COLCAP_COLUMNS];  // CAPFILE_COLUMNAR
+
+    // Index bookkeeping for the chunk being filled
+    uint64_t       ts_first;
+    uint64_t       ts_last;
+    uint32_t       records;
+    uint64_t       offset;         // Where the next chunk (or member) goes
+    uint64_t       member_offset;  // Where the last member went; pgz does not count sync points
+    struct flowbloom_entry* bloom;
+
+    pthread_mutex_t       pending_lock;
+    struct pending_chunk* pending_head;
+    struct pending_chunk* pending_tail;
+    int                   idx_error;
+
+    // Taken around every use of uw, and guards the chunks written but not yet indexed
+    pthread_mutex_t       out_lock;
+    struct pending_chunk* written_head;
+    struct pending_chunk* written_tail;
+};
+
+static int write_all(int fd, const unsigned char* buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void put_le16(unsigned char* p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static void put_le32(unsigned char* p, uint32_t v) {
+    put_le16(p, v);
+    put_le16(p + 2, v >> 16);
+}
+
+static uint32_t get_le32(const unsigned char* p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void make_sync(unsigned char* sync, const void* member, uint32_t len) {
+    memcpy(sync, sync_sig, SYNC_SIG_LEN);
+    put_le32(sync + 16, len);
+    put_le32(sync + 20, crc32(0, member, len));
+    put_le16(sync + 24, crc32(0, sync, 24));
+    memcpy(sync + 26, "\x03\0\0\0\0\0\0\0\0\0", 10);  // Empty final block, CRC-32 and size of nothing
+}
+
+// Returns 1 and the length and CRC-32 of the member before it if sync is a sync point
+static int parse_sync(const unsigned char* sync, uint32_t* len, uint32_t* crc) {
+    if (memcmp(sync, sync_sig, SYNC_SIG_LEN) != 0) return 0;
+    if ((uint32_t)(sync[24] | sync[25] << 8) != (crc32(0, sync, 24) & 0xffff)) return 0;
+    if (memcmp(sync + 26, "\x03\0\0\0\0\0\0\0\0\0", 10) != 0) return 0;
+    *len = get_le32(sync + 16);
+    *crc = get_le32(sync + 20);
+    return 1;
+}
+
+/*
+    Every byte bound for the capture file goes through here, pgz members included (as its
+    output function), and each member is followed by its sync point. With io_uring each write
+    is submitted straight away, so the time recorded is only how long the caller was held up,
+    not how long the disk took.
+*/
+static int output(void* arg, const void* buf, size_t len) {
+    struct capfile* cf = arg;
+    unsigned char sync[SYNC_SIZE];
+    size_t sync_len = cf->pgz ? SYNC_SIZE : 0;
+    if (sync_len) make_sync(sync, buf, len);
+
+    uint64_t started = metrics_now_ns();
+    pthread_mutex_lock(&cf->out_lock);
+    int err = cf->uw ? uring_writer_write(cf->uw, buf, len) < 0 || uring_writer_write(cf->uw, sync, sync_len) < 0 ||
+                       uring_writer_flush(cf->uw) < 0
+                     : write_all(cf->fd, buf, len) < 0 || write_all(cf->fd, sync, sync_len) < 0;
+    pthread_mutex_unlock(&cf->out_lock);
+    metric_observe_ns(&m_write, metrics_now_ns() - started);
+    if (err) return -1;
+    metric_add(&m_written, len + sync_len);
+    cf->member_offset = cf->offset;
+    cf->offset += len + sync_len;
+    return 0;
+}
+
+static void write_index_entry(struct capfile* cf, const struct capfile_index_entry* entry, struct flowbloom_entry* bloom) {
+    // A chunk holding only the global header has nothing to find
+    if (entry->records == 0) return;
+
+    // Bloom first: an index entry without its filter would misalign every later lookup
+    if (bloom) {
+        bloom->offset = entry->offset;
+        if (write_all(cf->bloom_fd, (const unsigned char*)bloom, sizeof(*bloom)) < 0) {
+            if (!cf->idx_error) cf->idx_error = errno;
+            return;
+        }
+    }
+    if (write_all(cf->idx_fd, (const unsigned char*)entry, sizeof(*entry)) < 0 && !cf->idx_error)
+        cf->idx_error = errno;
+}
+
+/*
+    Writes the index entries of every chunk that has reached the file, in order. With io_uring
+    a member is only queued when output() returns, and in direct mode its last block may go
+    out later still, so an entry published any sooner could send a live reader (pcap_extract)
+    to a hole. Called with out_lock held.
+*/
+static void publish_written(struct capfile* cf) {
+    uint64_t written = cf->uw ? uring_writer_written(cf->uw) : UINT64_MAX;
+    while (cf->written_head && cf->written_head->entry.offset + cf->written_head->entry.length <= written) {
+        struct pending_chunk* chunk = cf->written_head;
+        cf->written_head = chunk->next;
+        if (!cf->written_head) cf->written_tail = NULL;
+        write_index_entry(cf, &chunk->entry, chunk->bloom);
+        free(chunk->bloom);
+        free(chunk);
+    }
+}
+
+// Queues a chunk that has its place in the file for indexing, and indexes what it can
+static void chunk_written(struct capfile* cf, struct pending_chunk* chunk) {
+    pthread_mutex_lock(&cf->out_lock);
+    chunk->next = NULL;
+    if (cf->written_tail) cf->written_tail->next = chunk;
+    else cf->written_head = chunk;
+    cf->written_tail = chunk;
+    publish_written(cf);
+    pthread_mutex_unlock(&cf->out_lock);
+}
+
+// A pending chunk for the chunk being flushed; its bloom filter goes with it
+static struct pending_chunk* new_chunk(struct capfile* cf, const struct capfile_index_entry* entry) {
+    struct pending_chunk* chunk = malloc(sizeof(*chunk));
+    if (!chunk) return NULL;
+    chunk->entry = *entry;
+    chunk->bloom = NULL;
+    chunk->next = NULL;
+    if (cf->bloom) {
+        // The next chunk starts from a fresh filter
+        chunk->bloom = cf->bloom;
+        cf->bloom = calloc(1, sizeof(*cf->bloom));
+        if (!cf->bloom) {
+            cf->bloom = chunk->bloom;
+            free(chunk);
+            return NULL;
+        }
+    }
+    return chunk;
+}
+
+static void free_chunks(struct pending_chunk* chunk) {
+    while (chunk) {
+        struct pending_chunk* next = chunk->next;
+        free(chunk->bloom);
+        free(chunk);
+        chunk = next;
+    }
+}
+
+// Opens the sidecar <path><suffix> with the same create/append mode as the capture
+static int open_sidecar(const char* path, const char* suffix, int oflags) {
+    char sidecar[PATH_MAX];
+    if (snprintf(sidecar, sizeof(sidecar), "%s%s", path, suffix) >= (int)sizeof(sidecar)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return open(sidecar, oflags, 0644);
+}
+
+// pgz member callback: the oldest pending chunk is the one that was just written. It runs
+// right after output() wrote the member, which knows the real offset.
+static void on_member(void* arg, uint64_t offset, size_t len) {
+    struct capfile* cf = arg;
+    (void)offset;  // pgz's offset leaves out the sync points written between members
+
+    pthread_mutex_lock(&cf->pending_lock);
+    struct pending_chunk* chunk = cf->pending_head;
+    if (chunk) {
+        cf->pending_head = chunk->next;
+        if (!cf->pending_head) cf->pending_tail = NULL;
+    }
+    pthread_mutex_unlock(&cf->pending_lock);
+    if (!chunk) return;
+
+    chunk->entry.offset = cf->member_offset;
+    chunk->entry.length = len;
+    chunk_written(cf, chunk);
+}
+
+// CAPFILE_COLUMNAR: the pgz workers encode chunks into columns instead of gzip members
+static void* columnar_init(void* arg, int level, size_t block_size) {
+    struct capfile* cf = arg;
+    return colcap_encoder_new(level, cf->codecs, block_size);
+}
+
+static int columnar_encode(void* state, const void* in, size_t in_len, void* out, size_t out_size, size_t* out_len) {
+    return colcap_encode(state, in, in_len, out, out_size, out_len);
+}
+
+static void columnar_fini(void* state) {
+    colcap_encoder_free(state);
+}
+
+static const struct pgz_codec columnar_codec = { columnar_init, columnar_encode, columnar_fini, colcap_bound };
+
+struct capfile* capfile_open(const char* path, const struct capfile_opts* opts) {
+    if ((opts->flags & CAPFILE_COLUMNAR) && (opts->flags & CAPFILE_GZIP)) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct capfile* cf = calloc(1, sizeof(*cf));
+    if (!cf) return NULL;
+    metric_register(&m_records);
+    metric_register(&m_pcap_bytes);
+    metric_register(&m_written);
+    metric_register(&m_write);
+    cf->fd = -1;
+    cf->idx_fd = -1;
+    cf->bloom_fd = -1;
+    pthread_mutex_init(&cf->pending_lock, NULL);
+    pthread_mutex_init(&cf->out_lock, NULL);
+
+    cf->buf = malloc(CAPFILE_BUF_SIZE);
+    if (!cf->buf) goto fail;
+
+    colcap_default_codecs(cf->codecs);
+    if (opts->columns && colcap_parse_codecs(opts->columns, cf->codecs) < 0) {
+        errno = EINVAL;
+        goto fail;
+    }
+
+    int oflags = O_WRONLY | O_CREAT | (opts->flags & CAPFILE_APPEND ? O_APPEND : O_TRUNC);
+    cf->fd = open(path, oflags, 0644);
+    if (cf->fd < 0) goto fail;
+
+    if (opts->flags & (CAPFILE_INDEX | CAPFILE_BLOOM)) {
+        cf->idx_fd = open_sidecar(path, CAPFILE_INDEX_SUFFIX, oflags);
+        if (cf->idx_fd < 0) goto fail;
+    }
+
+    // The 5-tuple parser only understands Ethernet; other link types just get the index
+    if ((opts->flags & CAPFILE_BLOOM) && opts->linktype == LINKTYPE_ETHERNET) {
+        cf->bloom_fd = open_sidecar(path, FLOWBLOOM_SUFFIX, oflags);
+        cf->bloom = calloc(1, sizeof(*cf->bloom));
+        if (cf->bloom_fd < 0 || !cf->bloom) goto fail;
+    }
+
+    // Reserving the space keeps an hour's file contiguous and takes block allocation off the
+    // write path. KEEP_SIZE leaves the visible size alone, so readers never see the reserve.
+    struct stat sb;
+    if (fstat(cf->fd, &sb) < 0) goto fail;
+    if (opts->prealloc && S_ISREG(sb.st_mode))
+        cf->preallocated = fallocate(cf->fd, FALLOC_FL_KEEP_SIZE, sb.st_size, opts->prealloc) == 0;  // Best effort
+
+    if ((opts->flags & (CAPFILE_URING | CAPFILE_DIRECT)) && S_ISREG(sb.st_mode)) {
+        cf->uw = uring_writer_open(cf->fd, opts->flags & CAPFILE_DIRECT ? URING_DIRECT : 0, 0, 0);
+        if (!cf->uw && errno != ENOSYS && errno != EPERM) goto fail;
+    }
+
+    // An existing file already starts with a global header
+    cf->offset = sb.st_size;
+    cf->frac_ns = opts->flags & CAPFILE_NSEC ? 1 : 1000;
+    if (sb.st_size == 0) {
+        struct pcap_file_hdr hdr = {
+            .magic         = opts->flags & CAPFILE_NSEC ? PCAP_MAGIC_NSEC : PCAP_MAGIC_USEC,
+            .version_major = 2,
+            .version_minor = 4,
+            .thiszone      = 0,
+            .sigfigs       = 0,
+            .snaplen       = opts->snaplen,
+            .linktype      = opts->linktype
+        };
+        if (opts->flags & CAPFILE_COLUMNAR) {
+            // Written before there is a pgz, so no sync point follows it
+            struct colcap_file_hdr chdr = { .magic = COLCAP_FILE_MAGIC, .version = COLCAP_VERSION, .pcap = hdr };
+            if (output(cf, &chdr, sizeof(chdr)) < 0) goto fail;
+        } else {
+            memcpy(cf->buf, &hdr, sizeof(hdr));
+            cf->used = sizeof(hdr);
+        }
+    }
+
+    if (opts->flags & (CAPFILE_GZIP | CAPFILE_COLUMNAR)) {
+        int level = opts->level ? opts->level : PGZ_DEFAULT_LEVEL;
+        cf->pgz = opts->flags & CAPFILE_GZIP ? pgz_open(cf->fd, level, opts->workers, CAPFILE_BUF_SIZE)
+                                             : pgz_open_codec(cf->fd, level, opts->workers, CAPFILE_BUF_SIZE, &columnar_codec, cf);
+        if (!cf->pgz) goto fail;
+        if (cf->idx_fd >= 0) pgz_set_member_cb(cf->pgz, on_member, cf);
+        pgz_set_output(cf->pgz, output, cf);
+    }
+    return cf;
+
+fail:
+    {
+        int saved = errno;
+        capfile_close(cf);
+        errno = saved;
+    }
+    return NULL;
+}
+
+int capfile_write(struct capfile* cf, uint32_t ts_sec, uint32_t ts_frac, uint32_t caplen, uint32_t len, const void* data) {
+    size_t need = sizeof(struct pcap_record_hdr) + caplen;
+    if (need > CAPFILE_BUF_SIZE) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    if (cf->used + need > CAPFILE_BUF_SIZE && capfile_flush(cf) < 0) return -1;
+
+    struct pcap_record_hdr hdr = {
+        .ts_sec  = ts_sec,
+        .ts_usec = ts_frac,
+        .caplen  = caplen,
+        .len     = len
+    };
+    memcpy(cf->buf + cf->used, &hdr, sizeof(hdr));
+    memcpy(cf->buf + cf->used + sizeof(hdr), data, caplen);
+    cf->used += need;
+
+    uint64_t ts = ts_sec * 1000000000ULL + ts_frac * cf->frac_ns;
+    if (cf->records == 0 || ts < cf->ts_first) cf->ts_first = ts;
+    if (cf->records == 0 || ts > cf->ts_last) cf->ts_last = ts;
+    cf->records++;
+
+    struct flow_key key;
+    if (cf->bloom && flow_key_from_packet(data, caplen, &key) == 0)
+        flowbloom_add(cf->bloom->bits, &key);
+    return 0;
+}
+
+int capfile_flush(struct capfile* cf) {
+    if (cf->used == 0) {
+        // Index whatever has been written since; if the writer is busy it will do it itself
+        if (cf->uw && pthread_mutex_trylock(&cf->out_lock) == 0) {
+            publish_written(cf);
+            pthread_mutex_unlock(&cf->out_lock);
+        }
+        return 0;
+    }
+    metric_add(&m_records, cf->records);
+    metric_add(&m_pcap_bytes, cf->used);
+
+    struct capfile_index_entry entry = {
+        .ts_first = cf->ts_first,
+        .ts_last  = cf->ts_last,
+        .offset   = cf->offset,
+        .length   = cf->used,
+        .records  = cf->records
+    };
+
+    int err;
+    if (cf->pgz) {
+        // Queue the entry before the data so the callback can never run ahead of it
+        if (cf->idx_fd >= 0) {
+            struct pending_chunk* chunk = new_chunk(cf, &entry);
+            if (!chunk) return -1;
+            pthread_mutex_lock(&cf->pending_lock);
+            if (cf->pending_tail) cf->pending_tail->next = chunk;
+            else cf->pending_head = chunk;
+            cf->pending_tail = chunk;
+            pthread_mutex_unlock(&cf->pending_lock);
+        }
+        err = pgz_write(cf->pgz, cf->buf, cf->used) < 0 || pgz_flush(cf->pgz) < 0;
+    } else if (cf->uw && cf->idx_fd >= 0) {
+        struct pending_chunk* chunk = new_chunk(cf, &entry);
+        if (!chunk) return -1;
+        err = output(cf, cf->buf, cf->used) < 0;
+        if (err) free_chunks(chunk);
+        else chunk_written(cf, chunk);
+    } else {
+        err = output(cf, cf->buf, cf->used) < 0;
+        if (!err && cf->idx_fd >= 0) write_index_entry(cf, &entry, cf->bloom);
+        if (cf->bloom) memset(cf->bloom->bits, 0, sizeof(cf->bloom->bits));
+    }
+    cf->used = 0;
+    cf->records = 0;
+    if (!err && cf->idx_error) {
+        errno = cf->idx_error;
+        err = 1;
+    }
+    return err ? -1 : 0;
+}
+
+int capfile_close(struct capfile* cf) {
+    if (!cf) return 0;
+
+    int err = 0;
+    if (cf->fd >= 0 && capfile_flush(cf) < 0) err = errno;
+    if (cf->pgz && pgz_close(cf->pgz) < 0 && !err) err = errno;
+    if (cf->uw && uring_writer_close(cf->uw) < 0 && !err) err = errno;
+    cf->uw = NULL;
+
+    // Everything has reached the file now, unless a write failed
+    if (!err) publish_written(cf);
+
+    // Hand back whatever part of the reservation went unused
+    struct stat sb;
+    if (cf->preallocated && fstat(cf->fd, &sb) == 0 && ftruncate(cf->fd, sb.st_size) < 0 && !err) err = errno;
+    if (cf->idx_error && !err) err = cf->idx_error;
+    if (cf->idx_fd >= 0 && close(cf->idx_fd) < 0 && !err) err = errno;
+    if (cf->bloom_fd >= 0 && close(cf->bloom_fd) < 0 && !err) err = errno;
+    if (cf->fd >= 0 && close(cf->fd) < 0 && !err) err = errno;
+
+    // Chunks whose members never made it out (write errors) have nothing to index
+    free_chunks(cf->pending_head);
+    free_chunks(cf->written_head);
+    pthread_mutex_destroy(&cf->pending_lock);
+    pthread_mutex_destroy(&cf->out_lock);
+    free(cf->bloom);
+    free(cf->buf);
+    free(cf);
+
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+int capfile_rename(const char* from, const char* to) {
+    static const char* suffixes[] = { CAPFILE_INDEX_SUFFIX, FLOWBLOOM_SUFFIX };
+    char from_side[PATH_MAX], to_side[PATH_MAX];
+
+    if (rename(from, to) < 0) return -1;
+    for (size_t i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); i++) {
+        snprintf(from_side, sizeof(from_side), "%s%s", from, suffixes[i]);
+        snprintf(to_side, sizeof(to_side), "%s%s", to, suffixes[i]);
+        if (rename(from_side, to_side) < 0 && errno != ENOENT) return -1;
+    }
+    return 0;
+}
+
+static int read_at(int fd, void* buf, size_t len, uint64_t offset) {
+    unsigned char* p = buf;
+    while (len > 0) {
+        ssize_t n = pread(fd, p, len, offset);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (n == 0) {
+            errno = EIO;
+            return -1;
+        }
+        p += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+/*
+    Checks that a sync point ends at end and the member before it matches it. Returns 1 and
+    where that member starts if so, 0 if not, or -1 with errno set.
+*/
+static int sync_at(int fd, uint64_t end, uint64_t* member_start) {
+    unsigned char sync[SYNC_SIZE];
+    uint32_t len, crc;
+    if (end < SYNC_SIZE || read_at(fd, sync, SYNC_SIZE, end - SYNC_SIZE) < 0) return end < SYNC_SIZE ? 0 : -1;
+    if (!parse_sync(sync, &len, &crc) || len > MAX_MEMBER || len > end - SYNC_SIZE) return 0;
+
+    unsigned char* member = malloc(len);
+    if (!member) return -1;
+    int ok = read_at(fd, member, len, end - SYNC_SIZE - len);
+    if (ok == 0) ok = crc32(0, member, len) == crc;
+    free(member);
+    *member_start = end - SYNC_SIZE - len;
+    return ok;
+}
+
+/*
+    Finds the last place at or before limit, and no further back than floor, where a sync
+    point could end, going by its fixed leading bytes alone. Returns 1 and the position, 0 if
+    there is none, or -1 with errno set.
+*/
+static int scan_back(int fd, uint64_t limit, uint64_t floor, uint64_t* found) {
+    unsigned char* block = malloc(SCAN_BLOCK + SYNC_SIZE);
+    if (!block) return -1;
+    int ret = 0;
+    while (limit >= floor + SYNC_SIZE) {
+        // Each block overlaps the one after it by a sync point, so none falls between them
+        uint64_t start = limit - SYNC_SIZE > floor + SCAN_BLOCK ? limit - SYNC_SIZE - SCAN_BLOCK : floor;
+        size_t len = limit - start;
+        if (read_at(fd, block, len, start) < 0) {
+            ret = -1;
+            break;
+        }
+        for (size_t i = len - SYNC_SIZE + 1; i-- > 0 && ret == 0; ) {
+            if (block[i] == sync_sig[0] && memcmp(block + i, sync_sig, SYNC_SIG_LEN) == 0) {
+                *found = start + i + SYNC_SIZE;
+                ret = 1;
+            }
+        }
+        if (ret || start == floor) break;
+        limit = start + SYNC_SIZE - 1;
+    }
+    free(block);
+    return ret;
+}
+
+/*
+    With io_uring, writes complete out of order, so a crash can leave a hole under later data
+    that did make it. An intact sync point is only trusted once the chain of sync points behind
+    it checks out across the window that could have been in flight. Returns 1 if the chain
+    from end is intact; 0 and where to look again if not; -1 with errno set.
+*/
+static int verify_chain(int fd, uint64_t end, uint64_t base, uint64_t* retry) {
+    uint64_t pos = end;
+    while (pos > base && end - pos < RECOVER_WINDOW) {
+        uint64_t start;
+        int ok = sync_at(fd, pos, &start);
+        if (ok <= 0) {
+            *retry = pos - 1;
+            return ok;
+        }
+        pos = start;
+    }
+    return 1;
+}
+
+/*
+    Returns where the last intact chunk of a capture with sync points ends. The first chunk
+    starts at base, after the file header of a columnar capture. A columnar capture torn before
+    its first sync point still has a header to keep; a gzip one has nothing.
+*/
+static int recover_synced(int fd, uint64_t size, uint64_t base, uint64_t* end) {
+    // Only the in-flight window (and a member either side of it) can be damaged
+    uint64_t floor = size > RECOVER_WINDOW + 2 * MAX_MEMBER ? size - RECOVER_WINDOW - 2 * MAX_MEMBER : 0;
+    uint64_t limit = size;
+    if (floor < base) floor = base;
+    for (;;) {
+        int found = scan_back(fd, limit, floor, end);
+        if (found == 0 && base > 0 && floor == base) {
+            *end = size < base ? 0 : base;
+            return 0;
+        }
+        if (found <= 0) {
+            if (found == 0) errno = ENOMSG;
+            return -1;
+        }
+        int ok = verify_chain(fd, *end, base, &limit);
+        if (ok < 0) return -1;
+        if (ok) return 0;
+    }
+}
+
+/*
+    Returns where the last whole record of a plain capture ends, walking the records from
+    from, which must be a record boundary. A header that cannot be right (a hole reads as
+    zeros) ends the walk as surely as the end of the file does.
+*/
+static int recover_plain(int fd, uint64_t size, uint64_t from, uint64_t* end) {
+    struct pcap_file_hdr fhdr;
+    if (size < sizeof(fhdr)) {
+        *end = 0;
+        return 0;
+    }
+    if (read_at(fd, &fhdr, sizeof(fhdr), 0) < 0) return -1;
+    if (fhdr.magic != PCAP_MAGIC_USEC && fhdr.magic != PCAP_MAGIC_NSEC) {
+        errno = EINVAL;
+        return -1;
+    }
+    uint32_t frac_max = fhdr.magic == PCAP_MAGIC_NSEC ? 1000000000 : 1000000;
+
+    FILE* f = fdopen(dup(fd), "r");
+    if (!f) return -1;
+    if (from < sizeof(fhdr)) from = sizeof(fhdr);
+    if (fseeko(f, from, SEEK_SET) < 0) {
+        fclose(f);
+        return -1;
+    }
+
+    uint64_t pos = from;
+    struct pcap_record_hdr hdr;
+    while (fread(&hdr, sizeof(hdr), 1, f) == 1) {
+        if (hdr.len == 0 || hdr.caplen > hdr.len || hdr.caplen > fhdr.snaplen || hdr.ts_usec >= frac_max) break;
+        // Seeking past the end succeeds, so a record cut short is caught by its length
+        if (fseeko(f, hdr.caplen, SEEK_CUR) < 0 || pos + sizeof(hdr) + hdr.caplen > size) break;
+        pos += sizeof(hdr) + hdr.caplen;
+    }
+    int err = ferror(f);
+    fclose(f);
+    if (err) {
+        errno = EIO;
+        return -1;
+    }
+    *end = pos;
+    return 0;
+}
+
+/*
+    Finds how many entries of the index, counting from the start, are for chunks that end by
+    bound, and where the last of them ends. Entries are in file order, so this reads back from
+    the end of the index only as far as the first entry that fits.
+*/
+static int index_upto(int idx_fd, uint64_t bound, int64_t* count, uint64_t* end) {
+    struct stat sb;
+    if (fstat(idx_fd, &sb) < 0) return -1;
+    struct capfile_index_entry entry;
+    *count = sb.st_size / sizeof(entry);
+    *end = 0;
+    for (; *count > 0; (*count)--) {
+        if (read_at(idx_fd, &entry, sizeof(entry), (*count - 1) * sizeof(entry)) < 0) return -1;
+        if (entry.offset + entry.length <= bound) {
+            *end = entry.offset + entry.length;
+            break;
+        }
+    }
+    return 0;
+}
+
+/*
+    Cuts the index back to the entries for chunks that end by end, and the bloom filters with
+    it. Returns how many entries are left (and where the last of them ends), -2 if there is no
+    index, or -1 with errno set.
+*/
+static int64_t trim_index(const char* path, uint64_t end, uint64_t* indexed_end, uint32_t* dropped) {
+    int idx_fd = open_sidecar(path, CAPFILE_INDEX_SUFFIX, O_RDWR);
+    if (idx_fd < 0) return errno == ENOENT ? -2 : -1;
+
+    struct stat sb;
+    int64_t count;
+    if (fstat(idx_fd, &sb) < 0 || index_upto(idx_fd, end, &count, indexed_end) < 0 ||
+        ftruncate(idx_fd, count * sizeof(struct capfile_index_entry)) < 0) {
+        int saved = errno;
+        close(idx_fd);
+        errno = saved;
+        return -1;
+    }
+    close(idx_fd);
+    *dropped = (sb.st_size + sizeof(struct capfile_index_entry) - 1) / sizeof(struct capfile_index_entry) - count;
+
+    // Filters are written ahead of their index entries, so there can be one too many
+    int bloom_fd = open_sidecar(path, FLOWBLOOM_SUFFIX, O_WRONLY);
+    if (bloom_fd >= 0) {
+        int err = ftruncate(bloom_fd, count * sizeof(struct flowbloom_entry));
+        close(bloom_fd);
+        if (err < 0) return -1;
+    } else if (errno != ENOENT) {
+        return -1;
+    }
+    return count;
+}
+
+int capfile_recover(const char* path, struct capfile_recovery* rec) {
+    memset(rec, 0, sizeof(*rec));
+    int fd = open(path, O_RDWR);
+    if (fd < 0) return -1;
+
+    struct stat sb;
+    unsigned char magic[4] = { 0 };
+    if (fstat(fd, &sb) < 0 || (sb.st_size >= 4 && read_at(fd, magic, 4, 0) < 0)) goto fail;
+    uint64_t size = sb.st_size;
+    int gzip = magic[0] == 0x1f && magic[1] == 0x8b;
+    uint32_t file_magic;
+    memcpy(&file_magic, magic, sizeof(file_magic));
+    int columnar = file_magic == COLCAP_FILE_MAGIC;
+    int synced = gzip || columnar;
+
+    // A plain capture's records can be walked from any chunk boundary, so start from the last
+    // indexed chunk that is older than anything that could have been in flight
+    uint64_t from = 0;
+    if (!synced && size > RECOVER_WINDOW) {
+        int idx_fd = open_sidecar(path, CAPFILE_INDEX_SUFFIX, O_RDONLY);
+        if (idx_fd >= 0) {
+            int64_t count;
+            int err = index_upto(idx_fd, size - RECOVER_WINDOW, &count, &from);
+            close(idx_fd);
+            if (err < 0) goto fail;
+        }
+    }
+
+    uint64_t end = 0;
+    uint64_t base = columnar ? sizeof(struct colcap_file_hdr) : 0;
+    if (size > 0 && (synced ? recover_synced(fd, size, base, &end) : recover_plain(fd, size, from, &end)) < 0) goto fail;
+
+    uint64_t indexed_end;
+    int64_t count = trim_index(path, end, &indexed_end, &rec->dropped);
+    if (count == -1) goto fail;
+    if (count >= 0 && end > indexed_end) {
+        // Chunks past the last index entry are cut too (keeping the sync point after it)
+        uint64_t keep = count > 0 && synced ? indexed_end + SYNC_SIZE : indexed_end;
+        if (keep < end) end = keep;
+    }
+
+    if (end < size && ftruncate(fd, end) < 0) goto fail;
+    close(fd);
+    rec->size = end;
+    rec->discarded = size - end;
+    return 0;
+
+fail:
+    {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+    }
+    return -1;
+}
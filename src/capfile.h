@@ -0,0 +1,124 @@
+#ifndef CAPFILE_H
+#define CAPFILE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+    Buffered pcap file writer shared by the capture tools. Record headers and packet bytes
+    are serialised straight into one large buffer, and the buffer goes to the file (through
+    the parallel gzip writer, or as plain pcap) only when it is full or when the caller
+    flushes it. A flushed buffer always ends on a record boundary, and with gzip every
+    flushed buffer becomes exactly one gzip member.
+
+    With CAPFILE_INDEX every flushed buffer (a chunk) also gets an entry in a sidecar file,
+    <path>.idx, giving its timestamp range and where it sits in the capture. Chunks decompress
+    on their own, so a reader can jump straight to the chunks covering a time window. The
+    chunk at offset 0 starts with the pcap global header; no other chunk does.
+
+    CAPFILE_BLOOM adds <path>.bloom next to the index: a 5-tuple bloom filter per chunk (see
+    flowbloom.h), so flow lookups can skip chunks as well as time windows.
+
+    Every gzip member is followed by a sync point: an empty gzip member (which every gzip reader
+    skips) whose header records the length and CRC-32 of the member before it. After a crash,
+    capfile_recover() finds the last intact one by scanning back from the end of the file,
+    so resuming a large capture only reads its last few chunks.
+
+    CAPFILE_COLUMNAR writes the columnar format of colcap.h instead of pcap: the same chunks,
+    split into separately compressed columns on the pgz workers, each followed by a sync
+    point. The file starts with its own header, so no chunk carries the pcap global header.
+
+    CAPFILE_URING moves the capture file's writes onto io_uring (see uring.h), so a slow disk
+    backs up a queue of in-flight writes instead of the thread that flushes. Where io_uring is
+    unavailable the file is written with write(2) as before. CAPFILE_DIRECT adds O_DIRECT.
+*/
+
+#define CAPFILE_BUF_SIZE  (1 << 20)
+#define CAPFILE_GZIP      0x1  // Compress through pgz
+#define CAPFILE_APPEND    0x2  // Keep any existing contents (and their global header)
+#define CAPFILE_INDEX     0x4  // Maintain <path>.idx
+#define CAPFILE_BLOOM     0x8  // Maintain <path>.bloom (implies CAPFILE_INDEX, Ethernet only)
+#define CAPFILE_NSEC      0x10 // Nanosecond timestamps; when appending, must match the existing file
+#define CAPFILE_URING     0x20 // Write asynchronously through io_uring, if the kernel allows it
+#define CAPFILE_DIRECT    0x40 // Bypass the page cache (implies CAPFILE_URING)
+#define CAPFILE_COLUMNAR  0x80 // Columnar chunks (see colcap.h); not with CAPFILE_GZIP
+
+#define CAPFILE_SYNC_SIZE 36   // Bytes of the sync point after every gzip member or columnar chunk
+
+#define CAPFILE_INDEX_SUFFIX ".idx"
+
+#define PCAP_MAGIC_USEC   0xa1b2c3d4
+#define PCAP_MAGIC_NSEC   0xa1b23c4d  // Same layout, but ts_usec holds nanoseconds
+
+// On-disk pcap headers (struct pcap_pkthdr in libpcap has a struct timeval, which is not)
+struct pcap_file_hdr {
+    uint32_t magic;
+    uint16_t version_major;
+    uint16_t version_minor;
+    int32_t  thiszone;
+    uint32_t sigfigs;
+    uint32_t snaplen;
+    uint32_t linktype;
+};
+
+struct pcap_record_hdr {
+    uint32_t ts_sec;
+    uint32_t ts_usec;  // Nanoseconds in a PCAP_MAGIC_NSEC file
+    uint32_t caplen;
+    uint32_t len;
+};
+
+// The index file is nothing but these, one per chunk, in file order
+struct capfile_index_entry {
+    uint64_t ts_first;  // Oldest and newest packet in the chunk, nanoseconds since the epoch
+    uint64_t ts_last;
+    uint64_t offset;    // Byte offset and length of the chunk in the capture file
+    uint32_t length;
+    uint32_t records;
+};
+
+struct capfile_opts {
+    int      flags;
+    int      level;      // gzip level, 0 for the pgz default
+    int      workers;    // gzip threads, 0 for one per CPU
+    uint32_t snaplen;
+    uint32_t linktype;
+    uint64_t prealloc;   // Bytes to reserve on disk up front (fallocate), 0 for none
+    const char* columns; // CAPFILE_COLUMNAR codecs, e.g. "payload=store" (see colcap.h); NULL for the defaults
+};
+
+struct capfile;
+
+// Returns NULL with errno set on failure
+struct capfile* capfile_open(const char* path, const struct capfile_opts* opts);
+
+// ts_frac is in microseconds, or nanoseconds if the file was opened with CAPFILE_NSEC
+int capfile_write(struct capfile* cf, uint32_t ts_sec, uint32_t ts_frac, uint32_t caplen, uint32_t len, const void* data);
+
+// Writes out whatever is buffered; call periodically to bound how stale the file can get
+int capfile_flush(struct capfile* cf);
+
+// Flushes and closes. Returns -1 with errno set if anything failed to reach the file.
+int capfile_close(struct capfile* cf);
+
+// rename() for a capture and its sidecar files, if it has any
+int capfile_rename(const char* from, const char* to);
+
+struct capfile_recovery {
+    uint64_t size;       // Bytes of capture kept
+    uint64_t discarded;  // Bytes cut off the end
+    uint32_t dropped;    // Index entries cut off with them
+};
+
+/*
+    Makes a capture left by a writer that died mid-write fit to append to again: finds where
+    its last intact chunk ends and truncates the capture, <path>.idx and <path>.bloom there.
+    A gzip or columnar capture ends at its last verified sync point, a plain one at its last
+    whole record; only the tail that could have been in flight at the crash is examined.
+    Chunks without an index entry are cut as well, so the sidecars stay complete. Returns -1
+    with errno set on failure; ENOMSG means no intact sync point was found near the end (e.g.
+    the file predates sync points).
+*/
+int capfile_recover(const char* path, struct capfile_recovery* rec);
+
+#endif
@@ -0,0 +1,381 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <linux/if_ether.h>
+#include <zlib.h>
+
+#include "colcap.h"
+
+#define NS_PER_SEC 1000000000ULL
+
+static const char* column_names[COLCAP_COLUMNS] = {
+    "time", "caplen", "len", "src_ip", "dst_ip", "src_port", "dst_port", "header", "payload"
+};
+
+static const char* codec_names[COLCAP_CODECS] = { "store", "deflate", "huffman", "rle" };
+
+// zlib strategy per codec (store never reaches zlib)
+static const int codec_strategy[COLCAP_CODECS] = { 0, Z_DEFAULT_STRATEGY, Z_HUFFMAN_ONLY, Z_RLE };
+
+struct colcap_encoder {
+    uint8_t        codecs[COLCAP_COLUMNS];
+    z_stream       streams[COLCAP_CODECS];  // One per zlib codec; store's is never initialised
+    int            ready[COLCAP_CODECS];
+    unsigned char* raw[COLCAP_COLUMNS];     // Column contents before compression
+    size_t         raw_len[COLCAP_COLUMNS];
+};
+
+// Deflate everywhere: on payload it still beats entropy coding alone whenever there is text
+// in it, and a column that will not shrink is stored anyway
+void colcap_default_codecs(uint8_t codecs[COLCAP_COLUMNS]) {
+    for (int i = 0; i < COLCAP_COLUMNS; i++) codecs[i] = COLCAP_DEFLATE;
+}
+
+static int lookup(const char* name, size_t len, const char** names, int count) {
+    for (int i = 0; i < count; i++)
+        if (strlen(names[i]) == len && strncmp(name, names[i], len) == 0) return i;
+    return -1;
+}
+
+int colcap_parse_codecs(const char* spec, uint8_t codecs[COLCAP_COLUMNS]) {
+    while (*spec) {
+        size_t len = strcspn(spec, ",");
+        const char* eq = memchr(spec, '=', len);
+        if (!eq) return -1;
+        int column = lookup(spec, eq - spec, column_names, COLCAP_COLUMNS);
+        int codec = lookup(eq + 1, spec + len - eq - 1, codec_names, COLCAP_CODECS);
+        if (column < 0 || codec < 0) return -1;
+        codecs[column] = codec;
+        spec += len + (spec[len] == ',');
+    }
+    return 0;
+}
+
+/*
+    Where an IPv4 TCP/UDP frame's addresses and ports are, for exactly the frames
+    flow_key_from_packet() accepts. Only bytes in front of the addresses are read, and none
+    past the first have. Returns the offset of the IP header, or 0 if the frame has no 5-tuple.
+*/
+static uint32_t tuple_layout(const uint8_t* pkt, uint32_t caplen, uint32_t have, uint32_t* l4) {
+    uint32_t off = ETH_HLEN;
+    if (caplen < ETH_HLEN || have < ETH_HLEN) return 0;
+
+    uint16_t proto = (pkt[12] << 8) | pkt[13];
+    if (proto == ETH_P_8021Q) {
+        if (caplen < ETH_HLEN + 4 || have < ETH_HLEN + 4) return 0;
+        proto = (pkt[16] << 8) | pkt[17];
+        off += 4;
+    }
+    if (proto != ETH_P_IP || caplen < off + 20 || have < off + 12) return 0;
+
+    const uint8_t* ip = pkt + off;
+    uint32_t ihl = (ip[0] & 0x0f) * 4;
+    if ((ip[0] >> 4) != 4 || ihl < 20) return 0;
+    if (ip[9] != IPPROTO_TCP && ip[9] != IPPROTO_UDP) return 0;
+    if ((((ip[6] << 8) | ip[7]) & 0x1fff) || caplen < off + ihl + 4) return 0;
+
+    *l4 = off + ihl;
+    return off;
+}
+
+/*
+    How much of the frame goes in the header column (5-tuple included). For TCP that depends
+    on the data offset, at l4 + 12, so the decoder puts back everything up to there first.
+*/
+static uint32_t header_end(const uint8_t* pkt, uint32_t caplen, uint32_t ip_off, uint32_t l4) {
+    uint32_t end;
+    if (!ip_off)
+        end = COLCAP_RAW_HEADER;
+    else if (pkt[ip_off + 9] == IPPROTO_UDP)
+        end = l4 + 8;
+    else if (caplen > l4 + 12)
+        end = l4 + ((pkt[l4 + 12] >> 4) * 4 > 13 ? (pkt[l4 + 12] >> 4) * 4 : 13);
+    else
+        end = caplen;
+    return end < caplen ? end : caplen;
+}
+
+static void put_varint(struct colcap_encoder* enc, int column, uint64_t v) {
+    unsigned char* p = enc->raw[column] + enc->raw_len[column];
+    while (v >= 0x80) {
+        *p++ = v | 0x80;
+        v >>= 7;
+    }
+    *p++ = v;
+    enc->raw_len[column] = p - enc->raw[column];
+}
+
+static void put_bytes(struct colcap_encoder* enc, int column, const void* data, size_t len) {
+    memcpy(enc->raw[column] + enc->raw_len[column], data, len);
+    enc->raw_len[column] += len;
+}
+
+static uint64_t zigzag(int64_t v) {
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static int64_t unzigzag(uint64_t v) {
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+size_t colcap_bound(size_t block_size) {
+    // Per record (at least 16 bytes of input): the record header's 16 bytes become at most
+    // 10 + 5 + 10 bytes of varints; everything else only moves. Columns are stored raw
+    // rather than grow, so that is the bound.
+    return sizeof(struct colcap_chunk_hdr) + block_size + block_size / 16 * 9 + 64;
+}
+
+struct colcap_encoder* colcap_encoder_new(int level, const uint8_t codecs[COLCAP_COLUMNS], size_t max_block) {
+    struct colcap_encoder* enc = calloc(1, sizeof(*enc));
+    if (!enc) return NULL;
+    memcpy(enc->codecs, codecs, sizeof(enc->codecs));
+
+    for (int i = 0; i < COLCAP_COLUMNS; i++) {
+        // Varint columns can outgrow their share of the block; the rest only ever shrink it
+        enc->raw[i] = malloc(max_block + max_block / 16 * 10 + 16);
+        if (!enc->raw[i]) goto fail;
+    }
+    for (int c = COLCAP_DEFLATE; c < COLCAP_CODECS; c++) {
+        if (deflateInit2(&enc->streams[c], level, Z_DEFLATED, -15, 8, codec_strategy[c]) != Z_OK) goto fail;
+        enc->ready[c] = 1;
+    }
+    return enc;
+
+fail:
+    colcap_encoder_free(enc);
+    errno = ENOMEM;
+    return NULL;
+}
+
+void colcap_encoder_free(struct colcap_encoder* enc) {
+    if (!enc) return;
+    for (int c = 0; c < COLCAP_CODECS; c++)
+        if (enc->ready[c]) deflateEnd(&enc->streams[c]);
+    for (int i = 0; i < COLCAP_COLUMNS; i++) free(enc->raw[i]);
+    free(enc);
+}
+
+// Compresses a column into out, or stores it if it would not come out smaller
+static size_t encode_column(struct colcap_encoder* enc, int column, unsigned char* out, struct colcap_column_hdr* col) {
+    size_t len = enc->raw_len[column];
+    col->codec = enc->codecs[column];
+    col->raw_len = len;
+
+    if (col->codec != COLCAP_STORE && len > 0) {
+        z_stream* strm = &enc->streams[col->codec];
+        if (deflateReset(strm) == Z_OK) {
+            strm->next_in = enc->raw[column];
+            strm->avail_in = len;
+            strm->next_out = out;
+            strm->avail_out = len;
+            if (deflate(strm, Z_FINISH) == Z_STREAM_END) {
+                col->enc_len = len - strm->avail_out;
+                return col->enc_len;
+            }
+        }
+    }
+    col->codec = COLCAP_STORE;
+    col->enc_len = len;
+    memcpy(out, enc->raw[column], len);
+    return len;
+}
+
+int colcap_encode(struct colcap_encoder* enc, const void* records, size_t len, void* out, size_t out_size, size_t* out_len) {
+    const unsigned char* in = records;
+    struct pcap_record_hdr hdr;
+    if (out_size < colcap_bound(len)) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    // Timestamps are only packed as nanoseconds if every fraction fits, or it would not decode
+    uint32_t flags = 0;
+    uint32_t count = 0;
+    for (size_t pos = 0; pos < len; pos += sizeof(hdr) + hdr.caplen, count++) {
+        if (len - pos < sizeof(hdr)) {
+            errno = EINVAL;
+            return -1;
+        }
+        memcpy(&hdr, in + pos, sizeof(hdr));
+        if (hdr.caplen > len - pos - sizeof(hdr)) {
+            errno = EINVAL;
+            return -1;
+        }
+        if (hdr.ts_usec >= NS_PER_SEC) flags |= COLCAP_TS_SPLIT;
+    }
+
+    for (int i = 0; i < COLCAP_COLUMNS; i++) enc->raw_len[i] = 0;
+    uint64_t prev = 0;
+    for (size_t pos = 0; pos < len; pos += sizeof(hdr) + hdr.caplen) {
+        memcpy(&hdr, in + pos, sizeof(hdr));
+        const uint8_t* pkt = in + pos + sizeof(hdr);
+
+        uint64_t ts = flags & COLCAP_TS_SPLIT ? (uint64_t)hdr.ts_sec << 32 | hdr.ts_usec
+                                              : hdr.ts_sec * NS_PER_SEC + hdr.ts_usec;
+        put_varint(enc, COLCAP_TIME, zigzag(ts - prev));
+        prev = ts;
+        put_varint(enc, COLCAP_CAPLEN, hdr.caplen);
+        put_varint(enc, COLCAP_LEN, zigzag((int64_t)hdr.len - hdr.caplen));
+
+        uint32_t l4 = 0;
+        uint32_t ip_off = tuple_layout(pkt, hdr.caplen, hdr.caplen, &l4);
+        uint32_t end = header_end(pkt, hdr.caplen, ip_off, l4);
+        if (ip_off) {
+            put_bytes(enc, COLCAP_HEADER, pkt, ip_off + 12);
+            put_bytes(enc, COLCAP_SRC_IP, pkt + ip_off + 12, 4);
+            put_bytes(enc, COLCAP_DST_IP, pkt + ip_off + 16, 4);
+            put_bytes(enc, COLCAP_HEADER, pkt + ip_off + 20, l4 - ip_off - 20);
+            put_bytes(enc, COLCAP_SRC_PORT, pkt + l4, 2);
+            put_bytes(enc, COLCAP_DST_PORT, pkt + l4 + 2, 2);
+            put_bytes(enc, COLCAP_HEADER, pkt + l4 + 4, end - l4 - 4);
+        } else {
+            put_bytes(enc, COLCAP_HEADER, pkt, end);
+        }
+        put_bytes(enc, COLCAP_PAYLOAD, pkt + end, hdr.caplen - end);
+    }
+
+    struct colcap_chunk_hdr* chunk = out;
+    unsigned char* p = (unsigned char*)out + sizeof(*chunk);
+    chunk->magic = COLCAP_CHUNK_MAGIC;
+    chunk->records = count;
+    chunk->flags = flags;
+    for (int i = 0; i < COLCAP_COLUMNS; i++)
+        p += encode_column(enc, i, p, &chunk->columns[i]);
+    *out_len = p - (unsigned char*)out;
+    return 0;
+}
+
+size_t colcap_chunk_len(const struct colcap_chunk_hdr* hdr) {
+    if (hdr->magic != COLCAP_CHUNK_MAGIC) return 0;
+    size_t len = sizeof(*hdr);
+    for (int i = 0; i < COLCAP_COLUMNS; i++) {
+        if (hdr->columns[i].codec >= COLCAP_CODECS) return 0;
+        len += hdr->columns[i].enc_len;
+    }
+    return len;
+}
+
+// A decoded column and how far the rebuild has read into it
+struct column {
+    unsigned char* data;
+    size_t         len;
+    size_t         pos;
+};
+
+static int get_varint(struct column* col, uint64_t* v) {
+    *v = 0;
+    for (int shift = 0; shift < 64 && col->pos < col->len; shift += 7) {
+        unsigned char b = col->data[col->pos++];
+        *v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) return 0;
+    }
+    return -1;
+}
+
+static int get_bytes(struct column* col, unsigned char* out, size_t len) {
+    if (col->len - col->pos < len) return -1;
+    memcpy(out, col->data + col->pos, len);
+    col->pos += len;
+    return 0;
+}
+
+static int decode_column(const unsigned char* in, const struct colcap_column_hdr* hdr, size_t max_len, struct column* col) {
+    if (hdr->raw_len > max_len) return -1;
+    col->len = hdr->raw_len;
+    col->pos = 0;
+    col->data = malloc(col->len ? col->len : 1);
+    if (!col->data) return -1;
+    if (hdr->codec == COLCAP_STORE) {
+        if (hdr->enc_len != hdr->raw_len) return -1;
+        memcpy(col->data, in, col->len);
+        return 0;
+    }
+
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    if (inflateInit2(&strm, -15) != Z_OK) return -1;
+    strm.next_in = (unsigned char*)in;
+    strm.avail_in = hdr->enc_len;
+    strm.next_out = col->data;
+    strm.avail_out = col->len;
+    int ret = inflate(&strm, Z_FINISH);
+    inflateEnd(&strm);
+    return ret == Z_STREAM_END && strm.avail_out == 0 ? 0 : -1;
+}
+
+// Rebuilds one frame into pkt, taking the header and 5-tuple columns in the encoder's order
+static int rebuild_frame(struct column* cols, unsigned char* pkt, uint32_t caplen) {
+    struct column* header = &cols[COLCAP_HEADER];
+    uint32_t l4 = 0;
+    uint32_t ip_off = tuple_layout(header->data + header->pos, caplen, header->len - header->pos, &l4);
+    uint32_t end;
+    if (ip_off) {
+        if (get_bytes(header, pkt, ip_off + 12) < 0) return -1;
+
+        // A TCP header's length is at l4 + 12, so everything up to it has to be in place first
+        uint32_t known = pkt[ip_off + 9] == IPPROTO_UDP ? l4 + 8 : l4 + 13;
+        if (known > caplen) known = caplen;
+        if (get_bytes(&cols[COLCAP_SRC_IP], pkt + ip_off + 12, 4) < 0 ||
+            get_bytes(&cols[COLCAP_DST_IP], pkt + ip_off + 16, 4) < 0 ||
+            get_bytes(header, pkt + ip_off + 20, l4 - ip_off - 20) < 0 ||
+            get_bytes(&cols[COLCAP_SRC_PORT], pkt + l4, 2) < 0 ||
+            get_bytes(&cols[COLCAP_DST_PORT], pkt + l4 + 2, 2) < 0 ||
+            get_bytes(header, pkt + l4 + 4, known - l4 - 4) < 0)
+            return -1;
+        end = header_end(pkt, caplen, ip_off, l4);
+        if (end > known && get_bytes(header, pkt + known, end - known) < 0) return -1;
+    } else {
+        end = header_end(NULL, caplen, 0, 0);
+        if (get_bytes(header, pkt, end) < 0) return -1;
+    }
+    return get_bytes(&cols[COLCAP_PAYLOAD], pkt + end, caplen - end);
+}
+
+ssize_t colcap_decode(const void* chunk, size_t len, void* out, size_t out_size) {
+    const struct colcap_chunk_hdr* hdr = chunk;
+    struct column cols[COLCAP_COLUMNS];
+    memset(cols, 0, sizeof(cols));
+    if (len < sizeof(*hdr) || colcap_chunk_len(hdr) != len) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ssize_t ret = -1;
+    const unsigned char* in = (const unsigned char*)chunk + sizeof(*hdr);
+    for (int i = 0; i < COLCAP_COLUMNS; i++) {
+        // No column can be larger than the records it was split from
+        if (decode_column(in, &hdr->columns[i], colcap_bound(out_size), &cols[i]) < 0) goto done;
+        in += hdr->columns[i].enc_len;
+    }
+
+    unsigned char* p = out;
+    uint64_t ts = 0;
+    for (uint32_t i = 0; i < hdr->records; i++) {
+        uint64_t delta, caplen, extra;
+        if (get_varint(&cols[COLCAP_TIME], &delta) < 0 || get_varint(&cols[COLCAP_CAPLEN], &caplen) < 0 ||
+            get_varint(&cols[COLCAP_LEN], &extra) < 0 || caplen > UINT32_MAX)
+            goto done;
+        ts += unzigzag(delta);
+
+        struct pcap_record_hdr rec = {
+            .ts_sec  = hdr->flags & COLCAP_TS_SPLIT ? ts >> 32 : ts / NS_PER_SEC,
+            .ts_usec = hdr->flags & COLCAP_TS_SPLIT ? (uint32_t)ts : ts % NS_PER_SEC,
+            .caplen  = caplen,
+            .len     = caplen + unzigzag(extra)
+        };
+        if ((size_t)((unsigned char*)out + out_size - p) < sizeof(rec) + caplen) {
+            errno = EMSGSIZE;
+            goto done;
+        }
+        memcpy(p, &rec, sizeof(rec));
+        if (rebuild_frame(cols, p + sizeof(rec), caplen) < 0) goto done;
+        p += sizeof(rec) + caplen;
+    }
+    ret = p - (unsigned char*)out;
+
+done:
+    if (ret < 0 && errno != EMSGSIZE) errno = EINVAL;
+    for (int i = 0; i < COLCAP_COLUMNS; i++) free(cols[i].data);
+    return ret;
+}
@@ -0,0 +1,107 @@
+#ifndef COLCAP_H
+#define COLCAP_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "capfile.h"
+
+/*
+    Columnar capture chunks (CAPFILE_COLUMNAR). gzip over interleaved pcap records compresses
+    headers poorly: timestamps, addresses and ports sit between payload bytes, so no two of
+    them are ever close together. A columnar chunk takes the same block of pcap records and
+    stores each field as a column of its own: timestamps as deltas, lengths as varints, the
+    IPv4 5-tuple (as flow_key_from_packet() parses it) in fixed-width columns, the rest of the
+    L2-L4 headers in one column and payloads in another. Each column is compressed with its
+    own codec, so payload that will not compress is not made to pay for trying.
+
+    A columnar file is a colcap_file_hdr followed by chunks, each followed by a capfile sync
+    point. Decoding a chunk gives back exactly the pcap records it was encoded from, so
+    colcap2pcap rebuilds the original capture byte for byte.
+
+    The 5-tuple is moved, not copied: a frame's bytes are split across the columns, and the
+    decoder puts them back where the encoder found them. Where they go is decided only from
+    bytes in front of the addresses, which are back in place by the time it is needed.
+*/
+
+#define COLCAP_FILE_MAGIC  0x50414343  // "CCAP"
+#define COLCAP_CHUNK_MAGIC 0x4b4e4843  // "CHNK"
+#define COLCAP_VERSION     1
+
+#define COLCAP_RAW_HEADER  54  // Header bytes kept for frames without an IPv4 5-tuple (Ethernet + IPv6)
+
+enum colcap_column {
+    COLCAP_TIME,      // Zigzag varint deltas of sec * 10^9 + frac (see COLCAP_TS_SPLIT)
+    COLCAP_CAPLEN,    // Varint
+    COLCAP_LEN,       // Zigzag varint of len - caplen
+    COLCAP_SRC_IP,    // 4 bytes, network order, only for frames with a 5-tuple
+    COLCAP_DST_IP,
+    COLCAP_SRC_PORT,  // 2 bytes, network order
+    COLCAP_DST_PORT,
+    COLCAP_HEADER,    // L2-L4 headers without the 5-tuple
+    COLCAP_PAYLOAD,   // Everything after them
+    COLCAP_COLUMNS
+};
+
+// All but store are zlib raw deflate streams with a different strategy
+enum colcap_codec {
+    COLCAP_STORE,
+    COLCAP_DEFLATE,
+    COLCAP_HUFFMAN,  // Entropy coding only: fast, and all that high-entropy payload allows
+    COLCAP_RLE,
+    COLCAP_CODECS
+};
+
+#define COLCAP_TS_SPLIT 0x1  // A fraction was >= 10^9, so timestamps are sec << 32 | frac instead
+
+struct colcap_file_hdr {
+    uint32_t             magic;
+    uint32_t             version;
+    struct pcap_file_hdr pcap;  // Exactly what a pcap rebuilt from the chunks starts with
+};
+
+struct colcap_column_hdr {
+    uint32_t codec;    // What the column was actually stored with; store if compressing did not pay
+    uint32_t raw_len;
+    uint32_t enc_len;
+};
+
+// Columns follow the header in column order
+struct colcap_chunk_hdr {
+    uint32_t                 magic;
+    uint32_t                 records;
+    uint32_t                 flags;
+    struct colcap_column_hdr columns[COLCAP_COLUMNS];
+};
+
+struct colcap_encoder;
+
+/*
+    Parses a codec choice such as "payload=store,header=rle" into codecs, which should already
+    hold the defaults (colcap_default_codecs()); columns not named keep theirs. Returns -1 for
+    an unknown column or codec.
+*/
+void colcap_default_codecs(uint8_t codecs[COLCAP_COLUMNS]);
+int colcap_parse_codecs(const char* spec, uint8_t codecs[COLCAP_COLUMNS]);
+
+// Returns NULL with errno set. max_block is the largest block that will be encoded.
+struct colcap_encoder* colcap_encoder_new(int level, const uint8_t codecs[COLCAP_COLUMNS], size_t max_block);
+void colcap_encoder_free(struct colcap_encoder* enc);
+
+// Largest chunk a block of block_size bytes can encode to
+size_t colcap_bound(size_t block_size);
+
+/*
+    Encodes len bytes of whole pcap records (no file header) into one chunk. out_size must be
+    at least colcap_bound(len). Returns -1 with errno set if the records do not parse.
+*/
+int colcap_encode(struct colcap_encoder* enc, const void* records, size_t len, void* out, size_t out_size, size_t* out_len);
+
+// Total length of the chunk that starts with hdr, or 0 if hdr is not a chunk header
+size_t colcap_chunk_len(const struct colcap_chunk_hdr* hdr);
+
+// Decodes one chunk back into pcap records. Returns their length, or -1 with errno set.
+ssize_t colcap_decode(const void* chunk, size_t len, void* out, size_t out_size);
+
+#endif
@@ -0,0 +1,90 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "capfile.h"
+#include "colcap.h"
+
+/*
+    Converts a columnar capture (CAPFILE_COLUMNAR) back to plain pcap, on stdout or into the
+    named file. Every chunk decodes to the exact records it was made from, so the result is
+    the pcap the writer would have written without CAPFILE_COLUMNAR. Sync points are skipped.
+    A torn last chunk (a capture that was still being written) ends the conversion early,
+    with a warning, after everything before it.
+*/
+
+#define MAX_CHUNK (2 * CAPFILE_BUF_SIZE)
+
+static void usage(const char* prog) {
+    fprintf(stderr, "Usage: %s capture.colcap [output.pcap]\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2 || argc > 3) usage(argv[0]);
+    const char* input = argv[1];
+
+    FILE* in = fopen(input, "rb");
+    if (!in) {
+        fprintf(stderr, "%s: %s\n", input, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    struct colcap_file_hdr fh;
+    if (fread(&fh, sizeof(fh), 1, in) != 1 || fh.magic != COLCAP_FILE_MAGIC || fh.version != COLCAP_VERSION) {
+        fprintf(stderr, "%s: not a columnar capture\n", input);
+        exit(EXIT_FAILURE);
+    }
+
+    FILE* out = argc == 3 ? fopen(argv[2], "wb") : stdout;
+    if (!out) {
+        fprintf(stderr, "%s: %s\n", argv[2], strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    unsigned char* chunk = malloc(MAX_CHUNK);
+    unsigned char* records = malloc(CAPFILE_BUF_SIZE);
+    if (!chunk || !records) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    if (fwrite(&fh.pcap, sizeof(fh.pcap), 1, out) != 1) {
+        perror("write");
+        exit(EXIT_FAILURE);
+    }
+
+    unsigned long long chunks = 0;
+    struct colcap_chunk_hdr* hdr = (struct colcap_chunk_hdr*)chunk;
+    for (;;) {
+        size_t n = fread(hdr, 1, sizeof(*hdr), in);
+        if (n == 0) break;
+
+        size_t len = n == sizeof(*hdr) ? colcap_chunk_len(hdr) : 0;
+        if (len == 0 || len > MAX_CHUNK || fread(chunk + sizeof(*hdr), 1, len - sizeof(*hdr), in) != len - sizeof(*hdr)) {
+            fprintf(stderr, "%s: chunk %llu is incomplete, stopping there\n", input, chunks);
+            break;
+        }
+        ssize_t decoded = colcap_decode(chunk, len, records, CAPFILE_BUF_SIZE);
+        if (decoded < 0) {
+            fprintf(stderr, "%s: chunk %llu does not decode: %s\n", input, chunks, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        if (fwrite(records, decoded, 1, out) != 1 && decoded > 0) {
+            perror("write");
+            exit(EXIT_FAILURE);
+        }
+        chunks++;
+
+        // Every chunk is followed by a sync point, which only matters to capfile_recover()
+        if (fseek(in, CAPFILE_SYNC_SIZE, SEEK_CUR) < 0) break;
+    }
+
+    if (fclose(out) != 0) {
+        perror("close");
+        exit(EXIT_FAILURE);
+    }
+    fclose(in);
+    free(chunk);
+    free(records);
+    return 0;
+}
@@ -0,0 +1,42 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pcap.h>
+
+#include "xdp_filter.h"
+
+#define FILTER_SNAPLEN 65535
+
+int filter_compile(const char* expr, struct cbpf_insn** insns, char* errbuf, size_t errlen) {
+    // A dead handle is enough for pcap_compile; it only needs the link type and snaplen
+    pcap_t* pcap = pcap_open_dead(DLT_EN10MB, FILTER_SNAPLEN);
+    if (!pcap) {
+        snprintf(errbuf, errlen, "pcap_open_dead failed");
+        return -1;
+    }
+
+    struct bpf_program fcode;
+    if (pcap_compile(pcap, &fcode, expr, 1, PCAP_NETMASK_UNKNOWN) < 0) {
+        snprintf(errbuf, errlen, "%s", pcap_geterr(pcap));
+        pcap_close(pcap);
+        return -1;
+    }
+    pcap_close(pcap);
+
+    *insns = malloc(fcode.bf_len * sizeof(**insns));
+    if (!*insns) {
+        snprintf(errbuf, errlen, "out of memory");
+        pcap_freecode(&fcode);
+        return -1;
+    }
+    for (u_int i = 0; i < fcode.bf_len; i++) {
+        (*insns)[i].code = fcode.bf_insns[i].code;
+        (*insns)[i].jt = fcode.bf_insns[i].jt;
+        (*insns)[i].jf = fcode.bf_insns[i].jf;
+        (*insns)[i].k = fcode.bf_insns[i].k;
+    }
+
+    int count = fcode.bf_len;
+    pcap_freecode(&fcode);
+    return count;
+}
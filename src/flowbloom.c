@@ -0,0 +1,71 @@
+#include <stddef.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <linux/if_ether.h>
+
+#include "flowbloom.h"
+
+int flow_key_from_packet(const uint8_t* pkt, uint32_t caplen, struct flow_key* key) {
+    uint32_t off = ETH_HLEN;
+    if (caplen < ETH_HLEN) return -1;
+
+    uint16_t proto = (pkt[12] << 8) | pkt[13];
+    if (proto == ETH_P_8021Q) {
+        if (caplen < ETH_HLEN + 4) return -1;
+        proto = (pkt[16] << 8) | pkt[17];
+        off += 4;
+    }
+    if (proto != ETH_P_IP || caplen < off + 20) return -1;
+
+    const uint8_t* ip = pkt + off;
+    uint32_t ihl = (ip[0] & 0x0f) * 4;
+    if ((ip[0] >> 4) != 4 || ihl < 20) return -1;
+    if (ip[9] != IPPROTO_TCP && ip[9] != IPPROTO_UDP) return -1;
+
+    // Only the first fragment carries the ports
+    uint16_t frag = (ip[6] << 8) | ip[7];
+    if (frag & 0x1fff) return -1;
+    if (caplen < off + ihl + 4) return -1;
+
+    memset(key, 0, sizeof(*key));
+    memcpy(&key->src_ip, ip + 12, 4);
+    memcpy(&key->dst_ip, ip + 16, 4);
+    memcpy(&key->src_port, ip + ihl, 2);
+    memcpy(&key->dst_port, ip + ihl + 2, 2);
+    key->proto = ip[9];
+    return 0;
+}
+
+// FNV-1a over the key; the two halves drive double hashing for the bit positions
+static uint64_t hash_key(const struct flow_key* key) {
+    const uint8_t* p = (const uint8_t*)key;
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < offsetof(struct flow_key, pad); i++) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+    // FNV's low bits mix poorly on short keys; finish with a murmur-style avalanche
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+void flowbloom_add(uint8_t* bits, const struct flow_key* key) {
+    uint64_t h = hash_key(key);
+    uint32_t h1 = h, h2 = (h >> 32) | 1;
+    for (int i = 0; i < FLOWBLOOM_HASHES; i++) {
+        uint32_t bit = (h1 + i * h2) % FLOWBLOOM_BITS;
+        bits[bit / 8] |= 1 << (bit % 8);
+    }
+}
+
+int flowbloom_test(const uint8_t* bits, const struct flow_key* key) {
+    uint64_t h = hash_key(key);
+    uint32_t h1 = h, h2 = (h >> 32) | 1;
+    for (int i = 0; i < FLOWBLOOM_HASHES; i++) {
+        uint32_t bit = (h1 + i * h2) % FLOWBLOOM_BITS;
+        if (!(bits[bit / 8] & (1 << (bit % 8)))) return 0;
+    }
+    return 1;
+}
@@ -0,0 +1,213 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/socket.h>
+
+#include "ipfix.h"
+
+struct ipfix_template {
+    uint16_t           id;
+    uint16_t           count;
+    uint16_t           record_len;
+    struct ipfix_field fields[IPFIX_MAX_FIELDS];
+};
+
+struct ipfix_exporter {
+    int                   fd;
+    uint32_t              domain;
+    uint32_t              sequence;       // Data records exported so far, sent or not
+    time_t                templates_sent; // 0 until a message with the templates is sent, and again when one is added
+    struct ipfix_template templates[IPFIX_MAX_TEMPLATES];
+    int                   ntemplates;
+
+    uint8_t               msg[IPFIX_MAX_MESSAGE];
+    size_t                len;            // 0 when no message is pending
+    size_t                set;            // Offset of the open data set's header, 0 when none is open
+    uint16_t              set_id;
+    uint32_t              msg_records;    // Data records in the pending message
+    int                   msg_templates;  // The pending message starts with the template set
+
+    struct ipfix_stats    stats;
+};
+
+static int connect_udp(const char* spec) {
+    char host[256];
+    const char* port = IPFIX_DEFAULT_PORT;
+    const char* colon = strrchr(spec, ':');
+    // A bare IPv6 address has colons of its own but no port
+    if (colon && strchr(spec, ':') == colon) {
+        snprintf(host, sizeof(host), "%.*s", (int)(colon - spec), spec);
+        port = colon + 1;
+    } else {
+        snprintf(host, sizeof(host), "%s", spec);
+    }
+
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_DGRAM };
+    struct addrinfo* res;
+    if (getaddrinfo(host, port, &hints, &res) != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    int fd = -1;
+    for (struct addrinfo* ai = res; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd < 0) continue;
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) break;
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+struct ipfix_exporter* ipfix_open(const char* collector, uint32_t domain) {
+    struct ipfix_exporter* exp = calloc(1, sizeof(*exp));
+    if (!exp) return NULL;
+    exp->fd = connect_udp(collector);
+    if (exp->fd < 0) {
+        free(exp);
+        return NULL;
+    }
+    exp->domain = domain;
+    return exp;
+}
+
+int ipfix_add_template(struct ipfix_exporter* exp, uint16_t id, const struct ipfix_field* fields, int count) {
+    if (exp->ntemplates == IPFIX_MAX_TEMPLATES || id < IPFIX_MIN_TEMPLATE_ID || count <= 0 || count > IPFIX_MAX_FIELDS) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct ipfix_template* t = &exp->templates[exp->ntemplates];
+    t->id = id;
+    t->count = count;
+    t->record_len = 0;
+    for (int i = 0; i < count; i++) {
+        t->fields[i] = fields[i];
+        t->record_len += fields[i].length;
+    }
+
+    // Every template goes out with every template set, so the set and one record of each
+    // template must fit in one message
+    size_t need = sizeof(struct ipfix_msg_hdr) + sizeof(struct ipfix_set_hdr);
+    for (int i = 0; i <= exp->ntemplates; i++)
+        need += 4 + exp->templates[i].count * sizeof(struct ipfix_field) + sizeof(struct ipfix_set_hdr) + exp->templates[i].record_len;
+    if (need > IPFIX_MAX_MESSAGE) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    // Records of the new template must not go out ahead of it
+    ipfix_flush(exp);
+    exp->ntemplates++;
+    exp->templates_sent = 0;
+    return 0;
+}
+
+static struct ipfix_template* find_template(struct ipfix_exporter* exp, uint16_t id) {
+    for (int i = 0; i < exp->ntemplates; i++)
+        if (exp->templates[i].id == id) return &exp->templates[i];
+    return NULL;
+}
+
+static void close_set(struct ipfix_exporter* exp) {
+    if (!exp->set) return;
+    ipfix_put_u16(exp->msg + exp->set + 2, exp->len - exp->set);
+    exp->set = 0;
+}
+
+// Starts a message, with the template set first when it is due
+static void begin_message(struct ipfix_exporter* exp) {
+    exp->len = sizeof(struct ipfix_msg_hdr);
+    exp->msg_records = 0;
+    exp->msg_templates = 0;
+
+    // Only a send that succeeds counts: until then every message carries the templates
+    if (exp->templates_sent && time(NULL) - exp->templates_sent < IPFIX_TEMPLATE_REFRESH) return;
+    exp->msg_templates = 1;
+
+    size_t start = exp->len;
+    uint8_t* p = exp->msg + start + sizeof(struct ipfix_set_hdr);
+    for (int i = 0; i < exp->ntemplates; i++) {
+        const struct ipfix_template* t = &exp->templates[i];
+        p = ipfix_put_u16(p, t->id);
+        p = ipfix_put_u16(p, t->count);
+        for (int f = 0; f < t->count; f++) {
+            p = ipfix_put_u16(p, t->fields[f].id);
+            p = ipfix_put_u16(p, t->fields[f].length);
+        }
+    }
+    exp->len = p - exp->msg;
+    p = ipfix_put_u16(exp->msg + start, IPFIX_TEMPLATE_SET);
+    ipfix_put_u16(p, exp->len - start);
+}
+
+int ipfix_flush(struct ipfix_exporter* exp) {
+    if (!exp->len) return 0;
+    close_set(exp);
+
+    uint8_t* p = ipfix_put_u16(exp->msg, IPFIX_VERSION);
+    p = ipfix_put_u16(p, exp->len);
+    p = ipfix_put_u32(p, time(NULL));
+    p = ipfix_put_u32(p, exp->sequence);
+    ipfix_put_u32(p, exp->domain);
+
+    // The sequence number counts records exported, not received, so a lost message shows
+    // up at the collector as a gap of exactly its records
+    exp->sequence += exp->msg_records;
+    ssize_t n = send(exp->fd, exp->msg, exp->len, MSG_DONTWAIT);
+    size_t len = exp->len;
+    exp->len = 0;
+    // Counted with relaxed atomics, so ipfix_get_stats() can be called from a metrics scrape
+    if (n != (ssize_t)len) {
+        __atomic_add_fetch(&exp->stats.send_errors, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    if (exp->msg_templates) exp->templates_sent = time(NULL);
+    __atomic_add_fetch(&exp->stats.messages, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&exp->stats.records, exp->msg_records, __ATOMIC_RELAXED);
+    return 0;
+}
+
+void* ipfix_record(struct ipfix_exporter* exp, uint16_t id) {
+    const struct ipfix_template* t = find_template(exp, id);
+    if (!t) return NULL;
+
+    size_t need = t->record_len + (exp->set && exp->set_id == id ? 0 : sizeof(struct ipfix_set_hdr));
+    if (exp->len && exp->len + need > IPFIX_MAX_MESSAGE) ipfix_flush(exp);
+    if (!exp->len) begin_message(exp);
+
+    if (!exp->set || exp->set_id != id) {
+        // Records do not keep anything aligned, hence the byte-wise headers
+        close_set(exp);
+        ipfix_put_u16(exp->msg + exp->len, id);
+        exp->set = exp->len;
+        exp->set_id = id;
+        exp->len += sizeof(struct ipfix_set_hdr);
+    }
+
+    void* record = exp->msg + exp->len;
+    exp->len += t->record_len;
+    exp->msg_records++;
+    return record;
+}
+
+void ipfix_get_stats(const struct ipfix_exporter* exp, struct ipfix_stats* stats) {
+    stats->messages = __atomic_load_n(&exp->stats.messages, __ATOMIC_RELAXED);
+    stats->records = __atomic_load_n(&exp->stats.records, __ATOMIC_RELAXED);
+    stats->send_errors = __atomic_load_n(&exp->stats.send_errors, __ATOMIC_RELAXED);
+}
+
+void ipfix_close(struct ipfix_exporter* exp) {
+    if (!exp) return;
+    ipfix_flush(exp);
+    close(exp->fd);
+    free(exp);
+}
@@ -0,0 +1,142 @@
+#ifndef IPFIX_H
+#define IPFIX_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+    IPFIX (RFC 7011) export over UDP. The caller describes its records once as templates
+    (lists of information elements), then asks for room for one record at a time and fills it
+    in, in network byte order. Records are packed into messages of at most IPFIX_MAX_MESSAGE
+    bytes, one datagram each, and a message goes out when the next record does not fit or
+    ipfix_flush() is called.
+
+    UDP has no session, so a collector that starts (or restarts) after the exporter only
+    learns the templates from a later message: they go out with every message until one is
+    sent, and again with the first one after every IPFIX_TEMPLATE_REFRESH seconds.
+
+    Nothing here blocks or retries. A datagram the kernel will not take (the collector is not
+    listening, the socket buffer is full) is counted and dropped, and the sequence numbers
+    tell the collector how many records it lost.
+*/
+
+#define IPFIX_VERSION          10
+#define IPFIX_DEFAULT_PORT     "4739"
+#define IPFIX_MAX_MESSAGE      1400  // Bytes per datagram, well under a 1500 byte MTU
+#define IPFIX_TEMPLATE_SET     2
+#define IPFIX_MIN_TEMPLATE_ID  256
+#define IPFIX_MAX_TEMPLATES    4
+#define IPFIX_MAX_FIELDS       16
+#define IPFIX_TEMPLATE_REFRESH 60
+
+// Information elements (IANA registry) used by the exporters in this tree
+enum ipfix_ie {
+    IPFIX_IE_OCTET_DELTA_COUNT         = 1,
+    IPFIX_IE_PACKET_DELTA_COUNT        = 2,
+    IPFIX_IE_PROTOCOL_IDENTIFIER       = 4,
+    IPFIX_IE_TCP_CONTROL_BITS          = 6,
+    IPFIX_IE_SOURCE_TRANSPORT_PORT     = 7,
+    IPFIX_IE_SOURCE_IPV4_ADDRESS       = 8,
+    IPFIX_IE_DEST_TRANSPORT_PORT       = 11,
+    IPFIX_IE_DEST_IPV4_ADDRESS         = 12,
+    IPFIX_IE_FLOW_END_REASON           = 136,
+    IPFIX_IE_FLOW_START_MS             = 152,  // flowStartMilliseconds
+    IPFIX_IE_FLOW_END_MS               = 153,
+    IPFIX_IE_OBSERVATION_TIME_MS       = 323,
+};
+
+// flowEndReason values
+#define IPFIX_END_IDLE_TIMEOUT      0x01
+#define IPFIX_END_ACTIVE_TIMEOUT    0x02
+#define IPFIX_END_OF_FLOW           0x03
+#define IPFIX_END_FORCED            0x04
+#define IPFIX_END_LACK_OF_RESOURCES 0x05
+
+// Header layouts; on the wire every field is in network byte order
+struct ipfix_msg_hdr {
+    uint16_t version;
+    uint16_t length;       // Of the whole message, this header included
+    uint32_t export_time;  // Seconds since the epoch
+    uint32_t sequence;     // Data records sent in this domain before this message, mod 2^32
+    uint32_t domain;
+};
+
+struct ipfix_set_hdr {
+    uint16_t id;      // IPFIX_TEMPLATE_SET, or the template a data set's records follow
+    uint16_t length;  // Of the whole set, this header included
+};
+
+struct ipfix_field {
+    uint16_t id;
+    uint16_t length;
+};
+
+struct ipfix_stats {
+    uint64_t messages;
+    uint64_t records;
+    uint64_t send_errors;  // Datagrams the kernel refused; their records are lost
+};
+
+struct ipfix_exporter;
+
+/*
+    Connects a UDP socket to collector, given as host:port or host (port 4739). Records are
+    exported in observation domain domain. Returns NULL with errno set.
+*/
+struct ipfix_exporter* ipfix_open(const char* collector, uint32_t domain);
+
+// Flushes what is pending and closes the socket
+void ipfix_close(struct ipfix_exporter* exp);
+
+/*
+    Adds a template. id is at least IPFIX_MIN_TEMPLATE_ID; lengths are the encoded sizes of
+    the fields, in order. It is sent with the next message. Returns -1 with errno set when
+    the table is full or a record would not fit in a message.
+*/
+int ipfix_add_template(struct ipfix_exporter* exp, uint16_t id, const struct ipfix_field* fields, int count);
+
+/*
+    Returns room for one record of template id, to be filled in before the next call. This
+    may send the pending message to make room, so it never fails for a known template; it
+    returns NULL only for an unknown one.
+*/
+void* ipfix_record(struct ipfix_exporter* exp, uint16_t id);
+
+// Sends the pending message, if any. Returns -1 with errno set if the send failed.
+int ipfix_flush(struct ipfix_exporter* exp);
+
+void ipfix_get_stats(const struct ipfix_exporter* exp, struct ipfix_stats* stats);
+
+// Helpers for filling in a record: each stores v in network byte order and returns the next byte
+static inline uint8_t* ipfix_put_u8(uint8_t* p, uint8_t v) {
+    *p = v;
+    return p + 1;
+}
+
+static inline uint8_t* ipfix_put_u16(uint8_t* p, uint16_t v) {
+    p[0] = v >> 8;
+    p[1] = v;
+    return p + 2;
+}
+
+static inline uint8_t* ipfix_put_u32(uint8_t* p, uint32_t v) {
+    return ipfix_put_u16(ipfix_put_u16(p, v >> 16), v);
+}
+
+static inline uint8_t* ipfix_put_u64(uint8_t* p, uint64_t v) {
+    return ipfix_put_u32(ipfix_put_u32(p, v >> 32), v);
+}
+
+static inline uint16_t ipfix_get_u16(const uint8_t* p) {
+    return (uint16_t)p[0] << 8 | p[1];
+}
+
+static inline uint32_t ipfix_get_u32(const uint8_t* p) {
+    return (uint32_t)ipfix_get_u16(p) << 16 | ipfix_get_u16(p + 2);
+}
+
+static inline uint64_t ipfix_get_u64(const uint8_t* p) {
+    return (uint64_t)ipfix_get_u32(p) << 32 | ipfix_get_u32(p + 4);
+}
+
+#endif
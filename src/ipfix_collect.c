@@ -0,0 +1,278 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "ipfix.h"
+
+/*
+    A stand-in IPFIX collector: listens on UDP, learns templates as they arrive and prints
+    every data record on stdout, one line of name=value pairs per record. It is for checking
+    what an exporter sends (xdp_flow_user -x), not for keeping flows: templates are held in
+    a small fixed table and there is no storage. Sequence numbers are checked per observation
+    domain and every gap is reported on stderr, with a summary on exit.
+*/
+
+#define MAX_TEMPLATES 64
+
+struct template {
+    uint32_t           domain;
+    uint16_t           id;
+    uint16_t           count;
+    struct ipfix_field fields[IPFIX_MAX_FIELDS];
+};
+
+struct domain {
+    uint32_t id;
+    uint32_t next_sequence;
+    int      seen;
+};
+
+static struct template templates[MAX_TEMPLATES];
+static int             ntemplates = 0;
+static struct domain   domains[MAX_TEMPLATES];
+static int             ndomains = 0;
+
+static unsigned long long messages, records, lost, unknown;
+
+static volatile sig_atomic_t stop = 0;
+static void handle_signal(int sig) {
+    (void)sig;
+    stop = 1;
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr,
+        "Usage: %s [-n records] [listen]\n"
+        "    listen  port or host:port to receive on (default " IPFIX_DEFAULT_PORT ")\n"
+        "    -n      exit after this many data records\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+static const char* ie_name(uint16_t id) {
+    switch (id) {
+        case IPFIX_IE_OCTET_DELTA_COUNT:      return "octetDeltaCount";
+        case IPFIX_IE_PACKET_DELTA_COUNT:     return "packetDeltaCount";
+        case IPFIX_IE_PROTOCOL_IDENTIFIER:    return "protocolIdentifier";
+        case IPFIX_IE_TCP_CONTROL_BITS:       return "tcpControlBits";
+        case IPFIX_IE_SOURCE_TRANSPORT_PORT:  return "sourceTransportPort";
+        case IPFIX_IE_SOURCE_IPV4_ADDRESS:    return "sourceIPv4Address";
+        case IPFIX_IE_DEST_TRANSPORT_PORT:    return "destinationTransportPort";
+        case IPFIX_IE_DEST_IPV4_ADDRESS:      return "destinationIPv4Address";
+        case IPFIX_IE_FLOW_END_REASON:        return "flowEndReason";
+        case IPFIX_IE_FLOW_START_MS:          return "flowStartMilliseconds";
+        case IPFIX_IE_FLOW_END_MS:            return "flowEndMilliseconds";
+        case IPFIX_IE_OBSERVATION_TIME_MS:    return "observationTimeMilliseconds";
+        default:                              return NULL;
+    }
+}
+
+static void print_field(const struct ipfix_field* f, const uint8_t* p) {
+    const char* name = ie_name(f->id);
+    if (name) printf("%s=", name);
+    else printf("ie%u=", f->id);
+
+    if ((f->id == IPFIX_IE_SOURCE_IPV4_ADDRESS || f->id == IPFIX_IE_DEST_IPV4_ADDRESS) && f->length == 4) {
+        char addr[INET_ADDRSTRLEN];
+        printf("%s", inet_ntop(AF_INET, p, addr, sizeof(addr)));
+    } else if ((f->id == IPFIX_IE_FLOW_START_MS || f->id == IPFIX_IE_FLOW_END_MS || f->id == IPFIX_IE_OBSERVATION_TIME_MS) && f->length == 8) {
+        uint64_t ms = ipfix_get_u64(p);
+        printf("%llu.%03llu", (unsigned long long)(ms / 1000), (unsigned long long)(ms % 1000));
+    } else if (f->length <= 8) {
+        // Unsigned, possibly in reduced-size encoding
+        uint64_t v = 0;
+        for (int i = 0; i < f->length; i++) v = v << 8 | p[i];
+        printf("%llu", (unsigned long long)v);
+    } else {
+        for (int i = 0; i < f->length; i++) printf("%02x", p[i]);
+    }
+}
+
+static struct template* find_template(uint32_t domain, uint16_t id) {
+    for (int i = 0; i < ntemplates; i++)
+        if (templates[i].domain == domain && templates[i].id == id) return &templates[i];
+    return NULL;
+}
+
+// Template records replace any earlier template with the same id; a field count of 0 withdraws it
+static void parse_templates(uint32_t domain, const uint8_t* p, const uint8_t* end) {
+    while (end - p >= 4) {
+        uint16_t id = ipfix_get_u16(p);
+        uint16_t count = ipfix_get_u16(p + 2);
+        p += 4;
+        if (count > IPFIX_MAX_FIELDS || end - p < count * 4) {
+            fprintf(stderr, "Template %u in domain %u is malformed or too large, ignored\n", id, domain);
+            return;
+        }
+
+        struct template* t = find_template(domain, id);
+        if (count == 0) {
+            if (t) *t = templates[--ntemplates];
+            continue;
+        }
+        if (!t) {
+            if (ntemplates == MAX_TEMPLATES) {
+                fprintf(stderr, "Template table full, template %u in domain %u ignored\n", id, domain);
+                return;
+            }
+            t = &templates[ntemplates++];
+        }
+        t->domain = domain;
+        t->id = id;
+        t->count = count;
+        for (int i = 0; i < count; i++, p += 4) {
+            t->fields[i].id = ipfix_get_u16(p);
+            t->fields[i].length = ipfix_get_u16(p + 2);
+        }
+    }
+}
+
+static unsigned long long parse_data(uint32_t domain, uint16_t id, const uint8_t* p, const uint8_t* end) {
+    const struct template* t = find_template(domain, id);
+    if (!t) {
+        unknown++;
+        return 0;
+    }
+    size_t record_len = 0;
+    for (int i = 0; i < t->count; i++) record_len += t->fields[i].length;
+    if (record_len == 0) return 0;
+
+    // Whatever is left over at the end of a set, shorter than a record, is padding
+    unsigned long long n = 0;
+    for (; (size_t)(end - p) >= record_len; n++) {
+        printf("domain=%u template=%u", domain, id);
+        for (int i = 0; i < t->count; i++) {
+            putchar(' ');
+            print_field(&t->fields[i], p);
+            p += t->fields[i].length;
+        }
+        putchar('\n');
+    }
+    return n;
+}
+
+static struct domain* find_domain(uint32_t id) {
+    for (int i = 0; i < ndomains; i++)
+        if (domains[i].id == id) return &domains[i];
+    if (ndomains == MAX_TEMPLATES) return NULL;
+    domains[ndomains].id = id;
+    return &domains[ndomains++];
+}
+
+static void parse_message(const uint8_t* msg, size_t len) {
+    if (len < sizeof(struct ipfix_msg_hdr) || ipfix_get_u16(msg) != IPFIX_VERSION || ipfix_get_u16(msg + 2) != len) {
+        fprintf(stderr, "Ignoring a datagram that is not an IPFIX message\n");
+        return;
+    }
+    uint32_t sequence = ipfix_get_u32(msg + 8);
+    uint32_t domain = ipfix_get_u32(msg + 12);
+    messages++;
+
+    struct domain* d = find_domain(domain);
+    if (d && d->seen && sequence != d->next_sequence) {
+        uint32_t gap = sequence - d->next_sequence;
+        fprintf(stderr, "Domain %u: sequence %u, expected %u: %u records lost or reordered\n", domain, sequence, d->next_sequence, gap);
+        lost += gap;
+    }
+
+    unsigned long long n = 0, unknown_before = unknown;
+    const uint8_t* p = msg + sizeof(struct ipfix_msg_hdr);
+    const uint8_t* end = msg + len;
+    while (end - p >= (ptrdiff_t)sizeof(struct ipfix_set_hdr)) {
+        uint16_t id = ipfix_get_u16(p);
+        uint16_t set_len = ipfix_get_u16(p + 2);
+        if (set_len < sizeof(struct ipfix_set_hdr) || set_len > end - p) {
+            fprintf(stderr, "Domain %u: malformed set, rest of the message ignored\n", domain);
+            break;
+        }
+        const uint8_t* body = p + sizeof(struct ipfix_set_hdr);
+        if (id == IPFIX_TEMPLATE_SET) parse_templates(domain, body, p + set_len);
+        else if (id >= IPFIX_MIN_TEMPLATE_ID) n += parse_data(domain, id, body, p + set_len);
+        p += set_len;  // Options templates (set 3) are skipped
+    }
+    records += n;
+
+    // Records in sets that could not be decoded were still counted by the exporter, so
+    // the next sequence number is unknown until the next message
+    if (d) {
+        d->seen = unknown == unknown_before;
+        d->next_sequence = sequence + n;
+    }
+}
+
+static int bind_udp(const char* spec) {
+    char host[256] = "";
+    const char* port = spec;
+    const char* colon = strrchr(spec, ':');
+    if (colon) {
+        snprintf(host, sizeof(host), "%.*s", (int)(colon - spec), spec);
+        port = colon + 1;
+    }
+
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_DGRAM, .ai_flags = AI_PASSIVE };
+    struct addrinfo* res;
+    if (getaddrinfo(host[0] ? host : NULL, port, &hints, &res) != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    int fd = -1;
+    for (struct addrinfo* ai = res; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0) continue;
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0) break;
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+int main(int argc, char* argv[]) {
+    unsigned long long limit = 0;
+    int c;
+
+    while ((c = getopt(argc, argv, "n:h")) != -1) {
+        switch (c) {
+            case 'n': limit = strtoull(optarg, NULL, 10); break;
+            default: usage(argv[0]);
+        }
+    }
+    if (argc - optind > 1) usage(argv[0]);
+    const char* listen = optind < argc ? argv[optind] : IPFIX_DEFAULT_PORT;
+
+    int fd = bind_udp(listen);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to listen on %s: %s\n", listen, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    // No SA_RESTART, so a signal interrupts the blocking recv()
+    struct sigaction sa = { .sa_handler = handle_signal };
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    static uint8_t msg[65536];
+    while (!stop && (!limit || records < limit)) {
+        ssize_t n = recv(fd, msg, sizeof(msg), 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("recv");
+            break;
+        }
+        parse_message(msg, n);
+        fflush(stdout);
+    }
+
+    fprintf(stderr, "%llu messages, %llu records, %llu records lost, %llu data sets without a known template\n",
+            messages, records, lost, unknown);
+    close(fd);
+    return 0;
+}
@@ -17,11 +17,13 @@
 #include <sys/stat.h>
 
 #include <pcap.h>
-#include <zlib.h>
+
+#include "capfile.h"
+#include "pgz.h"
 
 #define PCAP_READ_LEN   2000 // number of bytes in each packet to read 
 #define PCAP_TIMEOUT    1000 // if not enough packets timeout after this ms 
-#define PIPE_SIZE       4096 // a UNIX pipe is one page of memory 
+#define FLUSH_INTERVAL  1    // seconds a packet may sit in the write buffer 
 
 /* strlcpy/strlcat hack */
 #define strlcpy(dst, src, len) \
@@ -38,15 +40,16 @@
 // ---------------------============= Globals =============--------------------
 static char             data_dir[MAXPATHLEN];
 static time_t           goal_ts;
-static pcap_dumper_t    *pdump;
+static time_t           flush_ts;
 static pcap_t           *pcap;
 static char             flag_gzip;
-static gzFile           gzfd;
-static FILE             *pipefd, *pcapfd;
-static char             junk[sizeof(struct pcap_file_header)];
-static char             pipebuf[PIPE_SIZE];
-static int              read_pipe;
+static int              gz_level;
+static int              gz_workers;
+static char             flag_direct;
+static uint64_t         prealloc_bytes;
+static struct capfile   *capfd;
 static char             pcap_fname[MAXPATHLEN];
+static volatile sig_atomic_t exit_sig;
 
 // --------------------============= Functions =============-------------------
 static void
@@ -55,9 +58,13 @@ usage(char *msg)
     if (msg != NULL)
         fprintf(stderr, "%s\n", msg);
     fprintf(stderr, 
-        "Usage: pcapture [-u] [-i interface] [-s data-dir] pcap-filter\n"
+        "Usage: pcapture [-u] [-l level] [-w workers] [-D] [-P MiB] [-i interface] [-s data-dir] pcap-filter\n"
         "    -k  keep the current user;do not switch to 'nobody'\n"
-        "    -u  do not gzip output files\n");
+        "    -u  do not gzip output files\n"
+        "    -l  gzip compression level (default 6)\n"
+        "    -w  gzip compression threads (default: one per CPU)\n"
+        "    -D  write with O_DIRECT, bypassing the page cache\n"
+        "    -P  reserve this much disk space for each hourly file up front\n");
     exit(1);
 }
 
@@ -65,30 +72,16 @@ static void
 close_hour_file()
 {
     char pcap_done_fname[MAXPATHLEN];
-    int errnum;
-    
-    // Close the pdump file
-    // Note that when we are outputting zipped pcap, this will close
-    // the 'write_fd' descriptor, so we only need to close the 'read_fd'
-    if (pdump != NULL)
-        pcap_dump_close(pdump);
-    if (flag_gzip > 0) 
-    {
-        if (gzclose(gzfd) < 0)
-            errx(1, "gzclose: %s\n", gzerror(gzfd, &errnum));
-    }
-    else
-    {
-        fclose(pcapfd);
-    }
     
-    // close the read side of the pipe
-    close(read_pipe);
+    // flush whatever is still buffered and close the file
+    if (capfile_close(capfd) < 0)
+        err(1, "capfile_close(%s)", pcap_fname);
+    capfd = NULL;
     
     // the file is complete so remove '.partial'
     strlcpy(pcap_done_fname, pcap_fname, sizeof(pcap_done_fname));
     pcap_done_fname[strlen(pcap_done_fname) - 8] = '\0';
-    if (rename(pcap_fname, pcap_done_fname) < 0)
+    if (capfile_rename(pcap_fname, pcap_done_fname) < 0)
         err(1, "rename %s to %s failed", pcap_fname, pcap_done_fname);
 }
 
@@ -147,12 +140,12 @@ create_hour_file(time_t ts)
 {
     // gzmode - open files to create and always append 
     char        buf[32], path[MAXPATHLEN], pcap_done_fname[MAXPATHLEN];
-    int         fds[2], bytes_read, rbytes, flag_append, fcntl_flags;
     struct tm   *tm;
     struct stat sb;
+    struct capfile_opts opts;
     
     // close current file 
-    if (pdump != NULL) 
+    if (capfd != NULL) 
         close_hour_file();
     
     // create current hour's file
@@ -179,64 +172,43 @@ create_hour_file(time_t ts)
     // move file to be partial if still exists
     if (stat(pcap_done_fname, &sb) == 0)
     {
-        if (rename(pcap_done_fname, pcap_fname) < 0)
+        if (capfile_rename(pcap_done_fname, pcap_fname) < 0)
             err(1, "rename %s to %s failed", pcap_done_fname, pcap_fname);
     }
     
-    // check if any existing file and set append flag if so
-    if (stat(pcap_fname, &sb) == 0 && sb.st_size > 0) 
-        flag_append = 1;
-    else
-        flag_append = 0;
-    
-    // open gzip file
-    if (flag_gzip > 0)
-    {
-        if ((gzfd = gzopen(pcap_fname, "a9")) == NULL)
-            err(1, "gzopen(%s): ", pcap_fname);
-    }
-    else
-    {
-        if ((pcapfd = fopen(pcap_fname, "a")) == NULL)
-            err(1, "fopen(%s): ", pcap_fname);
-    }
-    
-    // create the pipe between the file writer and us
-    if (pipe(fds) != 0) 
-        err(1, "pipe: ");
-    read_pipe = fds[0];
-    if ((pipefd = fdopen(fds[1], "w")) == NULL)
-        err(1, "fdopen(pipe): ");
-    
-    // set read pipe to be non-blocking
-    if ((fcntl_flags = fcntl(read_pipe, F_GETFL, 0)) < 0)
-        fcntl_flags = 0;
-    if (fcntl(read_pipe, F_SETFL, fcntl_flags | O_NONBLOCK) < 0)
-        err(1, "fcntl(read_pipe): ");
-    
-    // open the pcap/gzip files
-    if ((pdump = pcap_dump_fopen(pcap, pipefd)) == NULL)
-        errx(1, "pcap_dump_open: %s\n", pcap_geterr(pcap));
-    pcap_dump_flush(pdump);
-    
-    // if we are appending then we DO NOT write the pcap header again so skip
-    if (flag_append > 0)
+    // a partial file left by a crash may end in a torn chunk; cut it back to
+    // the last intact one, or move it aside if that can't be found
+    if (stat(pcap_fname, &sb) == 0)
     {
-        bytes_read = 0;
-        do
+        struct capfile_recovery rec;
+        if (capfile_recover(pcap_fname, &rec) == 0)
+            syslog(LOG_INFO, "resuming %s: kept %llu bytes, discarded %llu (%u index entries)",
+                pcap_fname, (unsigned long long)rec.size,
+                (unsigned long long)rec.discarded, rec.dropped);
+        else
         {
-            if ((rbytes = read(read_pipe, junk, 
-                sizeof(struct pcap_file_header) - bytes_read)) < 0)
-            {
-                if (errno == EAGAIN)
-                    if (bytes_read < sizeof(struct pcap_file_header))
-                        errx(1, "could not read full pcap file header.");
-                err(1, "create_hour_file() read error");
-            }
-            bytes_read += rbytes;
-        } while (bytes_read < sizeof(struct pcap_file_header));
+            char corrupt_fname[MAXPATHLEN];
+            syslog(LOG_WARNING, "cannot resume %s: %s", pcap_fname, strerror(errno));
+            snprintf(corrupt_fname, sizeof(corrupt_fname), "%s.corrupt", pcap_fname);
+            if (capfile_rename(pcap_fname, corrupt_fname) < 0)
+                err(1, "rename %s to %s failed", pcap_fname, corrupt_fname);
+        }
     }
     
+    // open the file; if it already has data we append to it and the
+    // existing pcap header is kept (with gzip, we just add more members)
+    memset(&opts, 0, sizeof(opts));
+    opts.flags = CAPFILE_APPEND | CAPFILE_INDEX | CAPFILE_BLOOM | CAPFILE_URING |
+        (flag_gzip > 0 ? CAPFILE_GZIP : 0) | (flag_direct ? CAPFILE_DIRECT : 0);
+    opts.level = gz_level;
+    opts.workers = gz_workers;
+    opts.snaplen = pcap_snapshot(pcap);
+    opts.linktype = pcap_datalink(pcap);
+    opts.prealloc = prealloc_bytes;
+    if ((capfd = capfile_open(pcap_fname, &opts)) == NULL)
+        err(1, "capfile_open(%s): ", pcap_fname);
+    flush_ts = ts + FLUSH_INTERVAL;
+    
     // set new goal 
     tm = gmtime(&ts);
     tm->tm_sec = 0;
@@ -246,34 +218,13 @@ create_hour_file(time_t ts)
 }
 
 static void
-rwpipe(void)
+flush_hour_file(time_t now)
 {
-    int bytes_read, written, wbytes, gzerr;
-    
-    // read from pcap dump descriptor and write to file
-    do {
-        if ((bytes_read = read(read_pipe, pipebuf, sizeof(pipebuf))) < 0)
-        {
-            if (errno == EAGAIN)
-                break;
-            err(1, "handle_pkt() read error");
-        }
-        if (flag_gzip > 0)
-        {
-            written = 0;
-            do {
-                if ((wbytes = gzwrite(gzfd, pipebuf + written, 
-                    bytes_read - written)) < 0)
-                    errx(1, "read: %s\n", gzerror(gzfd, &gzerr));
-                written += wbytes;
-            } while (written < wbytes);
-        }
-        else
-        {
-            if (fwrite(pipebuf, bytes_read, 1, pcapfd) != 1)
-                err(1, "handle_pkt() fwrite error");
-        }
-    } while (bytes_read > 0);
+    // push buffered packets to the file so a quiet link never leaves
+    // more than FLUSH_INTERVAL seconds of capture sitting in memory
+    if (capfile_flush(capfd) < 0)
+        err(1, "capfile_flush(%s)", pcap_fname);
+    flush_ts = now + FLUSH_INTERVAL;
 }
 
 static void
@@ -283,21 +234,20 @@ handle_pkt(u_char *arg, const struct pcap_pkthdr *hdr, const u_char *pkt)
     if (hdr->ts.tv_sec >= goal_ts)
         create_hour_file(hdr->ts.tv_sec);
     
-    // write packet to libpcap and flush to output pipe
-    pcap_dump((u_char *)pdump, hdr, pkt);
-    pcap_dump_flush(pdump);
-    rwpipe();
+    // serialise the packet straight into the write buffer; it only
+    // reaches the file when the buffer fills or the flush timer fires
+    if (capfile_write(capfd, hdr->ts.tv_sec, hdr->ts.tv_usec, hdr->caplen,
+        hdr->len, pkt) < 0)
+        err(1, "handle_pkt() capfile_write error");
 }
 
 static void
 close_cb(int sig)
 {
-    // flush and close the pcap dumper and write file
-    pcap_dump_flush(pdump);
-    rwpipe();
-    close_hour_file();
-    syslog(LOG_INFO, "exiting on signal %d", sig);
-    _exit(0);
+    // the compression threads hold locks, so the file is closed from main()
+    // once pcap_loop() returns rather than from inside the signal handler
+    exit_sig = sig;
+    pcap_breakloop(pcap);
 }
 
 int
@@ -310,15 +260,20 @@ main(int argc, char *argv[])
     struct bpf_program fcode;
     struct stat sb;
     struct passwd   *passwd;
+    time_t now;
     
     // parse cmd line options 
-    pdump = NULL;
+    capfd = NULL;
     intf[0] = '\0';
     data_dir[0] = '\0';
     flag_gzip = 1;
+    gz_level = PGZ_DEFAULT_LEVEL;
+    gz_workers = 0;
+    flag_direct = 0;
+    prealloc_bytes = 0;
     keep_user = 0; 
     
-    while ((c = getopt(argc, argv, "kui:s:h?")) != -1)
+    while ((c = getopt(argc, argv, "kul:w:DP:i:s:h?")) != -1)
     {
         switch (c) 
         {
@@ -328,6 +283,20 @@ main(int argc, char *argv[])
             case 'u':
                 flag_gzip = 0;
                 break;
+            case 'l':
+                gz_level = atoi(optarg);
+                if (gz_level < 1 || gz_level > 9)
+                    usage("compression level must be 1-9.");
+                break;
+            case 'w':
+                gz_workers = atoi(optarg);
+                break;
+            case 'D':
+                flag_direct = 1;
+                break;
+            case 'P':
+                prealloc_bytes = strtoull(optarg, NULL, 10) << 20;
+                break;
             case 'i':
                 strlcpy(intf, optarg, sizeof(intf));
                 break;
@@ -405,8 +374,20 @@ main(int argc, char *argv[])
     signal(SIGTERM, close_cb);
     signal(SIGINT, close_cb);
     
-    // loop through all packets
-    pcap_loop(pcap, -1, handle_pkt, NULL);
+    // loop through all packets; pcap_dispatch() returns at least every
+    // PCAP_TIMEOUT ms, which is when the flush timer gets checked
+    while (exit_sig == 0)
+    {
+        if (pcap_dispatch(pcap, -1, handle_pkt, NULL) < 0)
+            break;
+        now = time(NULL);
+        if (now >= flush_ts)
+            flush_hour_file(now);
+    }
+    
+    // flush and close the write file
+    close_hour_file();
+    syslog(LOG_INFO, "exiting on signal %d", exit_sig);
     
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,255 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+
+#include "metrics.h"
+
+#define MAX_COLLECTORS   8
+#define REQUEST_MAX      4096
+#define REQUEST_TIMEOUT_S 2  // A client that stalls mid-request is dropped after this long
+
+struct collector {
+    metrics_collect_fn fn;
+    void*              arg;
+};
+
+static pthread_mutex_t  registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct metric*   registry = NULL;
+static struct collector collectors[MAX_COLLECTORS];
+static int              ncollectors = 0;
+
+void metric_register(struct metric* m) {
+    pthread_mutex_lock(&registry_lock);
+    struct metric** p = &registry;
+    while (*p && *p != m) p = &(*p)->next;
+    if (!*p) *p = m;
+    pthread_mutex_unlock(&registry_lock);
+}
+
+void metric_observe_ns(struct metric* m, uint64_t ns) {
+    // Bucket i holds observations of at most 2^i microseconds
+    uint64_t us = (ns + 999) / 1000;
+    int i = 0;
+    while (i < METRIC_HIST_BUCKETS && us > (1ULL << i)) i++;
+    __atomic_add_fetch(&m->buckets[i], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&m->sum_ns, ns, __ATOMIC_RELAXED);
+}
+
+uint64_t metrics_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void metrics_add_collector(metrics_collect_fn fn, void* arg) {
+    pthread_mutex_lock(&registry_lock);
+    if (ncollectors < MAX_COLLECTORS)
+        collectors[ncollectors++] = (struct collector){ fn, arg };
+    pthread_mutex_unlock(&registry_lock);
+}
+
+// render() holds the lock for the whole scrape, so taking it waits out one in progress
+void metrics_remove_collector(metrics_collect_fn fn, void* arg) {
+    pthread_mutex_lock(&registry_lock);
+    for (int i = 0; i < ncollectors; i++) {
+        if (collectors[i].fn == fn && collectors[i].arg == arg) {
+            memmove(&collectors[i], &collectors[i + 1], (ncollectors - i - 1) * sizeof(collectors[0]));
+            ncollectors--;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&registry_lock);
+}
+
+void metrics_family(FILE* out, const char* name, const char* type, const char* help) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+void metrics_netdev_collector(FILE* out, void* ifname) {
+    static const char* stats[] = { "rx_packets", "rx_bytes", "rx_dropped", "rx_missed_errors", "rx_fifo_errors", "rx_errors" };
+    metrics_family(out, "netdev_rx_total", "counter", "Interface receive counters from /sys/class/net/<interface>/statistics");
+    for (size_t i = 0; i < sizeof(stats) / sizeof(stats[0]); i++) {
+        char path[256];
+        unsigned long long value;
+        snprintf(path, sizeof(path), "/sys/class/net/%s/statistics/%s", (const char*)ifname, stats[i]);
+        FILE* f = fopen(path, "r");
+        if (!f) continue;
+        if (fscanf(f, "%llu", &value) == 1)
+            fprintf(out, "netdev_rx_total{interface=\"%s\",counter=\"%s\"} %llu\n", (const char*)ifname, stats[i], value);
+        fclose(f);
+    }
+}
+
+static void render_metric(FILE* out, struct metric* m) {
+    static const char* types[] = { "counter", "gauge", "histogram" };
+    metrics_family(out, m->name, types[m->type], m->help);
+
+    if (m->type != METRIC_HISTOGRAM) {
+        fprintf(out, "%s %lld\n", m->name, (long long)__atomic_load_n(&m->value, __ATOMIC_RELAXED));
+        return;
+    }
+
+    // Buckets are updated independently, so a scrape can be off by the observations in flight
+    uint64_t cumulative = 0;
+    for (int i = 0; i < METRIC_HIST_BUCKETS; i++) {
+        cumulative += __atomic_load_n(&m->buckets[i], __ATOMIC_RELAXED);
+        fprintf(out, "%s_bucket{le=\"%.7g\"} %llu\n", m->name, (1ULL << i) / 1e6, (unsigned long long)cumulative);
+    }
+    cumulative += __atomic_load_n(&m->buckets[METRIC_HIST_BUCKETS], __ATOMIC_RELAXED);
+    fprintf(out, "%s_bucket{le=\"+Inf\"} %llu\n", m->name, (unsigned long long)cumulative);
+    fprintf(out, "%s_sum %.9f\n", m->name, __atomic_load_n(&m->sum_ns, __ATOMIC_RELAXED) / 1e9);
+    fprintf(out, "%s_count %llu\n", m->name, (unsigned long long)cumulative);
+}
+
+static void render(FILE* out) {
+    pthread_mutex_lock(&registry_lock);
+    for (struct metric* m = registry; m; m = m->next)
+        render_metric(out, m);
+    for (int i = 0; i < ncollectors; i++)
+        collectors[i].fn(out, collectors[i].arg);
+    pthread_mutex_unlock(&registry_lock);
+}
+
+static int send_all(int fd, const char* buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Reads up to the end of the request headers; the request itself is never looked at
+static void read_request(int fd) {
+    char buf[REQUEST_MAX];
+    size_t used = 0;
+    while (used < sizeof(buf) - 1) {
+        ssize_t n = recv(fd, buf + used, sizeof(buf) - 1 - used, 0);
+        if (n <= 0) return;
+        used += n;
+        buf[used] = '\0';
+        if (strstr(buf, "\r\n\r\n") || strstr(buf, "\n\n")) return;
+    }
+}
+
+static void serve_one(int fd) {
+    struct timeval timeout = { .tv_sec = REQUEST_TIMEOUT_S };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    read_request(fd);
+
+    char* body = NULL;
+    size_t body_len = 0;
+    FILE* out = open_memstream(&body, &body_len);
+    if (!out) return;
+    render(out);
+    fclose(out);
+
+    char header[256];
+    int n = snprintf(header, sizeof(header),
+        "HTTP/1.0 200 OK\r\n"
+        "Content-Type: text/plain; version=0.0.4\r\n"
+        "Content-Length: %zu\r\n"
+        "Connection: close\r\n\r\n", body_len);
+    if (send_all(fd, header, n) == 0) send_all(fd, body, body_len);
+    free(body);
+}
+
+static void* server_thread(void* arg) {
+    int listen_fd = (int)(long)arg;
+    for (;;) {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            perror("metrics: accept");
+            sleep(1);
+            continue;
+        }
+        serve_one(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+static int listen_unix(const char* path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    unlink(path);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 8) < 0) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+    return fd;
+}
+
+static int listen_tcp(const char* spec) {
+    char host[256] = "";
+    const char* port = spec;
+    const char* colon = strrchr(spec, ':');
+    if (colon) {
+        snprintf(host, sizeof(host), "%.*s", (int)(colon - spec), spec);
+        port = colon + 1;
+    }
+
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM, .ai_flags = AI_PASSIVE };
+    struct addrinfo* res;
+    if (getaddrinfo(host[0] ? host : NULL, port, &hints, &res) != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    int fd = -1;
+    for (struct addrinfo* ai = res; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd < 0) continue;
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, 8) == 0) break;
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+int metrics_serve(const char* listen) {
+    int fd = strchr(listen, '/') ? listen_unix(listen) : listen_tcp(listen);
+    if (fd < 0) return -1;
+
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int err = pthread_create(&thread, &attr, server_thread, (void*)(long)fd);
+    pthread_attr_destroy(&attr);
+    if (err) {
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
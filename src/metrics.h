@@ -0,0 +1,79 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+    Process-wide telemetry for the capture tools, served in the Prometheus text format.
+
+    A metric is a static struct owned by the module that updates it, registered once and then
+    updated with relaxed atomics; nothing is allocated and nothing locks on the hot path, so
+    modules keep their counters whether or not anything is serving them. Values that already
+    live elsewhere (BPF maps, socket statistics, a tool's own counters) are not copied into
+    metrics; a collector callback prints them at scrape time instead.
+
+    metrics_serve() starts one thread answering HTTP GETs with the current values, on a TCP
+    port or a unix socket (curl --unix-socket). It is for a local scraper, not the internet:
+    one request is handled at a time and whatever was asked for, every metric is returned.
+*/
+
+#define METRIC_HIST_BUCKETS 21  // Upper bounds of 1us, 2us, 4us ... ~1s, plus +Inf
+
+enum metric_type {
+    METRIC_COUNTER,
+    METRIC_GAUGE,
+    METRIC_HISTOGRAM,  // Durations, observed in nanoseconds and exported in seconds
+};
+
+struct metric {
+    const char*      name;
+    const char*      help;
+    enum metric_type type;
+    int64_t          value;  // Counter or gauge
+    uint64_t         buckets[METRIC_HIST_BUCKETS + 1];  // Histogram only, not cumulative
+    uint64_t         sum_ns;
+    struct metric*   next;
+};
+
+#define METRIC_INIT(n, t, h) { .name = (n), .help = (h), .type = (t) }
+
+// Called with the output stream of every scrape, after the registered metrics
+typedef void (*metrics_collect_fn)(FILE* out, void* arg);
+
+// Adds a metric to the registry; registering the same one twice is harmless
+void metric_register(struct metric* m);
+
+static inline void metric_add(struct metric* m, int64_t n) {
+    __atomic_add_fetch(&m->value, n, __ATOMIC_RELAXED);
+}
+
+static inline void metric_set(struct metric* m, int64_t v) {
+    __atomic_store_n(&m->value, v, __ATOMIC_RELAXED);
+}
+
+void metric_observe_ns(struct metric* m, uint64_t ns);
+
+// Monotonic nanoseconds, for timing what metric_observe_ns() records
+uint64_t metrics_now_ns(void);
+
+void metrics_add_collector(metrics_collect_fn fn, void* arg);
+
+// Unregisters a collector. Once this returns no scrape is running it, so arg can be freed.
+void metrics_remove_collector(metrics_collect_fn fn, void* arg);
+
+// Prints the # HELP and # TYPE lines for a collector's own family
+void metrics_family(FILE* out, const char* name, const char* type, const char* help);
+
+// Collector for the kernel's counters of a network interface (arg is the name): packets and
+// drops as the driver and the stack count them, before any capture program sees the frame
+void metrics_netdev_collector(FILE* out, void* ifname);
+
+/*
+    Starts serving. listen is a port, host:port, or a path (anything containing a '/') for a
+    unix socket, which is replaced if it exists. Returns -1 with errno set if the socket could
+    not be set up.
+*/
+int metrics_serve(const char* listen);
+
+#endif
@@ -0,0 +1,360 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <zlib.h>
+
+#include "capfile.h"
+#include "colcap.h"
+#include "flowbloom.h"
+
+/*
+    Pulls the packets in a time window, optionally of a single conversation, out of a capture
+    and writes them to stdout (or -o) as plain pcap. With a <capture>.idx sidecar only the
+    chunks whose timestamp range overlaps the window are read and decompressed, and with a
+    <capture>.bloom sidecar a flow lookup also skips every chunk whose filter rules the flow
+    out. Without an index the whole file is scanned.
+
+    Columnar captures (CAPFILE_COLUMNAR) are read the same way: each chunk is decoded back into
+    the pcap records it was made from, and the output is plain pcap either way.
+*/
+
+#define MAX_CAPLEN 262144
+
+static uint64_t window_start = 0, window_end = UINT64_MAX;
+static uint64_t frac_ns = 1000;  // Nanoseconds per unit of ts_usec, 1 in a nanosecond capture
+static int      columnar = 0;     // The capture starts with a colcap_file_hdr
+static FILE*    out;
+static unsigned long long matched;
+
+// The conversation being looked up, in both directions
+static int             flow_query = 0;
+static struct flow_key flow_fwd, flow_rev;
+
+static void usage(const char* prog) {
+    fprintf(stderr,
+        "Usage: %s -r capture.pcap[.gz]|capture.colcap [-s start] [-e end] [-p tcp|udp -a ip:port -b ip:port] [-o output.pcap]\n"
+        "    -s/-e  window as unix seconds (to the ns) or UTC \"YYYY-mm-dd HH:MM:SS\"; end is exclusive\n"
+        "    -p/-a/-b  only packets between endpoints a and b (either direction)\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+static uint64_t parse_time(const char* arg) {
+    struct tm tm;
+    char* end;
+
+    memset(&tm, 0, sizeof(tm));
+    end = strptime(arg, "%Y-%m-%d %H:%M:%S", &tm);
+    if (end && *end == '\0') return timegm(&tm) * 1000000000ULL;
+
+    // Seconds and fraction are parsed separately; a double can't hold epoch nanoseconds
+    uint64_t secs = strtoull(arg, &end, 10);
+    uint64_t ns = 0, scale = 100000000;
+    if (end != arg && *end == '.') {
+        for (end++; *end >= '0' && *end <= '9'; end++, scale /= 10)
+            ns += (*end - '0') * scale;
+    }
+    if (end == arg || *end != '\0' || arg[0] == '-') {
+        fprintf(stderr, "Cannot parse time %s\n", arg);
+        exit(EXIT_FAILURE);
+    }
+    return secs * 1000000000ULL + ns;
+}
+
+// Parses "a.b.c.d:port" into network byte order
+static int parse_endpoint(const char* arg, uint32_t* ip, uint16_t* port) {
+    char addr[INET_ADDRSTRLEN];
+    const char* colon = strrchr(arg, ':');
+    if (!colon || colon - arg >= (long)sizeof(addr)) return -1;
+    memcpy(addr, arg, colon - arg);
+    addr[colon - arg] = '\0';
+
+    char* end;
+    unsigned long p = strtoul(colon + 1, &end, 10);
+    if (*end != '\0' || p > 65535 || inet_pton(AF_INET, addr, ip) != 1) return -1;
+    *port = htons(p);
+    return 0;
+}
+
+static int record_matches(const struct pcap_record_hdr* hdr, const unsigned char* data) {
+    uint64_t ts = hdr->ts_sec * 1000000000ULL + hdr->ts_usec * frac_ns;
+    if (ts < window_start || ts >= window_end) return 0;
+    if (!flow_query) return 1;
+
+    struct flow_key key;
+    if (flow_key_from_packet(data, hdr->caplen, &key) < 0) return 0;
+    return memcmp(&key, &flow_fwd, sizeof(key)) == 0 || memcmp(&key, &flow_rev, sizeof(key)) == 0;
+}
+
+static void write_header(const struct pcap_file_hdr* hdr) {
+    if (fwrite(hdr, sizeof(*hdr), 1, out) != 1) {
+        perror("write");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Writes the records in buf[0..len) that fall inside the window. Returns -1 on a malformed chunk.
+static int filter_records(const unsigned char* buf, size_t len) {
+    size_t off = 0;
+    while (off + sizeof(struct pcap_record_hdr) <= len) {
+        const struct pcap_record_hdr* hdr = (const struct pcap_record_hdr*)(buf + off);
+        size_t rec_len = sizeof(*hdr) + hdr->caplen;
+        if (off + rec_len > len) return -1;
+
+        if (record_matches(hdr, (const unsigned char*)(hdr + 1))) {
+            if (fwrite(hdr, rec_len, 1, out) != 1) {
+                perror("write");
+                exit(EXIT_FAILURE);
+            }
+            matched++;
+        }
+        off += rec_len;
+    }
+    return off == len ? 0 : -1;
+}
+
+// Inflates one chunk (a complete gzip member) into out_buf. Returns the decompressed length.
+static long inflate_chunk(const unsigned char* in, size_t in_len, unsigned char* out_buf, size_t out_size) {
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    if (inflateInit2(&strm, 15 + 16) != Z_OK) return -1;
+
+    strm.next_in = (unsigned char*)in;
+    strm.avail_in = in_len;
+    strm.next_out = out_buf;
+    strm.avail_out = out_size;
+    int rc = inflate(&strm, Z_FINISH);
+    long n = out_size - strm.avail_out;
+    inflateEnd(&strm);
+    return rc == Z_STREAM_END ? n : -1;
+}
+
+/*
+    Reads the global header through zlib, which handles both plain and gzipped captures. A
+    columnar capture carries the header its records would have had inside its own.
+*/
+static int read_file_header(const char* path, struct pcap_file_hdr* fh) {
+    struct colcap_file_hdr ch;
+    gzFile gz = gzopen(path, "rb");
+    if (!gz) return -1;
+    int n = gzread(gz, &ch, sizeof(ch));
+    gzclose(gz);
+    if (n >= (int)sizeof(ch.magic) && ch.magic == COLCAP_FILE_MAGIC) {
+        if (n != sizeof(ch) || ch.version != COLCAP_VERSION) return -1;
+        *fh = ch.pcap;
+        columnar = 1;
+    } else {
+        if (n < (int)sizeof(*fh)) return -1;
+        memcpy(fh, &ch, sizeof(*fh));
+    }
+    if (fh->magic != PCAP_MAGIC_USEC && fh->magic != PCAP_MAGIC_NSEC) return -1;
+    frac_ns = fh->magic == PCAP_MAGIC_NSEC ? 1 : 1000;
+    return 0;
+}
+
+// Indexed path: read only the chunks that overlap the window (and may hold the flow)
+static int extract_indexed(int fd, FILE* idx, FILE* bloom) {
+    unsigned char* raw = malloc(CAPFILE_BUF_SIZE * 2);
+    unsigned char* plain = malloc(CAPFILE_BUF_SIZE);
+    struct capfile_index_entry entry;
+    struct flowbloom_entry* filter = malloc(sizeof(*filter));
+    unsigned long chunks = 0, read_chunks = 0;
+
+    if (!raw || !plain || !filter) return -1;
+
+    // Peek at the first bytes to tell gzip from plain pcap
+    unsigned char magic[2];
+    if (pread(fd, magic, sizeof(magic), 0) != sizeof(magic)) return -1;
+    int gz = magic[0] == 0x1f && magic[1] == 0x8b;
+
+    while (fread(&entry, sizeof(entry), 1, idx) == 1) {
+        chunks++;
+
+        // Bloom entries pair up with index entries one to one, so read it even if skipping
+        int have_filter = bloom && fread(filter, sizeof(*filter), 1, bloom) == 1;
+        if (have_filter && filter->offset != entry.offset) {
+            fprintf(stderr, "Bloom filters do not match the index, ignoring them\n");
+            bloom = NULL;
+            have_filter = 0;
+        }
+
+        if (entry.ts_last < window_start || entry.ts_first >= window_end) continue;
+        if (have_filter && !flowbloom_test(filter->bits, &flow_fwd) && !flowbloom_test(filter->bits, &flow_rev))
+            continue;
+
+        if (entry.length > CAPFILE_BUF_SIZE * 2) return -1;
+        if (pread(fd, raw, entry.length, entry.offset) != (ssize_t)entry.length) return -1;
+        read_chunks++;
+
+        const unsigned char* data = raw;
+        long len = entry.length;
+        if (columnar) {
+            len = colcap_decode(raw, entry.length, plain, CAPFILE_BUF_SIZE);
+            if (len < 0) return -1;
+            data = plain;
+        } else if (gz) {
+            len = inflate_chunk(raw, entry.length, plain, CAPFILE_BUF_SIZE);
+            if (len < 0) return -1;
+            data = plain;
+        }
+        // The chunk at the start of the file leads with the global header (never a columnar one)
+        if (entry.offset == 0 && !columnar) {
+            if (len < (long)sizeof(struct pcap_file_hdr)) return -1;
+            data += sizeof(struct pcap_file_hdr);
+            len -= sizeof(struct pcap_file_hdr);
+        }
+        if (filter_records(data, len) < 0) return -1;
+    }
+
+    fprintf(stderr, "Read %lu of %lu chunks\n", read_chunks, chunks);
+    free(raw);
+    free(plain);
+    free(filter);
+    return 0;
+}
+
+// Fallback for captures without an index: decompress and filter everything
+static int extract_scan(const char* path) {
+    gzFile gz = gzopen(path, "rb");
+    struct pcap_file_hdr fh;  // Already validated and written by main
+    struct pcap_record_hdr hdr;
+    unsigned char* data = malloc(MAX_CAPLEN);
+
+    if (!gz || !data) return -1;
+    gzbuffer(gz, CAPFILE_BUF_SIZE);
+    if (gzread(gz, &fh, sizeof(fh)) != sizeof(fh)) return -1;
+
+    while (gzread(gz, &hdr, sizeof(hdr)) == sizeof(hdr)) {
+        if (hdr.caplen > MAX_CAPLEN || gzread(gz, data, hdr.caplen) != (int)hdr.caplen) break;
+        if (record_matches(&hdr, data)) {
+            if (fwrite(&hdr, sizeof(hdr), 1, out) != 1 || fwrite(data, hdr.caplen, 1, out) != 1) {
+                perror("write");
+                exit(EXIT_FAILURE);
+            }
+            matched++;
+        }
+    }
+    gzclose(gz);
+    free(data);
+    return 0;
+}
+
+// Fallback for columnar captures without an index: decode every chunk, skipping sync points
+static int extract_scan_columnar(const char* path) {
+    FILE* in = fopen(path, "rb");
+    unsigned char* chunk = malloc(CAPFILE_BUF_SIZE * 2);
+    unsigned char* plain = malloc(CAPFILE_BUF_SIZE);
+    struct colcap_chunk_hdr* hdr = (struct colcap_chunk_hdr*)chunk;
+
+    if (!in || !chunk || !plain || fseek(in, sizeof(struct colcap_file_hdr), SEEK_SET) < 0) return -1;
+    while (fread(hdr, sizeof(*hdr), 1, in) == 1) {
+        // A torn last chunk ends the scan, as it ends a gzip capture
+        size_t len = colcap_chunk_len(hdr);
+        if (len == 0 || len > CAPFILE_BUF_SIZE * 2 || fread(chunk + sizeof(*hdr), len - sizeof(*hdr), 1, in) != 1) break;
+        ssize_t n = colcap_decode(chunk, len, plain, CAPFILE_BUF_SIZE);
+        if (n < 0 || filter_records(plain, n) < 0) return -1;
+        if (fseek(in, CAPFILE_SYNC_SIZE, SEEK_CUR) < 0) break;
+    }
+    fclose(in);
+    free(chunk);
+    free(plain);
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    const char* input = NULL;
+    const char* output = NULL;
+    const char* proto = NULL;
+    const char* endpoint_a = NULL;
+    const char* endpoint_b = NULL;
+    int c;
+
+    while ((c = getopt(argc, argv, "r:s:e:p:a:b:o:h")) != -1) {
+        switch (c) {
+            case 'r': input = optarg; break;
+            case 's': window_start = parse_time(optarg); break;
+            case 'e': window_end = parse_time(optarg); break;
+            case 'p': proto = optarg; break;
+            case 'a': endpoint_a = optarg; break;
+            case 'b': endpoint_b = optarg; break;
+            case 'o': output = optarg; break;
+            default: usage(argv[0]);
+        }
+    }
+    if (!input || window_end <= window_start) usage(argv[0]);
+
+    if (proto || endpoint_a || endpoint_b) {
+        // The filters are over the full 5-tuple, so a lookup needs all of it
+        if (!proto || !endpoint_a || !endpoint_b) usage(argv[0]);
+        if (strcmp(proto, "tcp") == 0) flow_fwd.proto = IPPROTO_TCP;
+        else if (strcmp(proto, "udp") == 0) flow_fwd.proto = IPPROTO_UDP;
+        else usage(argv[0]);
+        if (parse_endpoint(endpoint_a, &flow_fwd.src_ip, &flow_fwd.src_port) < 0 ||
+            parse_endpoint(endpoint_b, &flow_fwd.dst_ip, &flow_fwd.dst_port) < 0)
+            usage(argv[0]);
+
+        flow_rev.src_ip = flow_fwd.dst_ip;
+        flow_rev.dst_ip = flow_fwd.src_ip;
+        flow_rev.src_port = flow_fwd.dst_port;
+        flow_rev.dst_port = flow_fwd.src_port;
+        flow_rev.proto = flow_fwd.proto;
+        flow_query = 1;
+    }
+
+    out = output ? fopen(output, "wb") : stdout;
+    if (!out) {
+        fprintf(stderr, "%s: %s\n", output, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    struct pcap_file_hdr fh;
+    if (read_file_header(input, &fh) < 0) {
+        fprintf(stderr, "%s: not a readable pcap capture\n", input);
+        exit(EXIT_FAILURE);
+    }
+    write_header(&fh);
+
+    char idx_path[PATH_MAX];
+    snprintf(idx_path, sizeof(idx_path), "%s%s", input, CAPFILE_INDEX_SUFFIX);
+    FILE* idx = fopen(idx_path, "rb");
+
+    FILE* bloom = NULL;
+    if (flow_query) {
+        char bloom_path[PATH_MAX];
+        snprintf(bloom_path, sizeof(bloom_path), "%s%s", input, FLOWBLOOM_SUFFIX);
+        bloom = fopen(bloom_path, "rb");
+    }
+
+    int rc;
+    if (idx) {
+        int fd = open(input, O_RDONLY);
+        if (fd < 0) {
+            fprintf(stderr, "%s: %s\n", input, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        rc = extract_indexed(fd, idx, bloom);
+        close(fd);
+        fclose(idx);
+        if (bloom) fclose(bloom);
+    } else {
+        fprintf(stderr, "No index for %s, scanning the whole file\n", input);
+        rc = columnar ? extract_scan_columnar(input) : extract_scan(input);
+    }
+    if (rc < 0) {
+        fprintf(stderr, "%s: capture or index is corrupt\n", input);
+        exit(EXIT_FAILURE);
+    }
+    if (fflush(out) != 0) {
+        perror("write");
+        exit(EXIT_FAILURE);
+    }
+
+    fprintf(stderr, "Extracted %llu packets\n", matched);
+    exit(EXIT_SUCCESS);
+}
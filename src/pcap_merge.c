@@ -0,0 +1,180 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <zlib.h>
+
+#include "capfile.h"
+
+/*
+    Streaming k-way merge of pcap files into one time-ordered capture. Built for turning the
+    per-worker hourly files from tpacket_fanout into a single hourly pcap: each worker's file is
+    already in order, so only one record per input is held in memory at a time and a binary
+    heap picks the oldest. Inputs may be plain or gzipped pcap; the output is gzipped when its
+    name ends in .gz and gets the chunk index and flow filters used by pcap_extract. If any
+    input has nanosecond timestamps, so does the output.
+*/
+
+#define MAX_CAPLEN      262144
+#define READ_BUF_SIZE   (1 << 20)
+
+struct input {
+    const char*            path;
+    gzFile                 gz;
+    int                    nsec;     // Timestamps are in nanoseconds
+    unsigned long long     ts;       // Timestamp of the current record, in nanoseconds
+    struct pcap_record_hdr hdr;
+    unsigned char*         data;
+};
+
+static struct input*  inputs;
+static struct input** heap;
+static int            heap_len;
+
+static void usage(const char* prog) {
+    fprintf(stderr,
+        "Usage: %s -o output.pcap[.gz] [-l level] [-w threads] input.pcap[.gz] ...\n"
+        "    -l  gzip compression level (default 6)\n"
+        "    -w  gzip compression threads (default: one per CPU)\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+// Reads the next record into in. Returns 1 on a record, 0 at end of file, -1 on error.
+static int read_record(struct input* in) {
+    int n = gzread(in->gz, &in->hdr, sizeof(in->hdr));
+    if (n == 0) return 0;
+    if (n != sizeof(in->hdr)) {
+        // A torn last record is what a capture killed mid-write leaves behind; keep the rest
+        fprintf(stderr, "%s: truncated record header, ignoring the rest of the file\n", in->path);
+        return 0;
+    }
+    if (in->hdr.caplen > MAX_CAPLEN) {
+        fprintf(stderr, "%s: record with caplen %u, file is corrupt\n", in->path, in->hdr.caplen);
+        return -1;
+    }
+    if (gzread(in->gz, in->data, in->hdr.caplen) != (int)in->hdr.caplen) {
+        fprintf(stderr, "%s: truncated record, ignoring the rest of the file\n", in->path);
+        return 0;
+    }
+    in->ts = in->hdr.ts_sec * 1000000000ULL + (in->nsec ? in->hdr.ts_usec : in->hdr.ts_usec * 1000ULL);
+    return 1;
+}
+
+static int open_input(struct input* in, struct pcap_file_hdr* fh) {
+    in->gz = gzopen(in->path, "rb");
+    if (!in->gz) {
+        fprintf(stderr, "%s: %s\n", in->path, strerror(errno));
+        return -1;
+    }
+    gzbuffer(in->gz, READ_BUF_SIZE);
+
+    if (gzread(in->gz, fh, sizeof(*fh)) != sizeof(*fh)) {
+        fprintf(stderr, "%s: missing pcap header\n", in->path);
+        return -1;
+    }
+    if (fh->magic != PCAP_MAGIC_USEC && fh->magic != PCAP_MAGIC_NSEC) {
+        fprintf(stderr, "%s: not a pcap file (or not in host byte order)\n", in->path);
+        return -1;
+    }
+    in->nsec = fh->magic == PCAP_MAGIC_NSEC;
+    in->data = malloc(MAX_CAPLEN);
+    return in->data ? 0 : -1;
+}
+
+static void sift_down(int i) {
+    for (;;) {
+        int min = i, l = 2 * i + 1, r = 2 * i + 2;
+        if (l < heap_len && heap[l]->ts < heap[min]->ts) min = l;
+        if (r < heap_len && heap[r]->ts < heap[min]->ts) min = r;
+        if (min == i) return;
+        struct input* tmp = heap[i];
+        heap[i] = heap[min];
+        heap[min] = tmp;
+        i = min;
+    }
+}
+
+int main(int argc, char* argv[]) {
+    struct capfile_opts opts;
+    const char* output = NULL;
+    int c;
+
+    memset(&opts, 0, sizeof(opts));
+    opts.flags = CAPFILE_INDEX | CAPFILE_BLOOM | CAPFILE_URING;
+    while ((c = getopt(argc, argv, "o:l:w:h")) != -1) {
+        switch (c) {
+            case 'o': output = optarg; break;
+            case 'l': opts.level = atoi(optarg); break;
+            case 'w': opts.workers = atoi(optarg); break;
+            default: usage(argv[0]);
+        }
+    }
+    int ninputs = argc - optind;
+    if (!output || ninputs < 1) usage(argv[0]);
+
+    size_t olen = strlen(output);
+    if (olen > 3 && strcmp(output + olen - 3, ".gz") == 0) opts.flags |= CAPFILE_GZIP;
+
+    inputs = calloc(ninputs, sizeof(*inputs));
+    heap = calloc(ninputs, sizeof(*heap));
+    if (!inputs || !heap) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < ninputs; i++) {
+        struct pcap_file_hdr fh;
+        inputs[i].path = argv[optind + i];
+        if (open_input(&inputs[i], &fh) < 0) exit(EXIT_FAILURE);
+
+        if (i == 0) {
+            opts.linktype = fh.linktype;
+        } else if (fh.linktype != opts.linktype) {
+            fprintf(stderr, "%s: link type %u does not match %u\n", inputs[i].path, fh.linktype, opts.linktype);
+            exit(EXIT_FAILURE);
+        }
+        if (fh.snaplen > opts.snaplen) opts.snaplen = fh.snaplen;
+        if (inputs[i].nsec) opts.flags |= CAPFILE_NSEC;
+
+        int rc = read_record(&inputs[i]);
+        if (rc < 0) exit(EXIT_FAILURE);
+        if (rc > 0) heap[heap_len++] = &inputs[i];
+    }
+    for (int i = heap_len / 2 - 1; i >= 0; i--)
+        sift_down(i);
+
+    struct capfile* out = capfile_open(output, &opts);
+    if (!out) {
+        fprintf(stderr, "%s: %s\n", output, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    unsigned long long records = 0;
+    while (heap_len > 0) {
+        struct input* in = heap[0];
+        uint32_t frac = in->ts % 1000000000ULL;
+        if (!(opts.flags & CAPFILE_NSEC)) frac /= 1000;
+        if (capfile_write(out, in->hdr.ts_sec, frac, in->hdr.caplen, in->hdr.len, in->data) < 0) {
+            fprintf(stderr, "%s: %s\n", output, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        records++;
+
+        int rc = read_record(in);
+        if (rc < 0) exit(EXIT_FAILURE);
+        if (rc == 0) heap[0] = heap[--heap_len];
+        sift_down(0);
+    }
+
+    if (capfile_close(out) < 0) {
+        fprintf(stderr, "%s: %s\n", output, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < ninputs; i++) {
+        gzclose(inputs[i].gz);
+        free(inputs[i].data);
+    }
+    printf("Merged %llu records from %d files into %s\n", records, ninputs, output);
+    exit(EXIT_SUCCESS);
+}
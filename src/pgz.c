@@ -0,0 +1,323 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "pgz.h"
+#include "metrics.h"
+
+#define SLOTS_PER_WORKER 2  // Blocks in flight per worker, so workers never wait on the producer
+
+// Totals over every writer in the process; throughput is the rate of the byte counters
+static struct metric m_in_bytes = METRIC_INIT("pgz_input_bytes_total", METRIC_COUNTER, "Bytes handed to the gzip workers");
+static struct metric m_out_bytes = METRIC_INIT("pgz_output_bytes_total", METRIC_COUNTER, "Compressed bytes written out");
+static struct metric m_queued = METRIC_INIT("pgz_blocks_pending", METRIC_GAUGE, "Blocks queued or compressed but not yet written");
+static struct metric m_compress = METRIC_INIT("pgz_compress_seconds", METRIC_HISTOGRAM, "Time to compress one block on a worker");
+
+enum slot_state {
+    SLOT_FREE,
+    SLOT_QUEUED,
+    SLOT_DONE,
+};
+
+/*
+    One block of input and the gzip member it compresses to. Slots are used round-robin by
+    sequence number: block seq lives in slots[seq % nslots], which keeps ordering trivial.
+*/
+struct pgz_slot {
+    enum slot_state state;
+    unsigned char*  in;
+    size_t          in_len;
+    unsigned char*  out;
+    size_t          out_len;
+};
+
+struct pgz {
+    int              fd;
+    int              level;
+    const struct pgz_codec* codec;  // NULL for gzip
+    void*            codec_arg;
+    size_t           block_size;
+    size_t           out_size;
+
+    struct pgz_slot* slots;
+    unsigned int     nslots;
+    pthread_t*       threads;
+    int              nthreads;
+
+    pthread_mutex_t  lock;
+    pthread_cond_t   work_cond;     // Signalled when a block is queued or on shutdown
+    pthread_cond_t   free_cond;     // Signalled when a slot is written and free again
+
+    unsigned long    fill_seq;      // Block the producer is filling
+    unsigned long    compress_seq;  // Next block a worker will take
+    unsigned long    write_seq;     // Next block to be written out
+    int              writing;       // A worker is currently writing members out
+    int              closing;
+    int              error;         // First write error (errno), reported by pgz_write/close
+
+    uint64_t         offset;        // File offset the next member is written at
+    pgz_member_cb    on_member;
+    void*            cb_arg;
+    pgz_output_fn    output;        // NULL to write(2) to fd
+    void*            output_arg;
+};
+
+static int write_all(int fd, const unsigned char* buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+    Writes every finished block that is next in line. Only one worker does this at a time
+    (the writing flag), and the write itself happens without the lock held so the other
+    workers keep compressing. Called with the lock held.
+*/
+static void drain_done(struct pgz* pgz) {
+    if (pgz->writing) return;
+    pgz->writing = 1;
+
+    while (pgz->write_seq < pgz->compress_seq) {
+        struct pgz_slot* slot = &pgz->slots[pgz->write_seq % pgz->nslots];
+        if (slot->state != SLOT_DONE) break;
+
+        pthread_mutex_unlock(&pgz->lock);
+        int err = pgz->error ? 0
+                : pgz->output ? pgz->output(pgz->output_arg, slot->out, slot->out_len)
+                : write_all(pgz->fd, slot->out, slot->out_len);
+        if (!err && !pgz->error) {
+            metric_add(&m_out_bytes, slot->out_len);
+            if (pgz->on_member) pgz->on_member(pgz->cb_arg, pgz->offset, slot->out_len);
+            pgz->offset += slot->out_len;
+        }
+        pthread_mutex_lock(&pgz->lock);
+
+        if (err && !pgz->error) pgz->error = errno ? errno : EIO;
+        slot->state = SLOT_FREE;
+        slot->in_len = 0;
+        pgz->write_seq++;
+        metric_add(&m_queued, -1);
+        pthread_cond_broadcast(&pgz->free_cond);
+    }
+
+    pgz->writing = 0;
+}
+
+// Compresses one block into a single gzip member (windowBits 15 + 16 selects the gzip wrapper)
+static int compress_block(z_stream* strm, struct pgz_slot* slot, size_t out_size) {
+    if (deflateReset(strm) != Z_OK) return -1;
+    strm->next_in = slot->in;
+    strm->avail_in = slot->in_len;
+    strm->next_out = slot->out;
+    strm->avail_out = out_size;
+    if (deflate(strm, Z_FINISH) != Z_STREAM_END) return -1;
+    slot->out_len = out_size - strm->avail_out;
+    return 0;
+}
+
+static void* worker_thread(void* arg) {
+    struct pgz* pgz = arg;
+    z_stream strm;
+    void* state = NULL;
+
+    memset(&strm, 0, sizeof(strm));
+    if (pgz->codec ? !(state = pgz->codec->init(pgz->codec_arg, pgz->level, pgz->block_size))
+                   : deflateInit2(&strm, pgz->level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        pthread_mutex_lock(&pgz->lock);
+        if (!pgz->error) pgz->error = ENOMEM;
+        pthread_mutex_unlock(&pgz->lock);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&pgz->lock);
+    for (;;) {
+        while (pgz->compress_seq == pgz->fill_seq && !pgz->closing)
+            pthread_cond_wait(&pgz->work_cond, &pgz->lock);
+        if (pgz->compress_seq == pgz->fill_seq) break;
+
+        // Blocks below fill_seq are complete; take the oldest one nobody has claimed
+        struct pgz_slot* slot = &pgz->slots[pgz->compress_seq % pgz->nslots];
+        pgz->compress_seq++;
+        pthread_mutex_unlock(&pgz->lock);
+
+        uint64_t started = metrics_now_ns();
+        int err = pgz->codec ? pgz->codec->encode(state, slot->in, slot->in_len, slot->out, pgz->out_size, &slot->out_len)
+                             : compress_block(&strm, slot, pgz->out_size);
+        metric_observe_ns(&m_compress, metrics_now_ns() - started);
+
+        pthread_mutex_lock(&pgz->lock);
+        if (err) {
+            // The bound guarantees room, so this only happens on memory corruption (or, with
+            // a codec, input it cannot parse)
+            if (!pgz->error) pgz->error = EIO;
+            slot->out_len = 0;
+        }
+        slot->state = SLOT_DONE;
+        drain_done(pgz);
+    }
+    pthread_mutex_unlock(&pgz->lock);
+
+    if (pgz->codec) pgz->codec->fini(state);
+    else deflateEnd(&strm);
+    return NULL;
+}
+
+struct pgz* pgz_open(int fd, int level, int workers, size_t block_size) {
+    return pgz_open_codec(fd, level, workers, block_size, NULL, NULL);
+}
+
+struct pgz* pgz_open_codec(int fd, int level, int workers, size_t block_size, const struct pgz_codec* codec, void* arg) {
+    if (workers <= 0) workers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (workers <= 0) workers = 1;
+    if (block_size == 0) block_size = PGZ_DEFAULT_BLOCK_SIZE;
+
+    struct pgz* pgz = calloc(1, sizeof(*pgz));
+    if (!pgz) return NULL;
+
+    metric_register(&m_in_bytes);
+    metric_register(&m_out_bytes);
+    metric_register(&m_queued);
+    metric_register(&m_compress);
+
+    pgz->fd = fd;
+    pgz->level = level;
+    pgz->codec = codec;
+    pgz->codec_arg = arg;
+    pgz->block_size = block_size;
+    pgz->out_size = codec ? codec->bound(block_size) : compressBound(block_size) + 64;  // + gzip header and trailer
+    pgz->nslots = workers * SLOTS_PER_WORKER;
+
+    // Members go after whatever the file already holds (append) or at 0 (fresh file or pipe)
+    struct stat sb;
+    if (fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode)) pgz->offset = sb.st_size;
+
+    pthread_mutex_init(&pgz->lock, NULL);
+    pthread_cond_init(&pgz->work_cond, NULL);
+    pthread_cond_init(&pgz->free_cond, NULL);
+
+    pgz->slots = calloc(pgz->nslots, sizeof(struct pgz_slot));
+    pgz->threads = calloc(workers, sizeof(pthread_t));
+    if (!pgz->slots || !pgz->threads) goto fail;
+    for (unsigned int i = 0; i < pgz->nslots; i++) {
+        pgz->slots[i].in = malloc(block_size);
+        pgz->slots[i].out = malloc(pgz->out_size);
+        if (!pgz->slots[i].in || !pgz->slots[i].out) goto fail;
+    }
+
+    for (; pgz->nthreads < workers; pgz->nthreads++)
+        if (pthread_create(&pgz->threads[pgz->nthreads], NULL, worker_thread, pgz)) goto fail;
+    return pgz;
+
+fail:
+    pgz_close(pgz);
+    errno = ENOMEM;
+    return NULL;
+}
+
+void pgz_set_member_cb(struct pgz* pgz, pgz_member_cb cb, void* arg) {
+    pgz->on_member = cb;
+    pgz->cb_arg = arg;
+}
+
+void pgz_set_output(struct pgz* pgz, pgz_output_fn fn, void* arg) {
+    pgz->output = fn;
+    pgz->output_arg = arg;
+}
+
+// Hands the block being filled to the workers and waits until the next slot is free
+static int queue_block(struct pgz* pgz) {
+    pthread_mutex_lock(&pgz->lock);
+    struct pgz_slot* slot = &pgz->slots[pgz->fill_seq % pgz->nslots];
+    if (slot->in_len > 0) {
+        slot->state = SLOT_QUEUED;
+        pgz->fill_seq++;
+        metric_add(&m_in_bytes, slot->in_len);
+        metric_add(&m_queued, 1);
+        pthread_cond_signal(&pgz->work_cond);
+    }
+
+    struct pgz_slot* next = &pgz->slots[pgz->fill_seq % pgz->nslots];
+    while (next->state != SLOT_FREE && !pgz->error)
+        pthread_cond_wait(&pgz->free_cond, &pgz->lock);
+
+    int err = pgz->error;
+    pthread_mutex_unlock(&pgz->lock);
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+int pgz_write(struct pgz* pgz, const void* buf, size_t len) {
+    const unsigned char* p = buf;
+
+    // The slot being filled is only ever touched by the producer, so no lock is needed here
+    struct pgz_slot* slot = &pgz->slots[pgz->fill_seq % pgz->nslots];
+    if (slot->in_len + len > pgz->block_size && slot->in_len > 0) {
+        if (queue_block(pgz)) return -1;
+        slot = &pgz->slots[pgz->fill_seq % pgz->nslots];
+    }
+
+    // Only writes larger than a whole block get split
+    while (len > 0) {
+        size_t n = pgz->block_size - slot->in_len;
+        if (n > len) n = len;
+        memcpy(slot->in + slot->in_len, p, n);
+        slot->in_len += n;
+        p += n;
+        len -= n;
+
+        if (slot->in_len == pgz->block_size) {
+            if (queue_block(pgz)) return -1;
+            slot = &pgz->slots[pgz->fill_seq % pgz->nslots];
+        }
+    }
+    return 0;
+}
+
+int pgz_flush(struct pgz* pgz) {
+    return queue_block(pgz);
+}
+
+int pgz_close(struct pgz* pgz) {
+    if (!pgz) return 0;
+
+    if (pgz->slots && pgz->nthreads > 0) queue_block(pgz);
+
+    pthread_mutex_lock(&pgz->lock);
+    pgz->closing = 1;
+    pthread_cond_broadcast(&pgz->work_cond);
+    pthread_mutex_unlock(&pgz->lock);
+    for (int i = 0; i < pgz->nthreads; i++)
+        pthread_join(pgz->threads[i], NULL);
+
+    int err = pgz->error;
+    for (unsigned int i = 0; pgz->slots && i < pgz->nslots; i++) {
+        free(pgz->slots[i].in);
+        free(pgz->slots[i].out);
+    }
+    free(pgz->slots);
+    free(pgz->threads);
+    pthread_mutex_destroy(&pgz->lock);
+    pthread_cond_destroy(&pgz->work_cond);
+    pthread_cond_destroy(&pgz->free_cond);
+    free(pgz);
+
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,65 @@
+#ifndef PGZ_H
+#define PGZ_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+    Parallel gzip writer (pigz-style). Input is cut into blocks, each block is compressed on
+    a worker thread into a complete, independent gzip member, and members are written to the
+    output file in input order. Concatenated members are a valid gzip stream, so the result
+    reads fine with zcat, gzip -d, libpcap and Wireshark.
+
+    pgz_write() never splits a write across blocks unless the write is larger than a block,
+    so callers that write whole records get members that start and end on record boundaries.
+*/
+
+#define PGZ_DEFAULT_LEVEL      6
+#define PGZ_DEFAULT_BLOCK_SIZE (1 << 20)
+
+struct pgz;
+
+// Called once per member, in file order, after the member has been written (or handed to
+// the output function)
+typedef void (*pgz_member_cb)(void* arg, uint64_t offset, size_t len);
+
+// Takes the place of write(2) on the fd. Returns 0, or -1 with errno set.
+typedef int (*pgz_output_fn)(void* arg, const void* buf, size_t len);
+
+/*
+    A block encoder to use instead of gzip, for formats that want pgz's threads, ordering and
+    member callbacks but not its compression. Every worker gets its own state from init();
+    encode() turns one block into one self-contained member of at most bound(block_size) bytes.
+*/
+struct pgz_codec {
+    void*  (*init)(void* arg, int level, size_t block_size);  // NULL with errno set on failure
+    int    (*encode)(void* state, const void* in, size_t in_len, void* out, size_t out_size, size_t* out_len);
+    void   (*fini)(void* state);
+    size_t (*bound)(size_t block_size);
+};
+
+// Starts a writer on an already open fd (opened with O_APPEND to add to an existing file).
+// workers <= 0 picks one per online CPU. Returns NULL with errno set on failure.
+struct pgz* pgz_open(int fd, int level, int workers, size_t block_size);
+
+// pgz_open() with members made by codec (its init() gets arg) instead of gzip
+struct pgz* pgz_open_codec(int fd, int level, int workers, size_t block_size, const struct pgz_codec* codec, void* arg);
+
+// Reports where each member lands in the file. Set it before the first write. The callback
+// runs on a worker thread, but never concurrently with itself.
+void pgz_set_member_cb(struct pgz* pgz, pgz_member_cb cb, void* arg);
+
+// Sends members somewhere other than the fd, e.g. an asynchronous writer (see uring.h). Set it
+// before the first write. Like the member callback it runs on a worker thread, one at a time.
+void pgz_set_output(struct pgz* pgz, pgz_output_fn fn, void* arg);
+
+// Queues len bytes. Only blocks when every block slot is waiting on a worker.
+int pgz_write(struct pgz* pgz, const void* buf, size_t len);
+
+// Ends the current block so it is compressed now instead of when it fills up.
+int pgz_flush(struct pgz* pgz);
+
+// Flushes, waits for every member to be written and frees the writer. The fd is left open.
+int pgz_close(struct pgz* pgz);
+
+#endif
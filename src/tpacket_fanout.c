@@ -0,0 +1,349 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <linux/filter.h>
+
+#include "capfile.h"
+
+/*
+    AF_PACKET capture engine for hosts where XDP is not an option. Each worker thread owns a
+    TPACKET_V3 socket with its own mmap'ed block ring, and all sockets join one PACKET_FANOUT
+    group so the kernel spreads traffic across them (by flow hash or by receiving CPU). Every
+    worker writes its own hourly file; pcap_merge turns one hour's worker files into a single
+    time-ordered capture.
+*/
+
+#define BLOCK_SIZE       (1 << 20)  // Bytes per ring block; the kernel hands us whole blocks
+#define BLOCK_NR         64         // Blocks per worker ring
+#define FRAME_SIZE       2048       // Only used to size the ring; V3 packs frames tightly
+#define BLOCK_TIMEOUT_MS 100        // Kernel retires a partially filled block after this long
+#define DEFAULT_SNAPLEN  2000
+#define MAX_WORKERS      64
+#define FLUSH_INTERVAL_S 1
+
+struct worker {
+    int              id;
+    int              fd;
+    unsigned char*   ring;
+    struct capfile*  out;
+    char             fname[PATH_MAX];
+    time_t           goal_ts;
+    time_t           flush_ts;
+    unsigned long long packets;
+    pthread_t        thread;
+};
+
+static char  data_dir[PATH_MAX];
+static char  ifname[IF_NAMESIZE];
+static int   fanout_mode = PACKET_FANOUT_HASH;
+static int   pin_workers = 0;
+static __u32 snaplen = DEFAULT_SNAPLEN;
+static struct capfile_opts file_opts;
+
+static volatile sig_atomic_t stop = 0;
+static void handle_signal(int sig) {
+    (void)sig;
+    stop = 1;
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr,
+        "Usage: %s -i interface -s data-dir [-n workers] [-m hash|cpu] [-p] [-S snaplen] [-u] [-l level] [-w threads] [-D] [-P MiB]\n"
+        "    -n  worker threads, each with its own ring and output file (default: one per CPU)\n"
+        "    -m  fanout mode: hash keeps a flow on one worker, cpu follows the receiving CPU (default hash)\n"
+        "    -p  pin worker N to CPU N\n"
+        "    -S  bytes of each packet to write (default %d)\n"
+        "    -u  do not gzip output files\n"
+        "    -l  gzip compression level (default 6)\n"
+        "    -w  gzip compression threads per worker file (default 1)\n"
+        "    -D  write with O_DIRECT, bypassing the page cache\n"
+        "    -P  reserve this much disk space for each hourly worker file up front\n", prog, DEFAULT_SNAPLEN);
+    exit(EXIT_FAILURE);
+}
+
+// Closes the worker's current file and drops the .partial suffix
+static void close_worker_file(struct worker* w) {
+    if (!w->out) return;
+    if (capfile_close(w->out) < 0)
+        fprintf(stderr, "worker %d: closing %s: %s\n", w->id, w->fname, strerror(errno));
+    w->out = NULL;
+
+    char done[PATH_MAX];
+    snprintf(done, sizeof(done), "%s", w->fname);
+    done[strlen(done) - strlen(".partial")] = '\0';
+    if (capfile_rename(w->fname, done) < 0)
+        fprintf(stderr, "worker %d: rename %s: %s\n", w->id, w->fname, strerror(errno));
+}
+
+/*
+    Starts the hourly file for ts: <data-dir>/YYYY-mm-dd.HH.wNN.pcap[.gz].partial. As in
+    legacy, a restart within the hour picks up that hour's file again: a finished one is
+    moved back to .partial, a torn tail is cut back to the last sync point, and the file
+    is appended to rather than truncated.
+*/
+static int open_worker_file(struct worker* w, time_t ts) {
+    char hour[32], done[PATH_MAX];
+    struct tm tm;
+    struct stat sb;
+
+    close_worker_file(w);
+    gmtime_r(&ts, &tm);
+    strftime(hour, sizeof(hour), "%Y-%m-%d.%H", &tm);
+    int n = snprintf(w->fname, sizeof(w->fname), "%s/%s.w%02d.pcap%s.partial", data_dir, hour, w->id,
+                     file_opts.flags & CAPFILE_GZIP ? ".gz" : "");
+    if (n < 0 || (size_t)n >= sizeof(w->fname)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    snprintf(done, sizeof(done), "%.*s", n - (int)strlen(".partial"), w->fname);
+
+    if (stat(done, &sb) == 0 && capfile_rename(done, w->fname) < 0) return -1;
+
+    if (stat(w->fname, &sb) == 0) {
+        struct capfile_recovery rec;
+        if (capfile_recover(w->fname, &rec) == 0) {
+            printf("worker %d: resuming %s: kept %llu bytes, discarded %llu (%u index entries)\n",
+                   w->id, w->fname, (unsigned long long)rec.size, (unsigned long long)rec.discarded, rec.dropped);
+        } else {
+            char corrupt[PATH_MAX + sizeof(".corrupt")];
+            fprintf(stderr, "worker %d: cannot resume %s: %s\n", w->id, w->fname, strerror(errno));
+            snprintf(corrupt, sizeof(corrupt), "%s.corrupt", w->fname);
+            if (capfile_rename(w->fname, corrupt) < 0) return -1;
+        }
+    }
+
+    w->out = capfile_open(w->fname, &file_opts);
+    if (!w->out) return -1;
+
+    tm.tm_sec = 0;
+    tm.tm_min = 0;
+    tm.tm_hour += 1;
+    w->goal_ts = timegm(&tm);
+    w->flush_ts = ts + FLUSH_INTERVAL_S;
+    return 0;
+}
+
+/*
+    Creates the worker's TPACKET_V3 socket and ring, binds it to the interface and joins the
+    fanout group. The ring must be set up before joining, otherwise the kernel starts steering
+    packets to a socket that has nowhere to put them.
+
+    The socket is created with protocol 0 so it receives nothing until it is bound. The kernel
+    only lets a bound socket join a fanout group, so between bind() and PACKET_FANOUT it would
+    get a full copy of the interface's traffic on top of what the group already hands out; a
+    filter that drops everything covers that window and is removed once the socket is in the
+    group.
+*/
+static int setup_socket(struct worker* w, int ifindex, int group) {
+    w->fd = socket(AF_PACKET, SOCK_RAW, 0);
+    if (w->fd < 0) return -1;
+
+    int version = TPACKET_V3;
+    if (setsockopt(w->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0) return -1;
+
+    struct tpacket_req3 req = {
+        .tp_block_size       = BLOCK_SIZE,
+        .tp_block_nr         = BLOCK_NR,
+        .tp_frame_size       = FRAME_SIZE,
+        .tp_frame_nr         = (BLOCK_SIZE / FRAME_SIZE) * BLOCK_NR,
+        .tp_retire_blk_tov   = BLOCK_TIMEOUT_MS,
+        .tp_sizeof_priv      = 0,
+        .tp_feature_req_word = 0
+    };
+    if (setsockopt(w->fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0) return -1;
+
+    w->ring = mmap(NULL, (size_t)BLOCK_SIZE * BLOCK_NR, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_LOCKED, w->fd, 0);
+    if (w->ring == MAP_FAILED) {
+        w->ring = NULL;
+        return -1;
+    }
+
+    struct sock_filter drop_all = BPF_STMT(BPF_RET | BPF_K, 0);
+    struct sock_fprog drop = { .len = 1, .filter = &drop_all };
+    if (setsockopt(w->fd, SOL_SOCKET, SO_ATTACH_FILTER, &drop, sizeof(drop)) < 0) return -1;
+
+    struct sockaddr_ll sll = {
+        .sll_family   = AF_PACKET,
+        .sll_protocol = htons(ETH_P_ALL),
+        .sll_ifindex  = ifindex
+    };
+    if (bind(w->fd, (struct sockaddr*)&sll, sizeof(sll)) < 0) return -1;
+
+    struct packet_mreq mreq = { .mr_ifindex = ifindex, .mr_type = PACKET_MR_PROMISC };
+    if (setsockopt(w->fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) return -1;
+
+    int fanout = group | (fanout_mode << 16);
+    if (fanout_mode == PACKET_FANOUT_HASH) fanout |= PACKET_FANOUT_FLAG_DEFRAG << 16;
+    if (setsockopt(w->fd, SOL_PACKET, PACKET_FANOUT, &fanout, sizeof(fanout)) < 0) return -1;
+
+    int unused = 0;
+    return setsockopt(w->fd, SOL_SOCKET, SO_DETACH_FILTER, &unused, sizeof(unused));
+}
+
+// Writes every packet in one block the kernel has handed over
+static int drain_block(struct worker* w, struct tpacket_block_desc* bd) {
+    struct tpacket3_hdr* ppd = (struct tpacket3_hdr*)((unsigned char*)bd + bd->hdr.bh1.offset_to_first_pkt);
+
+    for (__u32 i = 0; i < bd->hdr.bh1.num_pkts; i++) {
+        if (ppd->tp_sec >= w->goal_ts && open_worker_file(w, ppd->tp_sec) < 0) return -1;
+
+        __u32 caplen = ppd->tp_snaplen > snaplen ? snaplen : ppd->tp_snaplen;
+        if (capfile_write(w->out, ppd->tp_sec, ppd->tp_nsec, caplen, ppd->tp_len,
+                          (unsigned char*)ppd + ppd->tp_mac) < 0)
+            return -1;
+        w->packets++;
+        ppd = (struct tpacket3_hdr*)((unsigned char*)ppd + ppd->tp_next_offset);
+    }
+    return 0;
+}
+
+static void* worker_thread(void* arg) {
+    struct worker* w = arg;
+    struct pollfd pfd = { .fd = w->fd, .events = POLLIN | POLLERR };
+    unsigned int block = 0;
+
+    if (pin_workers) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(w->id, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+
+    if (open_worker_file(w, time(NULL)) < 0) {
+        fprintf(stderr, "worker %d: opening %s: %s\n", w->id, w->fname, strerror(errno));
+        stop = 1;
+        return NULL;
+    }
+
+    while (!stop) {
+        struct tpacket_block_desc* bd = (struct tpacket_block_desc*)(w->ring + (size_t)block * BLOCK_SIZE);
+
+        if (!(__atomic_load_n(&bd->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER)) {
+            poll(&pfd, 1, 1000);
+        } else {
+            if (drain_block(w, bd) < 0) {
+                fprintf(stderr, "worker %d: writing %s: %s\n", w->id, w->fname, strerror(errno));
+                stop = 1;
+                break;
+            }
+            // Give the block back to the kernel
+            __atomic_store_n(&bd->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+            block = (block + 1) % BLOCK_NR;
+        }
+
+        time_t now = time(NULL);
+        if (now >= w->flush_ts) {
+            if (capfile_flush(w->out) < 0)
+                fprintf(stderr, "worker %d: flushing %s: %s\n", w->id, w->fname, strerror(errno));
+            w->flush_ts = now + FLUSH_INTERVAL_S;
+        }
+    }
+
+    close_worker_file(w);
+    return NULL;
+}
+
+int main(int argc, char* argv[]) {
+    int nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+    struct stat sb;
+    int c;
+
+    memset(&file_opts, 0, sizeof(file_opts));
+    file_opts.flags = CAPFILE_GZIP | CAPFILE_APPEND | CAPFILE_INDEX | CAPFILE_BLOOM | CAPFILE_NSEC | CAPFILE_URING;
+    file_opts.workers = 1;
+
+    while ((c = getopt(argc, argv, "i:s:n:m:pS:ul:w:DP:h")) != -1) {
+        switch (c) {
+            case 'i': snprintf(ifname, sizeof(ifname), "%s", optarg); break;
+            case 's': snprintf(data_dir, sizeof(data_dir), "%s", optarg); break;
+            case 'n': nworkers = atoi(optarg); break;
+            case 'm':
+                if (strcmp(optarg, "hash") == 0) fanout_mode = PACKET_FANOUT_HASH;
+                else if (strcmp(optarg, "cpu") == 0) fanout_mode = PACKET_FANOUT_CPU;
+                else usage(argv[0]);
+                break;
+            case 'p': pin_workers = 1; break;
+            case 'S': snaplen = strtoul(optarg, NULL, 10); break;
+            case 'u': file_opts.flags &= ~CAPFILE_GZIP; break;
+            case 'l': file_opts.level = atoi(optarg); break;
+            case 'w': file_opts.workers = atoi(optarg); break;
+            case 'D': file_opts.flags |= CAPFILE_DIRECT; break;
+            case 'P': file_opts.prealloc = strtoull(optarg, NULL, 10) << 20; break;
+            default: usage(argv[0]);
+        }
+    }
+    if (ifname[0] == '\0' || data_dir[0] == '\0') usage(argv[0]);
+    if (stat(data_dir, &sb) < 0 || !S_ISDIR(sb.st_mode)) {
+        fprintf(stderr, "%s is not a directory\n", data_dir);
+        exit(EXIT_FAILURE);
+    }
+    if (nworkers < 1) nworkers = 1;
+    if (nworkers > MAX_WORKERS) nworkers = MAX_WORKERS;
+    if (snaplen == 0) snaplen = BLOCK_SIZE;
+    file_opts.snaplen = snaplen;
+    file_opts.linktype = 1;  // Ethernet
+
+    int ifindex = if_nametoindex(ifname);
+    if (!ifindex) {
+        fprintf(stderr, "Unknown interface %s: %s\n", ifname, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+
+    static struct worker workers[MAX_WORKERS];
+    int group = getpid() & 0xffff;
+    for (int i = 0; i < nworkers; i++) {
+        workers[i].id = i;
+        if (setup_socket(&workers[i], ifindex, group) < 0) {
+            fprintf(stderr, "Failed to set up socket %d on %s: %s\n", i, ifname, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (int i = 0; i < nworkers; i++) {
+        if (pthread_create(&workers[i].thread, NULL, worker_thread, &workers[i])) {
+            perror("pthread_create");
+            stop = 1;
+            nworkers = i;
+            break;
+        }
+    }
+    printf("Capturing on %s with %d workers (%s fanout)\n", ifname, nworkers,
+           fanout_mode == PACKET_FANOUT_HASH ? "hash" : "cpu");
+
+    unsigned long long total_packets = 0, total_drops = 0;
+    for (int i = 0; i < nworkers; i++) {
+        pthread_join(workers[i].thread, NULL);
+
+        struct tpacket_stats_v3 st;
+        socklen_t len = sizeof(st);
+        if (getsockopt(workers[i].fd, SOL_PACKET, PACKET_STATISTICS, &st, &len) == 0) {
+            printf("worker %d: written=%llu kernel_packets=%u kernel_drops=%u\n",
+                   i, workers[i].packets, st.tp_packets, st.tp_drops);
+            total_drops += st.tp_drops;
+        }
+        total_packets += workers[i].packets;
+        munmap(workers[i].ring, (size_t)BLOCK_SIZE * BLOCK_NR);
+        close(workers[i].fd);
+    }
+    printf("total: written=%llu drops=%llu\n", total_packets, total_drops);
+    exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,368 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "uring.h"
+#include "metrics.h"
+
+/*
+    Completions are only reaped when the writer is next used, so the time from submission to
+    reaping says more about the caller than the disk. What is measured instead is how long
+    the caller waited with every buffer in flight, which is the disk's latency showing through.
+*/
+static struct metric m_inflight = METRIC_INIT("uring_writes_inflight", METRIC_GAUGE, "Buffers submitted to io_uring whose completion has not been reaped");
+static struct metric m_stall = METRIC_INIT("uring_stall_seconds", METRIC_HISTOGRAM, "Time spent waiting for a buffer with every buffer in flight");
+
+struct uring_buf {
+    unsigned char* data;
+    size_t         len;     // Bytes queued in the buffer
+    size_t         done;    // Bytes the kernel has written so far (short writes are resubmitted)
+    uint64_t       offset;  // Where the buffer goes in the file
+    int            busy;    // Submitted and not yet completed
+};
+
+/*
+    The submission and completion rings are mapped straight from the kernel, as in
+    xdp_xsk_user.c, rather than through liburing. Only what a single-issuer, write-only
+    user needs is kept.
+*/
+struct uring_writer {
+    int               fd;
+    int               ring_fd;
+    int               direct;
+
+    unsigned int*     sq_head;
+    unsigned int*     sq_tail;
+    unsigned int*     sq_mask;
+    unsigned int*     sq_array;
+    struct io_uring_sqe* sqes;
+    unsigned int*     cq_head;
+    unsigned int*     cq_tail;
+    unsigned int*     cq_mask;
+    struct io_uring_cqe* cqes;
+
+    void*             ring_map;
+    size_t            ring_map_len;
+    size_t            sqes_len;
+
+    struct uring_buf* bufs;
+    unsigned int      nbufs;
+    size_t            buf_size;
+    struct uring_buf* cur;       // Buffer being filled, if any
+    unsigned int      inflight;
+    uint64_t          offset;    // File offset of the next buffer submitted
+    int               error;     // First write error (errno)
+
+    // Direct mode: the padded copy of the partial last block written by a flush
+    struct uring_buf* tail;      // Its buffer while the write is in flight
+    uint64_t          tail_end;  // File offset just past the data it carried
+    uint64_t          tail_written;  // tail_end once that write has completed
+};
+
+static int ring_enter(int ring_fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags) {
+    return syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+// Queues the unwritten part of a buffer and tells the kernel straight away
+static int submit(struct uring_writer* w, struct uring_buf* b) {
+    unsigned int tail = *w->sq_tail;
+    unsigned int index = tail & *w->sq_mask;
+    struct io_uring_sqe* sqe = &w->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode    = IORING_OP_WRITE;
+    sqe->fd        = w->fd;
+    sqe->addr      = (uint64_t)(uintptr_t)(b->data + b->done);
+    sqe->len       = b->len - b->done;
+    sqe->off       = b->offset + b->done;
+    sqe->user_data = b - w->bufs;
+    w->sq_array[index] = index;
+    __atomic_store_n(w->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    b->busy = 1;
+    w->inflight++;
+    while (ring_enter(w->ring_fd, 1, 0, 0) < 0) {
+        if (errno == EINTR) continue;
+        return -1;
+    }
+    return 0;
+}
+
+// Handles every completion that is ready; with wait set, first waits for at least one
+static int reap(struct uring_writer* w, int wait) {
+    unsigned int head = *w->cq_head;
+    if (wait && head == __atomic_load_n(w->cq_tail, __ATOMIC_ACQUIRE)) {
+        while (ring_enter(w->ring_fd, 0, 1, IORING_ENTER_GETEVENTS) < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+    }
+
+    while (head != __atomic_load_n(w->cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe* cqe = &w->cqes[head & *w->cq_mask];
+        struct uring_buf* b = &w->bufs[cqe->user_data];
+        int res = cqe->res;
+        head++;
+        __atomic_store_n(w->cq_head, head, __ATOMIC_RELEASE);
+
+        w->inflight--;
+        b->busy = 0;
+        if (res == -EINTR || res == -EAGAIN) res = 0;
+        else if (res <= 0) {
+            if (!w->error) w->error = res < 0 ? -res : EIO;
+            if (b == w->tail) w->tail = NULL;
+            metric_add(&m_inflight, -1);
+            continue;
+        }
+        b->done += res;
+        if (b->done < b->len && !w->error) {
+            if (submit(w, b) < 0) return -1;
+            continue;
+        }
+        if (b == w->tail) {
+            w->tail = NULL;
+            w->tail_written = w->tail_end;
+        }
+        metric_add(&m_inflight, -1);
+    }
+    return 0;
+}
+
+// Waits out the tail write, so nothing that overlaps its block can complete before it does
+static int wait_tail(struct uring_writer* w) {
+    while (w->tail)
+        if (reap(w, 1) < 0) return -1;
+    return 0;
+}
+
+// Returns a buffer that is neither in flight nor being filled, waiting for one if need be
+static struct uring_buf* get_buf(struct uring_writer* w) {
+    uint64_t started = 0;
+    for (;;) {
+        for (unsigned int i = 0; i < w->nbufs; i++) {
+            struct uring_buf* b = &w->bufs[i];
+            if (!b->busy && b != w->cur) {
+                if (started) metric_observe_ns(&m_stall, metrics_now_ns() - started);
+                b->len = 0;
+                b->done = 0;
+                return b;
+            }
+        }
+        if (!started) started = metrics_now_ns();
+        if (reap(w, 1) < 0) return NULL;
+    }
+}
+
+static int submit_cur(struct uring_writer* w) {
+    if (wait_tail(w) < 0) return -1;
+    struct uring_buf* b = w->cur;
+    w->cur = NULL;
+    b->offset = w->offset;
+    w->offset += b->len;
+    metric_add(&m_inflight, 1);
+    return submit(w, b);
+}
+
+static void free_writer(struct uring_writer* w) {
+    if (w->bufs) {
+        for (unsigned int i = 0; i < w->nbufs; i++)
+            free(w->bufs[i].data);
+        free(w->bufs);
+    }
+    if (w->sqes && w->sqes != MAP_FAILED) munmap(w->sqes, w->sqes_len);
+    if (w->ring_map && w->ring_map != MAP_FAILED) munmap(w->ring_map, w->ring_map_len);
+    if (w->ring_fd >= 0) close(w->ring_fd);
+    free(w);
+}
+
+// Asks the kernel whether it has IORING_OP_WRITE; kernels older than the probe (5.6) have neither
+static int write_supported(int ring_fd) {
+    size_t len = sizeof(struct io_uring_probe) + (IORING_OP_WRITE + 1) * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe* probe = calloc(1, len);
+    if (!probe) return 0;
+    int ok = syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE, probe, IORING_OP_WRITE + 1) == 0 &&
+             probe->last_op >= IORING_OP_WRITE && (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    return ok;
+}
+
+struct uring_writer* uring_writer_open(int fd, int flags, unsigned int depth, size_t buf_size) {
+    struct uring_writer* w = calloc(1, sizeof(*w));
+    if (!w) return NULL;
+    metric_register(&m_inflight);
+    metric_register(&m_stall);
+    w->fd = fd;
+    w->ring_fd = -1;
+    w->nbufs = depth ? depth : URING_DEFAULT_DEPTH;
+    if (w->nbufs < 3) w->nbufs = 3;  // A direct flush moves the partial block to a second buffer and writes it from a third
+    w->buf_size = buf_size ? (buf_size + URING_ALIGN - 1) & ~(size_t)(URING_ALIGN - 1) : URING_DEFAULT_BUF_SIZE;
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    w->ring_fd = syscall(__NR_io_uring_setup, w->nbufs, &params);
+    if (w->ring_fd < 0) goto fail;
+
+    // Both rings are mapped with one mmap below
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !write_supported(w->ring_fd)) {
+        errno = ENOSYS;
+        goto fail;
+    }
+    size_t sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    size_t cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    w->ring_map_len = sq_len > cq_len ? sq_len : cq_len;
+    w->ring_map = mmap(NULL, w->ring_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, w->ring_fd, IORING_OFF_SQ_RING);
+    if (w->ring_map == MAP_FAILED) goto fail;
+    w->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    w->sqes = mmap(NULL, w->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, w->ring_fd, IORING_OFF_SQES);
+    if (w->sqes == MAP_FAILED) goto fail;
+
+    unsigned char* ring = w->ring_map;
+    w->sq_head  = (unsigned int*)(ring + params.sq_off.head);
+    w->sq_tail  = (unsigned int*)(ring + params.sq_off.tail);
+    w->sq_mask  = (unsigned int*)(ring + params.sq_off.ring_mask);
+    w->sq_array = (unsigned int*)(ring + params.sq_off.array);
+    w->cq_head  = (unsigned int*)(ring + params.cq_off.head);
+    w->cq_tail  = (unsigned int*)(ring + params.cq_off.tail);
+    w->cq_mask  = (unsigned int*)(ring + params.cq_off.ring_mask);
+    w->cqes     = (struct io_uring_cqe*)(ring + params.cq_off.cqes);
+
+    // One submission per buffer at most, and the kernel never makes the ring smaller than asked
+    w->bufs = calloc(w->nbufs, sizeof(*w->bufs));
+    if (!w->bufs) goto fail;
+    for (unsigned int i = 0; i < w->nbufs; i++) {
+        if (posix_memalign((void**)&w->bufs[i].data, URING_ALIGN, w->buf_size)) {
+            errno = ENOMEM;
+            goto fail;
+        }
+    }
+
+    struct stat sb;
+    int fl = fcntl(fd, F_GETFL);
+    if (fl < 0 || fstat(fd, &sb) < 0) goto fail;
+    w->offset = S_ISREG(sb.st_mode) ? sb.st_size : 0;
+    fl &= ~O_APPEND;
+    if ((flags & URING_DIRECT) && w->offset % URING_ALIGN == 0 && fcntl(fd, F_SETFL, fl | O_DIRECT) == 0)
+        w->direct = 1;
+    else if (fcntl(fd, F_SETFL, fl) < 0)
+        goto fail;
+    return w;
+
+fail:
+    {
+        int saved = errno;
+        free_writer(w);
+        errno = saved;
+    }
+    return NULL;
+}
+
+int uring_writer_write(struct uring_writer* w, const void* buf, size_t len) {
+    const unsigned char* p = buf;
+    while (len > 0) {
+        if (reap(w, 0) < 0) return -1;
+        if (w->error) {
+            errno = w->error;
+            return -1;
+        }
+        if (!w->cur && !(w->cur = get_buf(w))) return -1;
+
+        size_t n = w->buf_size - w->cur->len;
+        if (n > len) n = len;
+        memcpy(w->cur->data + w->cur->len, p, n);
+        w->cur->len += n;
+        p += n;
+        len -= n;
+
+        if (w->cur->len == w->buf_size && submit_cur(w) < 0) return -1;
+    }
+    return 0;
+}
+
+int uring_writer_flush(struct uring_writer* w) {
+    if (reap(w, 0) < 0) return -1;
+    if (w->error) {
+        errno = w->error;
+        return -1;
+    }
+    if (!w->cur || w->cur->len == 0) return 0;
+    if (!w->direct) return submit_cur(w);
+
+    // Only whole blocks can go out; the partial last block moves to a fresh buffer
+    size_t aligned = w->cur->len & ~(size_t)(URING_ALIGN - 1);
+    if (aligned > 0) {
+        struct uring_buf* next = get_buf(w);
+        if (!next) return -1;
+        next->len = w->cur->len - aligned;
+        memcpy(next->data, w->cur->data + aligned, next->len);
+        w->cur->len = aligned;
+        if (submit_cur(w) < 0) return -1;
+        w->cur = next;
+    }
+    if (w->cur->len == 0 || w->offset + w->cur->len == (w->tail ? w->tail_end : w->tail_written)) return 0;
+
+    /*
+        The partial block would otherwise stay in memory until more data arrives, which on a
+        quiet link could be never. A padded copy goes out now; the zeros past the data are
+        overwritten by the next write of the block, or truncated away on close.
+    */
+    if (wait_tail(w) < 0) return -1;
+    struct uring_buf* tail = get_buf(w);
+    if (!tail) return -1;
+    memcpy(tail->data, w->cur->data, w->cur->len);
+    memset(tail->data + w->cur->len, 0, URING_ALIGN - w->cur->len);
+    tail->len = URING_ALIGN;
+    tail->offset = w->offset;
+    w->tail = tail;
+    w->tail_end = w->offset + w->cur->len;
+    metric_add(&m_inflight, 1);
+    return submit(w, tail);
+}
+
+uint64_t uring_writer_written(struct uring_writer* w) {
+    reap(w, 0);
+    uint64_t written = w->offset;
+    for (unsigned int i = 0; i < w->nbufs; i++) {
+        const struct uring_buf* b = &w->bufs[i];
+        if (b->busy && b != w->tail && b->offset + b->done < written) written = b->offset + b->done;
+    }
+    if (written == w->offset && w->tail_written > written) written = w->tail_written;
+    return written;
+}
+
+int uring_writer_close(struct uring_writer* w) {
+    int err = 0;
+    uint64_t end = w->offset + (w->cur ? w->cur->len : 0);
+
+    if (w->cur && w->cur->len > 0) {
+        // A direct write must cover whole blocks; the padding is truncated away below
+        if (w->direct) {
+            size_t padded = (w->cur->len + URING_ALIGN - 1) & ~(size_t)(URING_ALIGN - 1);
+            memset(w->cur->data + w->cur->len, 0, padded - w->cur->len);
+            w->cur->len = padded;
+        }
+        if (submit_cur(w) < 0) err = errno;
+    }
+    while (w->inflight > 0) {
+        if (reap(w, 1) < 0) {
+            if (!err) err = errno;
+            break;
+        }
+    }
+    if (!err) err = w->error;
+    if (w->direct && !err && ftruncate(w->fd, end) < 0) err = errno;
+
+    free_writer(w);
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,50 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+    Asynchronous sequential file writer on io_uring. Bytes are copied into a pool of large,
+    page-aligned buffers; each full buffer is submitted as a single write at its own file
+    offset, with up to depth writes in flight at once. A buffer goes back to the pool when its
+    write completes, so a disk that stalls for a moment only deepens the queue. The caller
+    blocks only when every buffer is in flight.
+
+    With URING_DIRECT the fd is switched to O_DIRECT and writes bypass the page cache. Direct
+    writes must be block-aligned, so a flush writes the unaligned tail as a zero-padded block,
+    which the next write of that block replaces; close truncates the file back to size. Where
+    the filesystem refuses O_DIRECT, or an appended-to file does not end on a block boundary,
+    the writer quietly stays buffered.
+
+    Writes complete out of order, so what a reader of the file can see is given by
+    uring_writer_written(): everything before it has reached the file.
+*/
+
+#define URING_DEFAULT_DEPTH    8
+#define URING_DEFAULT_BUF_SIZE (4 << 20)
+#define URING_ALIGN            4096   // Block size assumed for O_DIRECT
+
+#define URING_DIRECT 0x1
+
+struct uring_writer;
+
+// Starts writing at the current end of fd. O_APPEND is cleared on the fd, since concurrent
+// writes must land at their own offsets. Returns NULL with errno set on failure; ENOSYS or
+// EPERM mean io_uring is unavailable (or disabled) and the caller should use write(2).
+struct uring_writer* uring_writer_open(int fd, int flags, unsigned int depth, size_t buf_size);
+
+// Copies len bytes in. Only blocks when every buffer is in flight.
+int uring_writer_write(struct uring_writer* w, const void* buf, size_t len);
+
+// Submits whatever is buffered
+int uring_writer_flush(struct uring_writer* w);
+
+// Reaps finished writes and returns the file offset below which every byte has been written
+uint64_t uring_writer_written(struct uring_writer* w);
+
+// Writes everything out, waits for it and frees the writer. The fd is left open. Returns -1
+// with errno set if any write failed.
+int uring_writer_close(struct uring_writer* w);
+
+#endif
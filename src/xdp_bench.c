@@ -0,0 +1,1062 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
+#include <arpa/inet.h>
+#include <linux/if_ether.h>
+#include <linux/ip.h>
+#include <linux/in.h>
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+
+#include "xdp_filter.h"
+
+/*
+    Runs crafted frames through each XDP program with BPF_PROG_TEST_RUN, no NIC or interface
+    needed. Every frame is first run once and what the program left behind (ring buffer
+    records, flow table entries, completed-flow events) is checked against what the parser is
+    supposed to do with it. The same frame is then run in batches to measure ns per packet.
+
+    Maps are unpinned before loading, so this never touches the maps of a capture that is
+    running on the same host. The capture filter is checked the way xdp_pcap_user runs it: a
+    compiled expression that tail-calls xdp_pcap with config.filtered set.
+*/
+
+#define PASS_OBJ      "bin/xdp_pass.o"
+#define PCAP_OBJ      "bin/xdp_pcap_kern.o"
+#define FLOW_OBJ      "bin/xdp_flow_kern.o"
+#define DEFAULT_REPEAT 1000000
+#define BATCH_REPEAT   10000        // Runs between ring buffer drains
+#define BENCH_RINGBUF  (16 << 20)   // Big enough for one batch of full-size records
+#define PCAP_SNAPLEN   256          // Default snaplen in xdp_pcap_kern.c
+#define MAX_FRAME      9216
+#define MAX_CPUS       256
+
+// Load shedding, as in xdp_pcap_kern.c
+#define PCAP_ENTRY_SHED_SHIFT 8
+#define PCAP_ENTRY_SHED_MASK  0xf
+#define SHED_SNAPLEN          128
+#define SHED_RUNS             12000    // Full-size records enough to fill BENCH_RINGBUF past 3/4
+#define SHED_QUIET_US         1100000  // A little over the kernel's quiet period per step down
+
+#define DEDUP_WINDOW_NS       (100 * 1000 * 1000ULL)
+#define DEDUP_WINDOW_US       150000   // Sleep that outlasts the window
+
+#define POLICY_PAYLOAD        512      // xdp_pcap_user -P default
+
+#define TCP_FIN 0x01
+#define TCP_SYN 0x02
+#define TCP_ACK 0x10
+
+// Variable-length entry as defined in kernel-level program
+struct pcap_entry {
+    __u64 timestamp;
+    __u32 len;
+    __u16 caplen;
+    __u16 flags;
+    __u8  data[];
+};
+
+// Capture counters as defined in kernel-level program
+enum pcap_stat {
+    PCAP_STAT_SEEN,
+    PCAP_STAT_PARSE_ERROR,
+    PCAP_STAT_FILTERED,
+    PCAP_STAT_RINGBUF_FULL,
+    PCAP_STAT_COPY_ERROR,
+    PCAP_STAT_CAPTURED,
+    PCAP_STAT_SHED,
+    PCAP_STAT_DUPLICATE,
+    PCAP_STAT_MAX
+};
+
+struct shed_state {
+    __u64 changed;
+    __u64 quiet_since;
+    __u32 level;
+    __u32 pad;
+};
+
+// Flow key, value and completed-flow event as defined in kernel-level program
+struct flow_key {
+    __u32 src_ip;
+    __u32 dst_ip;
+    __u16 src_port;
+    __u16 dst_port;
+    __u8  proto;
+    __u8  pad[3];
+};
+
+struct flow_value {
+    __u64 packets;
+    __u64 bytes;
+    __u64 first_seen;
+    __u64 last_seen;
+    __u8  tcp_flags;
+    __u8  pad[7];
+};
+
+struct flow_event {
+    struct flow_key key;
+    __u64 packets;
+    __u64 bytes;
+    __u64 first_seen;
+    __u64 last_seen;
+    __u8  tcp_flags;
+    __u8  reason;
+    __u8  pad[6];
+};
+
+#define FLOW_END_FIN 3
+
+// Load-time configuration of the flow program (.rodata)
+struct flow_config {
+    __u64 idle_timeout_ns;
+    __u64 active_timeout_ns;
+    __u64 sweep_interval_ns;
+    __u64 heavy_bytes;
+};
+
+// Flow counters, count-min sketch and heavy hitters as defined in kernel-level program
+enum flow_stat {
+    FLOW_STAT_SEEN,
+    FLOW_STAT_PARSE_ERROR,
+    FLOW_STAT_FILTERED,
+    FLOW_STAT_MAP_FULL,
+    FLOW_STAT_COUNTED,
+    FLOW_STAT_EXPORTED,
+    FLOW_STAT_RINGBUF_FULL,
+    FLOW_STAT_HEAVY,
+    FLOW_STAT_PROMOTED,
+    FLOW_STAT_MAX
+};
+
+#define SKETCH_DEPTH 4
+#define SKETCH_WIDTH 2048
+#define HEAVY_RUNS   10  // Packets of an untracked flow that make it heavy in the sketch test
+
+struct sketch_cell {
+    __u64 packets;
+    __u64 bytes;
+};
+
+struct topk_key {
+    struct flow_key flow;
+    __u32 epoch;
+};
+
+struct topk_value {
+    __u64 packets;
+    __u64 bytes;
+    __u64 promoted;
+    __u64 last_seen;
+};
+
+// Load-time configuration as defined in kernel-level program (.rodata)
+struct pcap_config {
+    __u32 snaplen;
+    __u32 filtered;
+    __u32 shed;
+    __u32 percpu;
+    __u64 dedup_window_ns;
+    __u32 policy;
+    __u32 policy_packets;
+    __u32 policy_payload;
+    __u32 pad;
+};
+
+/*
+    One crafted frame and what each program should make of it. Expectations are for a single
+    run: captured means one ring buffer record, tracked means one flow table entry (or, for a
+    FIN, one completed-flow event instead).
+*/
+struct test_case {
+    const char*   name;
+    unsigned char frame[MAX_FRAME];
+    __u32         len;
+    int           captured;
+    int           tracked;
+    int           exported;   // Flow completes immediately (FIN/RST)
+    int           oversize;   // Larger than a page; needs an xdp.frags program to test-run
+    struct flow_key key;
+};
+
+static int failures = 0;
+static int repeat = DEFAULT_REPEAT;
+
+#define CHECK(cond, fmt, ...) do {                                              \
+    if (!(cond)) {                                                              \
+        fprintf(stderr, "  FAIL %s: " fmt "\n", tc->name, ##__VA_ARGS__);       \
+        failures++;                                                             \
+    }                                                                           \
+} while (0)
+
+/*
+    Builds Ethernet + IPv4 + TCP/UDP with payload_len bytes of payload. ihl and doff are in
+    32-bit words so malformed headers can be described directly; options are zero-filled.
+*/
+static __u32 build_frame(unsigned char* buf, __u16 eth_proto, __u8 proto, __u8 ihl, __u8 doff,
+                         __u8 tcp_flags, __u32 payload_len, struct flow_key* key) {
+    memset(buf, 0, MAX_FRAME);
+    struct ethhdr* eth = (struct ethhdr*)buf;
+    memcpy(eth->h_dest, "\x02\x00\x00\x00\x00\x01", ETH_ALEN);
+    memcpy(eth->h_source, "\x02\x00\x00\x00\x00\x02", ETH_ALEN);
+    eth->h_proto = htons(eth_proto);
+    if (eth_proto != ETH_P_IP) return sizeof(*eth) + 28 + payload_len;  // ARP-sized and opaque
+
+    struct iphdr* ip = (struct iphdr*)(eth + 1);
+    __u32 ip_len = (ihl < 5 ? 5 : ihl) * 4;
+    __u32 l4_len = proto == IPPROTO_TCP ? (doff < 5 ? 5 : doff) * 4 : 8;
+    ip->version = 4;
+    ip->ihl = ihl;
+    ip->ttl = 64;
+    ip->protocol = proto;
+    ip->tot_len = htons(ip_len + l4_len + payload_len);
+    ip->saddr = inet_addr("192.0.2.1");
+    ip->daddr = inet_addr("198.51.100.7");
+
+    unsigned char* l4 = (unsigned char*)ip + ip_len;
+    __u16 sport = htons(40000), dport = htons(proto == IPPROTO_TCP ? 443 : 53);
+    memcpy(l4, &sport, 2);
+    memcpy(l4 + 2, &dport, 2);
+    if (proto == IPPROTO_TCP) {
+        l4[12] = doff << 4;
+        l4[13] = tcp_flags;
+    } else {
+        __u16 udp_len = htons(8 + payload_len);
+        memcpy(l4 + 4, &udp_len, 2);
+    }
+    for (__u32 i = 0; i < payload_len; i++)
+        l4[l4_len + i] = i;
+
+    memset(key, 0, sizeof(*key));
+    key->src_ip = ip->saddr;
+    key->dst_ip = ip->daddr;
+    key->src_port = sport;
+    key->dst_port = dport;
+    key->proto = proto;
+    return sizeof(*eth) + ip_len + l4_len + payload_len;
+}
+
+static struct test_case* build_cases(int* count) {
+    static struct test_case cases[12];
+    struct test_case* tc;
+    int n = 0;
+
+    tc = &cases[n++];
+    tc->name = "tcp_syn";
+    tc->len = build_frame(tc->frame, ETH_P_IP, IPPROTO_TCP, 5, 5, TCP_SYN, 0, &tc->key);
+    tc->captured = tc->tracked = 1;
+
+    tc = &cases[n++];
+    tc->name = "tcp_data_1400";
+    tc->len = build_frame(tc->frame, ETH_P_IP, IPPROTO_TCP, 5, 8, TCP_ACK, 1400, &tc->key);
+    tc->captured = tc->tracked = 1;
+
+    tc = &cases[n++];
+    tc->name = "tcp_fin";
+    tc->len = build_frame(tc->frame, ETH_P_IP, IPPROTO_TCP, 5, 5, TCP_FIN | TCP_ACK, 0, &tc->key);
+    tc->captured = tc->tracked = tc->exported = 1;
+
+    tc = &cases[n++];
+    tc->name = "udp_dns";
+    tc->len = build_frame(tc->frame, ETH_P_IP, IPPROTO_UDP, 5, 0, 0, 60, &tc->key);
+    tc->captured = tc->tracked = 1;
+
+    tc = &cases[n++];
+    tc->name = "ip_options";
+    tc->len = build_frame(tc->frame, ETH_P_IP, IPPROTO_UDP, 8, 0, 0, 32, &tc->key);
+    tc->captured = tc->tracked = 1;
+
+    tc = &cases[n++];
+    tc->name = "bad_ihl";
+    tc->len = build_frame(tc->frame, ETH_P_IP, IPPROTO_TCP, 4, 5, TCP_SYN, 0, &tc->key);
+
+    // The capture program only validates the IP header; the flow parser also checks doff
+    tc = &cases[n++];
+    tc->name = "bad_doff";
+    tc->len = build_frame(tc->frame, ETH_P_IP, IPPROTO_TCP, 5, 3, TCP_SYN, 0, &tc->key);
+    tc->captured = 1;
+
+    // UDP length claims more than the frame holds
+    tc = &cases[n++];
+    tc->name = "udp_len_overrun";
+    tc->len = build_frame(tc->frame, ETH_P_IP, IPPROTO_UDP, 5, 0, 0, 60, &tc->key) - 20;
+    tc->captured = 1;
+
+    tc = &cases[n++];
+    tc->name = "truncated_ip";
+    build_frame(tc->frame, ETH_P_IP, IPPROTO_TCP, 5, 5, TCP_SYN, 0, &tc->key);
+    tc->len = ETH_HLEN + 10;
+
+    tc = &cases[n++];
+    tc->name = "icmp";
+    tc->len = build_frame(tc->frame, ETH_P_IP, IPPROTO_ICMP, 5, 0, 0, 56, &tc->key);
+
+    tc = &cases[n++];
+    tc->name = "non_ip_arp";
+    tc->len = build_frame(tc->frame, ETH_P_ARP, 0, 0, 0, 0, 0, &tc->key);
+
+    tc = &cases[n++];
+    tc->name = "udp_jumbo_9000";
+    tc->len = build_frame(tc->frame, ETH_P_IP, IPPROTO_UDP, 5, 0, 0, 9000 - 42, &tc->key);
+    tc->captured = tc->tracked = 1;
+    tc->oversize = 1;
+
+    *count = n;
+    return cases;
+}
+
+static struct test_case* find_case(struct test_case* cases, int ncases, const char* name) {
+    for (int i = 0; i < ncases; i++)
+        if (strcmp(cases[i].name, name) == 0) return &cases[i];
+    return NULL;
+}
+
+// Ring buffer callbacks: keep a copy of the last record and count them
+struct ring_result {
+    int           records;
+    unsigned char last[sizeof(struct pcap_entry) + MAX_FRAME];
+    size_t        last_size;
+};
+
+static int collect_record(void* ctx, void* data, size_t size) {
+    struct ring_result* res = ctx;
+    res->records++;
+    res->last_size = size < sizeof(res->last) ? size : sizeof(res->last);
+    memcpy(res->last, data, res->last_size);
+    return 0;
+}
+
+// A loaded program and the consumer of its ring buffer, if it has one
+struct bench_prog {
+    struct bpf_object*  obj;
+    int                 prog_fd;
+    struct ring_buffer* rb;
+};
+
+struct bench_opts {
+    const char*           ring;         // Ring buffer to resize and consume
+    ring_buffer_sample_fn sample;       // collect_record if NULL
+    void*                 ctx;
+    const void*           config;       // Copied over the start of .rodata
+    size_t                config_size;
+    const char*           table;        // Map to cut down to table_size entries
+    __u32                 table_size;
+};
+
+/*
+    Opens and loads an object with every map unpinned, the ring (if any) resized so a whole
+    batch fits and a consumer set up on it. Returns -1 after reporting and counting the failure.
+*/
+static int open_bench(struct bench_prog* p, const char* path, const struct bench_opts* opts) {
+    memset(p, 0, sizeof(*p));
+    p->obj = bpf_object__open_file(path, NULL);
+    if (libbpf_get_error(p->obj)) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        p->obj = NULL;
+        failures++;
+        return -1;
+    }
+
+    struct bpf_map* map;
+    bpf_object__for_each_map(map, p->obj)
+        bpf_map__set_pin_path(map, NULL);
+
+    // The hardware-timestamp variant only loads bound to a real device
+    struct bpf_program* hwts = bpf_object__find_program_by_name(p->obj, "xdp_prog_hwts");
+    if (hwts) bpf_program__set_autoload(hwts, false);
+
+    if (opts->ring && (map = bpf_object__find_map_by_name(p->obj, opts->ring)))
+        bpf_map__set_max_entries(map, BENCH_RINGBUF);
+    if (opts->table && (map = bpf_object__find_map_by_name(p->obj, opts->table)))
+        bpf_map__set_max_entries(map, opts->table_size);
+
+    if (opts->config) {
+        size_t size;
+        map = bpf_object__find_map_by_name(p->obj, ".rodata");
+        void* rodata = map ? bpf_map__initial_value(map, &size) : NULL;
+        if (!rodata || size < opts->config_size) {
+            fprintf(stderr, "No config in %s\n", path);
+            goto fail;
+        }
+        memcpy(rodata, opts->config, opts->config_size);
+    }
+
+    if (bpf_object__load(p->obj)) {
+        fprintf(stderr, "Failed to load %s: %s\n", path, strerror(errno));
+        goto fail;
+    }
+    p->prog_fd = bpf_program__fd(bpf_object__find_program_by_name(p->obj, "xdp_prog"));
+
+    if (opts->ring) {
+        p->rb = ring_buffer__new(bpf_object__find_map_fd_by_name(p->obj, opts->ring),
+                                 opts->sample ? opts->sample : collect_record, opts->ctx, NULL);
+        if (!p->rb) {
+            fprintf(stderr, "Failed to create ring buffer: %s\n", strerror(errno));
+            goto fail;
+        }
+    }
+    return 0;
+
+fail:
+    bpf_object__close(p->obj);
+    p->obj = NULL;
+    failures++;
+    return -1;
+}
+
+static void close_bench(struct bench_prog* p) {
+    ring_buffer__free(p->rb);
+    bpf_object__close(p->obj);
+}
+
+static int run_prog(int prog_fd, struct test_case* tc, int count, __u32* retval, __u32* duration) {
+    LIBBPF_OPTS(bpf_test_run_opts, opts,
+        .data_in = tc->frame,
+        .data_size_in = tc->len,
+        .repeat = count
+    );
+    if (bpf_prog_test_run_opts(prog_fd, &opts)) return -errno;
+    *retval = opts.retval;
+    *duration = opts.duration;
+    return 0;
+}
+
+/*
+    Runs the frame in batches and reports the average ns per packet. drain is called between
+    batches so ring buffer programs keep measuring the submit path rather than a full ring.
+*/
+static double bench(int prog_fd, struct test_case* tc, struct ring_buffer* drain) {
+    unsigned long long total_ns = 0;
+    int done = 0;
+
+    while (done < repeat) {
+        int batch = repeat - done < BATCH_REPEAT ? repeat - done : BATCH_REPEAT;
+        __u32 retval, duration;
+        if (run_prog(prog_fd, tc, batch, &retval, &duration) < 0) return -1;
+        total_ns += (unsigned long long)duration * batch;
+        done += batch;
+        if (drain) ring_buffer__consume(drain);
+    }
+    return (double)total_ns / repeat;
+}
+
+// Runs the frame once; returns -1 (and reports) if the kernel will not run it at all
+static int run_once(int prog_fd, struct test_case* tc, const char* prog_name) {
+    __u32 retval, duration;
+    int err = run_prog(prog_fd, tc, 1, &retval, &duration);
+    if (err == -EINVAL && tc->oversize) {
+        printf("%-10s %-18s skipped (frames over a page need an xdp.frags program)\n", prog_name, tc->name);
+        return -1;
+    }
+    if (err < 0) {
+        fprintf(stderr, "  FAIL %s: test run failed: %s\n", tc->name, strerror(-err));
+        failures++;
+        return -1;
+    }
+    CHECK(retval == XDP_PASS, "verdict %u, expected XDP_PASS", retval);
+    return 0;
+}
+
+static void report(const char* prog_name, struct test_case* tc, double ns) {
+    if (ns < 0) {
+        fprintf(stderr, "  FAIL %s: benchmark run failed: %s\n", tc->name, strerror(errno));
+        failures++;
+        return;
+    }
+    printf("%-10s %-18s %5u bytes %8.1f ns/pkt\n", prog_name, tc->name, tc->len, ns);
+}
+
+static void test_pass(struct test_case* cases, int ncases) {
+    struct bench_opts opts = {0};
+    struct bench_prog p;
+    if (open_bench(&p, PASS_OBJ, &opts) < 0) return;
+
+    for (int i = 0; i < ncases; i++) {
+        struct test_case* tc = &cases[i];
+        if (run_once(p.prog_fd, tc, "xdp_pass") < 0) continue;
+        report("xdp_pass", tc, bench(p.prog_fd, tc, NULL));
+    }
+    close_bench(&p);
+}
+
+// Checks what one run of the frame left in the ring against the default capture
+static void check_capture(struct test_case* tc, struct ring_result* res) {
+    CHECK(res->records == tc->captured, "%d ring records, expected %d", res->records, tc->captured);
+    if (res->records == 1 && tc->captured) {
+        struct pcap_entry* entry = (struct pcap_entry*)res->last;
+        __u32 want_caplen = tc->len < PCAP_SNAPLEN ? tc->len : PCAP_SNAPLEN;
+        struct iphdr* ip = (struct iphdr*)(tc->frame + ETH_HLEN);
+        CHECK(entry->caplen == want_caplen, "caplen %u, expected %u", entry->caplen, want_caplen);
+        CHECK(entry->len == ETH_HLEN + ntohs(ip->tot_len), "len %u, expected %u", entry->len, ETH_HLEN + ntohs(ip->tot_len));
+        CHECK(res->last_size >= sizeof(*entry) + entry->caplen, "record of %zu bytes cannot hold caplen %u", res->last_size, entry->caplen);
+        CHECK(memcmp(entry->data, tc->frame, want_caplen) == 0, "captured bytes differ from the frame");
+        CHECK(entry->flags == 0, "flags 0x%x on a software-stamped record", entry->flags);
+    }
+}
+
+static void test_pcap(struct test_case* cases, int ncases) {
+    static struct ring_result res;
+    struct bench_opts opts = { .ring = "ringbuf", .ctx = &res };
+    struct bench_prog p;
+    if (open_bench(&p, PCAP_OBJ, &opts) < 0) return;
+
+    for (int i = 0; i < ncases; i++) {
+        struct test_case* tc = &cases[i];
+        res.records = 0;
+        if (run_once(p.prog_fd, tc, "xdp_pcap") < 0) continue;
+        ring_buffer__consume(p.rb);
+
+        check_capture(tc, &res);
+        report("xdp_pcap", tc, bench(p.prog_fd, tc, p.rb));
+    }
+    close_bench(&p);
+}
+
+// Sums one counter of a per-CPU stats array
+static __u64 read_stat(int stats_fd, __u32 stat) {
+    static __u64 values[MAX_CPUS];
+    int ncpus = libbpf_num_possible_cpus();
+    __u64 total = 0;
+
+    if (ncpus < 1 || ncpus > MAX_CPUS || bpf_map_lookup_elem(stats_fd, &stat, values)) return 0;
+    for (int i = 0; i < ncpus; i++)
+        total += values[i];
+    return total;
+}
+
+static __u32 read_shed_level(int shed_fd) {
+    struct shed_state state;
+    __u32 zero = 0;
+    return bpf_map_lookup_elem(shed_fd, &zero, &state) ? 0 : state.level;
+}
+
+// Ring buffer callback for the shedding test: counts records by whether they were shed
+struct shed_result {
+    int records;
+    int shed;      // Taken at a level above 0
+    int too_long;  // Of those, longer than SHED_SNAPLEN
+};
+
+static int collect_shed(void* ctx, void* data, size_t size) {
+    struct shed_result* res = ctx;
+    struct pcap_entry* entry = data;
+    (void)size;
+    res->records++;
+    if ((entry->flags >> PCAP_ENTRY_SHED_SHIFT & PCAP_ENTRY_SHED_MASK) > 0) {
+        res->shed++;
+        if (entry->caplen > SHED_SNAPLEN) res->too_long++;
+    }
+    return 0;
+}
+
+/*
+    Fills the ring in one test run, as a consumer that has fallen behind would let it fill,
+    and checks that the program shed load instead of losing frames to a full ring. With the
+    ring drained again the level must hold for a whole quiet period before it drops a step.
+*/
+static void test_shed(struct test_case* cases, int ncases) {
+    struct test_case* tc = find_case(cases, ncases, "tcp_data_1400");
+    struct pcap_config config = { .snaplen = 0, .shed = 1 };
+    struct shed_result res = {0};
+    struct bench_opts opts = { .ring = "ringbuf", .sample = collect_shed, .ctx = &res, .config = &config, .config_size = sizeof(config) };
+    struct bench_prog p;
+    if (!tc || open_bench(&p, PCAP_OBJ, &opts) < 0) return;
+    int stats_fd = bpf_object__find_map_fd_by_name(p.obj, "pcap_stats");
+    int shed_fd = bpf_object__find_map_fd_by_name(p.obj, "shed_map");
+
+    __u32 retval, duration;
+    int err = run_prog(p.prog_fd, tc, SHED_RUNS, &retval, &duration);
+    CHECK(err == 0, "shed: test run failed: %s", strerror(-err));
+    ring_buffer__consume(p.rb);
+
+    __u64 captured = read_stat(stats_fd, PCAP_STAT_CAPTURED);
+    __u64 shed = read_stat(stats_fd, PCAP_STAT_SHED);
+    __u64 full = read_stat(stats_fd, PCAP_STAT_RINGBUF_FULL);
+    __u32 level = read_shed_level(shed_fd);
+    CHECK(level > 0, "shed: still at level 0 after %d frames into an undrained ring", SHED_RUNS);
+    CHECK(res.shed > 0 || shed > 0, "shed: no record was cut or left out");
+    CHECK(res.too_long == 0, "shed: %d records taken while shedding are over %d bytes", res.too_long, SHED_SNAPLEN);
+    CHECK(full == 0, "shed: %llu frames lost to a full ring", (unsigned long long)full);
+    CHECK(captured == (__u64)res.records && captured + shed + full == SHED_RUNS, "shed: %llu captured (%d records), %llu shed, %llu lost of %d frames",
+          (unsigned long long)captured, res.records, (unsigned long long)shed, (unsigned long long)full, SHED_RUNS);
+
+    // Drained, but the last frames of the burst only just found the ring busy
+    __u32 now_level = level;
+    if (level > 0 && run_once(p.prog_fd, tc, "xdp_pcap") == 0) {
+        ring_buffer__consume(p.rb);
+        now_level = read_shed_level(shed_fd);
+        CHECK(now_level == level, "shed: level dropped from %u to %u without a quiet period", level, now_level);
+
+        usleep(SHED_QUIET_US);
+        if (run_once(p.prog_fd, tc, "xdp_pcap") == 0) {
+            ring_buffer__consume(p.rb);
+            now_level = read_shed_level(shed_fd);
+            CHECK(now_level == level - 1, "shed: level %u after a quiet period at %u, expected one step down", now_level, level);
+        }
+    }
+    printf("%-10s %-18s shed to level %u, then %u after a quiet period\n", "xdp_pcap", tc->name, level, now_level);
+    close_bench(&p);
+}
+
+/*
+    Pins the bench to the CPU it is on, for tests of per-CPU state: separate test runs could
+    otherwise land on different CPUs. Returns the CPU, or -1 after printing why.
+*/
+static int pin_cpu(cpu_set_t* saved) {
+    cpu_set_t pinned;
+    int cpu = sched_getcpu();
+    CPU_ZERO(&pinned);
+    if (cpu >= 0) CPU_SET(cpu, &pinned);
+    if (cpu < 0 || cpu >= MAX_CPUS || sched_getaffinity(0, sizeof(*saved), saved) || sched_setaffinity(0, sizeof(pinned), &pinned)) {
+        fprintf(stderr, "Failed to pin to a CPU: %s\n", strerror(errno));
+        return -1;
+    }
+    return cpu;
+}
+
+/*
+    Per-CPU rings, set up as xdp_pcap_user -C does. The bench is pinned to the CPU it is on, so
+    every test run must land in that CPU's ring and nothing in the shared one. With the CPU's
+    slot emptied, a frame has nowhere to go and is counted as lost to a full ring.
+*/
+static void test_percpu(struct test_case* cases, int ncases) {
+    static struct ring_result res, shared;
+    struct pcap_config config = { .snaplen = PCAP_SNAPLEN, .percpu = 1 };
+    struct bench_opts opts = { .ring = "ringbuf", .ctx = &shared, .config = &config, .config_size = sizeof(config) };
+    struct bench_prog p;
+    if (open_bench(&p, PCAP_OBJ, &opts) < 0) return;
+    int stats_fd = bpf_object__find_map_fd_by_name(p.obj, "pcap_stats");
+    int ringbufs_fd = bpf_object__find_map_fd_by_name(p.obj, "ringbufs");
+
+    cpu_set_t saved;
+    int cpu = pin_cpu(&saved);
+    if (cpu < 0) {
+        failures++;
+        close_bench(&p);
+        return;
+    }
+
+    __u32 key = cpu;
+    int ring_fd = bpf_map_create(BPF_MAP_TYPE_RINGBUF, NULL, 0, 0, BENCH_RINGBUF, NULL);
+    struct ring_buffer* rb = NULL;
+    if (ring_fd < 0 || bpf_map_update_elem(ringbufs_fd, &key, &ring_fd, BPF_ANY) ||
+        !(rb = ring_buffer__new(ring_fd, collect_record, &res, NULL))) {
+        fprintf(stderr, "Failed to set up the ring of CPU %d: %s\n", cpu, strerror(errno));
+        failures++;
+        goto out;
+    }
+
+    for (int i = 0; i < ncases; i++) {
+        struct test_case* tc = &cases[i];
+        res.records = shared.records = 0;
+        if (run_once(p.prog_fd, tc, "pcap_cpu") < 0) continue;
+        ring_buffer__consume(rb);
+        ring_buffer__consume(p.rb);
+
+        check_capture(tc, &res);
+        CHECK(shared.records == 0, "%d records in the shared ring", shared.records);
+        report("pcap_cpu", tc, bench(p.prog_fd, tc, rb));
+    }
+
+    struct test_case* tc = find_case(cases, ncases, "tcp_syn");
+    if (tc && bpf_map_delete_elem(ringbufs_fd, &key) == 0) {
+        __u64 lost = read_stat(stats_fd, PCAP_STAT_RINGBUF_FULL);
+        res.records = shared.records = 0;
+        if (run_once(p.prog_fd, tc, "pcap_cpu") == 0) {
+            ring_buffer__consume(rb);
+            ring_buffer__consume(p.rb);
+            lost = read_stat(stats_fd, PCAP_STAT_RINGBUF_FULL) - lost;
+            CHECK(res.records == 0 && shared.records == 0, "without a ring: %d records, %d in the shared ring", res.records, shared.records);
+            CHECK(lost == 1, "without a ring: %llu frames counted lost, expected 1", (unsigned long long)lost);
+        }
+    }
+
+out:
+    ring_buffer__free(rb);
+    if (ring_fd >= 0) close(ring_fd);
+    sched_setaffinity(0, sizeof(saved), &saved);
+    close_bench(&p);
+}
+
+/*
+    Duplicate suppression with a short window. A frame and its copy as the other direction of
+    a SPAN session would deliver it (new MACs, one hop less TTL, so a new IP checksum) must be
+    captured once and counted once as a duplicate; a different frame, or the same one after
+    the window, is captured as usual.
+*/
+static void test_dedup(struct test_case* cases, int ncases) {
+    struct test_case* tc = find_case(cases, ncases, "udp_dns");
+    struct test_case* other = find_case(cases, ncases, "tcp_syn");
+    static struct ring_result res;
+    struct pcap_config config = { .snaplen = PCAP_SNAPLEN, .dedup_window_ns = DEDUP_WINDOW_NS };
+    struct bench_opts opts = { .ring = "ringbuf", .ctx = &res, .config = &config, .config_size = sizeof(config) };
+    struct bench_prog p;
+    if (!tc || !other || open_bench(&p, PCAP_OBJ, &opts) < 0) return;
+    int stats_fd = bpf_object__find_map_fd_by_name(p.obj, "pcap_stats");
+
+    static struct test_case copy;
+    copy = *tc;
+    copy.name = "udp_dns_span_copy";
+    struct ethhdr* eth = (struct ethhdr*)copy.frame;
+    struct iphdr* ip = (struct iphdr*)(eth + 1);
+    memcpy(eth->h_dest, "\x02\x00\x00\x00\x00\x03", ETH_ALEN);
+    memcpy(eth->h_source, "\x02\x00\x00\x00\x00\x04", ETH_ALEN);
+    ip->ttl--;
+    ip->check = htons(0x1234);
+
+    // Each step: the frame, and whether it should reach the ring
+    struct {
+        struct test_case* frame;
+        int               captured;
+        int               sleep;  // Let the window pass first
+    } steps[] = {
+        { tc,    1, 0 },
+        { tc,    0, 0 },
+        { &copy, 0, 0 },
+        { other, 1, 0 },
+        { tc,    1, 1 },
+    };
+    for (size_t i = 0; i < sizeof(steps) / sizeof(steps[0]); i++) {
+        struct test_case* tc = steps[i].frame;
+        if (steps[i].sleep) usleep(DEDUP_WINDOW_US);
+        __u64 dups = read_stat(stats_fd, PCAP_STAT_DUPLICATE);
+        res.records = 0;
+        if (run_once(p.prog_fd, tc, "pcap_dedup") < 0) continue;
+        ring_buffer__consume(p.rb);
+        dups = read_stat(stats_fd, PCAP_STAT_DUPLICATE) - dups;
+        CHECK(res.records == steps[i].captured && dups == (__u64)!steps[i].captured, "dedup step %zu: %d records and %llu duplicates, expected %d and %d",
+              i + 1, res.records, (unsigned long long)dups, steps[i].captured, !steps[i].captured);
+    }
+
+    // All but one run per window are duplicates, so this times the path that drops them
+    report("pcap_dedup", tc, bench(p.prog_fd, tc, p.rb));
+    close_bench(&p);
+}
+
+/*
+    Capture policy as xdp_pcap_user -P 1 sets it up: the first packet of a flow keeps its
+    headers plus POLICY_PAYLOAD bytes, later ones are cut to the L2-L4 headers, and a port
+    rule (-R 443) brings back the whole frame. The original length is kept throughout.
+*/
+static void test_policy(struct test_case* cases, int ncases) {
+    struct test_case* tc = find_case(cases, ncases, "tcp_data_1400");
+    static struct ring_result res;
+    struct pcap_config config = { .snaplen = PCAP_SNAPLEN, .policy = 1, .policy_packets = 1, .policy_payload = POLICY_PAYLOAD };
+    struct bench_opts opts = { .ring = "ringbuf", .ctx = &res, .config = &config, .config_size = sizeof(config) };
+    struct bench_prog p;
+    if (!tc || open_bench(&p, PCAP_OBJ, &opts) < 0) return;
+    int ports_fd = bpf_object__find_map_fd_by_name(p.obj, "policy_ports");
+
+    struct iphdr* ip = (struct iphdr*)(tc->frame + ETH_HLEN);
+    __u32 headers = ETH_HLEN + ip->ihl * 4 + (tc->frame[ETH_HLEN + ip->ihl * 4 + 12] >> 4) * 4;
+    struct {
+        const char* what;
+        __u32       caplen;
+        __u32       port_rule;  // Whole frames to or from port 443 from this step on
+    } steps[] = {
+        { "first packet", headers + POLICY_PAYLOAD, 0 },
+        { "later packet", headers,                  0 },
+        { "port rule",    tc->len,                  1 },
+    };
+    for (size_t i = 0; i < sizeof(steps) / sizeof(steps[0]); i++) {
+        if (steps[i].port_rule) {
+            __u32 port = 443, snaplen = MAX_FRAME;
+            CHECK(bpf_map_update_elem(ports_fd, &port, &snaplen, BPF_ANY) == 0, "policy: cannot add a port rule: %s", strerror(errno));
+        }
+        res.records = 0;
+        if (run_once(p.prog_fd, tc, "pcap_pol") < 0) continue;
+        ring_buffer__consume(p.rb);
+
+        struct pcap_entry* entry = (struct pcap_entry*)res.last;
+        CHECK(res.records == 1, "policy, %s: %d ring records, expected 1", steps[i].what, res.records);
+        if (res.records != 1) continue;
+        CHECK(entry->caplen == steps[i].caplen, "policy, %s: caplen %u, expected %u", steps[i].what, entry->caplen, steps[i].caplen);
+        CHECK(entry->len == tc->len, "policy, %s: len %u, expected %u", steps[i].what, entry->len, tc->len);
+        CHECK(memcmp(entry->data, tc->frame, entry->caplen < tc->len ? entry->caplen : tc->len) == 0, "policy, %s: captured bytes differ from the frame", steps[i].what);
+    }
+
+    report("pcap_pol", tc, bench(p.prog_fd, tc, p.rb));
+    close_bench(&p);
+}
+
+/*
+    Filter expressions and which of the cases each should let through to the capture program.
+    With a filter the capture program skips its own IPv4 TCP/UDP check, so ARP is captured.
+*/
+static const struct {
+    const char* expr;
+    const char* frame;
+    int         captured;
+} filter_cases[] = {
+    { "tcp port 443", "tcp_syn",    1 },
+    { "tcp port 443", "udp_dns",    0 },
+    { "udp port 53",  "udp_dns",    1 },
+    { "udp port 53",  "tcp_syn",    0 },
+    { "arp",          "non_ip_arp", 1 },
+    { "arp",          "icmp",       0 },
+};
+
+static void test_filter(struct test_case* cases, int ncases) {
+    static struct ring_result res;
+    struct pcap_config config = { .snaplen = PCAP_SNAPLEN, .filtered = 1 };
+    struct bench_opts opts = { .ring = "ringbuf", .ctx = &res, .config = &config, .config_size = sizeof(config) };
+    struct bench_prog p;
+    if (open_bench(&p, PCAP_OBJ, &opts) < 0) return;
+
+    for (size_t i = 0; i < sizeof(filter_cases) / sizeof(filter_cases[0]); i++) {
+        struct test_case* tc = find_case(cases, ncases, filter_cases[i].frame);
+        if (!tc) continue;
+
+        struct cbpf_insn* insns;
+        char errbuf[256];
+        static char log[65536];
+        int count = filter_compile(filter_cases[i].expr, &insns, errbuf, sizeof(errbuf));
+        CHECK(count > 0, "\"%s\" does not compile: %s", filter_cases[i].expr, errbuf);
+        if (count <= 0) continue;
+        int jmp_fd = -1;
+        int prog_fd = xdp_filter_load(insns, count, p.prog_fd, &jmp_fd, log, sizeof(log));
+        free(insns);
+        CHECK(prog_fd >= 0, "\"%s\" does not load: %s\n%s", filter_cases[i].expr, strerror(errno), log);
+        if (prog_fd < 0) continue;
+
+        res.records = 0;
+        if (run_once(prog_fd, tc, "xdp_filter") == 0) {
+            ring_buffer__consume(p.rb);
+            CHECK(res.records == filter_cases[i].captured, "\"%s\": %d ring records, expected %d",
+                  filter_cases[i].expr, res.records, filter_cases[i].captured);
+            if (res.records == 1 && filter_cases[i].captured) {
+                struct pcap_entry* entry = (struct pcap_entry*)res.last;
+                __u32 want_caplen = tc->len < PCAP_SNAPLEN ? tc->len : PCAP_SNAPLEN;
+                CHECK(entry->caplen == want_caplen, "\"%s\": caplen %u, expected %u", filter_cases[i].expr, entry->caplen, want_caplen);
+                CHECK(memcmp(entry->data, tc->frame, want_caplen) == 0, "\"%s\": captured bytes differ from the frame", filter_cases[i].expr);
+            }
+            report("xdp_filter", tc, bench(prog_fd, tc, p.rb));
+        }
+        close(prog_fd);
+        close(jmp_fd);
+    }
+    close_bench(&p);
+}
+
+// Sums a flow's per-CPU copies (or reads the single copy of a shared table)
+static int read_flow(int map_fd, int percpu, struct flow_key* key, struct flow_value* total) {
+    static struct flow_value values[MAX_CPUS];
+    int ncpus = percpu ? libbpf_num_possible_cpus() : 1;
+
+    memset(total, 0, sizeof(*total));
+    if (ncpus < 1 || ncpus > MAX_CPUS || bpf_map_lookup_elem(map_fd, key, values)) return -1;
+    for (int i = 0; i < ncpus; i++) {
+        total->packets += values[i].packets;
+        total->bytes += values[i].bytes;
+        total->tcp_flags |= values[i].tcp_flags;
+    }
+    return 0;
+}
+
+static void test_flow(struct test_case* cases, int ncases) {
+    static struct ring_result res;
+    struct bench_opts opts = { .ring = "flow_events", .ctx = &res };
+    struct bench_prog p;
+    if (open_bench(&p, FLOW_OBJ, &opts) < 0) return;
+    struct bpf_map* flow_map = bpf_object__find_map_by_name(p.obj, "flow_map");
+    int map_fd = bpf_map__fd(flow_map);
+    int percpu = bpf_map__type(flow_map) == BPF_MAP_TYPE_PERCPU_HASH ||
+                 bpf_map__type(flow_map) == BPF_MAP_TYPE_LRU_PERCPU_HASH;
+
+    for (int i = 0; i < ncases; i++) {
+        struct test_case* tc = &cases[i];
+        struct flow_value total;
+        res.records = 0;
+        if (run_once(p.prog_fd, tc, "xdp_flow") < 0) continue;
+        ring_buffer__consume(p.rb);
+
+        int found = read_flow(map_fd, percpu, &tc->key, &total) == 0;
+        if (tc->exported) {
+            struct flow_event* ev = (struct flow_event*)res.last;
+            CHECK(!found, "completed flow is still in the table");
+            CHECK(res.records == 1, "%d flow events, expected 1", res.records);
+            if (res.records == 1) {
+                CHECK(memcmp(&ev->key, &tc->key, sizeof(tc->key)) == 0, "event key differs from the frame's 5-tuple");
+                CHECK(ev->packets == 1 && ev->bytes == tc->len, "event counts %llu/%llu, expected 1/%u",
+                      (unsigned long long)ev->packets, (unsigned long long)ev->bytes, tc->len);
+                CHECK(ev->reason == FLOW_END_FIN, "end reason %u, expected FIN", ev->reason);
+            }
+        } else if (tc->tracked) {
+            CHECK(found, "no flow entry for the frame's 5-tuple");
+            CHECK(!found || (total.packets == 1 && total.bytes == tc->len), "flow counts %llu/%llu, expected 1/%u",
+                  (unsigned long long)total.packets, (unsigned long long)total.bytes, tc->len);
+            CHECK(res.records == 0, "%d unexpected flow events", res.records);
+        } else {
+            CHECK(!found, "frame should not have created a flow entry");
+            CHECK(res.records == 0, "%d unexpected flow events", res.records);
+        }
+
+        report("xdp_flow", tc, bench(p.prog_fd, tc, p.rb));
+        bpf_map_delete_elem(map_fd, &tc->key);
+    }
+    close_bench(&p);
+}
+
+// Sums every counter of one row of an epoch's sketch over CPUs; each row adds up to the whole overflow
+static int read_sketch_row(int sketch_fd, __u32 epoch, __u32 row, struct sketch_cell* total) {
+    static struct sketch_cell cells[MAX_CPUS];
+    int ncpus = libbpf_num_possible_cpus();
+
+    memset(total, 0, sizeof(*total));
+    if (ncpus < 1 || ncpus > MAX_CPUS) return -1;
+    __u32 first = (epoch * SKETCH_DEPTH + row) * SKETCH_WIDTH;
+    for (__u32 i = first; i < first + SKETCH_WIDTH; i++) {
+        if (bpf_map_lookup_elem(sketch_fd, &i, cells)) return -1;
+        for (int cpu = 0; cpu < ncpus; cpu++) {
+            total->packets += cells[cpu].packets;
+            total->bytes += cells[cpu].bytes;
+        }
+    }
+    return 0;
+}
+
+/*
+    Overflow accounting. The flow table is cut down to one entry, which the first flow takes;
+    a second flow then goes into the sketch, and heavy_bytes is set so that it is promoted to
+    flow_topk by exactly its HEAVY_RUNS-th packet. After that it is counted in flow_topk alone,
+    until flow_epoch is flipped and its packets go into the other, empty copy of both maps.
+    An LRU table never overflows (it evicts), so there is nothing to check there.
+*/
+static void test_sketch(struct test_case* cases, int ncases) {
+    struct test_case* tracked = find_case(cases, ncases, "tcp_syn");
+    struct test_case* tc = find_case(cases, ncases, "udp_dns");
+    if (!tracked || !tc) return;
+
+    struct flow_config config = {
+        .idle_timeout_ns   = 15 * 1000000000ULL,
+        .active_timeout_ns = 1800 * 1000000000ULL,
+        .sweep_interval_ns = 5 * 1000000000ULL,
+        .heavy_bytes       = HEAVY_RUNS * tc->len,
+    };
+    struct bench_opts opts = { .config = &config, .config_size = sizeof(config), .table = "flow_map", .table_size = 1 };
+    struct bench_prog p;
+    if (open_bench(&p, FLOW_OBJ, &opts) < 0) return;
+    struct bpf_map* flow_map = bpf_object__find_map_by_name(p.obj, "flow_map");
+    if (bpf_map__type(flow_map) == BPF_MAP_TYPE_LRU_HASH || bpf_map__type(flow_map) == BPF_MAP_TYPE_LRU_PERCPU_HASH) {
+        printf("%-10s %-18s skipped (an LRU flow table never overflows)\n", "xdp_flow", "sketch");
+        close_bench(&p);
+        return;
+    }
+    int stats_fd = bpf_object__find_map_fd_by_name(p.obj, "flow_stats");
+    int sketch_fd = bpf_object__find_map_fd_by_name(p.obj, "flow_sketch");
+    int topk_fd = bpf_object__find_map_fd_by_name(p.obj, "flow_topk");
+    int epoch_fd = bpf_object__find_map_fd_by_name(p.obj, "flow_epoch");
+
+    // The sketch is per-CPU, and promotion only looks at this CPU's counters
+    cpu_set_t saved;
+    if (pin_cpu(&saved) < 0) {
+        failures++;
+        close_bench(&p);
+        return;
+    }
+
+    __u32 retval, duration;
+    struct topk_key heavy_key = { .flow = tc->key, .epoch = 0 };
+    struct topk_value heavy = {0};
+    if (run_once(p.prog_fd, tracked, "xdp_flow") < 0) goto out;
+
+    // One packet short of heavy: all of it in the sketch, nothing promoted yet
+    int err = run_prog(p.prog_fd, tc, HEAVY_RUNS - 1, &retval, &duration);
+    CHECK(err == 0, "sketch: test run failed: %s", strerror(-err));
+    CHECK(read_stat(stats_fd, FLOW_STAT_MAP_FULL) == HEAVY_RUNS - 1, "sketch: %llu packets found the table full, expected %d",
+          (unsigned long long)read_stat(stats_fd, FLOW_STAT_MAP_FULL), HEAVY_RUNS - 1);
+    CHECK(bpf_map_lookup_elem(topk_fd, &heavy_key, &heavy) != 0, "sketch: promoted before reaching %u bytes", (unsigned)config.heavy_bytes);
+
+    // The packet that reaches heavy_bytes promotes the flow, and is itself still in the sketch
+    if (run_once(p.prog_fd, tc, "xdp_flow") < 0) goto out;
+    CHECK(read_stat(stats_fd, FLOW_STAT_PROMOTED) == 1, "sketch: %llu flows promoted, expected 1",
+          (unsigned long long)read_stat(stats_fd, FLOW_STAT_PROMOTED));
+    CHECK(bpf_map_lookup_elem(topk_fd, &heavy_key, &heavy) == 0 && heavy.packets == 0, "sketch: flow not in flow_topk, or counted there early");
+
+    // From now on it is counted exactly
+    if (run_once(p.prog_fd, tc, "xdp_flow") < 0) goto out;
+    CHECK(read_stat(stats_fd, FLOW_STAT_HEAVY) == 1, "sketch: %llu packets counted as heavy, expected 1",
+          (unsigned long long)read_stat(stats_fd, FLOW_STAT_HEAVY));
+    CHECK(bpf_map_lookup_elem(topk_fd, &heavy_key, &heavy) == 0 && heavy.packets == 1 && heavy.bytes == tc->len,
+          "sketch: flow_topk counts %llu/%llu, expected 1/%u", (unsigned long long)heavy.packets, (unsigned long long)heavy.bytes, tc->len);
+
+    for (__u32 row = 0; row < SKETCH_DEPTH; row++) {
+        struct sketch_cell total;
+        CHECK(read_sketch_row(sketch_fd, 0, row, &total) == 0 && total.packets == HEAVY_RUNS && total.bytes == config.heavy_bytes,
+              "sketch: row %u sums to %llu/%llu, expected %d/%llu", row, (unsigned long long)total.packets,
+              (unsigned long long)total.bytes, HEAVY_RUNS, (unsigned long long)config.heavy_bytes);
+    }
+    CHECK(read_stat(stats_fd, FLOW_STAT_SEEN) == HEAVY_RUNS + 2 && read_stat(stats_fd, FLOW_STAT_COUNTED) == 1,
+          "sketch: %llu packets seen and %llu counted in the table, expected %d and 1",
+          (unsigned long long)read_stat(stats_fd, FLOW_STAT_SEEN), (unsigned long long)read_stat(stats_fd, FLOW_STAT_COUNTED), HEAVY_RUNS + 2);
+
+    // What a flood the table cannot hold costs per packet
+    report("flow_topk", tc, bench(p.prog_fd, tc, NULL));
+
+    // After a flip the flow is not heavy in the new epoch: its next packet goes into the other sketch
+    __u32 zero = 0, one = 1;
+    CHECK(bpf_map_update_elem(epoch_fd, &zero, &one, BPF_ANY) == 0, "sketch: cannot flip flow_epoch: %s", strerror(errno));
+    if (run_once(p.prog_fd, tc, "xdp_flow") < 0) goto out;
+    for (__u32 row = 0; row < SKETCH_DEPTH; row++) {
+        struct sketch_cell before, after;
+        CHECK(read_sketch_row(sketch_fd, 0, row, &before) == 0 && before.packets == HEAVY_RUNS &&
+              read_sketch_row(sketch_fd, 1, row, &after) == 0 && after.packets == 1 && after.bytes == tc->len,
+              "sketch: after the flip row %u sums to %llu packets in epoch 0 and %llu/%llu in epoch 1, expected %d and 1/%u", row,
+              (unsigned long long)before.packets, (unsigned long long)after.packets, (unsigned long long)after.bytes, HEAVY_RUNS, tc->len);
+    }
+
+out:
+    sched_setaffinity(0, sizeof(saved), &saved);
+    close_bench(&p);
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr,
+        "Usage: %s [-n repeat] [-p pass|pcap|filter|flow]\n"
+        "    -n  test runs per frame for the timing (default %d)\n"
+        "    -p  only this program (default: all)\n", prog, DEFAULT_REPEAT);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char* argv[]) {
+    const char* only = NULL;
+    int c;
+
+    while ((c = getopt(argc, argv, "n:p:h")) != -1) {
+        switch (c) {
+            case 'n': repeat = atoi(optarg); break;
+            case 'p': only = optarg; break;
+            default: usage(argv[0]);
+        }
+    }
+    if (repeat < 1) usage(argv[0]);
+
+    int ncases;
+    struct test_case* cases = build_cases(&ncases);
+
+    if (!only || strcmp(only, "pass") == 0) test_pass(cases, ncases);
+    if (!only || strcmp(only, "pcap") == 0) {
+        test_pcap(cases, ncases);
+        test_shed(cases, ncases);
+        test_percpu(cases, ncases);
+        test_dedup(cases, ncases);
+        test_policy(cases, ncases);
+    }
+    if (!only || strcmp(only, "filter") == 0) test_filter(cases, ncases);
+    if (!only || strcmp(only, "flow") == 0) {
+        test_flow(cases, ncases);
+        test_sketch(cases, ncases);
+    }
+
+    if (failures) {
+        printf("%d check(s) failed\n", failures);
+        exit(EXIT_FAILURE);
+    }
+    printf("All checks passed\n");
+    exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,337 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <linux/bpf.h>
+#include <linux/filter.h>
+#include <bpf/bpf.h>
+
+#include "xdp_filter.h"
+
+/*
+    Register allocation. A lives in R0 so a helper's return value lands directly in it; X,
+    the context and the packet pointers live in callee-saved registers and survive helper
+    calls. R1-R5 are scratch within a single translated instruction.
+*/
+#define REG_A    BPF_REG_0
+#define REG_X    BPF_REG_9
+#define REG_CTX  BPF_REG_6
+#define REG_DATA BPF_REG_7
+#define REG_END  BPF_REG_8
+
+#define SCRATCH_OFF (-BPF_MEMWORDS * 4)  // M[0..15] occupy the top 64 bytes of the stack
+#define SAVE_A_OFF  (SCRATCH_OFF - 8)    // Spill slot for A across a helper call
+#define MAX_OFFSET  0xffff               // MAX_PACKET_OFF: the verifier tracks no packet range past it
+
+// Jump targets that are not classic instructions
+#define NO_TARGET     -1
+#define LABEL_REJECT  -2
+#define LABEL_ACCEPT  -3
+
+#define MAX_EXPANSION 16  // eBPF instructions emitted per classic instruction, at most
+#define EPILOGUE_SIZE 32
+
+struct jit {
+    struct bpf_insn* insns;
+    int*             targets;  // What each jump resolves to: a classic index, a label or NO_TARGET
+    int              count;
+};
+
+static void emit(struct jit* j, __u8 code, __u8 dst, __u8 src, __s16 off, __s32 imm) {
+    j->insns[j->count] = (struct bpf_insn){ .code = code, .dst_reg = dst, .src_reg = src, .off = off, .imm = imm };
+    j->targets[j->count] = NO_TARGET;
+    j->count++;
+}
+
+static void emit_jump(struct jit* j, __u8 code, __u8 dst, __u8 src, __s32 imm, int target) {
+    emit(j, code, dst, src, 0, imm);
+    j->targets[j->count - 1] = target;
+}
+
+/*
+    dst = size bytes at offset k (plus X when indirect), converted to host byte order. The
+    bounds checks are written the way the verifier tracks packet pointers; a load past the end
+    of the frame ends the program without a match, exactly like the classic interpreter.
+    The verifier keeps no range for an end pointer that could reach past MAX_OFFSET, so the
+    start (k, or X + k) is held to MAX_OFFSET - size rather than MAX_OFFSET.
+*/
+static void emit_load(struct jit* j, __u8 dst, __u32 size, __u32 k, int indirect) {
+    __u8 bpf_size = size == 4 ? BPF_W : size == 2 ? BPF_H : BPF_B;
+
+    if (indirect) {
+        emit(j, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, REG_X, 0, 0);
+        emit(j, BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, k);
+        emit_jump(j, BPF_JMP | BPF_JGT | BPF_K, BPF_REG_2, 0, MAX_OFFSET - size, LABEL_REJECT);
+        emit(j, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_3, REG_DATA, 0, 0);
+        emit(j, BPF_ALU64 | BPF_ADD | BPF_X, BPF_REG_3, BPF_REG_2, 0, 0);
+    } else {
+        emit(j, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_3, REG_DATA, 0, 0);
+        emit(j, BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_3, 0, 0, k);
+    }
+    emit(j, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_3, 0, 0);
+    emit(j, BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_4, 0, 0, size);
+    emit_jump(j, BPF_JMP | BPF_JGT | BPF_X, BPF_REG_4, REG_END, 0, LABEL_REJECT);
+    emit(j, BPF_LDX | BPF_MEM | bpf_size, dst, BPF_REG_3, 0, 0);
+    if (size > 1) emit(j, BPF_ALU | BPF_END | BPF_TO_BE, dst, 0, 0, size * 8);
+}
+
+// dst = length of the frame, including any fragments
+static void emit_len(struct jit* j, __u8 dst) {
+    if (dst == REG_X) emit(j, BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, REG_A, SAVE_A_OFF, 0);
+    emit(j, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, REG_CTX, 0, 0);
+    emit(j, BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_xdp_get_buff_len);
+    if (dst == REG_X) {
+        emit(j, BPF_ALU | BPF_MOV | BPF_X, REG_X, REG_A, 0, 0);
+        emit(j, BPF_LDX | BPF_MEM | BPF_W, REG_A, BPF_REG_10, SAVE_A_OFF, 0);
+    }
+}
+
+static int load_size(__u16 code) {
+    switch (BPF_SIZE(code)) {
+        case BPF_W: return 4;
+        case BPF_H: return 2;
+        case BPF_B: return 1;
+        default: return 0;
+    }
+}
+
+// Translates one classic instruction. Returns 0, or -1 if it is invalid or unsupported.
+static int translate(struct jit* j, const struct cbpf_insn* insn, int index, int count) {
+    __u16 code = insn->code;
+    __u32 k = insn->k;
+    int size;
+
+    switch (BPF_CLASS(code)) {
+        case BPF_LD:
+        case BPF_LDX: {
+            __u8 dst = BPF_CLASS(code) == BPF_LD ? REG_A : REG_X;
+            switch (BPF_MODE(code)) {
+                case BPF_IMM:
+                    emit(j, BPF_ALU | BPF_MOV | BPF_K, dst, 0, 0, k);
+                    return 0;
+                case BPF_MEM:
+                    if (k >= BPF_MEMWORDS) return -1;
+                    emit(j, BPF_LDX | BPF_MEM | BPF_W, dst, BPF_REG_10, SCRATCH_OFF + k * 4, 0);
+                    return 0;
+                case BPF_LEN:
+                    emit_len(j, dst);
+                    return 0;
+                case BPF_ABS:
+                case BPF_IND:
+                    // Negative offsets are Linux socket-filter extensions, which pcap only emits for live handles
+                    size = load_size(code);
+                    if (dst != REG_A || !size || k > MAX_OFFSET - size) return -1;
+                    emit_load(j, REG_A, size, k, BPF_MODE(code) == BPF_IND);
+                    return 0;
+                case BPF_MSH:
+                    // X = 4 * (P[k] & 0xf), the IPv4 header length idiom
+                    if (dst != REG_X || k > MAX_OFFSET - 1) return -1;
+                    emit_load(j, REG_X, 1, k, 0);
+                    emit(j, BPF_ALU | BPF_AND | BPF_K, REG_X, 0, 0, 0xf);
+                    emit(j, BPF_ALU | BPF_LSH | BPF_K, REG_X, 0, 0, 2);
+                    return 0;
+            }
+            return -1;
+        }
+
+        case BPF_ST:
+        case BPF_STX:
+            if (k >= BPF_MEMWORDS) return -1;
+            emit(j, BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_CLASS(code) == BPF_ST ? REG_A : REG_X, SCRATCH_OFF + k * 4, 0);
+            return 0;
+
+        case BPF_ALU:
+            switch (BPF_OP(code)) {
+                case BPF_NEG:
+                    emit(j, BPF_ALU | BPF_NEG, REG_A, 0, 0, 0);
+                    return 0;
+                case BPF_LSH:
+                case BPF_RSH:
+                    if (BPF_SRC(code) == BPF_K && k >= 32) return -1;
+                    break;
+                case BPF_DIV:
+                case BPF_MOD:
+                    if (BPF_SRC(code) == BPF_K && k == 0) return -1;
+                    // Classic BPF rejects the packet on division by zero; eBPF would yield 0
+                    if (BPF_SRC(code) == BPF_X)
+                        emit_jump(j, BPF_JMP32 | BPF_JEQ | BPF_K, REG_X, 0, 0, LABEL_REJECT);
+                    break;
+                case BPF_ADD: case BPF_SUB: case BPF_MUL:
+                case BPF_OR:  case BPF_AND: case BPF_XOR:
+                    break;
+                default:
+                    return -1;
+            }
+            if (BPF_SRC(code) == BPF_K) emit(j, BPF_ALU | BPF_OP(code) | BPF_K, REG_A, 0, 0, k);
+            else emit(j, BPF_ALU | BPF_OP(code) | BPF_X, REG_A, REG_X, 0, 0);
+            return 0;
+
+        case BPF_JMP:
+            if (BPF_OP(code) == BPF_JA) {
+                if (k >= (__u32)(count - index - 1)) return -1;
+                emit_jump(j, BPF_JMP | BPF_JA, 0, 0, 0, index + 1 + k);
+                return 0;
+            }
+            switch (BPF_OP(code)) {
+                case BPF_JEQ: case BPF_JGT: case BPF_JGE: case BPF_JSET: break;
+                default: return -1;
+            }
+            if (index + 1 + insn->jt >= count || index + 1 + insn->jf >= count) return -1;
+
+            // A is 32 bits wide, so compare in 32-bit mode to keep k unsigned
+            if (BPF_SRC(code) == BPF_K)
+                emit_jump(j, BPF_JMP32 | BPF_OP(code) | BPF_K, REG_A, 0, k, index + 1 + insn->jt);
+            else
+                emit_jump(j, BPF_JMP32 | BPF_OP(code) | BPF_X, REG_A, REG_X, 0, index + 1 + insn->jt);
+            if (insn->jf) emit_jump(j, BPF_JMP | BPF_JA, 0, 0, 0, index + 1 + insn->jf);
+            return 0;
+
+        case BPF_RET:
+            // The classic return value is a snap length; anything non-zero is a match
+            switch (BPF_RVAL(code)) {
+                case BPF_K:
+                    emit_jump(j, BPF_JMP | BPF_JA, 0, 0, 0, k ? LABEL_ACCEPT : LABEL_REJECT);
+                    return 0;
+                case BPF_A:
+                    emit_jump(j, BPF_JMP32 | BPF_JEQ | BPF_K, REG_A, 0, 0, LABEL_REJECT);
+                    emit_jump(j, BPF_JMP | BPF_JA, 0, 0, 0, LABEL_ACCEPT);
+                    return 0;
+            }
+            return -1;
+
+        case BPF_MISC:
+            switch (BPF_MISCOP(code)) {
+                case BPF_TAX:
+                    emit(j, BPF_ALU | BPF_MOV | BPF_X, REG_X, REG_A, 0, 0);
+                    return 0;
+                case BPF_TXA:
+                    emit(j, BPF_ALU | BPF_MOV | BPF_X, REG_A, REG_X, 0, 0);
+                    return 0;
+            }
+            return -1;
+    }
+    return -1;
+}
+
+/*
+    Emits the whole program: a prologue that sets up registers and zeroes the scratch memory,
+    the translated instructions, then the reject and accept blocks. The accept block
+    tail-calls the capture program through a one-slot program array; if that ever fails the
+    frame is simply passed.
+*/
+static int jit_program(struct jit* j, const struct cbpf_insn* insns, int count, int prog_array_fd) {
+    int* start = malloc(count * sizeof(*start));
+    if (!start) return -1;
+
+    emit(j, BPF_ALU64 | BPF_MOV | BPF_X, REG_CTX, BPF_REG_1, 0, 0);
+    emit(j, BPF_LDX | BPF_MEM | BPF_W, REG_DATA, REG_CTX, offsetof(struct xdp_md, data), 0);
+    emit(j, BPF_LDX | BPF_MEM | BPF_W, REG_END, REG_CTX, offsetof(struct xdp_md, data_end), 0);
+    emit(j, BPF_ALU | BPF_MOV | BPF_K, REG_A, 0, 0, 0);
+    emit(j, BPF_ALU | BPF_MOV | BPF_K, REG_X, 0, 0, 0);
+    emit(j, BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_1, 0, 0, 0);
+    for (int off = SCRATCH_OFF; off < 0; off += 8)
+        emit(j, BPF_STX | BPF_MEM | BPF_DW, BPF_REG_10, BPF_REG_1, off, 0);
+
+    // Never taken (data never lies past data_end), but the verifier rejects unreachable code
+    // and a filter that can only accept, or only reject, would otherwise leave one block dead
+    emit_jump(j, BPF_JMP | BPF_JGT | BPF_X, REG_DATA, REG_END, 0, LABEL_REJECT);
+    emit_jump(j, BPF_JMP | BPF_JLT | BPF_X, REG_END, REG_DATA, 0, LABEL_ACCEPT);
+
+    for (int i = 0; i < count; i++) {
+        start[i] = j->count;
+        if (translate(j, &insns[i], i, count) < 0) {
+            free(start);
+            errno = EOPNOTSUPP;
+            return -1;
+        }
+    }
+
+    // Falling off the end of a classic program is a reject
+    int reject = j->count;
+    emit(j, BPF_ALU | BPF_MOV | BPF_K, REG_A, 0, 0, XDP_PASS);
+    emit(j, BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+
+    int accept = j->count;
+    emit(j, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, REG_CTX, 0, 0);
+    emit(j, BPF_LD | BPF_DW | BPF_IMM, BPF_REG_2, BPF_PSEUDO_MAP_FD, 0, prog_array_fd);
+    emit(j, 0, 0, 0, 0, 0);
+    emit(j, BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_3, 0, 0, 0);
+    emit(j, BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_tail_call);
+    emit(j, BPF_ALU | BPF_MOV | BPF_K, REG_A, 0, 0, XDP_PASS);
+    emit(j, BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+
+    for (int i = 0; i < j->count; i++) {
+        if (j->targets[i] == NO_TARGET) continue;
+        int dest = j->targets[i] == LABEL_REJECT ? reject
+                 : j->targets[i] == LABEL_ACCEPT ? accept
+                 : start[j->targets[i]];
+        int off = dest - (i + 1);
+        if (off < -32768 || off > 32767) {
+            free(start);
+            errno = E2BIG;
+            return -1;
+        }
+        j->insns[i].off = off;
+    }
+    free(start);
+    return 0;
+}
+
+int xdp_filter_load(const struct cbpf_insn* insns, int count, int target_fd, int* jmp_fd, char* log, size_t log_size) {
+    if (log_size) log[0] = '\0';
+    if (count <= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    int prog_array_fd = bpf_map_create(BPF_MAP_TYPE_PROG_ARRAY, "capture_jmp", sizeof(__u32), sizeof(__u32), 1, NULL);
+    if (prog_array_fd < 0) return -1;
+    __u32 key = 0;
+    if (bpf_map_update_elem(prog_array_fd, &key, &target_fd, BPF_ANY)) {
+        int err = errno;
+        close(prog_array_fd);
+        errno = err;
+        return -1;
+    }
+
+    struct jit j = {
+        .insns = calloc((size_t)count * MAX_EXPANSION + EPILOGUE_SIZE, sizeof(struct bpf_insn)),
+        .targets = calloc((size_t)count * MAX_EXPANSION + EPILOGUE_SIZE, sizeof(int)),
+    };
+    int fd = -1;
+    if (!j.insns || !j.targets) {
+        errno = ENOMEM;
+    } else if (jit_program(&j, insns, count, prog_array_fd) == 0) {
+        // libbpf loads the capture program as BPF_XDP; newer kernels refuse a tail call between
+        // programs whose expected_attach_type differs, so the filter has to declare it too
+        LIBBPF_OPTS(bpf_prog_load_opts, opts, .expected_attach_type = BPF_XDP);
+        fd = bpf_prog_load(BPF_PROG_TYPE_XDP, "orion_filter", "GPL", j.insns, j.count, &opts);
+
+        // Only ask for the verifier log on failure; a log that outgrows the buffer fails the load
+        if (fd < 0 && log_size) {
+            int err = errno;
+            opts.log_buf = log;
+            opts.log_size = log_size;
+            opts.log_level = 1;
+            bpf_prog_load(BPF_PROG_TYPE_XDP, "orion_filter", "GPL", j.insns, j.count, &opts);
+            errno = err;
+        }
+    }
+
+    int err = errno;
+    free(j.insns);
+    free(j.targets);
+    if (fd < 0) close(prog_array_fd);
+    else *jmp_fd = prog_array_fd;
+    errno = err;
+    return fd;
+}
+
+/*
+    - The translated program is roughly what the kernel does for classic socket filters, minus
+      the ancillary loads (SKF_AD_*). pcap_compile only generates those for a live Linux
+      handle, never for the dead handle filter_compile.c uses.
+
+    - NICs that strip VLAN tags before XDP runs hand the program untagged frames, so "vlan"
+      expressions only match where offload is off (ethtool -K dev rxvlan off).
+*/
@@ -0,0 +1,38 @@
+#ifndef XDP_FILTER_H
+#define XDP_FILTER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+    In-kernel evaluation of tcpdump-style capture filters for the XDP path. The expression is
+    compiled by libpcap into classic BPF, exactly as legacy.c does, and the classic program is
+    then translated into an eBPF XDP program. That program is attached to the interface in
+    place of the capture program: frames that match are handed to the capture program with a
+    tail call, everything else returns XDP_PASS without touching the ring buffer.
+
+    The two halves live in separate files because libpcap's struct bpf_insn (classic) and the
+    kernel's struct bpf_insn (eBPF) cannot be declared in the same translation unit.
+*/
+
+// One classic BPF instruction, laid out like libpcap's struct bpf_insn and struct sock_filter
+struct cbpf_insn {
+    uint16_t code;
+    uint8_t  jt;
+    uint8_t  jf;
+    uint32_t k;
+};
+
+// Compiles expr for Ethernet frames (filter_compile.c). Returns the number of instructions
+// and a malloc'd program in *insns, or -1 with a message in errbuf.
+int filter_compile(const char* expr, struct cbpf_insn** insns, char* errbuf, size_t errlen);
+
+/*
+    Translates a classic program into an XDP program that tail-calls target_fd on a match and
+    loads it (xdp_filter.c). Returns the program fd, or -1 with errno set; the verifier log, if
+    any, is left in log. *jmp_fd receives the program array holding target_fd: the kernel
+    empties a program array once its last fd is closed, so keep it open while attached.
+*/
+int xdp_filter_load(const struct cbpf_insn* insns, int count, int target_fd, int* jmp_fd, char* log, size_t log_size);
+
+#endif
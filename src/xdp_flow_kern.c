@@ -4,6 +4,7 @@
 #include <linux/in.h>
 #include <linux/tcp.h>
 #include <linux/udp.h>
+#include <linux/errno.h>
 #include <bpf/bpf_helpers.h>
 
 // Macros needed for flow map configuration and bounds checking on received packet
@@ -14,6 +15,30 @@
 #define TCP_HEADER_MAX_SIZE  60
 #define UDP_PACKET_MIN_SIZE  8
 #define UDP_PACKET_MAX_SIZE  65507
+#define FLOW_EVENTS_SIZE     (1 << 20)  // Bytes of ring buffer for completed flow records
+#define MAX_CPUS             256        // Upper bound when summing a flow's per-CPU copies
+#define SKETCH_DEPTH         4          // Count-min rows (independent hashes)
+#define SKETCH_WIDTH         2048       // Counters per row, a power of 2
+#define TOPK_MAX_ENTRIES     1024       // Heavy hitters counted exactly once the table is full
+#define NSEC_PER_SEC         1000000000ULL
+#define CLOCK_MONOTONIC      1
+
+// TCP flag bits as they appear in byte 13 of the TCP header
+#define TCP_FLAG_FIN_BIT     0x01
+#define TCP_FLAG_SYN_BIT     0x02
+#define TCP_FLAG_RST_BIT     0x04
+
+/*
+    The flow table is per-CPU by default: every CPU gets its own copy of each flow's value, so
+    the hot path is plain increments with no atomics and no cache lines bouncing between RX
+    queues. Build with -DFLOW_MAP_TYPE=BPF_MAP_TYPE_HASH to get the old shared table (which
+    falls back to atomic adds), or BPF_MAP_TYPE_LRU_PERCPU_HASH to evict old flows when full.
+    xdp_flow_user.c checks the map type at runtime and sums per-CPU values as needed.
+*/
+#ifndef FLOW_MAP_TYPE
+#define FLOW_MAP_TYPE BPF_MAP_TYPE_PERCPU_HASH
+#endif
+#define FLOW_MAP_PERCPU (FLOW_MAP_TYPE == BPF_MAP_TYPE_PERCPU_HASH || FLOW_MAP_TYPE == BPF_MAP_TYPE_LRU_PERCPU_HASH)
 
 /*
     Represents the key for every key-value pair in our hash map. For each packet
@@ -24,6 +49,10 @@
     received packet.
 
     Please note that all flow_key fields are stored in Network Byte Order.
+
+    The hash covers every byte of the key, padding included, so the padding is spelled out
+    and the key is always zeroed before it is filled in. Otherwise stack garbage in the
+    trailing bytes would split one flow across several entries.
 */
 struct flow_key {
     __u32 src_ip;
@@ -31,17 +60,73 @@ struct flow_key {
     __u16 src_port;
     __u16 dst_port;
     __u8  proto;
+    __u8  pad[3];
 };
 
 /*
     Represents the value for every key-value pair in our hash map. Many more features besides
     just packet count and byte count can be added. This is just a preliminary result.
 
-    Please note that both fields are stored in Host Byte Order.
+    Please note that both fields are stored in Host Byte Order. In the per-CPU table each
+    CPU only ever sees its own copy; the totals are the sum over all CPUs.
+
+    first_seen and last_seen are bpf_ktime_get_ns() values (monotonic, not wall-clock), and
+    tcp_flags is the OR of every TCP flag byte seen on the flow.
 */
 struct flow_value {
     __u64 packets;
     __u64 bytes;
+    __u64 first_seen;
+    __u64 last_seen;
+    __u8  tcp_flags;
+    __u8  pad[7];
+};
+
+/*
+    Why a flow left the table. Every flow that is removed is first pushed to flow_events
+    with one of these reasons, so user-space never has to scan the table to find them.
+*/
+enum flow_end_reason {
+    FLOW_END_IDLE    = 1,  // No packets for idle_timeout
+    FLOW_END_ACTIVE  = 2,  // Open longer than active_timeout; the next packet starts a new record
+    FLOW_END_FIN     = 3,  // TCP FIN seen
+    FLOW_END_RST     = 4,  // TCP RST seen
+    FLOW_END_EVICTED = 5,  // Removed early because the table was full
+};
+
+/*
+    A completed flow as pushed to user-space. Counters are already summed over all CPUs,
+    first_seen is the earliest and last_seen the latest of the per-CPU copies.
+*/
+struct flow_event {
+    struct flow_key key;
+    __u64 packets;
+    __u64 bytes;
+    __u64 first_seen;
+    __u64 last_seen;
+    __u8  tcp_flags;
+    __u8  reason;
+    __u8  pad[6];
+};
+
+/*
+    Load-time configuration (.rodata). When xdp_flow_user.c loads the program itself (-i) it
+    overrides the fields it was given options for (-I, -A, -T) and keeps these defaults for
+    the rest; a program loaded some other way runs on the defaults. The tool takes the start
+    of .rodata to be a struct flow_config, so no other read-only global may be added here.
+*/
+struct flow_config {
+    __u64 idle_timeout_ns;
+    __u64 active_timeout_ns;
+    __u64 sweep_interval_ns;
+    __u64 heavy_bytes;  // Sketch estimate at which an untracked flow moves to flow_topk
+};
+
+const volatile struct flow_config config = {
+    .idle_timeout_ns   = 15 * NSEC_PER_SEC,
+    .active_timeout_ns = 1800 * NSEC_PER_SEC,
+    .sweep_interval_ns = 5 * NSEC_PER_SEC,
+    .heavy_bytes       = 1 << 20,
 };
 
 /* 
@@ -50,7 +135,7 @@ struct flow_value {
     run "sudo watch -n1 cat /sys/fs/bpf/flow_map" in a terminal and watch the entries change.
 */
 struct {
-    __uint(type, BPF_MAP_TYPE_HASH);
+    __uint(type, FLOW_MAP_TYPE);
     __uint(max_entries, FLOW_MAP_MAX_ENTRIES);
     __type(key, struct flow_key);
     __type(value, struct flow_value);
@@ -59,23 +144,294 @@ struct {
     __uint(pinning, LIBBPF_PIN_BY_NAME);
 } flow_map SEC(".maps");
 
+/*
+    Completed and expired flows, pinned to /sys/fs/bpf/flow_events.
+*/
+struct {
+    __uint(type, BPF_MAP_TYPE_RINGBUF);
+    __uint(max_entries, FLOW_EVENTS_SIZE);
+    __uint(pinning, LIBBPF_PIN_BY_NAME);
+} flow_events SEC(".maps");
+
+/*
+    Where each packet ends up, one counter per outcome, pinned to /sys/fs/bpf/flow_stats.
+    Per-CPU like the flow table; user-space sums the CPUs.
+*/
+enum flow_stat {
+    FLOW_STAT_SEEN,          // Packets the program ran on
+    FLOW_STAT_PARSE_ERROR,   // Truncated or malformed Ethernet/IPv4/TCP/UDP header
+    FLOW_STAT_FILTERED,      // Not IPv4 TCP/UDP
+    FLOW_STAT_MAP_FULL,      // New flow not inserted because the table was full; counted by the sketch instead
+    FLOW_STAT_COUNTED,       // Added to a flow
+    FLOW_STAT_EXPORTED,      // Flows pushed to flow_events (from the packet path or the sweep)
+    FLOW_STAT_RINGBUF_FULL,  // Export postponed because flow_events was full
+    FLOW_STAT_HEAVY,         // Of MAP_FULL, counted exactly in flow_topk
+    FLOW_STAT_PROMOTED,      // Flows moved from the sketch to flow_topk
+    FLOW_STAT_MAX
+};
+
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, FLOW_STAT_MAX);
+    __type(key, __u32);
+    __type(value, __u64);
+    __uint(pinning, LIBBPF_PIN_BY_NAME);
+} flow_stats SEC(".maps");
+
+static __always_inline void count(__u32 stat) {
+    __u64* value = bpf_map_lookup_elem(&flow_stats, &stat);
+    if (value) *value += 1;
+}
+
+/*
+    What the table cannot hold is not lost. A packet whose flow could not be inserted goes
+    into flow_sketch, a per-CPU count-min sketch of packets and bytes over the 5-tuple:
+    SKETCH_DEPTH rows of SKETCH_WIDTH counters, one counter per row picked by its own hash.
+    Every row sums to the whole overflow, and the smallest of a flow's counters is an upper
+    bound on its traffic, off by at most e / SKETCH_WIDTH of the overflow bytes for all but
+    a 1 - e^-SKETCH_DEPTH share of flows. Memory is fixed however many flows there are.
+
+    Once a flow's estimate on this CPU reaches config.heavy_bytes it is promoted into
+    flow_topk, where it is counted exactly from then on and no longer adds to the sketch.
+    Promotion stops while flow_topk is full. The sweep evicts heavy hitters of the current
+    epoch that have been idle for the idle timeout, so slots come back when a flood moves on.
+
+    The counters only grow, so the sketch is only useful over a bounded window: once its
+    cells reach heavy_bytes every new flow would look heavy. Both maps therefore hold two
+    copies, and flow_epoch says which one packets go into. For every heavy hitter report
+    xdp_flow_user flips the epoch, waits out packets that read the old one, then drains and
+    zeroes the copy nothing writes to any more, summing the sketch over CPUs (it is linear)
+    to report each heavy hitter as its exact count plus the sketch's estimate of what came
+    before its promotion. It also clears both maps when it loads the program (they are
+    pinned, so they outlive it).
+
+    The sketch hash must match sketch_hash() in xdp_flow_user.c.
+*/
+struct sketch_cell {
+    __u64 packets;
+    __u64 bytes;
+};
+
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, 2 * SKETCH_DEPTH * SKETCH_WIDTH);  // Epoch-major, then row-major
+    __type(key, __u32);
+    __type(value, struct sketch_cell);
+    __uint(pinning, LIBBPF_PIN_BY_NAME);
+} flow_sketch SEC(".maps");
+
+// A heavy hitter's key: the flow, and which of the two copies it was promoted into
+struct topk_key {
+    struct flow_key flow;
+    __u32 epoch;
+};
+
+struct topk_value {
+    __u64 packets;  // Since promotion
+    __u64 bytes;
+    __u64 promoted; // bpf_ktime_get_ns() at promotion
+    __u64 last_seen;
+};
+
+struct {
+    __uint(type, BPF_MAP_TYPE_HASH);
+    __uint(max_entries, TOPK_MAX_ENTRIES);
+    __type(key, struct topk_key);
+    __type(value, struct topk_value);
+    __uint(pinning, LIBBPF_PIN_BY_NAME);
+} flow_topk SEC(".maps");
+
+// The copy of flow_sketch and flow_topk that packets are counted in (0 or 1); set by xdp_flow_user
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, 1);
+    __type(key, __u32);
+    __type(value, __u32);
+    __uint(pinning, LIBBPF_PIN_BY_NAME);
+} flow_epoch SEC(".maps");
+
+// Row i uses h1 + i * h2 (double hashing); h2 is odd so the rows never coincide
+static __always_inline __u64 sketch_hash(const struct flow_key* key) {
+    __u64 h = ((__u64)key->src_ip << 32 | key->dst_ip) * 0x9e3779b97f4a7c15ULL;
+    h ^= ((__u64)key->src_port << 24 | (__u64)key->dst_port << 8 | key->proto) * 0xc2b2ae3d27d4eb4fULL;
+    h ^= h >> 29;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    return h ^ (h >> 32);
+}
+
+// Accounts for a packet whose flow is not in flow_map because the table is full
+static __always_inline void count_untracked(struct flow_key* key, __u64 bytes, __u64 now) {
+    __u32 zero = 0;
+    __u32* epoch = bpf_map_lookup_elem(&flow_epoch, &zero);
+    if (!epoch) return;
+    struct topk_key heavy_key = { .flow = *key, .epoch = *epoch & 1 };
+    struct topk_value* heavy = bpf_map_lookup_elem(&flow_topk, &heavy_key);
+    if (heavy) {
+        __sync_fetch_and_add(&heavy->packets, 1);
+        __sync_fetch_and_add(&heavy->bytes, bytes);
+        heavy->last_seen = now;
+        count(FLOW_STAT_HEAVY);
+        return;
+    }
+
+    __u64 h = sketch_hash(key);
+    __u32 h1 = h, h2 = (h >> 32) | 1;
+    __u64 estimate = ~0ULL;
+    for (__u32 row = 0; row < SKETCH_DEPTH; row++) {
+        __u32 index = (heavy_key.epoch * SKETCH_DEPTH + row) * SKETCH_WIDTH + ((h1 + row * h2) & (SKETCH_WIDTH - 1));
+        struct sketch_cell* cell = bpf_map_lookup_elem(&flow_sketch, &index);
+        if (!cell) return;
+        cell->packets += 1;
+        cell->bytes += bytes;
+        if (cell->bytes < estimate) estimate = cell->bytes;
+    }
+
+    if (estimate < config.heavy_bytes) return;
+    struct topk_value promoted = { .packets = 0, .bytes = 0, .promoted = now, .last_seen = now };
+    if (bpf_map_update_elem(&flow_topk, &heavy_key, &promoted, BPF_NOEXIST) == 0) count(FLOW_STAT_PROMOTED);
+}
+
+/*
+    Holds the timer that periodically sweeps flow_map for idle flows. The sweep runs from the
+    timer's softirq callback rather than on the packet path, so no packet ever pays for it.
+    pressure is set when an insert fails because the table is full; the next sweep then also
+    evicts flows that have only been idle for a quarter of the idle timeout.
+*/
+struct sweep_state {
+    struct bpf_timer timer;
+    __u32 armed;
+    __u32 pressure;
+};
+
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, 1);
+    __type(key, __u32);
+    __type(value, struct sweep_state);
+} sweep_map SEC(".maps");
+
+struct sweep_ctx {
+    __u64 now;
+    __u64 idle_ns;
+    __u32 epoch;  // flow_epoch; the other copy of flow_topk is xdp_flow_user's to drain
+};
+
+/*
+    Fills in ev with the flow's totals. For the per-CPU table this reads every CPU's copy;
+    bpf_map_lookup_percpu_elem() returns NULL past the last possible CPU, which ends the loop.
+*/
+static __always_inline void collect_flow(struct flow_key* key, struct flow_value* value, struct flow_event* ev) {
+    ev->key = *key;
+    ev->packets = 0;
+    ev->bytes = 0;
+    ev->first_seen = 0;
+    ev->last_seen = 0;
+    ev->tcp_flags = 0;
+
+    for (__u32 cpu = 0; cpu < MAX_CPUS; cpu++) {
+        struct flow_value* v = value;
+        if (FLOW_MAP_PERCPU) {
+            v = bpf_map_lookup_percpu_elem(&flow_map, key, cpu);
+            if (!v) break;
+            if (v->packets == 0) continue;
+        }
+        ev->packets += v->packets;
+        ev->bytes += v->bytes;
+        ev->tcp_flags |= v->tcp_flags;
+        if (ev->first_seen == 0 || v->first_seen < ev->first_seen) ev->first_seen = v->first_seen;
+        if (v->last_seen > ev->last_seen) ev->last_seen = v->last_seen;
+        if (!FLOW_MAP_PERCPU) break;
+    }
+}
+
+// Pushes the flow to user-space and removes it. If the ring is full the flow is kept so a
+// later sweep can try again, rather than losing its counters.
+static __always_inline int export_flow(struct flow_key* key, struct flow_value* value, __u8 reason) {
+    struct flow_event* ev = bpf_ringbuf_reserve(&flow_events, sizeof(struct flow_event), 0);
+    if (!ev) {
+        count(FLOW_STAT_RINGBUF_FULL);
+        return -1;
+    }
+
+    collect_flow(key, value, ev);
+    ev->reason = reason;
+    bpf_ringbuf_submit(ev, 0);
+    count(FLOW_STAT_EXPORTED);
+    bpf_map_delete_elem(&flow_map, key);
+    return 0;
+}
+
+// bpf_for_each_map_elem() callback: expires one flow if every CPU's copy is idle
+static long sweep_flow(void* map, struct flow_key* key, struct flow_value* value, struct sweep_ctx* ctx) {
+    struct flow_event ev;
+    collect_flow(key, value, &ev);
+    if (ev.last_seen + ctx->idle_ns <= ctx->now)
+        export_flow(key, value, ctx->idle_ns < config.idle_timeout_ns ? FLOW_END_EVICTED : FLOW_END_IDLE);
+    return 0;
+}
+
+// bpf_for_each_map_elem() callback: frees the slot of a heavy hitter that has gone idle
+static long sweep_topk(void* map, struct topk_key* key, struct topk_value* value, struct sweep_ctx* ctx) {
+    if (key->epoch == ctx->epoch && value->last_seen + config.idle_timeout_ns <= ctx->now) bpf_map_delete_elem(&flow_topk, key);
+    return 0;
+}
+
+static int sweep_timer_cb(void* map, __u32* key, struct sweep_state* state) {
+    struct sweep_ctx ctx = {
+        .now     = bpf_ktime_get_ns(),
+        .idle_ns = state->pressure ? config.idle_timeout_ns / 4 : config.idle_timeout_ns,
+    };
+    state->pressure = 0;
+
+    __u32 zero = 0;
+    __u32* epoch = bpf_map_lookup_elem(&flow_epoch, &zero);
+    if (epoch) ctx.epoch = *epoch & 1;
+
+    bpf_for_each_map_elem(&flow_map, sweep_flow, &ctx, 0);
+    bpf_for_each_map_elem(&flow_topk, sweep_topk, &ctx, 0);
+    bpf_timer_start(&state->timer, config.sweep_interval_ns, 0);
+    return 0;
+}
+
+// Starts the sweep timer the first time any CPU sees a packet, or brings the next sweep
+// forward when the table is full. bpf_timer_init() fails harmlessly if we race another CPU.
+static __always_inline void kick_sweeper(int pressure) {
+    __u32 zero = 0;
+    struct sweep_state* state = bpf_map_lookup_elem(&sweep_map, &zero);
+    if (!state) return;
+
+    if (!state->armed) {
+        state->armed = 1;
+        if (bpf_timer_init(&state->timer, &sweep_map, CLOCK_MONOTONIC) == 0) {
+            bpf_timer_set_callback(&state->timer, sweep_timer_cb);
+            bpf_timer_start(&state->timer, config.sweep_interval_ns, 0);
+        }
+    }
+    if (pressure && !state->pressure) {
+        state->pressure = 1;
+        bpf_timer_start(&state->timer, 0, 0);
+    }
+}
+
 SEC("xdp")
 int xdp_prog(struct xdp_md* ctx) {
     // Pointers to start and end of packet
     void* data = (void*)(long)ctx->data;
     void* data_end = (void*)(long)ctx->data_end;
 
+    count(FLOW_STAT_SEEN);
+
     // Filter for IPv4 only
     struct ethhdr* eth = (struct ethhdr*)data;
-    if ((void*)(eth + 1) > data_end) return XDP_PASS;
-    if (eth->h_proto != __constant_htons(ETH_P_IP)) return XDP_PASS;
+    if ((void*)(eth + 1) > data_end) goto parse_error;
+    if (eth->h_proto != __constant_htons(ETH_P_IP)) goto filtered;
 
     // Filter for TCP and UDP only
     struct iphdr* ip = (struct iphdr*)(eth + 1);
-    if ((void*)(ip + 1) > data_end) return XDP_PASS;
+    if ((void*)(ip + 1) > data_end) goto parse_error;
     __u32 ip_header_length = ip->ihl * 4;
-    if (ip_header_length < IPV4_HEADER_MIN_SIZE || ip_header_length > IPV4_HEADER_MAX_SIZE || (void*)ip + ip_header_length > data_end) return XDP_PASS;
-    if (ip->protocol != IPPROTO_TCP && ip->protocol != IPPROTO_UDP) return XDP_PASS;
+    if (ip_header_length < IPV4_HEADER_MIN_SIZE || ip_header_length > IPV4_HEADER_MAX_SIZE || (void*)ip + ip_header_length > data_end) goto parse_error;
+    if (ip->protocol != IPPROTO_TCP && ip->protocol != IPPROTO_UDP) goto filtered;
 
     // Key values for this packet
     __u32 src_ip = ip->saddr;
@@ -83,52 +439,112 @@ int xdp_prog(struct xdp_md* ctx) {
     __u16 src_port;
     __u16 dst_port;
     __u8  proto = ip->protocol;
+    __u8  tcp_flags = 0;
 
     // TCP parsing for ports
     if (ip->protocol == IPPROTO_TCP) {
         struct tcphdr* tcp = (struct tcphdr*)((void*)ip + ip_header_length);
-        if ((void*)(tcp + 1) > data_end) return XDP_PASS;
+        if ((void*)(tcp + 1) > data_end) goto parse_error;
         __u32 tcp_header_length = tcp->doff * 4;
-        if (tcp_header_length < TCP_HEADER_MIN_SIZE || tcp_header_length > TCP_HEADER_MAX_SIZE || (void*)tcp + tcp_header_length > data_end) return XDP_PASS;
+        if (tcp_header_length < TCP_HEADER_MIN_SIZE || tcp_header_length > TCP_HEADER_MAX_SIZE || (void*)tcp + tcp_header_length > data_end) goto parse_error;
         src_port = tcp->source;
         dst_port = tcp->dest;
+        tcp_flags = ((__u8*)tcp)[13];
     }
 
     // UDP parsing for ports
     else {
         struct udphdr* udp = (struct udphdr*)((void*)ip + ip_header_length);
-        if ((void*)(udp + 1) > data_end) return XDP_PASS;
+        if ((void*)(udp + 1) > data_end) goto parse_error;
         __u32 udp_packet_length = __constant_ntohs(udp->len);
-        if (udp_packet_length < UDP_PACKET_MIN_SIZE || udp_packet_length > UDP_PACKET_MAX_SIZE || (void*)udp + udp_packet_length > data_end) return XDP_PASS;
+        if (udp_packet_length < UDP_PACKET_MIN_SIZE || udp_packet_length > UDP_PACKET_MAX_SIZE || (void*)udp + udp_packet_length > data_end) goto parse_error;
         src_port = udp->source;
         dst_port = udp->dest;
     }
 
-    // Create key instance
-    struct flow_key key = {
-        .src_ip   = src_ip,
-        .dst_ip   = dst_ip,
-        .src_port = src_port,
-        .dst_port = dst_port,
-        .proto    = proto
-    };
+    // Create key instance (zeroed first so the padding bytes are deterministic)
+    struct flow_key key;
+    __builtin_memset(&key, 0, sizeof(key));
+    key.src_ip   = src_ip;
+    key.dst_ip   = dst_ip;
+    key.src_port = src_port;
+    key.dst_port = dst_port;
+    key.proto    = proto;
 
     // Amount of bytes in the current packet (from start to finish; Ethernet frame and all other headers are included)
     __u64 bytes = data_end - data;
 
+    __u64 now = bpf_ktime_get_ns();
+    kick_sweeper(0);
+
     // If the key already exists in the map, update its value. Otherwise create an entry for it
     struct flow_value* value = bpf_map_lookup_elem(&flow_map, &key);
     if (!value) {
         struct flow_value new_value = {
-            .packets = 1,
-            .bytes = bytes
+            .packets    = 1,
+            .bytes      = bytes,
+            .first_seen = now,
+            .last_seen  = now,
+            .tcp_flags  = tcp_flags
         };
-        bpf_map_update_elem(&flow_map, &key, &new_value, BPF_NOEXIST);
+        long err = bpf_map_update_elem(&flow_map, &key, &new_value, BPF_NOEXIST);
+        if (err == 0) {
+            count(FLOW_STAT_COUNTED);
+            goto check_end;
+        }
+
+        // The table is full: have the sweeper make room now instead of in a few seconds, and
+        // keep this packet in the sketch meanwhile
+        if (err == -E2BIG) {
+            count(FLOW_STAT_MAP_FULL);
+            count_untracked(&key, bytes, now);
+            kick_sweeper(1);
+            return XDP_PASS;
+        }
+
+        // Another CPU created the entry between our lookup and insert. Count this packet
+        // against that entry instead of losing it.
+        value = bpf_map_lookup_elem(&flow_map, &key);
+        if (!value) return XDP_PASS;
+    }
+
+    count(FLOW_STAT_COUNTED);
+    if (FLOW_MAP_PERCPU) {
+        value->packets += 1;
+        value->bytes += bytes;
     } else {
         __sync_fetch_and_add(&value->packets, 1);
         __sync_fetch_and_add(&value->bytes, bytes);
     }
+    // A per-CPU copy may be new to this CPU even though the flow is not
+    if (value->first_seen == 0) value->first_seen = now;
+    value->last_seen = now;
+    value->tcp_flags |= tcp_flags;
 
+    // Long-lived flows are cut into active_timeout sized records, like NetFlow does
+    if (now - value->first_seen >= config.active_timeout_ns) {
+        export_flow(&key, value, FLOW_END_ACTIVE);
+        return XDP_PASS;
+    }
+
+check_end:
+    // FIN/RST completes the flow straight away
+    if (!(tcp_flags & (TCP_FLAG_FIN_BIT | TCP_FLAG_RST_BIT))) return XDP_PASS;
+    if (!value) value = bpf_map_lookup_elem(&flow_map, &key);
+    if (!value) return XDP_PASS;
+
+    if (tcp_flags & TCP_FLAG_RST_BIT)
+        export_flow(&key, value, FLOW_END_RST);
+    else if (tcp_flags & TCP_FLAG_FIN_BIT)
+        export_flow(&key, value, FLOW_END_FIN);
+
+    return XDP_PASS;
+
+parse_error:
+    count(FLOW_STAT_PARSE_ERROR);
+    return XDP_PASS;
+filtered:
+    count(FLOW_STAT_FILTERED);
     return XDP_PASS;
 }
 
@@ -145,10 +561,18 @@ int xdp_prog(struct xdp_md* ctx) {
       length field.
 
     - Is it necessary to use __u32 for packet and header lengths?
-    - Are there any restrictions / possible accompanying race conditions
-      with using __sync_fetch_and_add ?
+    - __sync_fetch_and_add is only used with the shared (non per-CPU) table. With the
+      per-CPU table a BPF_NOEXIST insert only initialises this CPU's copy; every other
+      CPU's copy starts at zero.
     - Would it make more sense to drop all packets since the sole purpose of this
       program is to write stuff to disk?
+    - Exporting a per-CPU flow reads every CPU's copy and then deletes the entry. A packet
+      counted on another CPU between those two steps is lost; RSS keeps a 5-tuple on one
+      queue, so in practice only one CPU has a copy.
+    - With an LRU map type the kernel evicts flows on its own when the table is full, and
+      those evictions are not exported.
+    - Only one direction of a TCP connection sees each FIN, so the other direction usually
+      ends on its own FIN/RST or through the idle timeout.
 */
 
 char _license[] SEC("license") = "GPL";
\ No newline at end of file
@@ -2,9 +2,19 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include <net/if.h>
+#include <linux/if_link.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+
+#include "metrics.h"
+#include "ipfix.h"
 
 /*
     Defines the path where the flow map already exists, and the
@@ -12,7 +22,23 @@
     a csv representation of said map.
 */
 #define MAP_PATH "/sys/fs/bpf/flow_map"
+#define EVENTS_PATH "/sys/fs/bpf/flow_events"
+#define STATS_PATH "/sys/fs/bpf/flow_stats"
+#define SKETCH_PATH "/sys/fs/bpf/flow_sketch"
+#define TOPK_PATH "/sys/fs/bpf/flow_topk"
+#define EPOCH_PATH "/sys/fs/bpf/flow_epoch"
+#define OBJ_PATH "bin/xdp_flow_kern.o"
 #define OUTPUT_FILE "flow_stats.csv"
+#define NSEC_PER_SEC 1000000000ULL
+#define BATCH_SIZE 4096             // Flows fetched per bpf_map_lookup_batch() call
+#define OUTPUT_BUF_SIZE (1 << 20)   // stdio buffer for the output file
+#define EXPORT_MAGIC 0x574f4c46     // "FLOW" in a little-endian dump
+#define IPFIX_TEMPLATE_EVENT    256 // Completed flows (-e)
+#define IPFIX_TEMPLATE_INTERVAL 257 // Per-interval deltas
+#define SKETCH_DEPTH 4              // Count-min sketch shape, as defined in kernel-level program
+#define SKETCH_WIDTH 2048
+#define HEAVY_REPORT_INTERVAL 60    // Seconds between heavy hitter reports with -e -k
+#define EPOCH_SETTLE_MS 10          // Wait after flipping flow_epoch for packets that read the old one
 
 // Key struct as defined in kernel-level program
 struct flow_key {
@@ -21,14 +47,276 @@ struct flow_key {
     __u16 src_port;
     __u16 dst_port;
     __u8  proto;
+    __u8  pad[3];
 };
 
 // Value struct as defined in kernel-level program
 struct flow_value {
     __u64 packets;
     __u64 bytes;
+    __u64 first_seen;
+    __u64 last_seen;
+    __u8  tcp_flags;
+    __u8  pad[7];
+};
+
+// Completed flow record as defined in kernel-level program
+struct flow_event {
+    struct flow_key key;
+    __u64 packets;
+    __u64 bytes;
+    __u64 first_seen;
+    __u64 last_seen;
+    __u8  tcp_flags;
+    __u8  reason;
+    __u8  pad[6];
+};
+
+// Load-time configuration as defined in kernel-level program (.rodata)
+struct flow_config {
+    __u64 idle_timeout_ns;
+    __u64 active_timeout_ns;
+    __u64 sweep_interval_ns;
+    __u64 heavy_bytes;
+};
+
+// Per-CPU outcome counters as defined in kernel-level program (flow_stats)
+enum flow_stat {
+    FLOW_STAT_SEEN,
+    FLOW_STAT_PARSE_ERROR,
+    FLOW_STAT_FILTERED,
+    FLOW_STAT_MAP_FULL,
+    FLOW_STAT_COUNTED,
+    FLOW_STAT_EXPORTED,
+    FLOW_STAT_RINGBUF_FULL,
+    FLOW_STAT_HEAVY,
+    FLOW_STAT_PROMOTED,
+    FLOW_STAT_MAX
+};
+
+static const char* flow_stat_names[FLOW_STAT_MAX] = {
+    "seen", "parse_error", "filtered", "map_full", "counted", "exported", "ringbuf_full", "heavy", "promoted"
+};
+
+// Count-min sketch counter and heavy hitter entry as defined in kernel-level program
+struct sketch_cell {
+    __u64 packets;
+    __u64 bytes;
 };
 
+struct topk_key {
+    struct flow_key flow;
+    __u32 epoch;
+};
+
+struct topk_value {
+    __u64 packets;
+    __u64 bytes;
+    __u64 promoted;
+    __u64 last_seen;
+};
+
+/*
+    The flow map is per-CPU unless the kernel program was built with a shared map type.
+    For per-CPU maps a lookup returns one value per possible CPU, each padded to 8 bytes,
+    and the flow's totals are their sum.
+*/
+static int percpu = 0;
+static int num_cpus = 1;
+static struct flow_value* percpu_values = NULL;
+
+static int detect_map_type(int map_fd) {
+    struct bpf_map_info info = {0};
+    __u32 info_len = sizeof(info);
+    if (bpf_obj_get_info_by_fd(map_fd, &info, &info_len)) return -1;
+
+    percpu = info.type == BPF_MAP_TYPE_PERCPU_HASH || info.type == BPF_MAP_TYPE_LRU_PERCPU_HASH;
+    if (!percpu) return 0;
+
+    num_cpus = libbpf_num_possible_cpus();
+    if (num_cpus <= 0) return -1;
+    percpu_values = calloc(num_cpus, sizeof(struct flow_value));
+    return percpu_values ? 0 : -1;
+}
+
+/*
+    Binary export format (-b). Every interval starts with a header giving the wall-clock time
+    of the snapshot and the number of records that follow. Records are the raw key as stored
+    in the map (network byte order) and the packet/byte deltas for the interval.
+*/
+struct export_header {
+    __u32 magic;
+    __u32 count;
+    __u64 timestamp_ns;
+};
+
+struct export_record {
+    struct flow_key key;
+    __u64 packets;
+    __u64 bytes;
+};
+
+/*
+    One snapshot of the map, with per-CPU values already summed. In daemon mode the previous
+    snapshot is kept in an open-addressing hash table so each flow's delta can be found in O(1).
+*/
+struct snapshot {
+    struct flow_key*   keys;
+    struct flow_value* values;
+    __u32              count;
+    __u32*             index;       // Slot -> position in keys/values plus 1, 0 when empty
+    __u32              index_mask;
+};
+
+static volatile sig_atomic_t stop = 0;
+static void handle_signal(int sig) {
+    stop = 1;
+}
+
+static int stats_fd = -1;
+
+// Set with -x: flows go to this collector instead of the output file
+static struct ipfix_exporter* ipfix = NULL;
+
+// Metrics collector for the kernel program's outcome counters
+static void collect_kernel_stats(FILE* out, void* arg) {
+    int ncpus = libbpf_num_possible_cpus();
+    if (ncpus <= 0) return;
+    __u64 values[ncpus];
+
+    metrics_family(out, "xdp_flow_kernel_events_total", "counter", "Packets seen by the XDP flow program by outcome, and flow exports");
+    for (__u32 key = 0; key < FLOW_STAT_MAX; key++) {
+        if (bpf_map_lookup_elem(stats_fd, &key, values)) continue;
+        unsigned long long total = 0;
+        for (int cpu = 0; cpu < ncpus; cpu++) total += values[cpu];
+        fprintf(out, "xdp_flow_kernel_events_total{outcome=\"%s\"} %llu\n", flow_stat_names[key], total);
+    }
+}
+
+static void collect_ipfix_stats(FILE* out, void* arg) {
+    struct ipfix_stats stats;
+    ipfix_get_stats(ipfix, &stats);
+    metrics_family(out, "xdp_flow_ipfix_messages_total", "counter", "IPFIX messages sent to the collector");
+    fprintf(out, "xdp_flow_ipfix_messages_total %llu\n", (unsigned long long)stats.messages);
+    metrics_family(out, "xdp_flow_ipfix_records_total", "counter", "Flow records in the IPFIX messages sent");
+    fprintf(out, "xdp_flow_ipfix_records_total %llu\n", (unsigned long long)stats.records);
+    metrics_family(out, "xdp_flow_ipfix_send_errors_total", "counter", "IPFIX messages the socket refused, and whose records were lost");
+    fprintf(out, "xdp_flow_ipfix_send_errors_total %llu\n", (unsigned long long)stats.send_errors);
+}
+
+// Looks up a flow and folds the per-CPU copies (if any) into a single value
+static int lookup_flow(int map_fd, const struct flow_key* key, struct flow_value* value) {
+    if (!percpu) return bpf_map_lookup_elem(map_fd, key, value);
+
+    if (bpf_map_lookup_elem(map_fd, key, percpu_values)) return -1;
+    value->packets = 0;
+    value->bytes = 0;
+    for (int cpu = 0; cpu < num_cpus; cpu++) {
+        value->packets += percpu_values[cpu].packets;
+        value->bytes += percpu_values[cpu].bytes;
+    }
+    return 0;
+}
+
+static __u32 hash_key(const struct flow_key* key) {
+    __u32 h = key->src_ip * 0x9e3779b1u;
+    h ^= key->dst_ip * 0x85ebca77u;
+    h ^= ((__u32)key->src_port << 16 | key->dst_port) * 0xc2b2ae3du;
+    h ^= key->proto;
+    return h ^ (h >> 15);
+}
+
+static int snapshot_init(struct snapshot* snap, __u32 max_entries) {
+    __u32 slots = 1;
+    while (slots < max_entries * 2) slots <<= 1;
+
+    snap->count = 0;
+    snap->index_mask = slots - 1;
+    snap->keys = calloc(max_entries, sizeof(struct flow_key));
+    snap->values = calloc(max_entries, sizeof(struct flow_value));
+    snap->index = calloc(slots, sizeof(__u32));
+    return snap->keys && snap->values && snap->index ? 0 : -1;
+}
+
+static void snapshot_index(struct snapshot* snap) {
+    memset(snap->index, 0, (snap->index_mask + 1) * sizeof(__u32));
+    for (__u32 i = 0; i < snap->count; i++) {
+        __u32 slot = hash_key(&snap->keys[i]) & snap->index_mask;
+        while (snap->index[slot]) slot = (slot + 1) & snap->index_mask;
+        snap->index[slot] = i + 1;
+    }
+}
+
+static const struct flow_value* snapshot_find(const struct snapshot* snap, const struct flow_key* key) {
+    __u32 slot = hash_key(key) & snap->index_mask;
+    while (snap->index[slot]) {
+        __u32 i = snap->index[slot] - 1;
+        if (memcmp(&snap->keys[i], key, sizeof(*key)) == 0) return &snap->values[i];
+        slot = (slot + 1) & snap->index_mask;
+    }
+    return NULL;
+}
+
+// Copies n values out of a batch buffer into the snapshot, summing per-CPU copies
+static void snapshot_add(struct snapshot* snap, const struct flow_key* keys, const struct flow_value* values, __u32 n) {
+    for (__u32 i = 0; i < n; i++) {
+        struct flow_value* out = &snap->values[snap->count];
+        const struct flow_value* in = &values[i * num_cpus];
+        out->packets = 0;
+        out->bytes = 0;
+        for (int cpu = 0; cpu < num_cpus; cpu++) {
+            out->packets += in[cpu].packets;
+            out->bytes += in[cpu].bytes;
+        }
+        snap->keys[snap->count++] = keys[i];
+    }
+}
+
+/*
+    Reads the whole map into snap with BATCH_SIZE flows per syscall. With delete set, flows
+    are removed as they are read (bpf_map_lookup_and_delete_batch), so the counters restart
+    from zero and the snapshot itself is the delta. Falls back to one get_next_key/lookup pair
+    per flow on kernels without batch support for this map type.
+*/
+static int take_snapshot(int map_fd, struct snapshot* snap, __u32 max_entries, int delete) {
+    static struct flow_key keys[BATCH_SIZE];
+    static struct flow_value* values = NULL;
+    LIBBPF_OPTS(bpf_map_batch_opts, opts);
+    struct flow_key batch;
+    void* in_batch = NULL;
+
+    if (!values && !(values = calloc((size_t)BATCH_SIZE * num_cpus, sizeof(struct flow_value)))) return -1;
+    snap->count = 0;
+
+    for (;;) {
+        __u32 n = BATCH_SIZE;
+        if (n > max_entries - snap->count) n = max_entries - snap->count;
+        int err = delete ? bpf_map_lookup_and_delete_batch(map_fd, in_batch, &batch, keys, values, &n, &opts)
+                         : bpf_map_lookup_batch(map_fd, in_batch, &batch, keys, values, &n, &opts);
+        if (err && errno != ENOENT) break;
+        snapshot_add(snap, keys, values, n);
+        if (err || snap->count >= max_entries) return 0;  // ENOENT: no more flows
+        in_batch = &batch;
+    }
+
+    if (errno != EINVAL && errno != ENOTSUP && errno != EOPNOTSUPP) return -1;
+
+    // No batch ops: walk the map key by key
+    struct flow_key key, next_key;
+    struct flow_value value;
+    snap->count = 0;
+    int err = bpf_map_get_next_key(map_fd, NULL, &next_key);
+    while (!err && snap->count < max_entries) {
+        key = next_key;
+        err = bpf_map_get_next_key(map_fd, &key, &next_key);
+        if (lookup_flow(map_fd, &key, &value)) continue;
+        if (delete) bpf_map_delete_elem(map_fd, &key);
+        snap->keys[snap->count] = key;
+        snap->values[snap->count++] = value;
+    }
+    return 0;
+}
+
 // Converts the protocol field in each packet to a string representation
 const char* proto_to_str(__u8 proto) {
     switch (proto) {
@@ -38,7 +326,587 @@ const char* proto_to_str(__u8 proto) {
     }
 }
 
-int main() {
+static void write_csv_header(FILE* out, int daemon) {
+    fprintf(out, "%sSource IP,Destination IP,Source Port,Destination Port,Protocol,Packets,Bytes\n",
+            daemon ? "Timestamp," : "");
+}
+
+static void write_csv_record(FILE* out, __u64 timestamp_ns, const struct flow_key* key, __u64 packets, __u64 bytes) {
+    char src_ip[INET_ADDRSTRLEN];
+    char dst_ip[INET_ADDRSTRLEN];
+
+    inet_ntop(AF_INET, &key->src_ip, src_ip, INET_ADDRSTRLEN);
+    inet_ntop(AF_INET, &key->dst_ip, dst_ip, INET_ADDRSTRLEN);
+
+    if (timestamp_ns)
+        fprintf(out, "%llu.%09llu,", timestamp_ns / 1000000000ULL, timestamp_ns % 1000000000ULL);
+    fprintf(out, "%s,%s,%u,%u,%s,%llu,%llu\n",
+            src_ip, dst_ip, ntohs(key->src_port), ntohs(key->dst_port),
+            proto_to_str(key->proto), packets, bytes);
+}
+
+/*
+    IPFIX export (-x). Keys are copied as they are, already in network byte order; completed
+    flows carry their own start and end, while interval deltas are stamped with the time of
+    the snapshot they came from.
+*/
+#define IPFIX_KEY_FIELDS \
+    { IPFIX_IE_SOURCE_IPV4_ADDRESS, 4 }, { IPFIX_IE_DEST_IPV4_ADDRESS, 4 }, \
+    { IPFIX_IE_SOURCE_TRANSPORT_PORT, 2 }, { IPFIX_IE_DEST_TRANSPORT_PORT, 2 }, \
+    { IPFIX_IE_PROTOCOL_IDENTIFIER, 1 }
+
+static const struct ipfix_field event_fields[] = {
+    IPFIX_KEY_FIELDS,
+    { IPFIX_IE_TCP_CONTROL_BITS, 1 },  // Reduced-size encoding: only the low 8 flags are tracked
+    { IPFIX_IE_FLOW_END_REASON, 1 },
+    { IPFIX_IE_PACKET_DELTA_COUNT, 8 },
+    { IPFIX_IE_OCTET_DELTA_COUNT, 8 },
+    { IPFIX_IE_FLOW_START_MS, 8 },
+    { IPFIX_IE_FLOW_END_MS, 8 },
+};
+
+static const struct ipfix_field interval_fields[] = {
+    IPFIX_KEY_FIELDS,
+    { IPFIX_IE_PACKET_DELTA_COUNT, 8 },
+    { IPFIX_IE_OCTET_DELTA_COUNT, 8 },
+    { IPFIX_IE_OBSERVATION_TIME_MS, 8 },
+};
+
+static int setup_ipfix(const char* collector, __u32 domain) {
+    ipfix = ipfix_open(collector, domain);
+    if (!ipfix) return -1;
+    if (ipfix_add_template(ipfix, IPFIX_TEMPLATE_EVENT, event_fields, sizeof(event_fields) / sizeof(event_fields[0])) ||
+        ipfix_add_template(ipfix, IPFIX_TEMPLATE_INTERVAL, interval_fields, sizeof(interval_fields) / sizeof(interval_fields[0]))) {
+        ipfix_close(ipfix);
+        ipfix = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+// The metrics thread reads the exporter's counters, so it has to let go of it first
+static void close_ipfix(void) {
+    if (!ipfix) return;
+    metrics_remove_collector(collect_ipfix_stats, NULL);
+    ipfix_close(ipfix);
+    ipfix = NULL;
+}
+
+static __u8* put_flow_key(__u8* p, const struct flow_key* key) {
+    memcpy(p, &key->src_ip, 4);
+    memcpy(p + 4, &key->dst_ip, 4);
+    memcpy(p + 8, &key->src_port, 2);
+    memcpy(p + 10, &key->dst_port, 2);
+    p[12] = key->proto;
+    return p + 13;
+}
+
+static void write_ipfix_interval(__u64 timestamp_ns, const struct flow_key* key, __u64 packets, __u64 bytes) {
+    __u8* p = put_flow_key(ipfix_record(ipfix, IPFIX_TEMPLATE_INTERVAL), key);
+    p = ipfix_put_u64(p, packets);
+    p = ipfix_put_u64(p, bytes);
+    ipfix_put_u64(p, timestamp_ns / 1000000);
+}
+
+// Computes flow i's delta against prev. A flow whose counters went backwards was deleted and
+// recreated, so its delta is its total. Returns 0 when the flow did not move.
+static int flow_delta(const struct snapshot* cur, const struct snapshot* prev, __u32 i, struct flow_value* delta) {
+    *delta = cur->values[i];
+    const struct flow_value* old = prev ? snapshot_find(prev, &cur->keys[i]) : NULL;
+    if (old && old->packets <= delta->packets) {
+        delta->packets -= old->packets;
+        delta->bytes -= old->bytes;
+    }
+    return delta->packets != 0;
+}
+
+/*
+    Writes every flow in cur whose counters moved since prev (or every flow when prev is NULL).
+    The binary format needs the record count up front, so it takes a counting pass first;
+    that keeps the output streamable to a pipe.
+*/
+static void write_deltas(FILE* out, int binary, __u64 timestamp_ns, const struct snapshot* cur, const struct snapshot* prev) {
+    struct flow_value delta;
+
+    if (ipfix) {
+        for (__u32 i = 0; i < cur->count; i++)
+            if (flow_delta(cur, prev, i, &delta))
+                write_ipfix_interval(timestamp_ns, &cur->keys[i], delta.packets, delta.bytes);
+        ipfix_flush(ipfix);
+        return;
+    }
+
+    if (binary) {
+        struct export_header hdr = { .magic = EXPORT_MAGIC, .count = 0, .timestamp_ns = timestamp_ns };
+        for (__u32 i = 0; i < cur->count; i++)
+            hdr.count += flow_delta(cur, prev, i, &delta);
+        fwrite(&hdr, sizeof(hdr), 1, out);
+    }
+
+    for (__u32 i = 0; i < cur->count; i++) {
+        if (!flow_delta(cur, prev, i, &delta)) continue;
+
+        if (binary) {
+            struct export_record rec = { .key = cur->keys[i], .packets = delta.packets, .bytes = delta.bytes };
+            fwrite(&rec, sizeof(rec), 1, out);
+        } else {
+            write_csv_record(out, timestamp_ns, &cur->keys[i], delta.packets, delta.bytes);
+        }
+    }
+}
+
+// Renders a binary export file (-b) as CSV on stdout
+static int render_export(const char* path) {
+    FILE* in = fopen(path, "r");
+    if (!in) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    write_csv_header(stdout, 1);
+    struct export_header hdr;
+    while (fread(&hdr, sizeof(hdr), 1, in) == 1) {
+        if (hdr.magic != EXPORT_MAGIC) {
+            fprintf(stderr, "%s: bad interval header\n", path);
+            fclose(in);
+            return -1;
+        }
+        struct export_record rec;
+        for (__u32 i = 0; i < hdr.count && fread(&rec, sizeof(rec), 1, in) == 1; i++)
+            write_csv_record(stdout, hdr.timestamp_ns, &rec.key, rec.packets, rec.bytes);
+    }
+    fclose(in);
+    return 0;
+}
+
+static const char* reason_to_str(__u8 reason) {
+    switch (reason) {
+        case 1: return "IDLE";
+        case 2: return "ACTIVE";
+        case 3: return "FIN";
+        case 4: return "RST";
+        case 5: return "EVICTED";
+        default: return "UNKNOWN";
+    }
+}
+
+// Kernel end reasons onto IPFIX flowEndReason: FIN and RST are both the end of the flow
+static __u8 end_reason_to_ipfix(__u8 reason) {
+    switch (reason) {
+        case 1: return IPFIX_END_IDLE_TIMEOUT;
+        case 2: return IPFIX_END_ACTIVE_TIMEOUT;
+        case 3:
+        case 4: return IPFIX_END_OF_FLOW;
+        case 5: return IPFIX_END_LACK_OF_RESOURCES;
+        default: return IPFIX_END_FORCED;
+    }
+}
+
+/*
+    Heavy hitters among the flows the table had no room for (-k). The kernel counts those in
+    flow_sketch, a per-CPU count-min sketch, until a flow is big enough to be promoted into
+    flow_topk and counted exactly. Summing the CPUs' sketches cell by cell gives the sketch
+    of all of them, so a flow's estimate is its exact count plus the merged sketch's count of
+    what it sent before promotion.
+
+    The sketch's counters only grow, so each report covers only the traffic since the last:
+    a heavy hitter is a flow that sent heavy_bytes within one report interval. Both maps hold
+    two copies and flow_epoch picks the one the kernel counts in. A report flips it, gives
+    packets that already read the old value EPOCH_SETTLE_MS to finish, then drains the copy
+    left behind, so every packet lands in exactly one report. The interval should stay well
+    short of the time a CPU takes to put heavy_bytes times SKETCH_WIDTH bytes (2 GiB by
+    default) into the sketch, after which every flow looks heavy.
+*/
+struct heavy_hitter {
+    struct flow_key key;
+    __u64 packets;
+    __u64 bytes;
+};
+
+// Must match sketch_hash() in the kernel program
+static __u64 sketch_hash(const struct flow_key* key) {
+    __u64 h = ((__u64)key->src_ip << 32 | key->dst_ip) * 0x9e3779b97f4a7c15ULL;
+    h ^= ((__u64)key->src_port << 24 | (__u64)key->dst_port << 8 | key->proto) * 0xc2b2ae3d27d4eb4fULL;
+    h ^= h >> 29;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    return h ^ (h >> 32);
+}
+
+// Count-min query: the smallest of the flow's counters, for packets and bytes separately
+static void sketch_query(const struct sketch_cell* sketch, const struct flow_key* key, __u64* packets, __u64* bytes) {
+    __u64 h = sketch_hash(key);
+    __u32 h1 = h, h2 = (h >> 32) | 1;
+    *packets = *bytes = ~0ULL;
+    for (__u32 row = 0; row < SKETCH_DEPTH; row++) {
+        const struct sketch_cell* cell = &sketch[row * SKETCH_WIDTH + ((h1 + row * h2) & (SKETCH_WIDTH - 1))];
+        if (cell->packets < *packets) *packets = cell->packets;
+        if (cell->bytes < *bytes) *bytes = cell->bytes;
+    }
+}
+
+static int compare_heavy(const void* a, const void* b) {
+    const struct heavy_hitter* x = a;
+    const struct heavy_hitter* y = b;
+    return x->bytes < y->bytes ? 1 : x->bytes > y->bytes ? -1 : 0;
+}
+
+// Zeroes every CPU's counters in one epoch's copy of the sketch
+static int clear_sketch(int sketch_fd, __u32 epoch) {
+    int ncpus = libbpf_num_possible_cpus();
+    if (ncpus <= 0) return -1;
+    struct sketch_cell cells[ncpus];
+    memset(cells, 0, sizeof(cells));
+
+    for (__u32 i = 0; i < SKETCH_DEPTH * SKETCH_WIDTH; i++) {
+        __u32 index = epoch * SKETCH_DEPTH * SKETCH_WIDTH + i;
+        if (bpf_map_update_elem(sketch_fd, &index, cells, BPF_ANY)) return -1;
+    }
+    return 0;
+}
+
+// Empties flow_topk, both copies
+static void clear_topk(int topk_fd) {
+    struct topk_key key;
+    while (!bpf_map_get_next_key(topk_fd, NULL, &key))
+        if (bpf_map_delete_elem(topk_fd, &key)) break;
+}
+
+// Sums one epoch's sketch over CPUs; a lookup in a per-CPU array returns them all at once
+static int merge_sketch(int sketch_fd, __u32 epoch, struct sketch_cell* merged) {
+    int ncpus = libbpf_num_possible_cpus();
+    if (ncpus <= 0) return -1;
+    struct sketch_cell cells[ncpus];
+
+    for (__u32 i = 0; i < SKETCH_DEPTH * SKETCH_WIDTH; i++) {
+        __u32 index = epoch * SKETCH_DEPTH * SKETCH_WIDTH + i;
+        if (bpf_map_lookup_elem(sketch_fd, &index, cells)) return -1;
+        merged[i].packets = 0;
+        merged[i].bytes = 0;
+        for (int cpu = 0; cpu < ncpus; cpu++) {
+            merged[i].packets += cells[cpu].packets;
+            merged[i].bytes += cells[cpu].bytes;
+        }
+    }
+    return 0;
+}
+
+// Points the kernel at the other copy; returns the one it was counting in, or -1
+static int flip_epoch(int epoch_fd) {
+    __u32 zero = 0, epoch;
+    if (bpf_map_lookup_elem(epoch_fd, &zero, &epoch)) return -1;
+    epoch &= 1;
+    __u32 next = epoch ^ 1;
+    if (bpf_map_update_elem(epoch_fd, &zero, &next, BPF_ANY)) return -1;
+    usleep(EPOCH_SETTLE_MS * 1000);
+    return epoch;
+}
+
+static void report_heavy_hitters(FILE* out, unsigned int top) {
+    static struct sketch_cell sketch[SKETCH_DEPTH * SKETCH_WIDTH];
+    static struct heavy_hitter heavy[1024];  // flow_topk's max_entries in the kernel program
+
+    int sketch_fd = bpf_obj_get(SKETCH_PATH);
+    int topk_fd = bpf_obj_get(TOPK_PATH);
+    int epoch_fd = bpf_obj_get(EPOCH_PATH);
+    int epoch = sketch_fd < 0 || topk_fd < 0 || epoch_fd < 0 ? -1 : flip_epoch(epoch_fd);
+    if (epoch < 0 || merge_sketch(sketch_fd, epoch, sketch) || clear_sketch(sketch_fd, epoch)) {
+        fprintf(out, "Failed to read %s and %s: %s\n", SKETCH_PATH, TOPK_PATH, strerror(errno));
+        if (sketch_fd >= 0) close(sketch_fd);
+        if (topk_fd >= 0) close(topk_fd);
+        if (epoch_fd >= 0) close(epoch_fd);
+        return;
+    }
+
+    // Every row of the sketch sums to everything it counted; row 0's empty counters also
+    // give the number of distinct flows (linear counting)
+    __u64 sketch_packets = 0, sketch_bytes = 0;
+    __u32 empty = 0;
+    for (__u32 i = 0; i < SKETCH_WIDTH; i++) {
+        sketch_packets += sketch[i].packets;
+        sketch_bytes += sketch[i].bytes;
+        empty += sketch[i].packets == 0;
+    }
+
+    __u32 nheavy = 0;
+    __u64 heavy_packets = 0, heavy_bytes = 0;
+    struct topk_key key, next_key;
+    struct topk_value value;
+    int err = bpf_map_get_next_key(topk_fd, NULL, &next_key);
+    while (!err && nheavy < sizeof(heavy) / sizeof(heavy[0])) {
+        key = next_key;
+        err = bpf_map_get_next_key(topk_fd, &key, &next_key);
+        // The current epoch's heavy hitters go in the next report
+        if (key.epoch != (__u32)epoch || bpf_map_lookup_and_delete_elem(topk_fd, &key, &value)) continue;
+
+        struct heavy_hitter* hh = &heavy[nheavy++];
+        hh->key = key.flow;
+        sketch_query(sketch, &key.flow, &hh->packets, &hh->bytes);
+        hh->packets += value.packets;
+        hh->bytes += value.bytes;
+        heavy_packets += value.packets;
+        heavy_bytes += value.bytes;
+    }
+    close(sketch_fd);
+    close(topk_fd);
+    close(epoch_fd);
+
+    if (sketch_packets + heavy_packets == 0) {
+        fprintf(out, "No traffic outside the flow table\n");
+        return;
+    }
+    // Past saturation linear counting only gives a lower bound
+    fprintf(out, "Outside the flow table since the last report: %llu packets, %llu bytes in %s %.0f flows, %u of them heavy hitters\n",
+            sketch_packets + heavy_packets, sketch_bytes + heavy_bytes, empty ? "about" : "over",
+            SKETCH_WIDTH * log((double)SKETCH_WIDTH / (empty ? empty : 1)), nheavy);
+    fprintf(out, "Estimates below may be high by up to %.0f bytes (e/%d of the sketched bytes) for 98%% of flows\n",
+            M_E * sketch_bytes / SKETCH_WIDTH, SKETCH_WIDTH);
+
+    qsort(heavy, nheavy, sizeof(heavy[0]), compare_heavy);
+    for (__u32 i = 0; i < nheavy && i < top; i++) {
+        char src_ip[INET_ADDRSTRLEN];
+        char dst_ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &heavy[i].key.src_ip, src_ip, INET_ADDRSTRLEN);
+        inet_ntop(AF_INET, &heavy[i].key.dst_ip, dst_ip, INET_ADDRSTRLEN);
+        fprintf(out, "%s,%s,%u,%u,%s,%llu,%llu\n", src_ip, dst_ip, ntohs(heavy[i].key.src_port), ntohs(heavy[i].key.dst_port),
+                proto_to_str(heavy[i].key.proto), heavy[i].packets, heavy[i].bytes);
+    }
+}
+
+// The kernel stamps flows with bpf_ktime_get_ns() (CLOCK_MONOTONIC); this is what to add to get wall-clock time
+static __s64 monotonic_to_realtime(void) {
+    struct timespec mono, real;
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    clock_gettime(CLOCK_REALTIME, &real);
+    return ((__s64)real.tv_sec - mono.tv_sec) * (__s64)NSEC_PER_SEC + (real.tv_nsec - mono.tv_nsec);
+}
+
+struct event_ctx {
+    FILE* out;
+    __s64 offset_ns;
+    unsigned long long count;
+};
+
+// Ring buffer callback: one completed flow from flow_events
+static int handle_flow_event(void* ctx, void* data, size_t size) {
+    struct event_ctx* ectx = ctx;
+    struct flow_event* ev = data;
+    if (size < sizeof(*ev)) return 0;
+
+    char src_ip[INET_ADDRSTRLEN];
+    char dst_ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &ev->key.src_ip, src_ip, INET_ADDRSTRLEN);
+    inet_ntop(AF_INET, &ev->key.dst_ip, dst_ip, INET_ADDRSTRLEN);
+
+    __u64 start = ev->first_seen + ectx->offset_ns;
+    __u64 end = ev->last_seen + ectx->offset_ns;
+    ectx->count++;
+
+    if (ipfix) {
+        __u8* p = put_flow_key(ipfix_record(ipfix, IPFIX_TEMPLATE_EVENT), &ev->key);
+        p = ipfix_put_u8(p, ev->tcp_flags);
+        p = ipfix_put_u8(p, end_reason_to_ipfix(ev->reason));
+        p = ipfix_put_u64(p, ev->packets);
+        p = ipfix_put_u64(p, ev->bytes);
+        p = ipfix_put_u64(p, start / 1000000);
+        ipfix_put_u64(p, end / 1000000);
+        return 0;
+    }
+    fprintf(ectx->out, "%llu.%09llu,%llu.%09llu,%s,%s,%u,%u,%s,%llu,%llu,0x%02x,%s\n",
+            start / NSEC_PER_SEC, start % NSEC_PER_SEC, end / NSEC_PER_SEC, end % NSEC_PER_SEC,
+            src_ip, dst_ip, ntohs(ev->key.src_port), ntohs(ev->key.dst_port),
+            proto_to_str(ev->key.proto), ev->packets, ev->bytes, ev->tcp_flags,
+            reason_to_str(ev->reason));
+    return 0;
+}
+
+/*
+    Writes completed flows as the kernel pushes them (-e). Nothing here ever walks flow_map:
+    the kernel exports on FIN/RST and active timeout, and its sweep timer exports idle flows.
+    With -x, out is NULL and the flows are batched into IPFIX messages, sent at least once
+    a second. With -k, heavy hitters are reported every report_s seconds.
+*/
+static int run_events(int events_fd, FILE* out, unsigned int top, unsigned int report_s) {
+    struct event_ctx ctx = { .out = out, .offset_ns = monotonic_to_realtime(), .count = 0 };
+    struct ring_buffer* rb = ring_buffer__new(events_fd, handle_flow_event, &ctx, NULL);
+    if (!rb) {
+        fprintf(stderr, "Failed to create ring buffer: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (out) fprintf(out, "Start,End,Source IP,Destination IP,Source Port,Destination Port,Protocol,Packets,Bytes,TCP Flags,End Reason\n");
+    time_t last_flush = time(NULL), last_report = last_flush;
+    while (!stop) {
+        int err = ring_buffer__poll(rb, 100);
+        if (err < 0 && err != -EINTR) {
+            perror("Error polling ring buffer");
+            break;
+        }
+        time_t now = time(NULL);
+        if (now != last_flush) {
+            // Resync with wall-clock once a second in case it was stepped
+            ctx.offset_ns = monotonic_to_realtime();
+            if (ipfix) ipfix_flush(ipfix);
+            else fflush(out);
+            last_flush = now;
+        }
+        if (top && now - last_report >= report_s) {
+            report_heavy_hitters(stderr, top);
+            last_report = now;
+        }
+    }
+
+    ring_buffer__free(rb);
+    fprintf(stderr, "Exported %llu completed flows\n", ctx.count);
+    return 0;
+}
+
+/*
+    Opens the kernel object, writes the timeouts into its .rodata config before the verifier
+    sees it, then loads and attaches the program. Maps are pinned by name as usual, so the
+    rest of the tool finds them at MAP_PATH/EVENTS_PATH either way. A pinned map is reused
+    as it is, so the sketch and heavy hitters left by an earlier run are cleared.
+*/
+static struct bpf_object* load_and_attach(int ifindex, __u32 xdp_flags, __u64 idle_s, __u64 active_s, __u64 heavy_bytes) {
+    struct bpf_object* obj = bpf_object__open_file(OBJ_PATH, NULL);
+    if (libbpf_get_error(obj)) return NULL;
+
+    size_t config_size;
+    struct bpf_map* rodata = bpf_object__find_map_by_name(obj, ".rodata");
+    struct flow_config* config = rodata ? bpf_map__initial_value(rodata, &config_size) : NULL;
+    if (!config || config_size < sizeof(*config)) goto fail;
+    if (idle_s) config->idle_timeout_ns = idle_s * NSEC_PER_SEC;
+    if (active_s) config->active_timeout_ns = active_s * NSEC_PER_SEC;
+    if (heavy_bytes) config->heavy_bytes = heavy_bytes;
+
+    if (bpf_object__load(obj)) goto fail;
+    struct bpf_map* sketch = bpf_object__find_map_by_name(obj, "flow_sketch");
+    struct bpf_map* topk = bpf_object__find_map_by_name(obj, "flow_topk");
+    if (!sketch || !topk || clear_sketch(bpf_map__fd(sketch), 0) || clear_sketch(bpf_map__fd(sketch), 1)) goto fail;
+    clear_topk(bpf_map__fd(topk));
+
+    struct bpf_program* prog = bpf_object__find_program_by_name(obj, "xdp_prog");
+    if (!prog || bpf_xdp_attach(ifindex, bpf_program__fd(prog), xdp_flags, NULL)) goto fail;
+    return obj;
+
+fail:
+    bpf_object__close(obj);
+    return NULL;
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr,
+        "Usage: %s [-i interface [-S] [-I seconds] [-A seconds] [-T bytes]] [-d seconds [-D] | -e [-d seconds]] [-b | -x collector] [-k top]\n"
+        "          [-o file] [-m listen]\n"
+        "       %s -r export-file\n"
+        "    -i  load " OBJ_PATH " and attach it to interface for as long as this runs\n"
+        "    -S  attach in generic (skb) mode\n"
+        "    -I  idle timeout in seconds for flows (with -i)\n"
+        "    -A  active timeout in seconds for flows (with -i)\n"
+        "    -T  bytes within one -k report after which a flow the full table had no room for\n"
+        "        is counted exactly as a heavy hitter (with -i, default 1 MiB)\n"
+        "    -e  write completed flows as the kernel reports them, instead of snapshots\n"
+        "    -d  keep running and export the flows that changed every N seconds\n"
+        "    -D  delete flows from the map as they are exported (counters restart each interval)\n"
+        "    -b  write the compact binary format instead of CSV\n"
+        "    -x  send the flows as IPFIX over UDP to collector (host or host:port, default port\n"
+        "        " IPFIX_DEFAULT_PORT ") instead of writing a file; the observation domain is the\n"
+        "        interface index given with -i, or 0\n"
+        "    -o  output file (default " OUTPUT_FILE ")\n"
+        "    -k  report the top heavy hitters among flows the table had no room for, and the\n"
+        "        traffic outside the table, on stderr after every snapshot (with -e, every -d\n"
+        "        seconds, default %d, and on exit); each report covers only the time since\n"
+        "        the one before\n"
+        "    -m  serve Prometheus metrics on a port, host:port or unix socket path\n"
+        "    -r  print a binary export file as CSV\n", prog, prog, HEAVY_REPORT_INTERVAL);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char* argv[]) {
+    const char* output = OUTPUT_FILE;
+    unsigned int interval = 0;
+    int delete = 0;
+    int binary = 0;
+    int events = 0;
+    char ifname[IF_NAMESIZE] = "";
+    __u32 xdp_flags = XDP_FLAGS_DRV_MODE;
+    __u64 idle_s = 0, active_s = 0, heavy_bytes = 0;
+    unsigned int top = 0;
+    struct bpf_object* obj = NULL;
+    int ifindex = 0;
+    const char* metrics_listen = NULL;
+    const char* collector = NULL;
+    int c;
+
+    while ((c = getopt(argc, argv, "i:SI:A:T:ed:Dbx:k:o:m:r:h")) != -1) {
+        switch (c) {
+            case 'i': snprintf(ifname, sizeof(ifname), "%s", optarg); break;
+            case 'S': xdp_flags = XDP_FLAGS_SKB_MODE; break;
+            case 'I': idle_s = strtoull(optarg, NULL, 10); break;
+            case 'A': active_s = strtoull(optarg, NULL, 10); break;
+            case 'T': heavy_bytes = strtoull(optarg, NULL, 10); break;
+            case 'e': events = 1; break;
+            case 'd': interval = strtoul(optarg, NULL, 10); break;
+            case 'D': delete = 1; break;
+            case 'b': binary = 1; break;
+            case 'x': collector = optarg; break;
+            case 'k': top = strtoul(optarg, NULL, 10); break;
+            case 'o': output = optarg; break;
+            case 'm': metrics_listen = optarg; break;
+            case 'r': exit(render_export(optarg) ? EXIT_FAILURE : EXIT_SUCCESS);
+            default: usage(argv[0]);
+        }
+    }
+
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+
+    if (ifname[0] != '\0') {
+        ifindex = if_nametoindex(ifname);
+        if (!ifindex || !(obj = load_and_attach(ifindex, xdp_flags, idle_s, active_s, heavy_bytes))) {
+            fprintf(stderr, "Failed to load %s on %s: %s\n", OBJ_PATH, ifname, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (collector && setup_ipfix(collector, ifindex)) {
+        fprintf(stderr, "Failed to set up IPFIX export to %s: %s\n", collector, strerror(errno));
+        if (obj) {
+            bpf_xdp_detach(ifindex, xdp_flags, NULL);
+            bpf_object__close(obj);
+        }
+        exit(EXIT_FAILURE);
+    }
+
+    // The stats map is pinned alongside the flow map, whoever loaded the program
+    if (metrics_listen) {
+        stats_fd = bpf_obj_get(STATS_PATH);
+        if (stats_fd >= 0) metrics_add_collector(collect_kernel_stats, NULL);
+        if (ifname[0] != '\0') metrics_add_collector(metrics_netdev_collector, ifname);
+        if (ipfix) metrics_add_collector(collect_ipfix_stats, NULL);
+        if (metrics_serve(metrics_listen) < 0)
+            fprintf(stderr, "Failed to serve metrics on %s: %s\n", metrics_listen, strerror(errno));
+    }
+
+    if (events) {
+        int events_fd = bpf_obj_get(EVENTS_PATH);
+        FILE* out = events_fd < 0 || ipfix ? NULL : fopen(output, "w");
+        if (events_fd < 0 || (!ipfix && !out)) {
+            fprintf(stderr, "Failed to open %s or %s: %s\n", EVENTS_PATH, output, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        if (out) setvbuf(out, NULL, _IOFBF, OUTPUT_BUF_SIZE);
+        int err = run_events(events_fd, out, top, interval ? interval : HEAVY_REPORT_INTERVAL);
+        if (top) report_heavy_hitters(stderr, top);
+        if (out) fclose(out);
+        close_ipfix();
+        close(events_fd);
+        if (obj) {
+            bpf_xdp_detach(ifindex, xdp_flags, NULL);
+            bpf_object__close(obj);
+        }
+        exit(err ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
+
     // Open the flow map
     int map_fd = bpf_obj_get(MAP_PATH);
     if (map_fd < 0) {
@@ -46,56 +914,67 @@ int main() {
         exit(EXIT_FAILURE);
     }
 
-    // Open the CSV file which you are creating
-    FILE* csv = fopen(OUTPUT_FILE, "w");
-    if (!csv) {
-        fprintf(stderr, "Failed to create output file %s: %s\n", OUTPUT_FILE, strerror(errno));
+    struct bpf_map_info info = {0};
+    __u32 info_len = sizeof(info);
+    if (detect_map_type(map_fd) || bpf_obj_get_info_by_fd(map_fd, &info, &info_len)) {
+        fprintf(stderr, "Failed to inspect BPF map at %s: %s\n", MAP_PATH, strerror(errno));
+        close(map_fd);
         exit(EXIT_FAILURE);
     }
 
-    // Write the CSV header
-    fprintf(csv, "Source IP,Destination IP,Source Port,Destination Port,Protocol,Packets,Bytes\n");
-
-    struct flow_key key;
-    struct flow_key next_key;
-    struct flow_value value;
+    // Open the output file which you are creating, unless the flows go to a collector
+    FILE* out = NULL;
+    if (!ipfix) {
+        out = fopen(output, "w");
+        if (!out) {
+            fprintf(stderr, "Failed to create output file %s: %s\n", output, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        setvbuf(out, NULL, _IOFBF, OUTPUT_BUF_SIZE);
+        if (!binary) write_csv_header(out, interval > 0);
+    }
 
-    // Try to get the first key
-    int err = bpf_map_get_next_key(map_fd, NULL, &next_key);
-    if (err < 0) {
-        fprintf(stderr, "Map is empty or error getting first key: %s\n", strerror(errno));
-        fclose(csv);
-        close(map_fd);
+    struct snapshot snaps[2];
+    if (snapshot_init(&snaps[0], info.max_entries) || snapshot_init(&snaps[1], info.max_entries)) {
+        fprintf(stderr, "Failed to allocate snapshot buffers\n");
         exit(EXIT_FAILURE);
     }
 
-    // Loop over the rest of the key-value pairs in the map and write to csv for each entry
+    // One-shot mode is a single interval with nothing to diff against
+    struct snapshot* cur = &snaps[0];
+    struct snapshot* prev = NULL;
     do {
-        key = next_key;
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        __u64 timestamp_ns = interval || ipfix ? (__u64)now.tv_sec * 1000000000ULL + now.tv_nsec : 0;
 
-        // Returns 0 on success
-        if (bpf_map_lookup_elem(map_fd, &key, &value)) { //?
-            fprintf(stderr, "Failed to lookup value for key\n");
-            continue;
+        if (take_snapshot(map_fd, cur, info.max_entries, delete)) {
+            fprintf(stderr, "Failed to read flows from %s: %s\n", MAP_PATH, strerror(errno));
+            break;
         }
+        if (!interval && cur->count == 0)
+            fprintf(stderr, "Map is empty\n");
+        if (top) report_heavy_hitters(stderr, top);
 
-        char src_ip[INET_ADDRSTRLEN];
-        char dst_ip[INET_ADDRSTRLEN];
-
-        inet_ntop(AF_INET, &key.src_ip, src_ip, INET_ADDRSTRLEN);
-        inet_ntop(AF_INET, &key.dst_ip, dst_ip, INET_ADDRSTRLEN);
-
-        __u16 src_port = ntohs(key.src_port);
-        __u16 dst_port = ntohs(key.dst_port);
+        write_deltas(out, binary, timestamp_ns, cur, delete ? NULL : prev);
+        if (out) fflush(out);
 
-        const char* proto = proto_to_str(key.proto);
+        // Keep this snapshot around to diff the next one against
+        if (!delete) {
+            snapshot_index(cur);
+            prev = cur;
+            cur = cur == &snaps[0] ? &snaps[1] : &snaps[0];
+        }
 
-        fprintf(csv, "%s,%s,%u,%u,%s,%llu,%llu\n",
-                src_ip, dst_ip, src_port, dst_port,
-                proto, value.packets, value.bytes);
-    } while (bpf_map_get_next_key(map_fd, &key, &next_key) == 0);
+        for (unsigned int i = 0; i < interval && !stop; i++) sleep(1);
+    } while (interval && !stop);
 
-    fclose(csv);
+    if (out) fclose(out);
+    close_ipfix();
     close(map_fd);
+    if (obj) {
+        bpf_xdp_detach(ifindex, xdp_flags, NULL);
+        bpf_object__close(obj);
+    }
     exit(EXIT_SUCCESS);
-}
\ No newline at end of file
+}
@@ -2,23 +2,92 @@
 #include <linux/if_ether.h>
 #include <linux/ip.h>
 #include <linux/in.h>
+#include <linux/errno.h>
 #include <bpf/bpf_helpers.h>
 
 #define RINGBUF_MAX_ENTRIES  16384
-#define MAX_PACKET_SIZE      256
+#define MAX_PACKET_SIZE      9216  // Largest jumbo frame we expect to capture in full
 #define IPV4_HEADER_MIN_SIZE 20
 #define IPV4_HEADER_MAX_SIZE 60
+#define MAX_CPUS             256   // Slots in ringbufs; user-space sizes it to the CPUs present
+
+// Load shedding (config.shed); see shed_level()
+#define SHED_SNAPLEN         128                     // Bytes kept of each frame while shedding
+#define SHED_MAX_LEVEL       8                       // Header-only, 1 in 128 flows
+#define SHED_STEP_UP_NS      (10 * 1000 * 1000ULL)   // Least time between two escalations
+#define SHED_STEP_DOWN_NS    (1000 * 1000 * 1000ULL) // Pressure must stay low this long per step down
+
+// Duplicate suppression (config.dedup_window_ns); see is_duplicate()
+#define DEDUP_MAX_ENTRIES    65536  // Frames remembered; must cover a window's worth of traffic
+#define DEDUP_PAYLOAD        64     // Bytes after the IP header that go into the hash
+
+// Capture policy (config.policy); see policy_snaplen()
+#define POLICY_MAX_FLOWS     65536  // Flows whose first packets are being counted
+#define POLICY_MAX_NETS      1024   // Prefix overrides
+#define TCP_HEADER_MIN_SIZE  20
+#define L4_HEADER_SIZE       8      // UDP, and ICMP up to the rest-of-header word
+
+#define ETH_P_8021Q_BE       __constant_htons(0x8100)
+#define ETH_P_8021AD_BE      __constant_htons(0x88a8)
+
+// Driver RX timestamp (kernel 6.3+); only callable from a device-bound program. Weak, so the
+// object still loads on older kernels, where libbpf resolves it to 0 and -H falls back
+extern int bpf_xdp_metadata_rx_timestamp(const struct xdp_md* ctx, __u64* timestamp) __ksym __weak;
 
 /*
     Represents each packet's pcap entry which will enter the ring buffer and then be written to
     a pcap.gz file. The ring buffer is pinned to /sys/fs/bpf/ringbuf
+
+    The data array is sized per packet: every entry is reserved from the smallest size class
+    that holds caplen bytes, so user-space must use the record size (or caplen) rather than
+    sizeof(struct pcap_entry) to find the end of the packet.
+
+    The timestamp is left as raw nanoseconds: CLOCK_MONOTONIC from bpf_ktime_get_ns(), which
+    user-space converts to wall-clock time, or the NIC's own clock when PCAP_ENTRY_HW_TIMESTAMP
+    is set. caplen never exceeds MAX_PACKET_SIZE, so 16 bits are enough.
+
+    The shedding level the frame was captured at is kept in bits 8-11 of flags: 0 is a normal
+    capture, 1 means the frame was cut to SHED_SNAPLEN, and a level n >= 2 additionally means
+    only 1 in 2^(n-1) flows was being captured when it was taken.
 */
 struct pcap_entry {
-    __u32 timestamp_s;
-    __u32 timestamp_ns;
-    __u32 caplen;
+    __u64 timestamp;
     __u32 len;
-    __u8  data[MAX_PACKET_SIZE];
+    __u16 caplen;
+    __u16 flags;
+    __u8  data[];
+};
+
+#define PCAP_ENTRY_HW_TIMESTAMP 0x1
+#define PCAP_ENTRY_SHED_SHIFT   8
+
+/*
+    Load-time configuration. This lives in .rodata, so xdp_pcap_user.c can patch it between
+    opening and loading the object and the verifier then sees it as a constant. It must stay
+    the only const volatile global in this file, because user-space writes it at offset 0.
+
+    A snaplen of 0 means capture the full frame, up to MAX_PACKET_SIZE. filtered is set when
+    the program is only reached through the capture filter (see xdp_filter.c), which has
+    already decided the frame is wanted, so the built-in IPv4 TCP/UDP check is skipped.
+    shed turns on load shedding (see shed_level()). percpu makes every CPU write to its own
+    ring buffer in ringbufs instead of the shared ringbuf. A non-zero dedup_window_ns drops
+    frames that repeat one seen less than that long ago (see is_duplicate()). policy replaces
+    snaplen for IPv4 with a length picked per frame (see policy_snaplen()).
+*/
+struct pcap_config {
+    __u32 snaplen;
+    __u32 filtered;
+    __u32 shed;
+    __u32 percpu;
+    __u64 dedup_window_ns;
+    __u32 policy;
+    __u32 policy_packets;  // Packets at the start of each flow that keep policy_payload bytes of payload
+    __u32 policy_payload;
+    __u32 pad;
+};
+
+const volatile struct pcap_config config = {
+    .snaplen = 256
 };
 
 /*
@@ -31,56 +100,515 @@ struct {
     __uint(pinning, LIBBPF_PIN_BY_NAME);
 } ringbuf SEC(".maps");
 
-SEC("xdp")
-int xdp_prog(struct xdp_md* ctx) {
-    // Pointers to start and end of packet
-    void* data = (void*)(long)ctx->data;
-    void* data_end = (void*)(long)ctx->data_end;
+/*
+    One ring buffer per CPU, for config.percpu. A single ring serialises every RX queue on its
+    producer lock and leaves one user-space thread to drain it all; with a ring each, CPUs never
+    touch each other's ring and user-space runs one consumer per ring (xdp_pcap_user -C). The
+    rings themselves are created and inserted by user-space, sized like ringbuf.
+*/
+struct ringbuf_inner {
+    __uint(type, BPF_MAP_TYPE_RINGBUF);
+    __uint(max_entries, RINGBUF_MAX_ENTRIES);
+};
+
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY_OF_MAPS);
+    __uint(max_entries, MAX_CPUS);
+    __type(key, __u32);
+    __array(values, struct ringbuf_inner);
+} ringbufs SEC(".maps");
+
+/*
+    Where each frame the program sees ends up, one counter per outcome, pinned to
+    /sys/fs/bpf/pcap_stats. Per-CPU, so counting costs a plain increment on the packet path;
+    user-space sums the CPUs when it reads them. A frame the capture filter rejects never
+    reaches this program and is not counted.
+*/
+enum pcap_stat {
+    PCAP_STAT_SEEN,          // Frames that reached the capture program
+    PCAP_STAT_PARSE_ERROR,   // Truncated or malformed Ethernet/IPv4 header
+    PCAP_STAT_FILTERED,      // Not IPv4 TCP/UDP (only without a capture filter)
+    PCAP_STAT_RINGBUF_FULL,  // No room in the ring buffer (or, per-CPU, no ring); the frame was lost
+    PCAP_STAT_COPY_ERROR,    // bpf_xdp_load_bytes() failed
+    PCAP_STAT_CAPTURED,      // Submitted to the ring buffer
+    PCAP_STAT_SHED,          // Left out by flow sampling while shedding load
+    PCAP_STAT_DUPLICATE,     // Repeat of a frame seen within the dedup window
+    PCAP_STAT_MAX
+};
+
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, PCAP_STAT_MAX);
+    __type(key, __u32);
+    __type(value, __u64);
+    __uint(pinning, LIBBPF_PIN_BY_NAME);
+} pcap_stats SEC(".maps");
 
-    // Filter for IPv4 only
-    struct ethhdr* eth = (struct ethhdr*)data;
-    if ((void*)(eth + 1) > data_end) return XDP_PASS;
-    if (eth->h_proto != __constant_htons(ETH_P_IP)) return XDP_PASS;
+static __always_inline void count(__u32 stat) {
+    __u64* value = bpf_map_lookup_elem(&pcap_stats, &stat);
+    if (value) *value += 1;
+}
+
+/*
+    Load shedding. Rather than letting a full ring buffer drop whatever frames happen to arrive
+    while it is full, the program degrades in steps that are recorded with every frame:
+
+        level 0   capture as configured
+        level 1   cut every frame to SHED_SNAPLEN (headers only)
+        level n   headers only, and only flows whose hash is 0 mod 2^(n-1)
+
+    A failed reservation, or a ring more than 3/4 full, raises the level by one (at most once
+    per SHED_STEP_UP_NS, so one burst of failures counts once). Once the ring has stayed under
+    1/4 full for SHED_STEP_DOWN_NS the level drops by one. The state is shared by every CPU;
+    CPUs racing on an update can lose a step, which the next packet corrects.
+*/
+struct shed_state {
+    __u64 changed;      // bpf_ktime_get_ns() of the last level change
+    __u64 quiet_since;  // Since when every packet has found the ring under 1/4 full
+    __u32 level;
+    __u32 pad;
+};
+
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, 1);
+    __type(key, __u32);
+    __type(value, struct shed_state);
+} shed_map SEC(".maps");
+
+// Any sign of pressure restarts the quiet period, whether or not the level can rise yet
+static __always_inline void shed_escalate(struct shed_state* state, __u64 now) {
+    state->quiet_since = now;
+    if (state->level < SHED_MAX_LEVEL && now - state->changed >= SHED_STEP_UP_NS) {
+        state->level++;
+        state->changed = now;
+    }
+}
+
+// Adjusts the level to the ring's current fill and returns it
+static __always_inline __u32 shed_level(void* rb, __u64 now) {
+    __u32 zero = 0;
+    struct shed_state* state = bpf_map_lookup_elem(&shed_map, &zero);
+    if (!state) return 0;
+
+    __u64 used = bpf_ringbuf_query(rb, BPF_RB_AVAIL_DATA);
+    __u64 size = bpf_ringbuf_query(rb, BPF_RB_RING_SIZE);
+    if (used > size / 4 * 3) {
+        shed_escalate(state, now);
+    } else if (state->level > 0) {
+        // The quiet period only matters while shedding, so at level 0 the line is not written
+        if (used >= size / 4) {
+            state->quiet_since = now;
+        } else if (now - state->quiet_since >= SHED_STEP_DOWN_NS) {
+            // Each step down starts a new quiet period, so the next one waits a full period too
+            state->level--;
+            state->changed = now;
+            state->quiet_since = now;
+        }
+    }
+    __u32 level = state->level;
+    return level < SHED_MAX_LEVEL ? level : SHED_MAX_LEVEL;
+}
+
+/*
+    Flow-consistent sampling: the hash is symmetric in source and destination, so both
+    directions of a flow are kept or left out together, and a kept flow stays kept for as long
+    as the level holds. Frames that are not IPv4 hash on their EtherType, as one "flow" each.
+*/
+static __always_inline int shed_keep(void* data, void* data_end, __u32 level) {
+    if (level < 2) return 1;
+
+    struct ethhdr* eth = data;
+    if ((void*)(eth + 1) > data_end) return 1;
+    __u32 hash = eth->h_proto;
 
-    // Filter for TCP and UDP only
     struct iphdr* ip = (struct iphdr*)(eth + 1);
-    if ((void*)(ip + 1) > data_end) return XDP_PASS;
+    if (eth->h_proto == __constant_htons(ETH_P_IP) && (void*)(ip + 1) <= data_end) {
+        hash = (ip->saddr ^ ip->daddr) + ip->protocol;
+
+        // Ports are the first 4 bytes of both TCP and UDP; fragments after the first have none
+        __u32 ip_header_length = ip->ihl * 4;
+        __u16* ports = (void*)ip + ip_header_length;
+        if ((ip->protocol == IPPROTO_TCP || ip->protocol == IPPROTO_UDP) && !(ip->frag_off & __constant_htons(0x1fff)) &&
+            ip_header_length >= IPV4_HEADER_MIN_SIZE && ip_header_length <= IPV4_HEADER_MAX_SIZE && (void*)(ports + 2) <= data_end)
+            hash += (__u32)(ports[0] ^ ports[1]) << 8;
+    }
+
+    // Finaliser from murmur3, so the low bits depend on every input bit
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6b;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35;
+    hash ^= hash >> 16;
+    return (hash & ((1U << (level - 1)) - 1)) == 0;
+}
+
+// Called when a reservation fails; a no-op unless shedding is on
+static __always_inline void shed_on_full(void) {
+    if (!config.shed) return;
+    __u32 zero = 0;
+    struct shed_state* state = bpf_map_lookup_elem(&shed_map, &zero);
+    if (state) shed_escalate(state, bpf_ktime_get_ns());
+}
+
+// Offset of the network header, behind at most one VLAN tag, and its EtherType; 0 if truncated
+static __always_inline __u32 l3_offset(void* data, void* data_end, __u16* proto) {
+    struct ethhdr* eth = data;
+    if ((void*)(eth + 1) > data_end) return 0;
+    *proto = eth->h_proto;
+    if (*proto != ETH_P_8021Q_BE && *proto != ETH_P_8021AD_BE) return sizeof(*eth);
+
+    __u16* inner = (void*)(eth + 1) + 2;
+    if ((void*)(inner + 1) > data_end) return 0;
+    *proto = *inner;
+    return sizeof(*eth) + 4;
+}
+
+/*
+    Duplicate suppression, for links where the same frame arrives twice: both directions of a
+    SPAN session, or TAP ports aggregated onto one interface. The copies differ in what the
+    path between the two observation points rewrote (MACs, VLAN tags, TTL and so the IP
+    checksum) and nothing else, so a frame is identified by a hash of the rest of its IPv4
+    header plus the first DEDUP_PAYLOAD bytes after it, which include the L4 header and its
+    checksum. Frames that are not IPv4 hash on their first DEDUP_PAYLOAD bytes as they are.
+
+    dedup_map remembers when each hash was first seen. A frame whose hash was seen less than
+    config.dedup_window_ns ago is a duplicate and is not captured; the window is not extended
+    by the duplicate, so a genuine retransmission after it is still kept. The LRU forgets the
+    oldest hashes first, so the table only has to hold one window's worth of frames. Both
+    copies often land on different CPUs at nearly the same time; the insert is BPF_NOEXIST so
+    exactly one of them wins and the other is counted as the duplicate.
+*/
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+    __uint(max_entries, DEDUP_MAX_ENTRIES);
+    __type(key, __u64);
+    __type(value, __u64);
+} dedup_map SEC(".maps");
+
+static __always_inline __u64 dedup_mix(__u64 h, __u64 v) {
+    h = (h ^ v) * 0x9e3779b97f4a7c15ULL;
+    return h ^ (h >> 32);
+}
+
+static __always_inline __u64 dedup_hash(struct xdp_md* ctx, void* data, void* data_end) {
+    __u64 words[DEDUP_PAYLOAD / 8] = {};
+    __u32 offset = 0;
+    __u64 h = 0;
+
+    __u16 proto;
+    __u32 l3 = l3_offset(data, data_end, &proto);
+    if (!l3) return 0;
+
+    struct iphdr* ip = data + l3;
+    if (proto == __constant_htons(ETH_P_IP) && (void*)(ip + 1) <= data_end) {
+        __u32 ip_header_length = ip->ihl * 4;
+        if (ip_header_length < IPV4_HEADER_MIN_SIZE || ip_header_length > IPV4_HEADER_MAX_SIZE) return 0;
+        // Everything but TTL and checksum
+        h = dedup_mix(h, (__u64)ip->saddr << 32 | ip->daddr);
+        h = dedup_mix(h, (__u64)ip->tot_len << 48 | (__u64)ip->id << 32 | (__u64)ip->frag_off << 16 | ip->protocol << 8 | ip->tos);
+        offset = l3 + ip_header_length;
+    }
+
+    __u32 frame = data_end - data;
+    if (offset < frame) {
+        __u32 n = frame - offset;
+        if (n > DEDUP_PAYLOAD) n = DEDUP_PAYLOAD;
+        if (n > 0 && bpf_xdp_load_bytes(ctx, offset, words, n) < 0) return 0;
+        h = dedup_mix(h, n);
+        for (int i = 0; i < DEDUP_PAYLOAD / 8; i++) h = dedup_mix(h, words[i]);
+    }
+    return h;
+}
+
+static __always_inline int is_duplicate(struct xdp_md* ctx, void* data, void* data_end, __u64 now) {
+    __u64 hash = dedup_hash(ctx, data, data_end);
+    if (hash == 0) return 0;
+
+    __u64* seen = bpf_map_lookup_elem(&dedup_map, &hash);
+    if (seen) {
+        // Signed: the other copy may have been stamped on another CPU just before this one
+        if ((__s64)(now - *seen) < (__s64)config.dedup_window_ns) return 1;
+        *seen = now;
+        return 0;
+    }
+    return bpf_map_update_elem(&dedup_map, &hash, &now, BPF_NOEXIST) == -EEXIST;
+}
+
+/*
+    Capture policy. Most stored bytes are bulk payload nobody reads, while the headers and the
+    first packets of a flow (handshakes, enough of the application protocol to identify it)
+    are what an investigation needs. With config.policy, an IPv4 frame is cut to:
+
+        its L2-L4 headers (Ethernet, a VLAN tag, IPv4 with options, TCP with options or the
+        8 byte UDP/ICMP header; just the IP header for anything else and for later fragments)
+        plus policy_payload bytes of payload for the first policy_packets packets of its flow
+        (each direction of a connection counts separately, and a TCP SYN starts over)
+        or more, if policy_ports or policy_nets has a rule for either port or address
+
+    Rules give a length for frames to or from a port (policy_ports, indexed by the port in
+    host order) or a prefix (policy_nets, where each address matches its most specific
+    prefix). The longest of the lengths that apply wins, so a rule of MAX_PACKET_SIZE captures
+    that traffic in full. user-space fills both maps in before attaching.
+    Frames that are not IPv4 are cut to snaplen as without a policy.
+*/
+struct policy_key {
+    __u32 saddr;
+    __u32 daddr;
+    __u16 sport;
+    __u16 dport;
+    __u8  proto;
+    __u8  pad[3];
+};
+
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+    __uint(max_entries, POLICY_MAX_FLOWS);
+    __type(key, struct policy_key);
+    __type(value, __u32);
+} policy_flows SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, 65536);
+    __type(key, __u32);
+    __type(value, __u32);
+} policy_ports SEC(".maps");
+
+struct policy_net {
+    __u32 prefixlen;
+    __u32 addr;  // Network byte order
+};
+
+struct {
+    __uint(type, BPF_MAP_TYPE_LPM_TRIE);
+    __uint(max_entries, POLICY_MAX_NETS);
+    __type(key, struct policy_net);
+    __type(value, __u32);
+    __uint(map_flags, BPF_F_NO_PREALLOC);
+} policy_nets SEC(".maps");
+
+// Counts a packet against its flow; true while the flow is within its first policy_packets
+static __always_inline int policy_early(struct policy_key* key, int syn) {
+    if (config.policy_packets == 0) return 0;
+
+    // A plain increment: CPUs racing on one flow can only let a packet or two more through
+    __u32* seen = bpf_map_lookup_elem(&policy_flows, key);
+    if (seen && !syn) {
+        if (*seen >= config.policy_packets) return 0;
+        *seen += 1;
+        return 1;
+    }
+    __u32 one = 1;
+    bpf_map_update_elem(&policy_flows, key, &one, BPF_ANY);
+    return 1;
+}
+
+static __always_inline __u32 policy_port(__u16 port) {
+    __u32 key = __constant_ntohs(port);
+    __u32* snaplen = bpf_map_lookup_elem(&policy_ports, &key);
+    return snaplen ? *snaplen : 0;
+}
+
+static __always_inline __u32 policy_net(__u32 addr) {
+    struct policy_net key = { .prefixlen = 32, .addr = addr };
+    __u32* snaplen = bpf_map_lookup_elem(&policy_nets, &key);
+    return snaplen ? *snaplen : 0;
+}
+
+static __always_inline __u32 max_u32(__u32 a, __u32 b) {
+    return a > b ? a : b;
+}
+
+// The length to capture of this frame, or fallback if the policy does not apply to it
+static __always_inline __u32 policy_snaplen(void* data, void* data_end, __u32 fallback) {
+    __u16 proto;
+    __u32 l3 = l3_offset(data, data_end, &proto);
+    struct iphdr* ip = data + l3;
+    if (!l3 || proto != __constant_htons(ETH_P_IP) || (void*)(ip + 1) > data_end) return fallback;
     __u32 ip_header_length = ip->ihl * 4;
-    if (ip_header_length < IPV4_HEADER_MIN_SIZE || ip_header_length > IPV4_HEADER_MAX_SIZE || (void*)ip + ip_header_length > data_end) return XDP_PASS;
-    if (ip->protocol != IPPROTO_TCP && ip->protocol != IPPROTO_UDP) return XDP_PASS;
-    
-    // Reserve space in ring buffer for pcap entry
-    struct pcap_entry* entry = bpf_ringbuf_reserve(&ringbuf, sizeof(struct pcap_entry), 0);
-    if (!entry) return XDP_PASS;
-    
-    // Assign pcap entry fields
-    entry->len = sizeof(struct ethhdr) + __constant_ntohs(ip->tot_len);    // Total original length = ethernet frame + ip packet
-    entry->caplen = data_end - data;                                       // Total captured length = end memory address - start memory address
-    if (entry->caplen > MAX_PACKET_SIZE) entry->caplen = MAX_PACKET_SIZE;  // Truncate the packet if it's too big
-    __u64 timestamp_ns = bpf_ktime_get_ns();                               // Consider moving this to the beginning of the function for more precision
-    entry->timestamp_s = timestamp_ns / 1000000000;                        // Timestamp in seconds
-    entry->timestamp_ns = timestamp_ns % 1000000000;                       // Remainder of timestamp in nanoseconds
-
-    __u32 pkt_len = data_end - data;
-    if (pkt_len > MAX_PACKET_SIZE) pkt_len = MAX_PACKET_SIZE;
+    if (ip_header_length < IPV4_HEADER_MIN_SIZE || ip_header_length > IPV4_HEADER_MAX_SIZE) return fallback;
+
+    struct policy_key key;
+    __builtin_memset(&key, 0, sizeof(key));
+    key.saddr = ip->saddr;
+    key.daddr = ip->daddr;
+    key.proto = ip->protocol;
+
+    __u32 snaplen = l3 + ip_header_length;
+    int syn = 0;
+    __u8* l4 = (void*)ip + ip_header_length;
+    if (!(ip->frag_off & __constant_htons(0x1fff))) {
+        if (ip->protocol == IPPROTO_TCP && (void*)(l4 + TCP_HEADER_MIN_SIZE) <= data_end) {
+            snaplen += max_u32((l4[12] >> 4) * 4, TCP_HEADER_MIN_SIZE);
+            syn = l4[13] & 0x02;
+        } else if ((ip->protocol == IPPROTO_UDP || ip->protocol == IPPROTO_ICMP) && (void*)(l4 + L4_HEADER_SIZE) <= data_end) {
+            snaplen += L4_HEADER_SIZE;
+        }
+        if ((ip->protocol == IPPROTO_TCP || ip->protocol == IPPROTO_UDP) && (void*)(l4 + 4) <= data_end) {
+            key.sport = *(__u16*)l4;
+            key.dport = *(__u16*)(l4 + 2);
+        }
+    }
+
+    if (policy_early(&key, syn)) snaplen += config.policy_payload;
+    snaplen = max_u32(snaplen, max_u32(policy_port(key.sport), policy_port(key.dport)));
+    snaplen = max_u32(snaplen, max_u32(policy_net(key.saddr), policy_net(key.daddr)));
+    return snaplen < MAX_PACKET_SIZE ? snaplen : MAX_PACKET_SIZE;
+}
+
+/*
+    Reserves an entry with room for exactly class_size bytes of packet data and copies caplen
+    bytes into it. bpf_ringbuf_reserve() only accepts a constant size, so this is always inlined
+    with a literal class_size and the verifier sees one fixed-size reservation per size class.
+*/
+static __always_inline int capture(struct xdp_md* ctx, void* rb, __u32 class_size, __u32 caplen, __u32 len, __u64 timestamp, __u16 flags) {
+    struct pcap_entry* entry = bpf_ringbuf_reserve(rb, sizeof(struct pcap_entry) + class_size, 0);
+    if (!entry) {
+        count(PCAP_STAT_RINGBUF_FULL);
+        shed_on_full();
+        return XDP_PASS;
+    }
+
+    // Redundant with the caller's checks, but keeps the copy length provably in bounds
+    if (caplen == 0 || caplen > class_size) {
+        bpf_ringbuf_discard(entry, 0);
+        return XDP_PASS;
+    }
+
+    entry->timestamp = timestamp;
+    entry->len = len;
+    entry->caplen = caplen;
+    entry->flags = flags;
 
     // Copy NIC packet memory (ctx) to pcap entry memory
-    if (bpf_probe_read_kernel(entry->data, pkt_len, data) < 0) {
+    if (bpf_xdp_load_bytes(ctx, 0, entry->data, caplen) < 0) {
         bpf_ringbuf_discard(entry, 0);
+        count(PCAP_STAT_COPY_ERROR);
         return XDP_PASS;
     }
 
     // Write pcap entry to ring buffer
     bpf_ringbuf_submit(entry, 0);
+    count(PCAP_STAT_CAPTURED);
     return XDP_PASS;
 }
 
+// Dispatches to the smallest size class that fits the captured length
+#define SIZE_CLASS(size) if (caplen <= (size)) return capture(ctx, rb, (size), caplen, len, timestamp, flags)
+
+/*
+    The capture path shared by both entry points. hw is a literal at each call site, so the
+    kfunc call only exists in xdp_prog_hwts: the verifier refuses RX metadata kfuncs anywhere
+    in a program that is not bound to a device, even on a branch it can prove is dead.
+*/
+static __always_inline int capture_frame(struct xdp_md* ctx, int hw) {
+    // Stamp first, so parsing and filtering don't skew the time
+    __u64 timestamp = 0;
+    __u16 flags = 0;
+    if (hw && bpf_ksym_exists(bpf_xdp_metadata_rx_timestamp) &&
+        bpf_xdp_metadata_rx_timestamp(ctx, &timestamp) == 0 && timestamp != 0) flags = PCAP_ENTRY_HW_TIMESTAMP;
+    else timestamp = bpf_ktime_get_ns();
+    count(PCAP_STAT_SEEN);
+
+    // Pointers to start and end of packet
+    void* data = (void*)(long)ctx->data;
+    void* data_end = (void*)(long)ctx->data_end;
+
+    __u32 caplen = data_end - data;                                        // Total captured length = end memory address - start memory address
+    __u32 len = caplen;                                                    // Original length, unless the IP header says otherwise
+
+    if (!config.filtered) {
+        // Filter for IPv4 only
+        struct ethhdr* eth = (struct ethhdr*)data;
+        if ((void*)(eth + 1) > data_end) goto parse_error;
+        if (eth->h_proto != __constant_htons(ETH_P_IP)) goto filtered;
+
+        // Filter for TCP and UDP only
+        struct iphdr* ip = (struct iphdr*)(eth + 1);
+        if ((void*)(ip + 1) > data_end) goto parse_error;
+        __u32 ip_header_length = ip->ihl * 4;
+        if (ip_header_length < IPV4_HEADER_MIN_SIZE || ip_header_length > IPV4_HEADER_MAX_SIZE || (void*)ip + ip_header_length > data_end) goto parse_error;
+        if (ip->protocol != IPPROTO_TCP && ip->protocol != IPPROTO_UDP) goto filtered;
+
+        len = sizeof(struct ethhdr) + __constant_ntohs(ip->tot_len);       // Total original length = ethernet frame + ip packet
+    }
+
+    // Before the ring and shedding see it: a duplicate should cost neither
+    if (config.dedup_window_ns && is_duplicate(ctx, data, data_end, hw ? bpf_ktime_get_ns() : timestamp)) {
+        count(PCAP_STAT_DUPLICATE);
+        return XDP_PASS;
+    }
+
+    // config.percpu is constant, so the verifier only ever sees one of the two
+    void* rb = &ringbuf;
+    if (config.percpu) {
+        __u32 cpu = bpf_get_smp_processor_id();
+        rb = bpf_map_lookup_elem(&ringbufs, &cpu);
+        if (!rb) {
+            count(PCAP_STAT_RINGBUF_FULL);
+            return XDP_PASS;
+        }
+    }
+
+    __u32 snaplen = config.snaplen;
+    if (snaplen == 0 || snaplen > MAX_PACKET_SIZE) snaplen = MAX_PACKET_SIZE;
+    if (config.policy) snaplen = policy_snaplen(data, data_end, snaplen);
+    if (config.shed) {
+        __u32 level = shed_level(rb, hw ? bpf_ktime_get_ns() : timestamp);
+        if (!shed_keep(data, data_end, level)) {
+            count(PCAP_STAT_SHED);
+            return XDP_PASS;
+        }
+        if (level > 0 && snaplen > SHED_SNAPLEN) snaplen = SHED_SNAPLEN;
+        flags |= level << PCAP_ENTRY_SHED_SHIFT;
+    }
+    if (caplen > snaplen) caplen = snaplen;                                // Truncate the packet if it's too big
+
+    // Reserve only as much of the ring buffer as this packet needs
+    SIZE_CLASS(64);
+    SIZE_CLASS(128);
+    SIZE_CLASS(192);
+    SIZE_CLASS(256);
+    SIZE_CLASS(512);
+    SIZE_CLASS(1024);
+    SIZE_CLASS(1536);
+    SIZE_CLASS(2048);
+    SIZE_CLASS(4096);
+    SIZE_CLASS(MAX_PACKET_SIZE);
+    return XDP_PASS;
+
+parse_error:
+    count(PCAP_STAT_PARSE_ERROR);
+    return XDP_PASS;
+filtered:
+    count(PCAP_STAT_FILTERED);
+    return XDP_PASS;
+}
+
+SEC("xdp")
+int xdp_prog(struct xdp_md* ctx) {
+    return capture_frame(ctx, 0);
+}
+
+/*
+    Stamps packets with the NIC's receive timestamp where the driver exposes one, falling back
+    to bpf_ktime_get_ns() per packet. It has to be loaded bound to the capture device
+    (xdp_pcap_user -H does that), and is not loaded otherwise.
+*/
+SEC("xdp")
+int xdp_prog_hwts(struct xdp_md* ctx) {
+    return capture_frame(ctx, 1);
+}
+
 // WILL FAIL WITHOUHT LICENSE!
 char _license[] SEC("license") = "GPL";
 
 /*
-    - It might be inefficient to create an empty array MAX_PACKET_SIZE bytes long every time.
-      Consider using bpf_ringbuf_output instead, although there will be more overhead.
+    - Size classes keep the waste per record under ~50% (much less for small frames) while
+      still giving the verifier a constant reservation size. bpf_ringbuf_output would allow
+      exact sizes but needs a per-CPU scratch buffer and an extra copy.
 
-    - Maybe its failing because there is a bunch of empty stuff
+    - Full-frame capture of jumbo frames needs a larger ring than RINGBUF_MAX_ENTRIES; the
+      user-space loader can resize it with -r.
 */
\ No newline at end of file
@@ -1,125 +1,1275 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
 #include <signal.h>
-#include <zlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/timex.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <net/if.h>
+#include <linux/if_link.h>
+#include <arpa/inet.h>
 #include <bpf/bpf.h>
 #include <bpf/libbpf.h>
 
+#include "capfile.h"
+#include "pgz.h"
+#include "xdp_filter.h"
+#include "metrics.h"
+
 #define MAP_PATH "/sys/fs/bpf/ringbuf"
+#define STATS_PATH "/sys/fs/bpf/pcap_stats"
+#define OBJ_PATH "bin/xdp_pcap_kern.o"
 #define OUTPUT_FILE "netflow.pcap.gz"
-#define MAX_PACKET_SIZE 256
+#define DEFAULT_SNAPLEN 256
+#define MAX_PACKET_SIZE 9216
+#define FILTER_MAX_LEN  4096
 
+#define STAGING_BUF_SIZE  (4 << 20)  // Bytes of pcap records collected before a buffer is handed off
+#define STAGING_BUF_COUNT 16         // Buffers in the pool; all are allocated up front
+#define FLUSH_INTERVAL_S  1          // Hand off a partially filled buffer after this long
+#define POLL_TIMEOUT_MS   100
 
-struct pcap_global_header {
-    __u32 magic_number;
-    __u16 version_major;
-    __u16 version_minor;
-    __u32 thiszone;
-    __u32 sigfigs;
-    __u32 snaplen;
-    __u32 network;
-};
+// Per-CPU rings (-C): smaller buffers, handed off sooner, so one quiet CPU doesn't hold up the merge
+#define PERCPU_STAGING_BUF_SIZE  (1 << 20)
+#define PERCPU_STAGING_BUFS      4           // Per ring, on top of STAGING_BUF_COUNT
+#define PERCPU_FLUSH_NS          (100 * 1000000ULL)
+#define MERGE_SLACK_NS           (10 * 1000000ULL)  // Allowance for a frame stamped but not yet in its ring
+#define MERGE_WAIT_MS            5
+#define STATS_INTERVAL_S  10         // How often the counters are printed
+#define CLOCK_SYNC_INTERVAL_S 1      // How often the monotonic to realtime offset is resampled
+#define CLOCK_SYNC_TRIES      5      // Samples per resync; the tightest bracket wins
+
+#ifndef BPF_F_XDP_DEV_BOUND_ONLY
+#define BPF_F_XDP_DEV_BOUND_ONLY (1U << 6)
+#endif
 
+// Variable-length entry as defined in kernel-level program
 struct pcap_entry {
-    __u32 timestamp_s;
-    __u32 timestamp_ns;
-    __u32 caplen;
+    __u64 timestamp;
     __u32 len;
-    __u8  data[MAX_PACKET_SIZE];
+    __u16 caplen;
+    __u16 flags;
+    __u8  data[];
+};
+
+#define PCAP_ENTRY_HW_TIMESTAMP 0x1
+#define PCAP_ENTRY_SHED_SHIFT   8
+#define PCAP_ENTRY_SHED_MASK    0xf
+#define SHED_SNAPLEN            128
+#define SHED_SUFFIX             ".shed"
+
+// Load-time configuration as defined in kernel-level program (.rodata)
+struct pcap_config {
+    __u32 snaplen;
+    __u32 filtered;
+    __u32 shed;
+    __u32 percpu;
+    __u64 dedup_window_ns;
+    __u32 policy;
+    __u32 policy_packets;
+    __u32 policy_payload;
+    __u32 pad;
+};
+
+// Key of policy_nets as defined in kernel-level program
+struct policy_net {
+    __u32 prefixlen;
+    __u32 addr;
+};
+
+// Capture policy (-P, -R): written into the program's config and rule maps before it is attached
+#define POLICY_MAX_RULES 64
+#define POLICY_PAYLOAD   512  // Bytes of payload in a flow's first packets when -P does not say
+
+struct policy_rule {
+    int   net;        // A prefix rule; otherwise a port rule
+    __u32 port;
+    __u32 addr;       // Network byte order
+    __u32 prefixlen;
+    __u32 snaplen;
+};
+
+struct capture_policy {
+    int                enabled;
+    __u32              packets;
+    __u32              payload;
+    int                nrules;
+    struct policy_rule rules[POLICY_MAX_RULES];
+};
+
+// Per-CPU outcome counters as defined in kernel-level program (pcap_stats)
+enum pcap_stat {
+    PCAP_STAT_SEEN,
+    PCAP_STAT_PARSE_ERROR,
+    PCAP_STAT_FILTERED,
+    PCAP_STAT_RINGBUF_FULL,
+    PCAP_STAT_COPY_ERROR,
+    PCAP_STAT_CAPTURED,
+    PCAP_STAT_SHED,
+    PCAP_STAT_DUPLICATE,
+    PCAP_STAT_MAX
+};
+
+static const char* pcap_stat_names[PCAP_STAT_MAX] = {
+    "seen", "parse_error", "filtered", "ringbuf_full", "copy_error", "captured", "shed", "duplicate"
 };
 
+// Record header in the staging buffers; the output is a nanosecond pcap
 struct pcap_pkthdr {
     __u32 ts_sec;
-    __u32 ts_usec;
+    __u32 ts_nsec;
     __u32 caplen;
     __u32 len;
 };
 
-static gzFile pcap_gz = NULL;
+/*
+    A staging buffer holds serialised pcap records (header + data) exactly as they will
+    appear in the output file. A ring's consumer fills one at a time and hands it to the
+    writer thread, which feeds the records to the capture file and returns it to the free pool.
+    Buffers are only ever recycled, never allocated on the packet path. All buffers are
+    staging_size bytes, which depends on the mode.
+*/
+struct staging_buf {
+    struct staging_buf* next;
+    size_t              used;
+    __u64               started;  // CLOCK_MONOTONIC ns when the first record went in
+    unsigned char       data[];
+};
+
+// A mutex-protected FIFO of staging buffers (used for both the free pool and the full queue)
+struct buf_queue {
+    struct staging_buf* head;
+    struct staging_buf* tail;
+    unsigned int        count;
+    int                 closed;
+    pthread_mutex_t     lock;
+    pthread_cond_t      cond;
+};
+
+/*
+    One ring buffer and everything that drains it. Without -C there is one, for the shared
+    ring, and the main thread polls it. With -C there is one per CPU, each polled by its own
+    thread pinned to that CPU. A ring's records come out in time order, so each consumer's
+    queue is a sorted stream of chunks, which the merge thread interleaves into the file.
+*/
+struct ring_consumer {
+    int                 cpu;        // -1 for the shared ring
+    int                 ring_fd;    // The per-CPU ring, -1 for the shared one (owned elsewhere)
+    struct ring_buffer* rb;
+    struct staging_buf* current;
+    struct buf_queue    full;       // Filled buffers, oldest first
+    __u64               watermark;  // -C: no record still to come from this ring is older (ns since the epoch)
+    int                 wake_fd;    // -C: eventfd the merge thread signals when it is waiting on this ring
+    int                 epoll_fd;   // -C: the ring and wake_fd, polled together
+    pthread_t           thread;
+
+    // Owned by whoever polls the ring; a reader elsewhere may see them a packet stale
+    unsigned long long  packets_seen;
+    unsigned long long  bytes_seen;
+    unsigned long long  packets_dropped;
+};
+
+static struct capfile* pcap_out = NULL;
+static int stats_fd = -1;
+
+static struct ring_consumer* consumers = NULL;
+static int                   nconsumers = 0;
+static size_t                staging_size = STAGING_BUF_SIZE;
+
+// The attached capture filter and the program array it jumps through, when -i is given a filter
+static int filter_fd = -1;
+static int filter_jmp_fd = -1;
+
+static struct buf_queue    free_bufs = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+static volatile int        writer_failed = 0;
+
+// Added to kernel (CLOCK_MONOTONIC) timestamps. Only the main thread writes it; without -C
+// that happens between polls, so each batch of records is converted consistently.
+static __s64 clock_offset_ns = 0;
+
+// Added to NIC (-H) timestamps: minus the kernel's TAI-UTC offset, or 0 with -T utc. It is
+// resampled with clock_offset_ns, so a leap second reaches both at the same time.
+static int   phc_utc = 0;
+static __s64 hw_offset_ns = 0;
+
+// -C: time of the oldest record the merge holds but cannot write yet, UINT64_MAX if none
+static __u64 merge_wanted = UINT64_MAX;
+
+/*
+    With -L, every change of the kernel's shedding level is logged to <output>.shed, stamped
+    with the first packet captured at the new level, so a reader knows which stretches of the
+    capture are truncated or sampled and at what rate. Consumers share it under shed_lock.
+*/
+static FILE*           shed_log = NULL;
+static unsigned int    shed_level = 0;
+static pthread_mutex_t shed_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void queue_push(struct buf_queue* q, struct staging_buf* buf) {
+    buf->next = NULL;
+    pthread_mutex_lock(&q->lock);
+    if (q->tail) q->tail->next = buf;
+    else q->head = buf;
+    q->tail = buf;
+    q->count++;
+    pthread_cond_signal(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+}
+
+// Pops the oldest buffer. If wait is zero this never blocks and returns NULL when empty;
+// otherwise it blocks until a buffer arrives or the queue is closed and drained.
+static struct staging_buf* queue_pop(struct buf_queue* q, int wait) {
+    pthread_mutex_lock(&q->lock);
+    while (wait && !q->head && !q->closed)
+        pthread_cond_wait(&q->cond, &q->lock);
+    struct staging_buf* buf = q->head;
+    if (buf) {
+        q->head = buf->next;
+        if (!q->head) q->tail = NULL;
+        q->count--;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return buf;
+}
+
+static void queue_close(struct buf_queue* q) {
+    pthread_mutex_lock(&q->lock);
+    q->closed = 1;
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+}
+
+static unsigned int queue_depth(struct buf_queue* q) {
+    pthread_mutex_lock(&q->lock);
+    unsigned int count = q->count;
+    pthread_mutex_unlock(&q->lock);
+    return count;
+}
+
+// True once the queue is closed and nothing is left in it
+static int queue_drained(struct buf_queue* q) {
+    pthread_mutex_lock(&q->lock);
+    int drained = q->closed && !q->head;
+    pthread_mutex_unlock(&q->lock);
+    return drained;
+}
+
+// Waits up to timeout_ms for the queue to be non-empty or closed
+static void queue_wait(struct buf_queue* q, int timeout_ms) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += timeout_ms * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    pthread_mutex_lock(&q->lock);
+    if (!q->head && !q->closed) pthread_cond_timedwait(&q->cond, &q->lock, &deadline);
+    pthread_mutex_unlock(&q->lock);
+}
+
+// Hands the consumer's current buffer (if it holds anything) to the writer thread
+static void flush_current(struct ring_consumer* c) {
+    if (!c->current || c->current->used == 0) return;
+    queue_push(&c->full, c->current);
+    c->current = NULL;
+}
+
+// Passes every record in a staging buffer to the capture file
+static int write_staged(struct staging_buf* buf) {
+    size_t off = 0;
+    while (off < buf->used) {
+        struct pcap_pkthdr* hdr = (struct pcap_pkthdr*)(buf->data + off);
+        if (capfile_write(pcap_out, hdr->ts_sec, hdr->ts_nsec, hdr->caplen, hdr->len, hdr + 1) < 0)
+            return -1;
+        off += sizeof(*hdr) + hdr->caplen;
+    }
+    return 0;
+}
+
+/*
+    Writes full buffers in the order they were queued, then recycles them. capfile only
+    copies into its chunk buffer (compression runs on the pgz worker threads), and a stall
+    there only backs up the queue; the poll thread keeps draining the ring buffer regardless.
+    Once the queue is empty the partial chunk is flushed, so a quiet link still reaches the
+    file (and its index) about once per FLUSH_INTERVAL_S.
+*/
+static void* writer_thread(void* arg) {
+    struct buf_queue* full = &consumers[0].full;
+    struct staging_buf* buf;
+    while ((buf = queue_pop(full, 1)) != NULL) {
+        if (!writer_failed && write_staged(buf) < 0) {
+            perror("capfile_write (packets)");
+            writer_failed = 1;
+        }
+        buf->used = 0;
+        queue_push(&free_bufs, buf);
+
+        if (!writer_failed && queue_depth(full) == 0 && capfile_flush(pcap_out) < 0) {
+            perror("capfile_flush");
+            writer_failed = 1;
+        }
+    }
+    return NULL;
+}
+
+static __u64 timespec_ns(const struct timespec* ts) {
+    return ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+static __u64 monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return timespec_ns(&ts);
+}
+
+static __u64 record_time(const struct pcap_pkthdr* hdr) {
+    return hdr->ts_sec * 1000000000ULL + hdr->ts_nsec;
+}
+
+/*
+    Merge mode (-C). Every ring is a stream; a binary min-heap holds the open streams, keyed by
+    the time of the next record in hand or, when a stream has nothing queued, by its
+    watermark. While the top of the heap is a record it is written out. When it is a waiting
+    stream, that ring could still deliver something older than everything in hand, so the
+    merge waits for it. It publishes the oldest record it holds in merge_wanted and wakes that
+    ring's consumer, which hands over its current buffer if it starts before that record and
+    republishes its watermark straight away, so a quiet ring costs the merge a wakeup rather
+    than a poll interval or PERCPU_FLUSH_NS.
+*/
+struct merge_stream {
+    struct ring_consumer* c;
+    struct staging_buf*   buf;  // Buffer being merged, NULL while waiting for one
+    size_t                off;
+    __u64                 key;
+};
+
+static int stream_before(const struct merge_stream* a, const struct merge_stream* b) {
+    if (a->key != b->key) return a->key < b->key;
+    return a->buf && !b->buf;  // On a tie, write rather than wait
+}
+
+static void heap_down(struct merge_stream** heap, int n, int i) {
+    for (;;) {
+        int least = i, l = 2 * i + 1, r = l + 1;
+        if (l < n && stream_before(heap[l], heap[least])) least = l;
+        if (r < n && stream_before(heap[r], heap[least])) least = r;
+        if (least == i) return;
+        struct merge_stream* tmp = heap[i];
+        heap[i] = heap[least];
+        heap[least] = tmp;
+        i = least;
+    }
+}
+
+/*
+    Takes the stream's next buffer if one is queued, and rekeys it. The watermark is read
+    before the queue: the consumer queues its records before publishing a watermark past them,
+    so a stream found empty really has nothing older than that watermark. Returns 0 once the
+    consumer has finished and everything it queued has been merged.
+*/
+static int stream_refresh(struct merge_stream* s) {
+    if (s->buf) return 1;
+    __u64 watermark = __atomic_load_n(&s->c->watermark, __ATOMIC_ACQUIRE);
+    s->buf = queue_pop(&s->c->full, 0);
+    if (s->buf) {
+        s->off = 0;
+        s->key = record_time((struct pcap_pkthdr*)s->buf->data);
+        return 1;
+    }
+    if (queue_drained(&s->c->full)) return 0;
+    s->key = watermark;
+    return 1;
+}
+
+static void* merge_thread(void* arg) {
+    struct merge_stream* streams = calloc(nconsumers, sizeof(*streams));
+    struct merge_stream** heap = calloc(nconsumers, sizeof(*heap));
+    if (!streams || !heap) {
+        perror("calloc (merge)");
+        writer_failed = 1;
+        return NULL;
+    }
+    int n = 0;
+    for (int i = 0; i < nconsumers; i++) {
+        streams[i].c = &consumers[i];
+        streams[i].key = 0;
+        heap[n++] = &streams[i];
+    }
+
+    __u64 last_flush = monotonic_ns();
+    while (n > 0) {
+        struct merge_stream* top = heap[0];
+        if (!top->buf) {
+            // Blocked on a ring: if a record is held up, tell the ring which, then look at every waiting stream again
+            __u64 wanted = UINT64_MAX;
+            for (int i = 0; i < n; i++)
+                if (heap[i]->buf && heap[i]->key < wanted) wanted = heap[i]->key;
+            if (wanted != UINT64_MAX) {
+                __u64 one = 1;
+                __atomic_store_n(&merge_wanted, wanted, __ATOMIC_RELEASE);
+                if (write(top->c->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) perror("write (merge wakeup)");
+            }
+            queue_wait(&top->c->full, MERGE_WAIT_MS);
+            for (int i = 0; i < n; ) {
+                if (stream_refresh(heap[i])) {
+                    i++;
+                    continue;
+                }
+                heap[i] = heap[--n];
+            }
+            for (int i = n / 2 - 1; i >= 0; i--) heap_down(heap, n, i);
+
+            // Like the single-ring writer, push a partial chunk out when there is a lull
+            if (!writer_failed && monotonic_ns() - last_flush >= FLUSH_INTERVAL_S * 1000000000ULL) {
+                if (capfile_flush(pcap_out) < 0) {
+                    perror("capfile_flush");
+                    writer_failed = 1;
+                }
+                last_flush = monotonic_ns();
+            }
+            continue;
+        }
+
+        struct pcap_pkthdr* hdr = (struct pcap_pkthdr*)(top->buf->data + top->off);
+        if (!writer_failed && capfile_write(pcap_out, hdr->ts_sec, hdr->ts_nsec, hdr->caplen, hdr->len, hdr + 1) < 0) {
+            perror("capfile_write (packets)");
+            writer_failed = 1;
+        }
+        top->off += sizeof(*hdr) + hdr->caplen;
+        if (top->off < top->buf->used) {
+            top->key = record_time((struct pcap_pkthdr*)(top->buf->data + top->off));
+        } else {
+            top->buf->used = 0;
+            queue_push(&free_bufs, top->buf);
+            top->buf = NULL;
+            if (!stream_refresh(top)) heap[0] = heap[--n];
+        }
+        heap_down(heap, n, 0);
+    }
+
+    free(heap);
+    free(streams);
+    return NULL;
+}
+
+/*
+    Returns CLOCK_REALTIME - CLOCK_MONOTONIC. Each try brackets one realtime read between two
+    monotonic reads and takes the midpoint; the try with the narrowest bracket was the least
+    disturbed by preemption, so its error is bounded by half that width (tens of ns).
+*/
+static __s64 sample_clock_offset(void) {
+    __s64 best_offset = 0;
+    __u64 best_width = UINT64_MAX;
+    for (int i = 0; i < CLOCK_SYNC_TRIES; i++) {
+        struct timespec before, real, after;
+        clock_gettime(CLOCK_MONOTONIC, &before);
+        clock_gettime(CLOCK_REALTIME, &real);
+        clock_gettime(CLOCK_MONOTONIC, &after);
+        __u64 width = timespec_ns(&after) - timespec_ns(&before);
+        if (width < best_width) {
+            best_width = width;
+            best_offset = (__s64)(timespec_ns(&real) - (timespec_ns(&before) + width / 2));
+        }
+    }
+    return best_offset;
+}
+
+/*
+    Returns the offset that turns a NIC timestamp into UTC. A PHC disciplined by ptp4l runs on
+    TAI, which is ahead of UTC by the offset the kernel keeps in adjtimex()'s tai field (set by
+    ptp4l/phc2sys or chronyd); -T utc is for a NIC clock that was set to UTC instead.
+*/
+static __s64 sample_hw_offset(void) {
+    struct timex tx = {0};
+    if (phc_utc || adjtimex(&tx) < 0) return 0;
+    return -(__s64)tx.tai * 1000000000;
+}
+
+static void log_shed_level(unsigned int level, __u32 ts_sec, __u32 ts_nsec) {
+    pthread_mutex_lock(&shed_lock);
+    if (level == shed_level) {
+        pthread_mutex_unlock(&shed_lock);
+        return;
+    }
+    __atomic_store_n(&shed_level, level, __ATOMIC_RELAXED);
+    if (!shed_log) {
+        pthread_mutex_unlock(&shed_lock);
+        return;
+    }
+    if (level == 0)
+        fprintf(shed_log, "%u.%09u level=0 full capture\n", ts_sec, ts_nsec);
+    else if (level == 1)
+        fprintf(shed_log, "%u.%09u level=1 snaplen=%d sample=1/1\n", ts_sec, ts_nsec, SHED_SNAPLEN);
+    else
+        fprintf(shed_log, "%u.%09u level=%u snaplen=%d sample=1/%u\n", ts_sec, ts_nsec, level, SHED_SNAPLEN, 1U << (level - 1));
+    fflush(shed_log);
+    pthread_mutex_unlock(&shed_lock);
+}
 
 static int handle_event(void* ctx, void* data, size_t size) {
+    struct ring_consumer* c = ctx;
     struct pcap_entry* entry = data;
+    if (size < sizeof(*entry) || entry->caplen > size - sizeof(*entry)) {
+        fprintf(stderr, "Skipping malformed ring buffer record (%zu bytes)\n", size);
+        return 0;
+    }
+
+    // Hardware stamps come from the NIC clock, software ones from CLOCK_MONOTONIC
+    __u64 ts = entry->timestamp;
+    if (entry->flags & PCAP_ENTRY_HW_TIMESTAMP) ts += __atomic_load_n(&hw_offset_ns, __ATOMIC_RELAXED);
+    else ts += __atomic_load_n(&clock_offset_ns, __ATOMIC_RELAXED);
     struct pcap_pkthdr hdr = {
-        .ts_sec = entry->timestamp_s,
-        .ts_usec = entry->timestamp_ns / 1000,
+        .ts_sec = ts / 1000000000,
+        .ts_nsec = ts % 1000000000,
         .caplen = entry->caplen,
         .len = entry->len
     };
+    size_t record_size = sizeof(hdr) + entry->caplen;
 
-    if (gzwrite(pcap_gz, &hdr, sizeof(hdr)) != sizeof(hdr)) {
-        perror("gzwrite (header)");
-        return -1;
-    }
+    // CPUs racing across a change can interleave a few records of each level; the log follows
+    unsigned int level = (entry->flags >> PCAP_ENTRY_SHED_SHIFT) & PCAP_ENTRY_SHED_MASK;
+    if (level != __atomic_load_n(&shed_level, __ATOMIC_RELAXED)) log_shed_level(level, hdr.ts_sec, hdr.ts_nsec);
 
-    if (gzwrite(pcap_gz, entry->data, entry->caplen) != entry->caplen) {
-        perror("gzwrite (data)");
-        return -1;
+    if (c->current && c->current->used + record_size > staging_size)
+        flush_current(c);
+
+    // Never wait for the writer here. If every buffer is queued, the record is dropped
+    // and counted instead of letting the kernel ring overflow behind our back.
+    if (!c->current) {
+        c->current = queue_pop(&free_bufs, 0);
+        if (!c->current) {
+            c->packets_dropped++;
+            return 0;
+        }
+        c->current->started = monotonic_ns();
     }
 
-    printf("Packet written: %u bytes\n", entry->len);
+    memcpy(c->current->data + c->current->used, &hdr, sizeof(hdr));
+    memcpy(c->current->data + c->current->used + sizeof(hdr), entry->data, entry->caplen);
+    c->current->used += record_size;
+
+    c->packets_seen++;
+    c->bytes_seen += record_size;
     return 0;
 }
 
 static volatile sig_atomic_t stop = 0;
+
+/*
+    Sets up what a per-CPU consumer waits on: its ring's epoll fd and an eventfd the merge
+    thread uses to wake it, in one epoll set.
+*/
+static int consumer_wakeup_init(struct ring_consumer* c) {
+    c->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    c->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (c->wake_fd < 0 || c->epoll_fd < 0) return -1;
+
+    struct epoll_event ring_ev = { .events = EPOLLIN, .data.fd = ring_buffer__epoll_fd(c->rb) };
+    struct epoll_event wake_ev = { .events = EPOLLIN, .data.fd = c->wake_fd };
+    if (epoll_ctl(c->epoll_fd, EPOLL_CTL_ADD, ring_ev.data.fd, &ring_ev) < 0) return -1;
+    return epoll_ctl(c->epoll_fd, EPOLL_CTL_ADD, c->wake_fd, &wake_ev);
+}
+
+/*
+    Consumer for one per-CPU ring (-C). Each pass drains the ring, so afterwards nothing older
+    than a moment ago (MERGE_SLACK_NS, for frames still being written) can arrive, apart from
+    what sits in the current buffer; that is the watermark. The current buffer is handed over
+    after PERCPU_FLUSH_NS, or at once when the merge is waiting on a record it starts before.
+*/
+static void* consumer_thread(void* arg) {
+    struct ring_consumer* c = arg;
+
+    // Best effort: an offline CPU, or a cpuset that excludes it, just leaves the thread unpinned
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(c->cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+
+    while (!stop && !writer_failed) {
+        struct epoll_event events[2];
+        if (epoll_wait(c->epoll_fd, events, 2, POLL_TIMEOUT_MS) < 0 && errno != EINTR) {
+            fprintf(stderr, "Error waiting on ring buffer of CPU %d: %s\n", c->cpu, strerror(errno));
+            break;
+        }
+        int err = ring_buffer__consume(c->rb);
+        if (err < 0 && err != -EINTR) {
+            fprintf(stderr, "Error polling ring buffer of CPU %d: %s\n", c->cpu, strerror(-err));
+            break;
+        }
+        __u64 woken;
+        if (read(c->wake_fd, &woken, sizeof(woken)) < 0) woken = 0;
+
+        __u64 now = monotonic_ns();
+        if (c->current && (now - c->current->started >= PERCPU_FLUSH_NS ||
+                           (woken && record_time((struct pcap_pkthdr*)c->current->data) <= __atomic_load_n(&merge_wanted, __ATOMIC_ACQUIRE))))
+            flush_current(c);
+
+        __u64 watermark = now + __atomic_load_n(&clock_offset_ns, __ATOMIC_RELAXED) - MERGE_SLACK_NS;
+        if (c->current) {
+            __u64 pending = record_time((struct pcap_pkthdr*)c->current->data);
+            if (pending < watermark) watermark = pending;
+        }
+        // Hardware stamps can run a little behind; never let the watermark go backwards
+        if (watermark > c->watermark) __atomic_store_n(&c->watermark, watermark, __ATOMIC_RELEASE);
+    }
+
+    flush_current(c);
+    queue_close(&c->full);
+    return NULL;
+}
+
+// Sums the consumers' counters; returns the number of buffers queued for the writer
+static unsigned int totals(unsigned long long* packets, unsigned long long* bytes, unsigned long long* dropped) {
+    unsigned int queued = 0;
+    *packets = *bytes = *dropped = 0;
+    for (int i = 0; i < nconsumers; i++) {
+        *packets += consumers[i].packets_seen;
+        *bytes += consumers[i].bytes_seen;
+        *dropped += consumers[i].packets_dropped;
+        queued += queue_depth(&consumers[i].full);
+    }
+    return queued;
+}
+
+/*
+    Metrics collector for everything this tool counts itself: the kernel program's outcome
+    counters, then what happened to the records after they left the ring buffer. Read
+    together, they say at which stage packets went missing.
+*/
+static void collect_metrics(FILE* out, void* arg) {
+    if (stats_fd >= 0) {
+        int ncpus = libbpf_num_possible_cpus();
+        __u64 values[ncpus > 0 ? ncpus : 1];
+        metrics_family(out, "xdp_pcap_kernel_packets_total", "counter", "Frames seen by the XDP capture program, by outcome");
+        for (__u32 key = 0; ncpus > 0 && key < PCAP_STAT_MAX; key++) {
+            if (bpf_map_lookup_elem(stats_fd, &key, values)) continue;
+            unsigned long long total = 0;
+            for (int cpu = 0; cpu < ncpus; cpu++) total += values[cpu];
+            fprintf(out, "xdp_pcap_kernel_packets_total{outcome=\"%s\"} %llu\n", pcap_stat_names[key], total);
+        }
+    }
+
+    unsigned long long packets, bytes, dropped;
+    unsigned int queued = totals(&packets, &bytes, &dropped);
+    metrics_family(out, "xdp_pcap_staged_packets_total", "counter", "Records copied from the ring buffer into staging buffers");
+    fprintf(out, "xdp_pcap_staged_packets_total %llu\n", packets);
+    metrics_family(out, "xdp_pcap_staged_bytes_total", "counter", "Bytes of pcap records staged");
+    fprintf(out, "xdp_pcap_staged_bytes_total %llu\n", bytes);
+    metrics_family(out, "xdp_pcap_staging_dropped_total", "counter", "Records dropped because every staging buffer was queued for the writer");
+    fprintf(out, "xdp_pcap_staging_dropped_total %llu\n", dropped);
+    metrics_family(out, "xdp_pcap_staging_queued", "gauge", "Staging buffers waiting for the writer thread");
+    fprintf(out, "xdp_pcap_staging_queued %u\n", queued);
+    metrics_family(out, "xdp_pcap_staging_free", "gauge", "Staging buffers free for the poll thread");
+    fprintf(out, "xdp_pcap_staging_free %u\n", queue_depth(&free_bufs));
+    metrics_family(out, "xdp_pcap_shed_level", "gauge", "Load shedding level of the latest record: 0 none, 1 headers only, n headers and 1 in 2^(n-1) flows");
+    fprintf(out, "xdp_pcap_shed_level %u\n", __atomic_load_n(&shed_level, __ATOMIC_RELAXED));
+}
+
 static void handle_signal(int sig) {
     stop = 1;
 }
 
-int main() {
-    signal(SIGINT, handle_signal);
+static void usage(const char* prog) {
+    fprintf(stderr,
+        "Usage: %s [-i interface [-S] [-H [-T tai|utc]] [-L] [-C] [-u usecs] [-P packets[:bytes] [-R rule]...] [-r ring-bytes]]\n"
+        "        [-s snaplen] [-o file] [-F format] [-D] [-m listen] [filter]\n"
+        "    -i  load " OBJ_PATH " and attach it to interface; without this the\n"
+        "        ring buffer already pinned at " MAP_PATH " is used\n"
+        "    -S  attach in generic (skb) mode\n"
+        "    -H  use the NIC's receive timestamps where the driver provides them (kernel 6.3+,\n"
+        "        not with a filter); the NIC clock should be synced, e.g. by ptp4l\n"
+        "    -T  timescale of the NIC clock: tai (default, as ptp4l runs it; converted with the\n"
+        "        kernel's TAI-UTC offset) or utc\n"
+        "    -L  shed load when the ring buffer fills: first cut frames to %d bytes, then sample\n"
+        "        1 in 2, 4 ... 128 flows, stepping back up as the pressure clears; the levels\n"
+        "        are logged to <file>" SHED_SUFFIX "\n"
+        "    -C  give every CPU its own ring buffer and consumer thread, and merge them into\n"
+        "        one time-ordered file; for links one ring and one thread cannot keep up with\n"
+        "    -u  drop frames that repeat one seen less than this many microseconds ago, as\n"
+        "        both directions of a SPAN or aggregated TAP ports deliver; MACs, VLAN tags and\n"
+        "        TTL may differ between the copies\n"
+        "    -P  capture IPv4 frames by protocol instead of to a fixed snaplen: the L2-L4 headers\n"
+        "        only, except that the first packets of each flow also keep bytes of payload\n"
+        "        (default %d; e.g. 8:512 for handshakes and enough to identify the application);\n"
+        "        -s then only applies to frames that are not IPv4\n"
+        "    -R  with -P, capture more of the frames to or from a port or prefix: 443, 53=512,\n"
+        "        10.1.0.0/16; whole frames unless =bytes is given. Repeatable, up to %d rules\n"
+        "    -r  ring buffer size in bytes, a power of 2 multiple of the page size; with -C,\n"
+        "        the size of each CPU's ring\n"
+        "    -s  bytes of each packet to capture, 0 for the full frame (default %d); needs -i\n"
+        "    -o  output file (default " OUTPUT_FILE ")\n"
+        "    -F  gzip (default), or columnar: each field of the headers in a column of its own,\n"
+        "        for smaller files in less CPU time; columnar:payload=huffman,header=rle picks\n"
+        "        a codec (store, deflate, huffman or rle) per column. pcap_extract reads both;\n"
+        "        colcap2pcap converts a columnar capture back to pcap\n"
+        "    -l  compression level (default %d)\n"
+        "    -w  compression threads (default: one per CPU)\n"
+        "    -D  write with O_DIRECT, bypassing the page cache\n"
+        "    -m  serve Prometheus metrics on a port, host:port or unix socket path\n"
+        "    filter is a pcap-filter(7) expression, evaluated in the kernel before a frame is\n"
+        "    copied to the ring buffer; it needs -i. Without it only IPv4 TCP/UDP is captured.\n", prog, SHED_SNAPLEN, POLICY_PAYLOAD, POLICY_MAX_RULES, DEFAULT_SNAPLEN, PGZ_DEFAULT_LEVEL);
+    exit(EXIT_FAILURE);
+}
 
-    int map_fd = bpf_obj_get(MAP_PATH);
-    if (map_fd < 0) {
-        fprintf(stderr, "Failed to open BPF map at %s: %s\n", MAP_PATH, strerror(errno));
-        exit(EXIT_FAILURE);
+// Parses -P packets[:bytes]
+static int parse_policy(const char* arg, struct capture_policy* policy) {
+    char* end;
+    policy->packets = strtoul(arg, &end, 10);
+    if (end == arg) return -1;
+    policy->payload = POLICY_PAYLOAD;
+    if (*end == ':') {
+        const char* bytes = end + 1;
+        policy->payload = strtoul(bytes, &end, 10);
+        if (end == bytes) return -1;
     }
+    if (*end != '\0') return -1;
+    policy->enabled = 1;
+    return 0;
+}
 
-    struct ring_buffer* ringbuf = ring_buffer__new(map_fd, handle_event, NULL, NULL);
-    if (!ringbuf) {
-        fprintf(stderr, "Failed to create ring buffer: %s\n", strerror(errno));
-        close(map_fd);
-        exit(EXIT_FAILURE);
+// Parses -R port[=bytes] or -R address[/prefix][=bytes]; without bytes, the frames are kept whole
+static int parse_rule(const char* arg, struct capture_policy* policy) {
+    if (policy->nrules == POLICY_MAX_RULES) return -1;
+    struct policy_rule* rule = &policy->rules[policy->nrules];
+    char what[64];
+    const char* eq = strchr(arg, '=');
+    snprintf(what, sizeof(what), "%.*s", eq ? (int)(eq - arg) : (int)strlen(arg), arg);
+
+    char* end;
+    rule->snaplen = MAX_PACKET_SIZE;
+    if (eq) {
+        rule->snaplen = strtoul(eq + 1, &end, 10);
+        if (end == eq + 1 || *end != '\0' || rule->snaplen == 0) return -1;
+    }
+
+    char* slash = strchr(what, '/');
+    rule->net = slash || strchr(what, '.');
+    if (rule->net) {
+        rule->prefixlen = 32;
+        if (slash) {
+            *slash = '\0';
+            rule->prefixlen = strtoul(slash + 1, &end, 10);
+            if (end == slash + 1 || *end != '\0' || rule->prefixlen > 32) return -1;
+        }
+        if (inet_pton(AF_INET, what, &rule->addr) != 1) return -1;
+        if (rule->prefixlen < 32) rule->addr &= rule->prefixlen ? htonl(~0U << (32 - rule->prefixlen)) : 0;
+    } else {
+        rule->port = strtoul(what, &end, 10);
+        if (end == what || *end != '\0' || rule->port == 0 || rule->port > 65535) return -1;
+    }
+    policy->nrules++;
+    return 0;
+}
+
+/*
+    Fills in policy_ports and policy_nets. Two rules for one port keep the longer snaplen; an
+    address matches only its most specific prefix (that is what the LPM trie looks up), and a
+    repeated prefix takes the last rule given.
+*/
+static int write_policy_rules(struct bpf_object* obj, const struct capture_policy* policy) {
+    int ports_fd = bpf_object__find_map_fd_by_name(obj, "policy_ports");
+    int nets_fd = bpf_object__find_map_fd_by_name(obj, "policy_nets");
+    if (ports_fd < 0 || nets_fd < 0) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    for (int i = 0; i < policy->nrules; i++) {
+        const struct policy_rule* rule = &policy->rules[i];
+        __u32 snaplen = rule->snaplen > MAX_PACKET_SIZE ? MAX_PACKET_SIZE : rule->snaplen;
+        __u32 old;
+        int err;
+        if (rule->net) {
+            struct policy_net key = { .prefixlen = rule->prefixlen, .addr = rule->addr };
+            err = bpf_map_update_elem(nets_fd, &key, &snaplen, BPF_ANY);
+        } else {
+            if (bpf_map_lookup_elem(ports_fd, &rule->port, &old) == 0 && old > snaplen) continue;
+            err = bpf_map_update_elem(ports_fd, &rule->port, &snaplen, BPF_ANY);
+        }
+        if (err) return -1;
+    }
+    return 0;
+}
+
+/*
+    Compiles the filter expression and loads it as an XDP program that tail-calls the capture
+    program on a match. Returns the filter program's fd, or -1 after printing why.
+*/
+static int load_filter(const char* filter, int capture_fd) {
+    struct cbpf_insn* insns;
+    char errbuf[256];
+    int count = filter_compile(filter, &insns, errbuf, sizeof(errbuf));
+    if (count < 0) {
+        fprintf(stderr, "Invalid filter \"%s\": %s\n", filter, errbuf);
+        return -1;
+    }
+
+    static char log[65536];
+    int fd = xdp_filter_load(insns, count, capture_fd, &filter_jmp_fd, log, sizeof(log));
+    if (fd < 0) fprintf(stderr, "Failed to load filter \"%s\": %s\n%s", filter, strerror(errno), log);
+    free(insns);
+    return fd;
+}
+
+/*
+    Opens the kernel object, writes the snaplen into its .rodata config before the verifier
+    sees it, optionally resizes the ring buffer, then loads and attaches the program. With a
+    filter, the filter program is attached instead and the capture program only runs behind
+    it. Only one of the two capture programs is loaded: xdp_prog_hwts has to be bound to the
+    device for the timestamp kfunc, and a device-bound program cannot be a tail call target.
+    With percpu, a ring per possible CPU is created and put in ringbufs, and consumers[] is
+    set up with one entry per ring. Returns the (shared) ring buffer's fd, or -1 with errno set.
+*/
+static int load_and_attach(struct bpf_object** objp, int ifindex, __u32 xdp_flags, __u32 snaplen, __u32 ring_size, const char* filter, int hw_timestamps, int shed, int percpu, __u64 dedup_ns,
+                           const struct capture_policy* policy) {
+    struct bpf_object* obj = bpf_object__open_file(OBJ_PATH, NULL);
+    if (libbpf_get_error(obj)) return -1;
+    *objp = obj;
+
+    size_t config_size;
+    struct bpf_map* rodata = bpf_object__find_map_by_name(obj, ".rodata");
+    struct pcap_config* config = rodata ? bpf_map__initial_value(rodata, &config_size) : NULL;
+    if (!config || config_size < sizeof(*config)) {
+        errno = ENOENT;
+        return -1;
+    }
+    config->snaplen = snaplen;
+    config->filtered = filter != NULL;
+    config->shed = shed;
+    config->percpu = percpu;
+    config->dedup_window_ns = dedup_ns;
+    config->policy = policy->enabled;
+    config->policy_packets = policy->packets;
+    config->policy_payload = policy->payload;
+
+    struct bpf_map* ringbuf = bpf_object__find_map_by_name(obj, "ringbuf");
+    struct bpf_map* ringbufs = bpf_object__find_map_by_name(obj, "ringbufs");
+    if (!ringbuf || !ringbufs) {
+        errno = ENOENT;
+        return -1;
+    }
+    if (ring_size && bpf_map__set_max_entries(ringbuf, ring_size)) return -1;
+
+    int ncpus = libbpf_num_possible_cpus();
+    if (ncpus < 0) {
+        errno = -ncpus;
+        return -1;
+    }
+    if (percpu && bpf_map__set_max_entries(ringbufs, ncpus)) return -1;
+
+    struct bpf_program* prog = bpf_object__find_program_by_name(obj, hw_timestamps ? "xdp_prog_hwts" : "xdp_prog");
+    struct bpf_program* unused = bpf_object__find_program_by_name(obj, hw_timestamps ? "xdp_prog" : "xdp_prog_hwts");
+    if (!prog) {
+        errno = ENOENT;
+        return -1;
+    }
+    if (unused) bpf_program__set_autoload(unused, false);
+    if (hw_timestamps) {
+        bpf_program__set_ifindex(prog, ifindex);
+        bpf_program__set_flags(prog, bpf_program__flags(prog) | BPF_F_XDP_DEV_BOUND_ONLY);
+    }
+
+    if (bpf_object__load(obj)) return -1;
+
+    int prog_fd = bpf_program__fd(prog);
+    if (filter) {
+        filter_fd = load_filter(filter, prog_fd);
+        if (filter_fd < 0) {
+            errno = EINVAL;
+            return -1;
+        }
+        prog_fd = filter_fd;
+    }
+    // Rings go in before the program is attached, so no CPU ever finds its slot empty
+    if (percpu) {
+        __u32 size = ring_size ? ring_size : bpf_map__max_entries(bpf_map__inner_map(ringbufs));
+        consumers = calloc(ncpus, sizeof(*consumers));
+        if (!consumers) return -1;
+        for (int cpu = 0; cpu < ncpus; cpu++) {
+            consumers[cpu].cpu = cpu;
+            consumers[cpu].wake_fd = consumers[cpu].epoll_fd = -1;
+            consumers[cpu].ring_fd = bpf_map_create(BPF_MAP_TYPE_RINGBUF, NULL, 0, 0, size, NULL);
+            nconsumers++;
+            if (consumers[cpu].ring_fd < 0) return -1;
+            __u32 key = cpu;
+            if (bpf_map_update_elem(bpf_map__fd(ringbufs), &key, &consumers[cpu].ring_fd, BPF_ANY)) return -1;
+        }
     }
 
-    pcap_gz = gzopen(OUTPUT_FILE, "wb");
-    if (!pcap_gz) {
-        fprintf(stderr, "Failed to open pcap.gz file: %s\n", strerror(errno));
-        ring_buffer__free(ringbuf);
+    if (write_policy_rules(obj, policy)) return -1;
+
+    if (bpf_xdp_attach(ifindex, prog_fd, xdp_flags, NULL)) return -1;
+    stats_fd = bpf_object__find_map_fd_by_name(obj, "pcap_stats");
+    return bpf_map__fd(ringbuf);
+}
+
+// Undoes load_and_attach(), or just closes the pinned map when nothing was loaded
+static void detach(struct bpf_object* obj, int ifindex, __u32 xdp_flags, int map_fd) {
+    if (!obj) {
+        if (stats_fd >= 0) close(stats_fd);
         close(map_fd);
+        return;
+    }
+    bpf_xdp_detach(ifindex, xdp_flags, NULL);
+    if (filter_fd >= 0) close(filter_fd);
+    if (filter_jmp_fd >= 0) close(filter_jmp_fd);
+    for (int i = 0; i < nconsumers; i++) {
+        if (consumers[i].ring_fd >= 0) close(consumers[i].ring_fd);
+        if (consumers[i].wake_fd >= 0) close(consumers[i].wake_fd);
+        if (consumers[i].epoll_fd >= 0) close(consumers[i].epoll_fd);
+    }
+    bpf_object__close(obj);
+}
+
+/*
+    Returns an fd for the .rodata of the program that writes to the ring: the xdp_prog
+    (or xdp_prog_hwts) that references the ring's map id. Without -i that program was loaded
+    before this tool started, so its config is only found this way. -1 if there is none.
+*/
+static int find_rodata(int ring_fd) {
+    struct bpf_map_info ring_info = {0};
+    __u32 info_len = sizeof(ring_info);
+    if (bpf_obj_get_info_by_fd(ring_fd, &ring_info, &info_len)) return -1;
+
+    __u32 id = 0;
+    while (bpf_prog_get_next_id(id, &id) == 0) {
+        int prog_fd = bpf_prog_get_fd_by_id(id);
+        if (prog_fd < 0) continue;
+        __u32 map_ids[16];
+        struct bpf_prog_info info = { .nr_map_ids = 16, .map_ids = (__u64)(unsigned long)map_ids };
+        info_len = sizeof(info);
+        int err = bpf_obj_get_info_by_fd(prog_fd, &info, &info_len);
+        close(prog_fd);
+        if (err || info.type != BPF_PROG_TYPE_XDP) continue;
+
+        __u32 nmaps = info.nr_map_ids < 16 ? info.nr_map_ids : 16;
+        int uses_ring = 0;
+        for (__u32 i = 0; i < nmaps; i++)
+            if (map_ids[i] == ring_info.id) uses_ring = 1;
+        for (__u32 i = 0; uses_ring && i < nmaps; i++) {
+            int map_fd = bpf_map_get_fd_by_id(map_ids[i]);
+            if (map_fd < 0) continue;
+            struct bpf_map_info map_info = {0};
+            info_len = sizeof(map_info);
+            const char* suffix = bpf_obj_get_info_by_fd(map_fd, &map_info, &info_len) ? NULL : strrchr(map_info.name, '.');
+            if (suffix && strcmp(suffix, ".rodata") == 0) return map_fd;
+            close(map_fd);
+        }
+    }
+    return -1;
+}
+
+// Reads the config at the start of a loaded program's .rodata
+static int read_config(int rodata_fd, struct pcap_config* config) {
+    struct bpf_map_info info = {0};
+    __u32 info_len = sizeof(info);
+    if (rodata_fd < 0 || bpf_obj_get_info_by_fd(rodata_fd, &info, &info_len) || info.value_size < sizeof(*config)) return -1;
+
+    void* rodata = malloc(info.value_size);
+    __u32 zero = 0;
+    int err = !rodata || bpf_map_lookup_elem(rodata_fd, &zero, rodata) ? -1 : 0;
+    if (!err) memcpy(config, rodata, sizeof(*config));
+    free(rodata);
+    return err;
+}
+
+int main(int argc, char* argv[]) {
+    char ifname[IF_NAMESIZE] = "";
+    const char* output = OUTPUT_FILE;
+    __u32 snaplen = DEFAULT_SNAPLEN;
+    int snaplen_given = 0;
+    __u32 ring_size = 0;
+    __u32 xdp_flags = XDP_FLAGS_DRV_MODE;
+    struct bpf_object* obj = NULL;
+    int ifindex = 0;
+    int map_fd;
+    int c;
+
+    int level = PGZ_DEFAULT_LEVEL;
+    int workers = 0;
+    int hw_timestamps = 0;
+    int phc_given = 0;
+    int direct = 0;
+    int shed = 0;
+    int percpu = 0;
+    __u64 dedup_us = 0;
+    static struct capture_policy policy;
+    int columnar = 0;
+    const char* columns = NULL;
+    const char* metrics_listen = NULL;
+
+    while ((c = getopt(argc, argv, "i:SHT:LCu:P:R:r:s:o:F:l:w:Dm:h")) != -1) {
+        switch (c) {
+            case 'i': snprintf(ifname, sizeof(ifname), "%s", optarg); break;
+            case 'S': xdp_flags = XDP_FLAGS_SKB_MODE; break;
+            case 'H': hw_timestamps = 1; break;
+            case 'T':
+                if (strcmp(optarg, "utc") == 0) phc_utc = 1;
+                else if (strcmp(optarg, "tai") != 0) usage(argv[0]);
+                phc_given = 1;
+                break;
+            case 'L': shed = 1; break;
+            case 'C': percpu = 1; break;
+            case 'u': dedup_us = strtoull(optarg, NULL, 10); break;
+            case 'P':
+            case 'R':
+                if ((c == 'P' ? parse_policy : parse_rule)(optarg, &policy)) {
+                    fprintf(stderr, "Invalid -%c %s\n", c, optarg);
+                    usage(argv[0]);
+                }
+                break;
+            case 'r': ring_size = strtoul(optarg, NULL, 0); break;
+            case 's':
+                snaplen = strtoul(optarg, NULL, 10);
+                snaplen_given = 1;
+                break;
+            case 'o': output = optarg; break;
+            case 'F':
+                if (strncmp(optarg, "columnar", 8) == 0 && (optarg[8] == '\0' || optarg[8] == ':')) {
+                    columnar = 1;
+                    if (optarg[8] == ':') columns = optarg + 9;
+                } else if (strcmp(optarg, "gzip") != 0) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'l': level = atoi(optarg); break;
+            case 'w': workers = atoi(optarg); break;
+            case 'D': direct = 1; break;
+            case 'm': metrics_listen = optarg; break;
+            default: usage(argv[0]);
+        }
+    }
+    if (snaplen > MAX_PACKET_SIZE) snaplen = MAX_PACKET_SIZE;
+
+    // Remaining arguments form the filter, as with tcpdump
+    char filter[FILTER_MAX_LEN] = "";
+    for (int i = optind; i < argc; i++) {
+        if (i > optind) strncat(filter, " ", sizeof(filter) - strlen(filter) - 1);
+        strncat(filter, argv[i], sizeof(filter) - strlen(filter) - 1);
+    }
+    if (filter[0] != '\0' && ifname[0] == '\0') {
+        fprintf(stderr, "A filter needs -i: the program behind " MAP_PATH " is already attached\n");
+        exit(EXIT_FAILURE);
+    }
+    if (hw_timestamps && (ifname[0] == '\0' || filter[0] != '\0')) {
+        fprintf(stderr, "-H needs -i and cannot be combined with a filter\n");
+        exit(EXIT_FAILURE);
+    }
+    if (phc_given && !hw_timestamps) {
+        fprintf(stderr, "-T needs -H: it only applies to the NIC's timestamps\n");
+        exit(EXIT_FAILURE);
+    }
+    if (shed && ifname[0] == '\0') {
+        fprintf(stderr, "-L needs -i: the program behind " MAP_PATH " is already configured\n");
         exit(EXIT_FAILURE);
     }
+    if (snaplen_given && ifname[0] == '\0') {
+        fprintf(stderr, "-s needs -i: the program behind " MAP_PATH " is already configured\n");
+        exit(EXIT_FAILURE);
+    }
+    if (dedup_us && ifname[0] == '\0') {
+        fprintf(stderr, "-u needs -i: the program behind " MAP_PATH " is already configured\n");
+        exit(EXIT_FAILURE);
+    }
+    if (policy.nrules && !policy.enabled) {
+        fprintf(stderr, "-R needs -P: rules only raise the length the policy picks\n");
+        exit(EXIT_FAILURE);
+    }
+    if (policy.enabled && ifname[0] == '\0') {
+        fprintf(stderr, "-P and -R need -i: the program behind " MAP_PATH " is already configured\n");
+        exit(EXIT_FAILURE);
+    }
+    if (percpu && ifname[0] == '\0') {
+        fprintf(stderr, "-C needs -i: the program behind " MAP_PATH " writes to the shared ring\n");
+        exit(EXIT_FAILURE);
+    }
+
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
 
-    struct pcap_global_header gh = {
-        .magic_number  = 0xA1B2C3D4,
-        .version_major = 2,
-        .version_minor = 4,
-        .thiszone      = 0,
-        .sigfigs       = 0,
-        .snaplen       = MAX_PACKET_SIZE,
-        .network       = 1
+    if (ifname[0] != '\0') {
+        ifindex = if_nametoindex(ifname);
+        if (!ifindex) {
+            fprintf(stderr, "Unknown interface %s: %s\n", ifname, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        map_fd = load_and_attach(&obj, ifindex, xdp_flags, snaplen, ring_size, filter[0] ? filter : NULL, hw_timestamps, shed, percpu, dedup_us * 1000, &policy);
+        if (map_fd < 0) {
+            fprintf(stderr, "Failed to load %s on %s: %s\n", OBJ_PATH, ifname, strerror(errno));
+            bpf_object__close(obj);
+            exit(EXIT_FAILURE);
+        }
+    } else {
+        map_fd = bpf_obj_get(MAP_PATH);
+        if (map_fd < 0) {
+            fprintf(stderr, "Failed to open BPF map at %s: %s\n", MAP_PATH, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        stats_fd = bpf_obj_get(STATS_PATH);  // Missing if an older program is attached
+    }
+
+    if (!percpu) {
+        consumers = calloc(1, sizeof(*consumers));
+        if (!consumers) {
+            perror("calloc (consumers)");
+            exit(EXIT_FAILURE);
+        }
+        consumers[0].cpu = -1;
+        consumers[0].ring_fd = -1;
+        consumers[0].wake_fd = consumers[0].epoll_fd = -1;
+        nconsumers = 1;
+    }
+    for (int i = 0; i < nconsumers; i++) {
+        struct ring_consumer* rc = &consumers[i];
+        pthread_mutex_init(&rc->full.lock, NULL);
+        pthread_cond_init(&rc->full.cond, NULL);
+        rc->rb = ring_buffer__new(percpu ? rc->ring_fd : map_fd, handle_event, rc, NULL);
+        if (!rc->rb || (percpu && consumer_wakeup_init(rc) < 0)) {
+            fprintf(stderr, "Failed to create ring buffer: %s\n", strerror(errno));
+            detach(obj, ifindex, xdp_flags, map_fd);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /*
+        The file header's snaplen comes from the config the kernel is actually running with,
+        as written by load_and_attach() or by whoever loaded the program without -i. Under a
+        capture policy the length varies per frame, so the header says the most it can be, as
+        it does when the config cannot be read: a larger snaplen is harmless, a smaller one not.
+    */
+    struct pcap_config config = {0};
+    int rodata_fd = obj ? bpf_map__fd(bpf_object__find_map_by_name(obj, ".rodata")) : find_rodata(map_fd);
+    if (read_config(rodata_fd, &config) < 0)
+        fprintf(stderr, "Cannot read the capture program's config; the file header says snaplen %d\n", MAX_PACKET_SIZE);
+    if (!obj && rodata_fd >= 0) close(rodata_fd);
+    __u32 file_snaplen = config.snaplen && config.snaplen < MAX_PACKET_SIZE && !config.policy ? config.snaplen : MAX_PACKET_SIZE;
+
+    struct capfile_opts opts = {
+        .flags    = (columnar ? CAPFILE_COLUMNAR : CAPFILE_GZIP) | CAPFILE_INDEX | CAPFILE_BLOOM | CAPFILE_NSEC | CAPFILE_URING |
+                    (direct ? CAPFILE_DIRECT : 0),
+        .level    = level,
+        .workers  = workers,
+        .snaplen  = file_snaplen,
+        .linktype = 1,
+        .columns  = columns
     };
+    pcap_out = capfile_open(output, &opts);
+    if (!pcap_out) {
+        fprintf(stderr, "Failed to open %s: %s\n", output, strerror(errno));
+        for (int i = 0; i < nconsumers; i++) ring_buffer__free(consumers[i].rb);
+        detach(obj, ifindex, xdp_flags, map_fd);
+        exit(EXIT_FAILURE);
+    }
 
-    if (gzwrite(pcap_gz, &gh, sizeof(gh)) != sizeof(gh)) {
-        perror("gzwrite (global header)");
-        gzclose(pcap_gz);
-        ring_buffer__free(ringbuf);
-        close(map_fd);
+    if (shed) {
+        char path[4096];
+        snprintf(path, sizeof(path), "%s" SHED_SUFFIX, output);
+        shed_log = fopen(path, "a");
+        if (!shed_log) fprintf(stderr, "Failed to open %s, shedding levels will not be logged: %s\n", path, strerror(errno));
+    }
+
+    // Per-CPU rings hold smaller buffers for longer (until the merge gets to them), so
+    // there are more of them: enough for every ring to have a few queued
+    int buf_count = STAGING_BUF_COUNT;
+    if (percpu) {
+        staging_size = PERCPU_STAGING_BUF_SIZE;
+        buf_count += nconsumers * PERCPU_STAGING_BUFS;
+    }
+    for (int i = 0; i < buf_count; i++) {
+        struct staging_buf* buf = malloc(sizeof(*buf) + staging_size);
+        if (!buf) {
+            perror("malloc (staging buffer)");
+            exit(EXIT_FAILURE);
+        }
+        buf->used = 0;
+        queue_push(&free_bufs, buf);
+    }
+
+    if (metrics_listen) {
+        metrics_add_collector(collect_metrics, NULL);
+        if (ifname[0] != '\0') metrics_add_collector(metrics_netdev_collector, ifname);
+        if (metrics_serve(metrics_listen) < 0)
+            fprintf(stderr, "Failed to serve metrics on %s: %s\n", metrics_listen, strerror(errno));
+    }
+
+    __atomic_store_n(&clock_offset_ns, sample_clock_offset(), __ATOMIC_RELAXED);
+    __atomic_store_n(&hw_offset_ns, sample_hw_offset(), __ATOMIC_RELAXED);
+    if (hw_timestamps && !phc_utc && hw_offset_ns == 0)
+        fprintf(stderr, "The kernel's TAI-UTC offset is not set; NIC timestamps are written as they are, in TAI\n");
+    time_t last_sync = time(NULL);
+
+    // Without -C the main thread polls the one ring and the writer thread drains it. With -C
+    // every ring gets its consumer, the merge thread writes, and this thread only keeps time.
+    pthread_t writer;
+    if (pthread_create(&writer, NULL, percpu ? merge_thread : writer_thread, NULL)) {
+        perror("pthread_create (writer)");
         exit(EXIT_FAILURE);
     }
+    for (int i = 0; percpu && i < nconsumers; i++) {
+        if (pthread_create(&consumers[i].thread, NULL, consumer_thread, &consumers[i])) {
+            perror("pthread_create (consumer)");
+            exit(EXIT_FAILURE);
+        }
+    }
 
-    while (!stop) {
-        int err = ring_buffer__poll(ringbuf, 100);
-        if (err < 0) {
-            perror("Error polling ring buffer");
-            break;
+    time_t last_stats = time(NULL);
+    while (!stop && !writer_failed) {
+        if (percpu) {
+            usleep(POLL_TIMEOUT_MS * 1000);
+        } else {
+            int err = ring_buffer__poll(consumers[0].rb, POLL_TIMEOUT_MS);
+            if (err < 0 && err != -EINTR) {
+                perror("Error polling ring buffer");
+                break;
+            }
+
+            // Bound the latency of a quiet link by handing off partially filled buffers
+            struct staging_buf* cur = consumers[0].current;
+            if (cur && monotonic_ns() - cur->started >= FLUSH_INTERVAL_S * 1000000000ULL)
+                flush_current(&consumers[0]);
+        }
+
+        // Follow NTP slewing and steps
+        time_t now = time(NULL);
+        if (now - last_sync >= CLOCK_SYNC_INTERVAL_S) {
+            __atomic_store_n(&clock_offset_ns, sample_clock_offset(), __ATOMIC_RELAXED);
+            __atomic_store_n(&hw_offset_ns, sample_hw_offset(), __ATOMIC_RELAXED);
+            last_sync = now;
+        }
+
+        if (now - last_stats >= STATS_INTERVAL_S) {
+            unsigned long long packets, bytes, dropped;
+            unsigned int queued = totals(&packets, &bytes, &dropped);
+            printf("packets=%llu bytes=%llu dropped=%llu queued=%u shed_level=%u\n",
+                   packets, bytes, dropped, queued, __atomic_load_n(&shed_level, __ATOMIC_RELAXED));
+            fflush(stdout);
+            last_stats = now;
         }
     }
 
-    printf("Closing pcap.gz file...\n");
-    gzclose(pcap_gz);
-    ring_buffer__free(ringbuf);
-    close(map_fd);
+    // Let the writer drain everything still queued before the file is closed; consumers
+    // flush and close their own queues on the way out
+    stop = 1;
+    if (percpu) {
+        for (int i = 0; i < nconsumers; i++) pthread_join(consumers[i].thread, NULL);
+    } else {
+        flush_current(&consumers[0]);
+        queue_close(&consumers[0].full);
+    }
+    pthread_join(writer, NULL);
+
+    unsigned long long packets, bytes, dropped;
+    totals(&packets, &bytes, &dropped);
+    printf("Closing pcap.gz file... packets=%llu bytes=%llu dropped=%llu\n", packets, bytes, dropped);
+    if (capfile_close(pcap_out) < 0) perror("capfile_close");
+    if (shed_log) fclose(shed_log);
+    for (int i = 0; i < nconsumers; i++) ring_buffer__free(consumers[i].rb);
+    detach(obj, ifindex, xdp_flags, map_fd);
     exit(EXIT_FAILURE);
-}
\ No newline at end of file
+}
@@ -0,0 +1,57 @@
+#include <linux/bpf.h>
+#include <linux/if_ether.h>
+#include <linux/ip.h>
+#include <linux/in.h>
+#include <bpf/bpf_helpers.h>
+
+#define XSKS_MAP_MAX_ENTRIES 64
+#define IPV4_HEADER_MIN_SIZE 20
+#define IPV4_HEADER_MAX_SIZE 60
+
+/*
+    Represents the AF_XDP socket map. Each RX queue index maps to the AF_XDP socket
+    that xdp_xsk_user.c bound to that queue, and matching frames are redirected
+    straight into that socket's UMEM instead of being copied into a ring buffer.
+    The map is pinned to /sys/fs/bpf/xsks_map so the user-space consumer can insert
+    its socket after this program has been loaded with xdp-loader.
+*/
+struct {
+    __uint(type, BPF_MAP_TYPE_XSKMAP);
+    __uint(max_entries, XSKS_MAP_MAX_ENTRIES);
+    __type(key, __u32);
+    __type(value, __u32);
+    __uint(pinning, LIBBPF_PIN_BY_NAME);
+} xsks_map SEC(".maps");
+
+SEC("xdp")
+int xdp_prog(struct xdp_md* ctx) {
+    // Pointers to start and end of packet
+    void* data = (void*)(long)ctx->data;
+    void* data_end = (void*)(long)ctx->data_end;
+
+    // Filter for IPv4 only
+    struct ethhdr* eth = (struct ethhdr*)data;
+    if ((void*)(eth + 1) > data_end) return XDP_PASS;
+    if (eth->h_proto != __constant_htons(ETH_P_IP)) return XDP_PASS;
+
+    // Filter for TCP and UDP only
+    struct iphdr* ip = (struct iphdr*)(eth + 1);
+    if ((void*)(ip + 1) > data_end) return XDP_PASS;
+    __u32 ip_header_length = ip->ihl * 4;
+    if (ip_header_length < IPV4_HEADER_MIN_SIZE || ip_header_length > IPV4_HEADER_MAX_SIZE || (void*)ip + ip_header_length > data_end) return XDP_PASS;
+    if (ip->protocol != IPPROTO_TCP && ip->protocol != IPPROTO_UDP) return XDP_PASS;
+
+    // Hand the frame to the socket bound on this RX queue. If no socket is bound
+    // the lower bits of the flags argument are returned, so the packet is passed.
+    return bpf_redirect_map(&xsks_map, ctx->rx_queue_index, XDP_PASS);
+}
+
+char _license[] SEC("license") = "GPL";
+
+/*
+    - Redirected frames are consumed by the socket and never reach the kernel stack.
+      That is fine on a dedicated capture/TAP port, but do not attach this to an
+      interface the host itself talks on.
+    - Zero-copy needs driver support (i40e, ice, mlx5, ...). veth and most other
+      drivers only do copy mode, which is still a single copy into UMEM.
+*/
@@ -0,0 +1,356 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <net/if.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <linux/if_xdp.h>
+#include <zlib.h>
+#include <bpf/bpf.h>
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+#define MAP_PATH       "/sys/fs/bpf/xsks_map"
+#define OUTPUT_FILE    "netflow.pcap.gz"
+#define NUM_FRAMES     4096
+#define FRAME_SIZE     4096
+#define RING_SIZE      NUM_FRAMES
+#define RX_BATCH_SIZE  64
+#define MAX_PACKET_SIZE FRAME_SIZE
+
+struct pcap_global_header {
+    __u32 magic_number;
+    __u16 version_major;
+    __u16 version_minor;
+    __u32 thiszone;
+    __u32 sigfigs;
+    __u32 snaplen;
+    __u32 network;
+};
+
+struct pcap_pkthdr {
+    __u32 ts_sec;
+    __u32 ts_usec;
+    __u32 caplen;
+    __u32 len;
+};
+
+/*
+    A single-producer/single-consumer ring shared with the kernel. The producer and
+    consumer indices are free-running and masked on access, exactly like the kernel
+    side in net/xdp/xsk_queue.h. Only the fields needed for an RX-only socket are kept.
+*/
+struct xsk_ring {
+    __u32* producer;
+    __u32* consumer;
+    __u32* flags;
+    void*  ring;
+    __u32  mask;
+    void*  map;
+    size_t map_len;
+};
+
+/*
+    Everything belonging to one AF_XDP socket: the UMEM area frames are written into
+    by the NIC (or by the kernel in copy mode), the fill ring we hand free frames back
+    through, the completion ring the kernel requires even for RX-only sockets, and
+    the RX ring we read descriptors from.
+*/
+struct xsk_socket {
+    int            fd;
+    void*          umem;
+    struct xsk_ring fill;
+    struct xsk_ring comp;
+    struct xsk_ring rx;
+    int            zero_copy;
+};
+
+static gzFile pcap_gz = NULL;
+static int    pcap_fd = -1;
+static __u32  snaplen = MAX_PACKET_SIZE;
+
+static volatile sig_atomic_t stop = 0;
+static void handle_signal(int sig) {
+    stop = 1;
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr,
+        "Usage: %s -i interface [-q queue] [-o file] [-s snaplen] [-c|-z] [-u]\n"
+        "    -q  RX queue to bind to (default 0)\n"
+        "    -o  output file (default " OUTPUT_FILE ")\n"
+        "    -s  bytes of each frame to write (default %d)\n"
+        "    -c  force copy mode\n"
+        "    -z  force zero-copy mode (fail if the driver cannot do it)\n"
+        "    -u  do not gzip the output file\n", prog, MAX_PACKET_SIZE);
+    exit(EXIT_FAILURE);
+}
+
+// Maps one of the socket's rings into our address space using the offsets the kernel reported
+static int map_ring(int fd, struct xsk_ring* r, const struct xdp_ring_offset* off,
+                    __u32 entries, size_t desc_size, off_t pgoff) {
+    r->map_len = off->desc + entries * desc_size;
+    r->map = mmap(NULL, r->map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, pgoff);
+    if (r->map == MAP_FAILED) return -1;
+
+    r->producer = (__u32*)((char*)r->map + off->producer);
+    r->consumer = (__u32*)((char*)r->map + off->consumer);
+    r->flags    = (__u32*)((char*)r->map + off->flags);
+    r->ring     = (char*)r->map + off->desc;
+    r->mask     = entries - 1;
+    return 0;
+}
+
+static int xsk_bind(struct xsk_socket* xsk, int ifindex, __u32 queue, __u16 mode) {
+    struct sockaddr_xdp sxdp = {
+        .sxdp_family   = AF_XDP,
+        .sxdp_ifindex  = ifindex,
+        .sxdp_queue_id = queue,
+        .sxdp_flags    = mode | XDP_USE_NEED_WAKEUP
+    };
+    if (bind(xsk->fd, (struct sockaddr*)&sxdp, sizeof(sxdp)) < 0) return -1;
+    xsk->zero_copy = (mode == XDP_ZEROCOPY);
+    return 0;
+}
+
+/*
+    Creates the socket, registers the UMEM, sizes and maps the rings, and binds to the
+    requested queue. When no mode is forced, zero-copy is tried first and copy mode is
+    used if the driver refuses it.
+*/
+static int xsk_create(struct xsk_socket* xsk, int ifindex, __u32 queue, __u16 mode) {
+    memset(xsk, 0, sizeof(*xsk));
+    xsk->fd = -1;
+
+    xsk->umem = mmap(NULL, (size_t)NUM_FRAMES * FRAME_SIZE, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (xsk->umem == MAP_FAILED) return -1;
+
+    xsk->fd = socket(AF_XDP, SOCK_RAW, 0);
+    if (xsk->fd < 0) return -1;
+
+    struct xdp_umem_reg mr = {
+        .addr       = (__u64)(unsigned long)xsk->umem,
+        .len        = (__u64)NUM_FRAMES * FRAME_SIZE,
+        .chunk_size = FRAME_SIZE,
+        .headroom   = 0
+    };
+    if (setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_REG, &mr, sizeof(mr)) < 0) return -1;
+
+    int ring_size = RING_SIZE;
+    if (setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_FILL_RING, &ring_size, sizeof(ring_size)) < 0) return -1;
+    if (setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &ring_size, sizeof(ring_size)) < 0) return -1;
+    if (setsockopt(xsk->fd, SOL_XDP, XDP_RX_RING, &ring_size, sizeof(ring_size)) < 0) return -1;
+
+    struct xdp_mmap_offsets off;
+    socklen_t optlen = sizeof(off);
+    if (getsockopt(xsk->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen) < 0) return -1;
+
+    if (map_ring(xsk->fd, &xsk->fill, &off.fr, RING_SIZE, sizeof(__u64), XDP_UMEM_PGOFF_FILL_RING) < 0) return -1;
+    if (map_ring(xsk->fd, &xsk->comp, &off.cr, RING_SIZE, sizeof(__u64), XDP_UMEM_PGOFF_COMPLETION_RING) < 0) return -1;
+    if (map_ring(xsk->fd, &xsk->rx, &off.rx, RING_SIZE, sizeof(struct xdp_desc), XDP_PGOFF_RX_RING) < 0) return -1;
+
+    // Hand every frame to the kernel up front. Each received frame goes straight back
+    // onto the fill ring once it is written, so the UMEM never needs more frames than this.
+    __u64* fill = xsk->fill.ring;
+    for (__u32 i = 0; i < RING_SIZE; i++)
+        fill[i] = (__u64)i * FRAME_SIZE;
+    __atomic_store_n(xsk->fill.producer, RING_SIZE, __ATOMIC_RELEASE);
+
+    if (mode != 0) return xsk_bind(xsk, ifindex, queue, mode);
+    if (xsk_bind(xsk, ifindex, queue, XDP_ZEROCOPY) == 0) return 0;
+    return xsk_bind(xsk, ifindex, queue, XDP_COPY);
+}
+
+static void xsk_destroy(struct xsk_socket* xsk) {
+    if (xsk->fill.map) munmap(xsk->fill.map, xsk->fill.map_len);
+    if (xsk->comp.map) munmap(xsk->comp.map, xsk->comp.map_len);
+    if (xsk->rx.map) munmap(xsk->rx.map, xsk->rx.map_len);
+    if (xsk->fd >= 0) close(xsk->fd);
+    if (xsk->umem && xsk->umem != MAP_FAILED) munmap(xsk->umem, (size_t)NUM_FRAMES * FRAME_SIZE);
+}
+
+/*
+    Writes one batch of received frames. The pcap record headers live on the stack but
+    the frame bytes are handed to zlib (or writev) directly from UMEM, so the only copy
+    between the NIC and the output file is the one done by the compressor itself.
+*/
+static int write_batch(struct xsk_socket* xsk, const struct xdp_desc* descs, __u32 n) {
+    struct pcap_pkthdr hdrs[RX_BATCH_SIZE];
+    struct iovec iov[RX_BATCH_SIZE * 2];
+    struct timespec now;
+
+    // AF_XDP descriptors carry no timestamp, so one wall-clock read covers the batch
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    for (__u32 i = 0; i < n; i++) {
+        // In aligned mode the descriptor address already includes the headroom offset
+        void* frame = (char*)xsk->umem + descs[i].addr;
+        hdrs[i].ts_sec  = now.tv_sec;
+        hdrs[i].ts_usec = now.tv_nsec / 1000;
+        hdrs[i].len     = descs[i].len;
+        hdrs[i].caplen  = descs[i].len > snaplen ? snaplen : descs[i].len;
+
+        if (pcap_gz) {
+            if (gzwrite(pcap_gz, &hdrs[i], sizeof(hdrs[i])) != sizeof(hdrs[i])) return -1;
+            if (gzwrite(pcap_gz, frame, hdrs[i].caplen) != (int)hdrs[i].caplen) return -1;
+        } else {
+            iov[2 * i].iov_base     = &hdrs[i];
+            iov[2 * i].iov_len      = sizeof(hdrs[i]);
+            iov[2 * i + 1].iov_base = frame;
+            iov[2 * i + 1].iov_len  = hdrs[i].caplen;
+        }
+    }
+
+    if (!pcap_gz && n > 0 && writev(pcap_fd, iov, n * 2) < 0) return -1;
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    char ifname[IF_NAMESIZE] = "";
+    const char* output = OUTPUT_FILE;
+    __u32 queue = 0;
+    __u16 mode = 0;
+    int gzip = 1;
+    int rc = EXIT_FAILURE;
+    int c;
+
+    while ((c = getopt(argc, argv, "i:q:o:s:czuh")) != -1) {
+        switch (c) {
+            case 'i': snprintf(ifname, sizeof(ifname), "%s", optarg); break;
+            case 'q': queue = strtoul(optarg, NULL, 10); break;
+            case 'o': output = optarg; break;
+            case 's': snaplen = strtoul(optarg, NULL, 10); break;
+            case 'c': mode = XDP_COPY; break;
+            case 'z': mode = XDP_ZEROCOPY; break;
+            case 'u': gzip = 0; break;
+            default: usage(argv[0]);
+        }
+    }
+    if (ifname[0] == '\0') usage(argv[0]);
+    if (snaplen == 0 || snaplen > MAX_PACKET_SIZE) snaplen = MAX_PACKET_SIZE;
+
+    int ifindex = if_nametoindex(ifname);
+    if (!ifindex) {
+        fprintf(stderr, "Unknown interface %s: %s\n", ifname, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+
+    int map_fd = bpf_obj_get(MAP_PATH);
+    if (map_fd < 0) {
+        fprintf(stderr, "Failed to open BPF map at %s: %s\n", MAP_PATH, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    struct xsk_socket xsk;
+    if (xsk_create(&xsk, ifindex, queue, mode) < 0) {
+        fprintf(stderr, "Failed to create AF_XDP socket on %s queue %u: %s\n", ifname, queue, strerror(errno));
+        xsk_destroy(&xsk);
+        close(map_fd);
+        exit(EXIT_FAILURE);
+    }
+
+    if (bpf_map_update_elem(map_fd, &queue, &xsk.fd, BPF_ANY)) {
+        fprintf(stderr, "Failed to register socket in %s: %s\n", MAP_PATH, strerror(errno));
+        xsk_destroy(&xsk);
+        close(map_fd);
+        exit(EXIT_FAILURE);
+    }
+    printf("Bound to %s queue %u in %s mode\n", ifname, queue, xsk.zero_copy ? "zero-copy" : "copy");
+
+    if (gzip) {
+        pcap_gz = gzopen(output, "wb");
+        if (!pcap_gz) {
+            fprintf(stderr, "Failed to open %s: %s\n", output, strerror(errno));
+            goto out;
+        }
+    } else {
+        pcap_fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (pcap_fd < 0) {
+            fprintf(stderr, "Failed to open %s: %s\n", output, strerror(errno));
+            goto out;
+        }
+    }
+
+    struct pcap_global_header gh = {
+        .magic_number  = 0xA1B2C3D4,
+        .version_major = 2,
+        .version_minor = 4,
+        .thiszone      = 0,
+        .sigfigs       = 0,
+        .snaplen       = snaplen,
+        .network       = 1
+    };
+    if (pcap_gz ? gzwrite(pcap_gz, &gh, sizeof(gh)) != sizeof(gh) : write(pcap_fd, &gh, sizeof(gh)) != sizeof(gh)) {
+        perror("write (global header)");
+        goto out;
+    }
+
+    struct pollfd pfd = { .fd = xsk.fd, .events = POLLIN };
+    struct xdp_desc* rx_ring = xsk.rx.ring;
+    __u64* fill_ring = xsk.fill.ring;
+    unsigned long long packets = 0;
+
+    while (!stop) {
+        __u32 prod = __atomic_load_n(xsk.rx.producer, __ATOMIC_ACQUIRE);
+        __u32 cons = *xsk.rx.consumer;
+        __u32 n = prod - cons;
+
+        if (n == 0) {
+            // Kick the driver if it went to sleep waiting for fill ring entries
+            if (*xsk.fill.flags & XDP_RING_NEED_WAKEUP)
+                recvfrom(xsk.fd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+            if (poll(&pfd, 1, 100) < 0 && errno != EINTR) {
+                perror("poll");
+                break;
+            }
+            continue;
+        }
+        if (n > RX_BATCH_SIZE) n = RX_BATCH_SIZE;
+
+        struct xdp_desc descs[RX_BATCH_SIZE];
+        for (__u32 i = 0; i < n; i++)
+            descs[i] = rx_ring[(cons + i) & xsk.rx.mask];
+
+        if (write_batch(&xsk, descs, n) < 0) {
+            perror("write (packets)");
+            break;
+        }
+
+        // Frames are written, so give the RX slots and the frames back to the kernel.
+        // The fill ring is as large as the RX ring, so there is always room for them.
+        __atomic_store_n(xsk.rx.consumer, cons + n, __ATOMIC_RELEASE);
+        __u32 fill_prod = *xsk.fill.producer;
+        for (__u32 i = 0; i < n; i++)
+            fill_ring[(fill_prod + i) & xsk.fill.mask] = descs[i].addr & ~((__u64)FRAME_SIZE - 1);
+        __atomic_store_n(xsk.fill.producer, fill_prod + n, __ATOMIC_RELEASE);
+
+        packets += n;
+    }
+
+    printf("Captured %llu packets, closing %s...\n", packets, output);
+    rc = EXIT_SUCCESS;
+
+out:
+    bpf_map_delete_elem(map_fd, &queue);
+    if (pcap_gz) gzclose(pcap_gz);
+    if (pcap_fd >= 0) close(pcap_fd);
+    xsk_destroy(&xsk);
+    close(map_fd);
+    exit(rc);
+}